@@ -38,75 +38,48 @@ as_id_parse(const ASN1_INTEGER *v, uint32_t *out)
 }
 
 /*
- * Given a newly-parsed AS number or range "a", make sure that "a" does
- * not overlap with any other numbers or ranges in the "as" array.
- * This is defined by RFC 3779 section 3.2.3.4.
+ * Make sure that the AS numbers and ranges in the "as" array do not
+ * overlap and that an inheritance statement stands alone.
+ * This is defined by RFC 3779 section 3.2.3.3 and 3.2.3.4.
+ * The ranges are sorted by their lower bound, so only the range with
+ * the highest upper bound seen so far needs to be compared.
  * Returns zero on failure, non-zero on success.
  */
 int
-as_check_overlap(const struct cert_as *a, const char *fn,
-    const struct cert_as *as, size_t asz, int quiet)
+as_check_overlap(const char *fn, const struct cert_as *as, size_t asz)
 {
-	size_t	 i;
+	struct res_index	 ri;
+	size_t			 i;
+	uint32_t		 max = 0;
+	int			 rc = 1;
+
+	memset(&ri, 0, sizeof(ri));
+	as_index_build(&ri, as, asz);
 
 	/* We can have only one inheritance statement. */
 
-	if (asz &&
-	    (a->type == CERT_AS_INHERIT || as[0].type == CERT_AS_INHERIT)) {
-		if (!quiet) {
-			warnx("%s: RFC 3779 section 3.2.3.3: "
-			    "cannot have inheritance and multiple ASnum or "
-			    "multiple inheritance", fn);
-		}
+	if (ri.asinherit && asz > 1) {
+		warnx("%s: RFC 3779 section 3.2.3.3: "
+		    "cannot have inheritance and multiple ASnum or "
+		    "multiple inheritance", fn);
 		return 0;
 	}
 
 	/* Now check for overlaps between singletons/ranges. */
 
-	for (i = 0; i < asz; i++) {
-		switch (as[i].type) {
-		case CERT_AS_ID:
-			switch (a->type) {
-			case CERT_AS_ID:
-				if (a->id != as[i].id)
-					continue;
-				break;
-			case CERT_AS_RANGE:
-				if (as->range.min > as[i].id ||
-				    as->range.max < as[i].id)
-					continue;
-				break;
-			default:
-				abort();
-			}
-			break;
-		case CERT_AS_RANGE:
-			switch (a->type) {
-			case CERT_AS_ID:
-				if (as[i].range.min > a->id ||
-				    as[i].range.max < a->id)
-					continue;
-				break;
-			case CERT_AS_RANGE:
-				if (a->range.max < as[i].range.min ||
-				    a->range.min > as[i].range.max)
-					continue;
-				break;
-			default:
-				abort();
-			}
-			break;
-		default:
-			abort();
-		}
-		if (!quiet) {
+	for (i = 0; i < ri.asz; i++) {
+		if (i > 0 && ri.as[i].min <= max) {
 			warnx("%s: RFC 3779 section 3.2.3.4: "
 			    "cannot have overlapping ASnum", fn);
+			rc = 0;
+			break;
 		}
-		return 0;
+		if (i == 0 || ri.as[i].max > max)
+			max = ri.as[i].max;
 	}
 
-	return 1;
+	free(ri.as);
+	return rc;
 }
 
 /*
@@ -136,6 +109,93 @@ as_check_covered(uint32_t min, uint32_t max,
 	return -1;
 }
 
+static int
+as_index_cmp(const void *a, const void *b)
+{
+	const struct cert_as_range *ra = a, *rb = b;
+
+	if (ra->min < rb->min)
+		return -1;
+	return ra->min > rb->min;
+}
+
+/*
+ * Build the index of the AS resources in as, see ip_index_build().
+ */
+void
+as_index_build(struct res_index *ri, const struct cert_as *as, size_t asz)
+{
+	size_t	 i;
+
+	ri->as = NULL;
+	ri->asz = 0;
+	for (i = 0; i < asz; i++)
+		if (as[i].type == CERT_AS_INHERIT)
+			ri->asinherit = 1;
+	if (ri->asinherit || asz == 0)
+		return;
+
+	if ((ri->as = calloc(asz, sizeof(*ri->as))) == NULL)
+		err(1, NULL);
+	for (i = 0; i < asz; i++) {
+		if (as[i].type == CERT_AS_RANGE)
+			ri->as[i] = as[i].range;
+		else
+			ri->as[i].min = ri->as[i].max = as[i].id;
+	}
+	ri->asz = asz;
+	if (asz > 1)
+		qsort(ri->as, asz, sizeof(*ri->as), as_index_cmp);
+}
+
+/*
+ * Same as as_check_covered() but using the index built by as_index_build().
+ */
+int
+as_index_covered(const struct res_index *ri, uint32_t min, uint32_t max)
+{
+	size_t	 lo, hi, mid;
+
+	if (ri->asinherit)
+		return 0;
+
+	lo = 0;
+	hi = ri->asz;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (ri->as[mid].min <= min)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo > 0 && ri->as[lo - 1].max >= max)
+		return 1;
+
+	return -1;
+}
+
+/*
+ * Return 1 if min--max overlaps a range in the index built by
+ * as_index_build(), 0 otherwise. Only the last range starting at or
+ * below max can overlap since the ranges are disjoint.
+ */
+int
+as_index_overlaps(const struct res_index *ri, uint32_t min, uint32_t max)
+{
+	size_t	 lo, hi, mid;
+
+	lo = 0;
+	hi = ri->asz;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (ri->as[mid].min <= max)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo > 0 && ri->as[lo - 1].max >= min;
+}
+
 void
 as_warn(const char *fn, const char *msg, const struct cert_as *as)
 {
@@ -116,6 +116,57 @@ aspa_parse_providers(const char *fn, struct aspa *aspa,
 	return 1;
 }
 
+/*
+ * Decode the eContent straight into aspa without the templates.
+ * Only handles well-formed strict DER, returns zero for anything else
+ * and leaves the diagnostics to the template decoder.
+ */
+static int
+aspa_parse_econtent_der(struct aspa *aspa, const unsigned char *d,
+    size_t dsz)
+{
+	struct der	 der, econ, version, providers, tmp;
+	uint32_t	 v, provider;
+	size_t		 providersz;
+
+	der.p = d;
+	der.len = dsz;
+	if (!der_get(&der, DER_SEQUENCE, &econ) || der.len != 0)
+		return 0;
+	if (!der_get(&econ, DER_EXPLICIT0, &version) ||
+	    !der_get_uint32(&version, &v) || version.len != 0 || v != 1)
+		return 0;
+	if (!der_get_uint32(&econ, &aspa->custasid))
+		return 0;
+	if (!der_get(&econ, DER_SEQUENCE, &providers) || econ.len != 0)
+		return 0;
+
+	/* count them first to size the array */
+	for (tmp = providers, providersz = 0; tmp.len > 0; providersz++) {
+		if (!der_get_uint32(&tmp, &provider))
+			return 0;
+	}
+	if (providersz == 0 || providersz >= MAX_ASPA_PROVIDERS)
+		return 0;
+
+	aspa->providers = calloc(providersz, sizeof(provider));
+	if (aspa->providers == NULL)
+		err(1, NULL);
+
+	while (providers.len > 0) {
+		if (!der_get_uint32(&providers, &provider))
+			return 0;
+		if (aspa->custasid == provider)
+			return 0;
+		if (aspa->providersz > 0 &&
+		    aspa->providers[aspa->providersz - 1] >= provider)
+			return 0;
+		aspa->providers[aspa->providersz++] = provider;
+	}
+
+	return 1;
+}
+
 /*
  * Parse the eContent of an ASPA file.
  * Returns zero on failure, non-zero on success.
@@ -128,6 +179,14 @@ aspa_parse_econtent(const char *fn, struct aspa *aspa, const unsigned char *d,
 	ASProviderAttestation	*aspa_asn1;
 	int			 rc = 0;
 
+	if (aspa_parse_econtent_der(aspa, d, dsz))
+		return 1;
+
+	/* Redo it with the templates for proper diagnostics. */
+	free(aspa->providers);
+	aspa->providers = NULL;
+	aspa->providersz = 0;
+
 	oder = d;
 	if ((aspa_asn1 = d2i_ASProviderAttestation(NULL, &d, dsz)) == NULL) {
 		warnx("%s: ASPA: failed to parse ASProviderAttestation", fn);
@@ -206,17 +265,17 @@ aspa_parse(X509 **x509, const char *fn, int talid, const unsigned char *der,
 	if (!x509_get_notafter(*x509, fn, &aspa->notafter))
 		goto out;
 
-	if (x509_any_inherits(*x509)) {
-		warnx("%s: inherit elements not allowed in EE cert", fn);
-		goto out;
-	}
-
 	if (!aspa_parse_econtent(fn, aspa, cms, cmsz))
 		goto out;
 
 	if ((cert = cert_parse_ee_cert(fn, talid, *x509)) == NULL)
 		goto out;
 
+	if (cert_any_inherits(cert)) {
+		warnx("%s: inherit elements not allowed in EE cert", fn);
+		goto out;
+	}
+
 	aspa->valid = valid_aspa(fn, cert, aspa);
 
 	rc = 1;
@@ -302,21 +361,6 @@ aspa_read(struct ibuf *b)
 	return p;
 }
 
-/*
- * Insert a new uint32_t at index idx in the struct vap v.
- * All elements in the provider array from idx are moved up by one
- * to make space for the new element.
- */
-static void
-insert_vap(struct vap *v, uint32_t idx, uint32_t *p)
-{
-	if (idx < v->providersz)
-		memmove(v->providers + idx + 1, v->providers + idx,
-		    (v->providersz - idx) * sizeof(*v->providers));
-	v->providers[idx] = *p;
-	v->providersz++;
-}
-
 /*
  * Add each ProviderAS entry into the Validated ASPA Providers (VAP) tree.
  * Duplicated entries are merged.
@@ -326,7 +370,7 @@ aspa_insert_vaps(char *fn, struct vap_tree *tree, struct aspa *aspa,
     struct repo *rp)
 {
 	struct vap	*v, *found;
-	size_t		 i, j;
+	size_t		 i, j, k, n;
 
 	if ((v = calloc(1, sizeof(*v))) == NULL)
 		err(1, NULL);
@@ -359,32 +403,26 @@ aspa_insert_vaps(char *fn, struct vap_tree *tree, struct aspa *aspa,
 
 	repo_stat_inc(rp, aspa->talid, RTYPE_ASPA, STYPE_TOTAL);
 
-	v->providers = reallocarray(v->providers,
-	    v->providersz + aspa->providersz, sizeof(*v->providers));
-	if (v->providers == NULL)
-		err(1, NULL);
-
 	/*
-	 * Merge all data from aspa into v: loop over all aspa providers,
-	 * insert them in the right place in v->providers while keeping the
-	 * order of the providers array.
+	 * Both provider arrays are sorted. Count the providers of aspa
+	 * missing in v, then merge from the back so every element is
+	 * moved at most once.
 	 */
-	for (i = 0, j = 0; i < aspa->providersz; ) {
+	for (i = 0, j = 0, n = 0; i < aspa->providersz; ) {
 		if (j == v->providersz ||
 		    aspa->providers[i] < v->providers[j]) {
-			/* merge provider from aspa into v */
 			repo_stat_inc(rp, v->talid, RTYPE_ASPA,
 			    STYPE_PROVIDERS);
-			insert_vap(v, j, &aspa->providers[i]);
+			n++;
 			i++;
-		} else if (aspa->providers[i] == v->providers[j])
+		} else if (aspa->providers[i] == v->providers[j]) {
 			i++;
-
-		if (j < v->providersz)
+			j++;
+		} else
 			j++;
 	}
 
-	if (v->providersz >= MAX_ASPA_PROVIDERS) {
+	if (v->providersz + n >= MAX_ASPA_PROVIDERS) {
 		v->overflowed = 1;
 		free(v->providers);
 		v->providers = NULL;
@@ -394,6 +432,26 @@ aspa_insert_vaps(char *fn, struct vap_tree *tree, struct aspa *aspa,
 		    "(more than %d)", fn, v->custasid, MAX_ASPA_PROVIDERS);
 		return;
 	}
+	if (n == 0)
+		return;
+
+	v->providers = reallocarray(v->providers, v->providersz + n,
+	    sizeof(*v->providers));
+	if (v->providers == NULL)
+		err(1, NULL);
+
+	i = aspa->providersz;
+	j = v->providersz;
+	k = j + n;
+	while (i > 0) {
+		if (j > 0 && v->providers[j - 1] >= aspa->providers[i - 1]) {
+			if (v->providers[j - 1] == aspa->providers[i - 1])
+				i--;
+			v->providers[--k] = v->providers[--j];
+		} else
+			v->providers[--k] = aspa->providers[--i];
+	}
+	v->providersz += n;
 }
 
 static inline int
@@ -36,38 +36,28 @@ extern ASN1_OBJECT	*notify_oid;	/* 1.3.6.1.5.5.7.48.13 (rpkiNotify) */
 
 /*
  * Append an IP address structure to our list of results.
- * This will also constrain us to having at most one inheritance
- * statement per AFI and also not have overlapping ranges (as prohibited
- * in section 2.2.3.6).
+ * Inheritance and overlaps are checked for the whole list by
+ * ip_addr_check_overlap() once it is complete.
  * It does not make sure that ranges can't coalesce, that is, that any
  * two ranges abut each other.
  * This is warned against in section 2.2.3.6, but doesn't change the
  * semantics of the system.
- * Returns zero on failure (IP overlap) non-zero on success.
  */
-static int
-append_ip(const char *fn, struct cert_ip *ips, size_t *ipsz,
-    const struct cert_ip *ip)
+static void
+append_ip(struct cert_ip *ips, size_t *ipsz, const struct cert_ip *ip)
 {
-	if (!ip_addr_check_overlap(ip, fn, ips, *ipsz, 0))
-		return 0;
 	ips[(*ipsz)++] = *ip;
-	return 1;
 }
 
 /*
  * Append an AS identifier structure to our list of results.
- * Makes sure that the identifiers do not overlap or improperly inherit
- * as defined by RFC 3779 section 3.3.
+ * Inheritance and overlaps as defined by RFC 3779 section 3.3 are
+ * checked by as_check_overlap() once the list is complete.
  */
-static int
-append_as(const char *fn, struct cert_as *ases, size_t *asz,
-    const struct cert_as *as)
+static void
+append_as(struct cert_as *ases, size_t *asz, const struct cert_as *as)
 {
-	if (!as_check_overlap(as, fn, ases, *asz, 0))
-		return 0;
 	ases[(*asz)++] = *as;
-	return 1;
 }
 
 /*
@@ -105,7 +95,8 @@ sbgp_as_range(const char *fn, struct cert_as *ases, size_t *asz,
 		return 0;
 	}
 
-	return append_as(fn, ases, asz, &as);
+	append_as(ases, asz, &as);
+	return 1;
 }
 
 /*
@@ -131,7 +122,8 @@ sbgp_as_id(const char *fn, struct cert_as *ases, size_t *asz,
 		return 0;
 	}
 
-	return append_as(fn, ases, asz, &as);
+	append_as(ases, asz, &as);
+	return 1;
 }
 
 static int
@@ -142,7 +134,8 @@ sbgp_as_inherit(const char *fn, struct cert_as *ases, size_t *asz)
 	memset(&as, 0, sizeof(struct cert_as));
 	as.type = CERT_AS_INHERIT;
 
-	return append_as(fn, ases, asz, &as);
+	append_as(ases, asz, &as);
+	return 1;
 }
 
 int
@@ -220,6 +213,9 @@ sbgp_parse_assysnum(const char *fn, const ASIdentifiers *asidentifiers,
 		}
 	}
 
+	if (!as_check_overlap(fn, as, asz))
+		goto out;
+
 	*out_as = as;
 	*out_asz = asz;
 
@@ -290,7 +286,8 @@ sbgp_addr(const char *fn, struct cert_ip *ips, size_t *ipsz, enum afi afi,
 		return 0;
 	}
 
-	return append_ip(fn, ips, ipsz, &ip);
+	append_ip(ips, ipsz, &ip);
+	return 1;
 }
 
 /*
@@ -326,7 +323,8 @@ sbgp_addr_range(const char *fn, struct cert_ip *ips, size_t *ipsz,
 		return 0;
 	}
 
-	return append_ip(fn, ips, ipsz, &ip);
+	append_ip(ips, ipsz, &ip);
+	return 1;
 }
 
 static int
@@ -340,7 +338,8 @@ sbgp_addr_inherit(const char *fn, struct cert_ip *ips, size_t *ipsz,
 	ip.afi = afi;
 	ip.type = CERT_IP_INHERIT;
 
-	return append_ip(fn, ips, ipsz, &ip);
+	append_ip(ips, ipsz, &ip);
+	return 1;
 }
 
 int
@@ -444,6 +443,9 @@ sbgp_parse_ipaddrblk(const char *fn, const IPAddrBlocks *addrblk,
 		}
 	}
 
+	if (!ip_addr_check_overlap(fn, ips, ipsz))
+		goto out;
+
 	*out_ips = ips;
 	*out_ipsz = ipsz;
 
@@ -649,6 +651,24 @@ certificate_policies(const char *fn, struct cert *cert, X509_EXTENSION *ext)
 	return rc;
 }
 
+/*
+ * Check whether at least one of the parsed RFC 3779 resources of cert is
+ * set to inherit. Return 1 if so, 0 otherwise.
+ */
+int
+cert_any_inherits(const struct cert *cert)
+{
+	size_t	 i;
+
+	for (i = 0; i < cert->ipsz; i++)
+		if (cert->ips[i].type == CERT_IP_INHERIT)
+			return 1;
+	for (i = 0; i < cert->asz; i++)
+		if (cert->as[i].type == CERT_AS_INHERIT)
+			return 1;
+	return 0;
+}
+
 /*
  * Lightweight version of cert_parse_pre() for EE certs.
  * Parses the two RFC 3779 extensions, and performs some sanity checks.
@@ -728,6 +748,8 @@ cert_parse_pre(const char *fn, const unsigned char *der, size_t len)
 	int			 i, extsz;
 	X509			*x = NULL;
 	X509_EXTENSION		*ext = NULL;
+	X509_EXTENSION		*akiext = NULL, *skiext = NULL;
+	X509_EXTENSION		*aiaext = NULL, *crldpext = NULL;
 	const X509_ALGOR	*palg;
 	const ASN1_BIT_STRING	*piuid = NULL, *psuid = NULL;
 	const ASN1_OBJECT	*cobj;
@@ -832,18 +854,22 @@ cert_parse_pre(const char *fn, const unsigned char *der, size_t len)
 		case NID_crl_distribution_points:
 			if (crldp++ > 0)
 				goto dup;
+			crldpext = ext;
 			break;
 		case NID_info_access:
 			if (aia++ > 0)
 				goto dup;
+			aiaext = ext;
 			break;
 		case NID_authority_key_identifier:
 			if (aki++ > 0)
 				goto dup;
+			akiext = ext;
 			break;
 		case NID_subject_key_identifier:
 			if (ski++ > 0)
 				goto dup;
+			skiext = ext;
 			break;
 		case NID_ext_key_usage:
 			if (eku++ > 0)
@@ -869,13 +895,14 @@ cert_parse_pre(const char *fn, const unsigned char *der, size_t len)
 		}
 	}
 
-	if (!x509_get_aki(x, fn, &cert->aki))
+	/* decode the extensions found above without searching them again */
+	if (!x509_ext_get_aki(x, akiext, fn, &cert->aki))
 		goto out;
-	if (!x509_get_ski(x, fn, &cert->ski))
+	if (!x509_ext_get_ski(x, skiext, fn, &cert->ski))
 		goto out;
-	if (!x509_get_aia(x, fn, &cert->aia))
+	if (!x509_ext_get_aia(x, aiaext, fn, &cert->aia))
 		goto out;
-	if (!x509_get_crl(x, fn, &cert->crl))
+	if (!x509_ext_get_crl(x, crldpext, fn, &cert->crl))
 		goto out;
 	if (!x509_get_notbefore(x, fn, &cert->notbefore))
 		goto out;
@@ -1055,7 +1082,7 @@ ta_parse(const char *fn, struct cert *p, const unsigned char *pkey,
 		warnx("%s: BGPsec cert cannot be a trust anchor", fn);
 		goto badcert;
 	}
-	if (x509_any_inherits(p->x509)) {
+	if (cert_any_inherits(p)) {
 		warnx("%s: Trust anchor IP/AS resources may not inherit", fn);
 		goto badcert;
 	}
@@ -1093,6 +1120,37 @@ cert_free(struct cert *p)
 	free(p);
 }
 
+/*
+ * Release the parts of a CA cert which are not needed for validation
+ * once it is in the auth tree and was sent to the parent. What remains
+ * is the SKI, the TAL, the validity and the X509, the resources live
+ * on in the index of the auth.
+ */
+void
+cert_compact(struct cert *p)
+{
+	free(p->crl);
+	free(p->repo);
+	free(p->mft);
+	free(p->notify);
+	free(p->ips);
+	free(p->as);
+	free(p->aia);
+	free(p->aki);
+	free(p->pubkey);
+	p->crl = NULL;
+	p->repo = NULL;
+	p->mft = NULL;
+	p->notify = NULL;
+	p->ips = NULL;
+	p->ipsz = 0;
+	p->as = NULL;
+	p->asz = 0;
+	p->aia = NULL;
+	p->aki = NULL;
+	p->pubkey = NULL;
+}
+
 /*
  * Write certificate parsed content into buffer.
  * See cert_read() for the other side of the pipe.
@@ -1164,10 +1222,85 @@ cert_read(struct ibuf *b)
 	return p;
 }
 
+/*
+ * Only the decoded X509 of the AUTH_RESIDENT most recently used CA certs
+ * is kept, the others are decoded again from their DER when needed.
+ */
+#define AUTH_RESIDENT	(8 * 1024)
+
+static TAILQ_HEAD(auth_lru_head, auth) auth_lru =
+    TAILQ_HEAD_INITIALIZER(auth_lru);
+static size_t auth_nresident;
+
+static void
+auth_evict(struct auth *a)
+{
+	TAILQ_REMOVE(&auth_lru, a, lru);
+	a->resident = 0;
+	auth_nresident--;
+
+	/* the chains of other CAs hold their own reference */
+	sk_X509_pop_free(a->untrusted, X509_free);
+	sk_X509_pop_free(a->trusted, X509_free);
+	a->untrusted = NULL;
+	a->trusted = NULL;
+	X509_free(a->cert->x509);
+	a->cert->x509 = NULL;
+}
+
+static void
+auth_touch(struct auth *a)
+{
+	if (a->der == NULL)
+		return;
+
+	if (a->resident)
+		TAILQ_REMOVE(&auth_lru, a, lru);
+	else {
+		a->resident = 1;
+		auth_nresident++;
+	}
+	TAILQ_INSERT_HEAD(&auth_lru, a, lru);
+
+	while (auth_nresident > AUTH_RESIDENT)
+		auth_evict(TAILQ_LAST(&auth_lru, auth_lru_head));
+}
+
+/*
+ * Keep a copy of the DER of the cert so its X509 can be evicted.
+ */
+void
+auth_lru_add(struct auth *a, const unsigned char *der, size_t len)
+{
+	if ((a->der = malloc(len)) == NULL)
+		err(1, NULL);
+	memcpy(a->der, der, len);
+	a->dersz = len;
+	auth_touch(a);
+}
+
+/*
+ * Return the X509 of the cert of a, decoding it again if it was evicted.
+ */
+X509 *
+auth_x509(struct auth *a)
+{
+	const unsigned char	*der;
+
+	if (a->cert->x509 == NULL) {
+		der = a->der;
+		a->cert->x509 = d2i_X509(NULL, &der, a->dersz);
+		if (a->cert->x509 == NULL)
+			errx(1, "%s: d2i_X509 failed", a->cert->ski);
+	}
+	auth_touch(a);
+	return a->cert->x509;
+}
+
 static inline int
 authcmp(struct auth *a, struct auth *b)
 {
-	return strcmp(a->cert->ski, b->cert->ski);
+	return memcmp(a->skid, b->skid, sizeof(a->skid));
 }
 
 RB_GENERATE_STATIC(auth_tree, auth, entry, authcmp);
@@ -1180,19 +1313,26 @@ auth_tree_free(struct auth_tree *auths)
 	RB_FOREACH_SAFE(auth, auth_tree, auths, tauth) {
 		RB_REMOVE(auth_tree, auths, auth);
 		cert_free(auth->cert);
+		free(auth->res.ips[0]);
+		free(auth->res.ips[1]);
+		free(auth->res.as);
+		sk_X509_pop_free(auth->untrusted, X509_free);
+		sk_X509_pop_free(auth->trusted, X509_free);
+		free(auth->der);
 		free(auth);
 	}
+	TAILQ_INIT(&auth_lru);
+	auth_nresident = 0;
 }
 
 struct auth *
 auth_find(struct auth_tree *auths, const char *aki)
 {
 	struct auth a;
-	struct cert c;
 
 	/* we look up the cert where the ski == aki */
-	c.ski = (char *)aki;
-	a.cert = &c;
+	if (hex_decode(aki, (char *)a.skid, sizeof(a.skid)) == -1)
+		return NULL;
 
 	return RB_FIND(auth_tree, auths, &a);
 }
@@ -1200,15 +1340,44 @@ auth_find(struct auth_tree *auths, const char *aki)
 struct auth *
 auth_insert(struct auth_tree *auths, struct cert *cert, struct auth *issuer)
 {
-	struct auth *na;
+	struct auth	*na;
+	SHA256_CTX	 ctx;
+	unsigned char	 md[SHA256_DIGEST_LENGTH];
+	int		 i;
 
-	na = malloc(sizeof(*na));
+	na = calloc(1, sizeof(*na));
 	if (na == NULL)
 		err(1, NULL);
 
 	na->issuer = issuer;
 	na->cert = cert;
-	na->any_inherits = x509_any_inherits(cert->x509);
+	if (hex_decode(cert->ski, (char *)na->skid, sizeof(na->skid)) == -1)
+		errx(1, "bad SKI %s", cert->ski);
+	na->any_inherits = cert_any_inherits(cert);
+	ip_index_build(&na->res, cert->ips, cert->ipsz);
+	as_index_build(&na->res, cert->as, cert->asz);
+
+	/* resolve inherit once, the issuer is already resolved */
+	for (i = 0; i < 2; i++) {
+		if (!na->res.ipinherit[i])
+			na->ipfrom[i] = na;
+		else if (issuer != NULL)
+			na->ipfrom[i] = issuer->ipfrom[i];
+	}
+	if (!na->res.asinherit)
+		na->asfrom = na;
+	else if (issuer != NULL)
+		na->asfrom = issuer->asfrom;
+
+	/* hash over the cert and all of its issuers, used by the cache */
+	if (!X509_digest(cert->x509, EVP_sha256(), md, NULL))
+		errx(1, "X509_digest failed");
+	SHA256_Init(&ctx);
+	if (issuer != NULL)
+		SHA256_Update(&ctx, issuer->chainhash,
+		    sizeof(issuer->chainhash));
+	SHA256_Update(&ctx, md, sizeof(md));
+	SHA256_Final(na->chainhash, &ctx);
 
 	if (RB_INSERT(auth_tree, auths, na) != NULL)
 		err(1, "auth tree corrupted");
@@ -1217,14 +1386,16 @@ auth_insert(struct auth_tree *auths, struct cert *cert, struct auth *issuer)
 }
 
 static void
-insert_brk(struct brk_tree *tree, struct cert *cert, int asid)
+insert_brk(struct brk_tree *tree, struct cert *cert, uint32_t min,
+    uint32_t max)
 {
 	struct brk	*b, *found;
 
 	if ((b = calloc(1, sizeof(*b))) == NULL)
 		err(1, NULL);
 
-	b->asid = asid;
+	b->asid = min;
+	b->asid_max = max;
 	b->expires = cert->notafter;
 	b->talid = cert->talid;
 	if ((b->ski = strdup(cert->ski)) == NULL)
@@ -1248,22 +1419,23 @@ insert_brk(struct brk_tree *tree, struct cert *cert, int asid)
 }
 
 /*
- * Add each BGPsec Router Key into the BRK tree.
+ * Add each BGPsec Router Key into the BRK tree, one entry per AS
+ * identifier or range of the certificate.
  */
 void
 cert_insert_brks(struct brk_tree *tree, struct cert *cert)
 {
-	size_t		 i, asid;
+	size_t		 i;
 
 	for (i = 0; i < cert->asz; i++) {
 		switch (cert->as[i].type) {
 		case CERT_AS_ID:
-			insert_brk(tree, cert, cert->as[i].id);
+			insert_brk(tree, cert, cert->as[i].id,
+			    cert->as[i].id);
 			break;
 		case CERT_AS_RANGE:
-			for (asid = cert->as[i].range.min;
-			    asid <= cert->as[i].range.max; asid++)
-				insert_brk(tree, cert, asid);
+			insert_brk(tree, cert, cert->as[i].range.min,
+			    cert->as[i].range.max);
 			break;
 		default:
 			warnx("invalid AS identifier type");
@@ -1281,6 +1453,10 @@ brkcmp(struct brk *a, struct brk *b)
 		return 1;
 	if (a->asid < b->asid)
 		return -1;
+	if (a->asid_max > b->asid_max)
+		return 1;
+	if (a->asid_max < b->asid_max)
+		return -1;
 
 	rv = strcmp(a->ski, b->ski);
 	if (rv > 0)
@@ -18,20 +18,131 @@
 #include <assert.h>
 #include <err.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
 #include <openssl/bio.h>
 #include <openssl/cms.h>
+#include <openssl/evp.h>
+#include <openssl/sha.h>
 
 #include "extern.h"
+#include "version.h"
 
 extern ASN1_OBJECT	*cnt_type_oid;
 extern ASN1_OBJECT	*msg_dgst_oid;
 extern ASN1_OBJECT	*sign_time_oid;
 extern ASN1_OBJECT	*bin_sign_time_oid;
 
+/*
+ * Sorted digests of the CMS objects whose signature verified in the
+ * previous run. The public key operation is skipped for byte-identical
+ * objects since its result can not differ, all the other checks are
+ * still done. The digests verified in this run are collected in
+ * sigs and passed on to the main process which stores them for the
+ * next run.
+ */
+static unsigned char	*sigcache;
+static size_t		 sigcachesz;	/* number of digests */
+static int		 sigcache_on;
+static unsigned char	*sigs;
+static size_t		 sigsz, sigmax;	/* in bytes */
+
+static int
+sigcache_cmp(const void *a, const void *b)
+{
+	return memcmp(a, b, SHA256_DIGEST_LENGTH);
+}
+
+/*
+ * Load the signature cache written by the main process and start to
+ * collect the digests of verified signatures.
+ */
+void
+cms_sigcache_load(const char *name)
+{
+	FILE *f;
+	unsigned char *c;
+	char *line = NULL;
+	size_t linesize = 0, max = 0;
+
+	sigcache_on = 1;
+
+	if ((f = fopen(name, "r")) == NULL)
+		return;
+	if (getline(&line, &linesize, f) == -1 ||
+	    strcmp(line, CACHE_MAGIC) != 0)
+		goto out;
+
+	for (;;) {
+		if (sigcachesz == max) {
+			max = max == 0 ? 4096 : max * 2;
+			c = reallocarray(sigcache, max, SHA256_DIGEST_LENGTH);
+			if (c == NULL)
+				err(1, NULL);
+			sigcache = c;
+		}
+		if (fread(sigcache + sigcachesz * SHA256_DIGEST_LENGTH,
+		    SHA256_DIGEST_LENGTH, 1, f) != 1)
+			break;
+		sigcachesz++;
+	}
+	qsort(sigcache, sigcachesz, SHA256_DIGEST_LENGTH, sigcache_cmp);
+
+ out:
+	free(line);
+	fclose(f);
+}
+
+/*
+ * Return 1 if digests were collected since the last cms_sigcache_buffer().
+ */
+int
+cms_sigcache_pending(void)
+{
+	return sigsz > 0;
+}
+
+/*
+ * Move the collected digests into b.
+ */
+void
+cms_sigcache_buffer(struct ibuf *b)
+{
+	io_buf_buffer(b, sigs, sigsz);
+	sigsz = 0;
+}
+
+static void
+sigcache_collect(const unsigned char *dgst)
+{
+	unsigned char *s;
+	size_t max;
+
+	if (sigsz + SHA256_DIGEST_LENGTH > sigmax) {
+		max = sigmax == 0 ? 64 * SHA256_DIGEST_LENGTH : sigmax * 2;
+		if ((s = realloc(sigs, max)) == NULL)
+			err(1, NULL);
+		sigs = s;
+		sigmax = max;
+	}
+	memcpy(sigs + sigsz, dgst, SHA256_DIGEST_LENGTH);
+	sigsz += SHA256_DIGEST_LENGTH;
+}
+
+/*
+ * Keep the digest of an object whose validated result was taken from
+ * the cache, its signature was verified when the result was cached.
+ */
+void
+cms_sigcache_keep(const unsigned char *dgst)
+{
+	if (sigcache_on)
+		sigcache_collect(dgst);
+}
+
 static int
 cms_extract_econtent(const char *fn, CMS_ContentInfo *cms, unsigned char **res,
     size_t *rsz)
@@ -107,6 +218,8 @@ cms_parse_validate_internal(X509 **xp, const char *fn, const unsigned char *der,
 	CMS_SignerInfo			*si;
 	EVP_PKEY			*pkey;
 	X509_ALGOR			*pdig, *psig;
+	unsigned char			 dgst[SHA256_DIGEST_LENGTH];
+	unsigned int			 flags = CMS_NO_SIGNER_CERT_VERIFY;
 	int				 i, nattrs, nid;
 	int				 has_ct = 0, has_md = 0, has_st = 0,
 					 has_bst = 0;
@@ -132,15 +245,25 @@ cms_parse_validate_internal(X509 **xp, const char *fn, const unsigned char *der,
 		goto out;
 	}
 
+	if (sigcache_on) {
+		if (!EVP_Digest(oder, len, dgst, NULL, EVP_sha256(), NULL))
+			errx(1, "EVP_Digest failed");
+		if (bsearch(dgst, sigcache, sigcachesz, sizeof(dgst),
+		    sigcache_cmp) != NULL)
+			flags |= CMS_NO_ATTR_VERIFY;
+	}
+
 	/*
 	 * The CMS is self-signed with a signing certificate.
 	 * Verify that the self-signage is correct.
+	 * The message digest is checked even if the signature is known good.
 	 */
-	if (!CMS_verify(cms, NULL, NULL, bio, NULL,
-	    CMS_NO_SIGNER_CERT_VERIFY)) {
+	if (!CMS_verify(cms, NULL, NULL, bio, NULL, flags)) {
 		warnx("%s: CMS verification error", fn);
 		goto out;
 	}
+	if (sigcache_on)
+		sigcache_collect(dgst);
 
 	/* RFC 6488 section 3 verify the CMS */
 
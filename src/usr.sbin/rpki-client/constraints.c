@@ -48,12 +48,16 @@ struct tal_constraints {
 	size_t		 deny_ipsz;	/* length of "deny_ips" */
 	struct cert_as	*deny_as;	/* forbidden AS numbers and ranges */
 	size_t		 deny_asz;	/* length of "deny_as" */
+	struct res_index allow;		/* sorted index of the allowlists */
+	struct res_index deny;		/* sorted index of the denylists */
 } tal_constraints[TALSZ_MAX];
 
 /*
  * If there is a .constraints file next to a .tal file, load its contents
  * into into tal_constraints[talid]. The load function only opens the fd
- * and stores the filename. The actual parsing happens in constraints_parse().
+ * and stores the filename. The actual parsing happens in constraints_parse(),
+ * called once by the main process before the parsers are forked off so
+ * they all inherit the result.
  * Resources of EE certs can then be constrained using constraints_validate().
  */
 
@@ -107,20 +111,36 @@ constraints_load(void)
 		constraints_load_talid(talid);
 }
 
+static void
+constraints_index_free(struct res_index *ri)
+{
+	free(ri->ips[0]);
+	free(ri->ips[1]);
+	free(ri->as);
+	memset(ri, 0, sizeof(*ri));
+}
+
 void
 constraints_unload(void)
 {
-	int	 saved_errno, talid;
+	struct tal_constraints	*tc;
+	int			 saved_errno, talid;
 
 	saved_errno = errno;
 	for (talid = 0; talid < talsz; talid++) {
-		if (tal_constraints[talid].fd != -1)
-			close(tal_constraints[talid].fd);
-		free(tal_constraints[talid].fn);
-		free(tal_constraints[talid].warn);
-		tal_constraints[talid].fd = -1;
-		tal_constraints[talid].fn = NULL;
-		tal_constraints[talid].warn = NULL;
+		tc = &tal_constraints[talid];
+		if (tc->fd != -1)
+			close(tc->fd);
+		free(tc->fn);
+		free(tc->warn);
+		free(tc->allow_ips);
+		free(tc->allow_as);
+		free(tc->deny_ips);
+		free(tc->deny_as);
+		constraints_index_free(&tc->allow);
+		constraints_index_free(&tc->deny);
+		memset(tc, 0, sizeof(*tc));
+		tc->fd = -1;
 	}
 	errno = saved_errno;
 }
@@ -489,6 +509,11 @@ constraints_parse_talid(int talid)
 	tal_constraints[talid].deny_ips = deny_ips;
 	tal_constraints[talid].deny_ipsz = deny_ipsz;
 
+	ip_index_build(&tal_constraints[talid].allow, allow_ips, allow_ipsz);
+	as_index_build(&tal_constraints[talid].allow, allow_as, allow_asz);
+	ip_index_build(&tal_constraints[talid].deny, deny_ips, deny_ipsz);
+	as_index_build(&tal_constraints[talid].deny, deny_as, deny_asz);
+
 	IPAddrBlocks_free(allow_addrs);
 	IPAddrBlocks_free(deny_addrs);
 	ASIdentifiers_free(allow_asids);
@@ -509,10 +534,13 @@ constraints_parse(void)
 		constraints_parse_talid(talid);
 }
 
+/*
+ * The lists are canonized, so sorted and free of overlaps, which lets
+ * both checks use a binary search.
+ */
 static int
-constraints_check_as(const char *fn, struct cert_as *cert,
-    const struct cert_as *allow_as, size_t allow_asz,
-    const struct cert_as *deny_as, size_t deny_asz)
+constraints_check_as(const struct tal_constraints *tc,
+    const struct cert_as *cert)
 {
 	uint32_t min, max;
 
@@ -528,33 +556,28 @@ constraints_check_as(const char *fn, struct cert_as *cert,
 		max = cert->range.max;
 	}
 
-	if (deny_as != NULL) {
-		if (!as_check_overlap(cert, fn, deny_as, deny_asz, 1))
-			return 0;
-	}
-	if (allow_as != NULL) {
-		if (as_check_covered(min, max, allow_as, allow_asz) <= 0)
+	if (as_index_overlaps(&tc->deny, min, max))
+		return 0;
+	if (tc->allow_as != NULL) {
+		if (as_index_covered(&tc->allow, min, max) <= 0)
 			return 0;
 	}
 	return 1;
 }
 
 static int
-constraints_check_ips(const char *fn, struct cert_ip *cert,
-    const struct cert_ip *allow_ips, size_t allow_ipsz,
-    const struct cert_ip *deny_ips, size_t deny_ipsz)
+constraints_check_ips(const struct tal_constraints *tc,
+    const struct cert_ip *cert)
 {
 	/* Inheriting EE resources are not to be constrained. */
 	if (cert->type == CERT_IP_INHERIT)
 		return 1;
 
-	if (deny_ips != NULL) {
-		if (!ip_addr_check_overlap(cert, fn, deny_ips, deny_ipsz, 1))
-			return 0;
-	}
-	if (allow_ips != NULL) {
-		if (ip_addr_check_covered(cert->afi, cert->min, cert->max,
-		    allow_ips, allow_ipsz) <= 0)
+	if (ip_index_overlaps(&tc->deny, cert->afi, cert->min, cert->max))
+		return 0;
+	if (tc->allow_ips != NULL) {
+		if (ip_index_covered(&tc->allow, cert->afi, cert->min,
+		    cert->max) <= 0)
 			return 0;
 	}
 	return 1;
@@ -568,44 +591,45 @@ constraints_check_ips(const char *fn, struct cert_ip *cert,
 int
 constraints_validate(const char *fn, const struct cert *cert)
 {
-	int		 talid = cert->talid;
-	struct cert_as	*allow_as, *deny_as;
-	struct cert_ip	*allow_ips, *deny_ips;
-	size_t		 i, allow_asz, allow_ipsz, deny_asz, deny_ipsz;
+	const struct tal_constraints	*tc;
+	int				 talid = cert->talid;
+	size_t				 i;
 
 	/* Accept negative talid to bypass validation. */
 	if (talid < 0)
 		return 1;
 	if (talid >= talsz)
 		errx(1, "%s: talid out of range %d", fn, talid);
-
-	allow_as = tal_constraints[talid].allow_as;
-	allow_asz = tal_constraints[talid].allow_asz;
-	deny_as = tal_constraints[talid].deny_as;
-	deny_asz = tal_constraints[talid].deny_asz;
+	tc = &tal_constraints[talid];
 
 	for (i = 0; i < cert->asz; i++) {
-		if (constraints_check_as(fn, &cert->as[i], allow_as, allow_asz,
-		    deny_as, deny_asz))
+		if (constraints_check_as(tc, &cert->as[i]))
 			continue;
 
-		as_warn(fn, tal_constraints[talid].warn, &cert->as[i]);
+		as_warn(fn, tc->warn, &cert->as[i]);
 		return 0;
 	}
 
-	allow_ips = tal_constraints[talid].allow_ips;
-	allow_ipsz = tal_constraints[talid].allow_ipsz;
-	deny_ips = tal_constraints[talid].deny_ips;
-	deny_ipsz = tal_constraints[talid].deny_ipsz;
-
 	for (i = 0; i < cert->ipsz; i++) {
-		if (constraints_check_ips(fn, &cert->ips[i], allow_ips,
-		    allow_ipsz, deny_ips, deny_ipsz))
+		if (constraints_check_ips(tc, &cert->ips[i]))
 			continue;
 
-		ip_warn(fn, tal_constraints[talid].warn, &cert->ips[i]);
+		ip_warn(fn, tc->warn, &cert->ips[i]);
 		return 0;
 	}
 
 	return 1;
 }
+
+/*
+ * Return 1 if the resources under talid are restricted by a constraints
+ * file, 0 otherwise.
+ */
+int
+constraints_active(int talid)
+{
+	const struct tal_constraints *tc = &tal_constraints[talid];
+
+	return tc->allow_asz > 0 || tc->allow_ipsz > 0 ||
+	    tc->deny_asz > 0 || tc->deny_ipsz > 0;
+}
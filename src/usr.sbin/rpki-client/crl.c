@@ -20,6 +20,7 @@
 #include <string.h>
 #include <unistd.h>
 
+#include <openssl/evp.h>
 #include <openssl/x509.h>
 
 #include "extern.h"
@@ -51,6 +52,9 @@ crl_parse(const char *fn, const unsigned char *der, size_t len)
 		goto out;
 	}
 
+	if (!EVP_Digest(oder, len, crl->hash, NULL, EVP_sha256(), NULL))
+		errx(1, "EVP_Digest failed");
+
 	if (X509_CRL_get_version(crl->x509_crl) != 1) {
 		warnx("%s: RFC 6487 section 5: version 2 expected", fn);
 		goto out;
@@ -80,6 +84,10 @@ crl_parse(const char *fn, const unsigned char *der, size_t len)
 		warnx("%s: x509_crl_get_aki failed", fn);
 		goto out;
 	}
+	if (hex_decode(crl->aki, (char *)crl->akid, sizeof(crl->akid)) == -1) {
+		warnx("%s: bad AKI", fn);
+		goto out;
+	}
 	if ((crl->number = x509_crl_get_number(crl->x509_crl, fn)) == NULL) {
 		warnx("%s: x509_crl_get_number failed", fn);
 		goto out;
@@ -122,7 +130,7 @@ crl_parse(const char *fn, const unsigned char *der, size_t len)
 static inline int
 crlcmp(struct crl *a, struct crl *b)
 {
-	return strcmp(a->aki, b->aki);
+	return memcmp(a->akid, b->akid, sizeof(a->akid));
 }
 
 RB_GENERATE_STATIC(crl_tree, crl, entry, crlcmp);
@@ -137,7 +145,7 @@ crl_get(struct crl_tree *crlt, const struct auth *a)
 
 	if (a == NULL)
 		return NULL;
-	find.aki = a->cert->ski;
+	memcpy(find.akid, a->skid, sizeof(find.akid));
 	return RB_FIND(crl_tree, crlt, &find);
 }
 
@@ -155,6 +163,7 @@ crl_free(struct crl *crl)
 	free(crl->aki);
 	free(crl->number);
 	X509_CRL_free(crl->x509_crl);
+	sk_X509_CRL_free(crl->crls);
 	free(crl);
 }
 
@@ -0,0 +1,99 @@
+/*	$OpenBSD$ */
+/*
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * A minimal DER reader for the simple eContent structures. Only single
+ * byte tags and definite lengths in their shortest form are accepted.
+ * Callers fall back to the ASN.1 templates for anything this rejects,
+ * so there are no diagnostics here.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "extern.h"
+
+/*
+ * Read the next element, which must have the given tag, and return its
+ * content in out. Returns zero on failure, non-zero on success.
+ */
+int
+der_get(struct der *d, unsigned char tag, struct der *out)
+{
+	size_t	 len, hlen, i, n;
+
+	if (d->len < 2 || d->p[0] != tag)
+		return 0;
+
+	len = d->p[1];
+	hlen = 2;
+	if (len & 0x80) {
+		n = len & 0x7f;
+		if (n == 0 || n > 4 || d->len < 2 + n || d->p[2] == 0)
+			return 0;
+		for (len = 0, i = 0; i < n; i++)
+			len = len << 8 | d->p[2 + i];
+		if (len < 0x80)
+			return 0;
+		hlen += n;
+	}
+	if (d->len - hlen < len)
+		return 0;
+
+	out->p = d->p + hlen;
+	out->len = len;
+	d->p += hlen + len;
+	d->len -= hlen + len;
+	return 1;
+}
+
+/*
+ * Check if the next element has the given tag.
+ */
+int
+der_peek(const struct der *d, unsigned char tag)
+{
+	return d->len > 0 && d->p[0] == tag;
+}
+
+/*
+ * Read a minimally encoded non-negative INTEGER which fits 32 bits.
+ * Returns zero on failure, non-zero on success.
+ */
+int
+der_get_uint32(struct der *d, uint32_t *out)
+{
+	struct der	 i;
+	uint32_t	 v = 0;
+
+	if (!der_get(d, DER_INTEGER, &i) || i.len == 0)
+		return 0;
+	if (i.p[0] & 0x80)
+		return 0;
+	if (i.len > 1 && i.p[0] == 0 && (i.p[1] & 0x80) == 0)
+		return 0;
+	if (i.p[0] == 0) {
+		i.p++;
+		i.len--;
+	}
+	if (i.len > sizeof(v))
+		return 0;
+	for (; i.len > 0; i.p++, i.len--)
+		v = v << 8 | i.p[0];
+	*out = v;
+	return 1;
+}
@@ -14,13 +14,14 @@
  * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
+#include <sys/mman.h>
 #include <sys/stat.h>
 
 #include <err.h>
 #include <errno.h>
-#include <ctype.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
@@ -28,6 +29,7 @@
 #include <openssl/evp.h>
 
 #include "extern.h"
+#include "version.h"
 
 /*
  * Load file from disk and return the buffer and size.
@@ -73,6 +75,129 @@ err:
 	return NULL;
 }
 
+/* scratch buffer map_file() reads the small files into */
+static unsigned char *filebuf;
+
+/*
+ * Like load_file() but files of at least MMAP_MIN_SIZE bytes are mapped
+ * read-only instead of copied. Smaller files are cheaper to read and
+ * go into a buffer which is reused by the next call, so only one file
+ * can be in use at a time.
+ * The returned buffer must be released with unmap_file().
+ */
+unsigned char *
+map_file(const char *name, size_t *len)
+{
+	struct stat st;
+	void *buf = NULL;
+	ssize_t n;
+	size_t size;
+	int fd, saved_errno;
+
+	*len = 0;
+
+	if ((fd = open(name, O_RDONLY)) == -1)
+		return NULL;
+	if (fstat(fd, &st) != 0)
+		goto err;
+	if (st.st_size <= 0 || st.st_size > MAX_FILE_SIZE) {
+		errno = EFBIG;
+		goto err;
+	}
+	size = (size_t)st.st_size;
+	if (size < MMAP_MIN_SIZE) {
+		if (filebuf == NULL &&
+		    (filebuf = malloc(MMAP_MIN_SIZE)) == NULL)
+			goto err;
+		buf = filebuf;
+		n = read(fd, buf, size);
+		if (n == -1)
+			goto err;
+		if ((size_t)n != size) {
+			errno = EIO;
+			goto err;
+		}
+	} else {
+		buf = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (buf == MAP_FAILED) {
+			buf = NULL;
+			goto err;
+		}
+		/* the whole object is parsed right away */
+		madvise(buf, size, MADV_WILLNEED);
+	}
+	close(fd);
+	*len = size;
+	return buf;
+
+err:
+	saved_errno = errno;
+	close(fd);
+	errno = saved_errno;
+	return NULL;
+}
+
+/*
+ * Release a buffer returned by map_file().
+ * The scratch buffer of the small files is kept for the next file.
+ */
+void
+unmap_file(unsigned char *buf, size_t len)
+{
+	if (buf == NULL || len < MMAP_MIN_SIZE)
+		return;
+	if (munmap(buf, len) == -1)
+		err(1, "munmap");
+}
+
+/*
+ * Load a cache file written by the main process and pass each record together
+ * with its data to insert, which takes ownership of the data.
+ * Returns 0 on success and -1 if the file is missing, outdated or truncated.
+ * Records read before an error are kept.
+ */
+int
+load_cache_file(const char *name,
+    void (*insert)(struct cache_rec *, unsigned char *))
+{
+	struct cache_rec rec;
+	unsigned char *data;
+	FILE *f;
+	char *line = NULL;
+	size_t linesize = 0;
+	int rc = -1;
+
+	if ((f = fopen(name, "r")) == NULL)
+		return -1;
+
+	/* the serialized objects are only valid for this very version */
+	if (getline(&line, &linesize, f) == -1 ||
+	    strcmp(line, CACHE_MAGIC) != 0)
+		goto out;
+
+	for (;;) {
+		if (fread(&rec, sizeof(rec), 1, f) != 1) {
+			if (feof(f))
+				rc = 0;
+			break;
+		}
+		if (rec.len == 0 || rec.len > INT32_MAX)
+			break;
+		if ((data = malloc(rec.len)) == NULL)
+			err(1, NULL);
+		if (fread(data, rec.len, 1, f) != 1) {
+			free(data);
+			break;
+		}
+		insert(&rec, data);
+	}
+
+ out:
+	free(line);
+	fclose(f);
+	return rc;
+}
+
 /*
  * Return the size of the data blob in outlen for an inlen sized base64 buffer.
  * Returns 0 on success and -1 if inlen would overflow an int.
@@ -190,6 +315,16 @@ hex_encode(const unsigned char *in, size_t insz)
 	return out;
 }
 
+/*
+ * Value of a hex digit plus one, zero for all other characters.
+ */
+static const unsigned char hexval[256] = {
+	['0'] = 1, ['1'] = 2, ['2'] = 3, ['3'] = 4, ['4'] = 5,
+	['5'] = 6, ['6'] = 7, ['7'] = 8, ['8'] = 9, ['9'] = 10,
+	['A'] = 11, ['B'] = 12, ['C'] = 13, ['D'] = 14, ['E'] = 15, ['F'] = 16,
+	['a'] = 11, ['b'] = 12, ['c'] = 13, ['d'] = 14, ['e'] = 15, ['f'] = 16,
+};
+
 /*
  * Hex decode hexstring into the supplied buffer.
  * Return 0 on success else -1, if buffer too small or bad encoding.
@@ -197,32 +332,22 @@ hex_encode(const unsigned char *in, size_t insz)
 int
 hex_decode(const char *hexstr, char *buf, size_t len)
 {
-	unsigned char ch, r;
+	const unsigned char *in = (const unsigned char *)hexstr;
+	unsigned char hi, lo;
 	size_t pos = 0;
-	int i;
-
-	while (*hexstr) {
-		r = 0;
-		for (i = 0; i < 2; i++) {
-			ch = hexstr[i];
-			if (isdigit(ch))
-				ch -= '0';
-			else if (islower(ch))
-				ch -= ('a' - 10);
-			else if (isupper(ch))
-				ch -= ('A' - 10);
-			else
-				return -1;
-			if (ch > 0xf)
-				return -1;
-			r = r << 4 | ch;
-		}
+
+	while (*in) {
+		/* a NUL as second digit is caught as bad encoding */
+		hi = hexval[in[0]];
+		lo = hexval[in[1]];
+		if (hi == 0 || lo == 0)
+			return -1;
 		if (pos < len)
-			buf[pos++] = r;
+			buf[pos++] = (hi - 1) << 4 | (lo - 1);
 		else
 			return -1;
 
-		hexstr += 2;
+		in += 2;
 	}
 	return 0;
 }
@@ -171,6 +171,11 @@ enum rtype {
 	RTYPE_TAK,
 	RTYPE_GEOFEED,
 	RTYPE_SPL,
+	RTYPE_AUTH,
+	RTYPE_SIG,
+	RTYPE_STAMP,
+	RTYPE_PTIMES,
+	RTYPE_RTIMES,
 };
 
 enum location {
@@ -212,6 +217,8 @@ struct mft {
 	size_t		 filesz; /* number of filenames */
 	unsigned int	 repoid;
 	int		 talid;
+	int		 filesref; /* files[].file point into the read buffer */
+	char		*filenames; /* or into this one */
 };
 
 /*
@@ -336,7 +343,7 @@ struct tak {
  * A single geofeed record
  */
 struct geoip {
-	struct cert_ip	*ip;
+	struct cert_ip	 ip;
 	char		*loc;
 };
 
@@ -416,20 +423,26 @@ RB_PROTOTYPE(vap_tree, vap, entry, vapcmp);
  * A single VRP element (including ASID)
  */
 struct vrp {
-	RB_ENTRY(vrp)	entry;
 	struct ip_addr	addr;
 	uint32_t	asid;
 	enum afi	afi;
 	unsigned char	maxlength;
 	time_t		expires; /* transitive expiry moment */
 	int		talid; /* covered by which TAL */
-	unsigned int	repoid;
+	struct repo	*repo;
 };
 /*
- * Tree of VRP sorted by afi, addr, maxlength and asid
+ * Array of VRP, filled in any order and then sorted by afi, addr,
+ * maxlength and asid and made unique by vrp_sort().
  */
-RB_HEAD(vrp_tree, vrp);
-RB_PROTOTYPE(vrp_tree, vrp, entry, vrpcmp);
+struct vrp_array {
+	struct vrp	*v;
+	size_t		 num;
+	size_t		 max;
+};
+
+#define VRP_FOREACH(vrp, va) \
+	for ((vrp) = (va)->v; (vrp) < (va)->v + (va)->num; (vrp)++)
 
 /*
  * Validated SignedPrefixList Payload
@@ -452,11 +465,13 @@ RB_HEAD(vsp_tree, vsp);
 RB_PROTOTYPE(vsp_tree, vsp, entry, vspcmp);
 
 /*
- * A single BGPsec Router Key (including ASID)
+ * A single BGPsec Router Key for a range of ASIDs. The range is kept as
+ * in the certificate and only expanded when the keys are written out.
  */
 struct brk {
 	RB_ENTRY(brk)	 entry;
-	uint32_t	 asid;
+	uint32_t	 asid; /* first ASID of the range */
+	uint32_t	 asid_max; /* last ASID of the range */
 	int		 talid; /* covered by which TAL */
 	char		*ski; /* Subject Key Identifier */
 	char		*pubkey; /* Subject Public Key Info */
@@ -468,6 +483,23 @@ struct brk {
 RB_HEAD(brk_tree, brk);
 RB_PROTOTYPE(brk_tree, brk, entry, brkcmp);
 
+/*
+ * Walk of a BRK tree one ASID at a time, in ASID order. Only the keys
+ * covering the current ASID are held, a key of overlapping ranges is
+ * returned once per ASID.
+ */
+struct brk_iter {
+	struct brk_tree	*tree;
+	struct brk	*next;		/* next key to enter the walk */
+	struct brk	**active;	/* keys covering asid */
+	size_t		 nactive;
+	size_t		 maxactive;
+	size_t		 idx;
+	uint32_t	 asid;
+	int		 started;
+	int		 done;
+};
+
 /*
  * A single CRL
  */
@@ -475,15 +507,39 @@ struct crl {
 	RB_ENTRY(crl)	 entry;
 	char		*aki;
 	char		*number;
+	unsigned char	 akid[SHA_DIGEST_LENGTH]; /* binary aki */
 	X509_CRL	*x509_crl;
+	STACK_OF(X509_CRL) *crls;	/* x509_crl for valid_x509() */
 	time_t		 thisupdate;	/* do not use before */
 	time_t		 nextupdate;	/* do not use after */
+	unsigned char	 hash[SHA256_DIGEST_LENGTH]; /* of the DER */
 };
 /*
- * Tree of CRLs sorted by uri
+ * Tree of CRLs sorted by binary aki
  */
 RB_HEAD(crl_tree, crl);
 
+/*
+ * A copy of the range of a cert_ip in a res_index.
+ */
+struct cert_ip_range {
+	unsigned char	 min[16];
+	unsigned char	 max[16];
+};
+
+/*
+ * The resources of a cert sorted by their minimum for binary search.
+ * The IP ranges are kept per AFI, indexed by afi - 1.
+ */
+struct res_index {
+	struct cert_ip_range	 *ips[2];
+	size_t			  ipsz[2];
+	int			  ipinherit[2];
+	struct cert_as_range	 *as;
+	size_t			  asz;
+	int			  asinherit;
+};
+
 /*
  * An authentication tuple.
  * This specifies a public key and a subject key identifier used to
@@ -493,15 +549,30 @@ struct auth {
 	RB_ENTRY(auth)	 entry;
 	struct cert	*cert; /* owner information */
 	struct auth	*issuer; /* pointer to issuer or NULL for TA cert */
+	unsigned char	 skid[SHA_DIGEST_LENGTH]; /* binary cert->ski */
+	struct res_index res; /* index of the cert resources */
+	struct auth	*ipfrom[2]; /* holder of the effective IP resources */
+	struct auth	*asfrom; /* holder of the effective AS resources */
+	STACK_OF(X509)	*untrusted; /* chain for valid_x509(), lazily built */
+	STACK_OF(X509)	*trusted;
+	time_t		 expires; /* of the chain, once expires_done is set */
+	int		 expires_done;
 	int		 any_inherits;
+	unsigned char	 chainhash[SHA256_DIGEST_LENGTH]; /* cert and issuers */
+	TAILQ_ENTRY(auth) lru; /* while cert->x509 is resident */
+	unsigned char	*der; /* to reload cert->x509, NULL if never evicted */
+	size_t		 dersz;
+	int		 resident;
 };
 /*
- * Tree of auth sorted by ski
+ * Tree of auth sorted by binary ski
  */
 RB_HEAD(auth_tree, auth);
 
 struct auth	*auth_find(struct auth_tree *, const char *);
 struct auth	*auth_insert(struct auth_tree *, struct cert *, struct auth *);
+void		 auth_lru_add(struct auth *, const unsigned char *, size_t);
+X509		*auth_x509(struct auth *);
 
 enum http_result {
 	HTTP_FAILED,	/* anything else */
@@ -522,8 +593,12 @@ enum rrdp_msg {
 	RRDP_HTTP_INI,
 	RRDP_HTTP_FIN,
 	RRDP_ABORT,
+	RRDP_PARSED,
 };
 
+/* Files staged by the RRDP process in the temp repo start with this. */
+#define RRDP_STAGE_PREFIX	".publish."
+
 /* Maximum number of delta files per RRDP notification file. */
 #define MAX_RRDP_DELTAS		300
 
@@ -532,8 +607,11 @@ enum rrdp_msg {
  */
 struct rrdp_session {
 	char			*last_mod;
+	char			*etag;
 	char			*session_id;
 	long long		 serial;
+	long long		 snapshot_size;	/* of the last snapshot */
+	long long		 delta_size;	/* average of recent deltas */
 	char			*deltas[MAX_RRDP_DELTAS];
 };
 
@@ -546,6 +624,55 @@ enum publish_type {
 	PUB_DEL,
 };
 
+/*
+ * Object cache record, followed by len bytes of the serialized object.
+ * A cached result is reused as long as the object, the chain of issuers
+ * and CRLs are unchanged and the result has not expired.
+ */
+struct cache_rec {
+	unsigned char	 hash[SHA256_DIGEST_LENGTH];	/* of the object */
+	unsigned char	 chain[SHA256_DIGEST_LENGTH];	/* issuers and CRLs */
+	time_t		 vtime;		/* time of validation */
+	time_t		 expires;	/* result not usable after */
+	time_t		 mtime;		/* signing time of the object */
+	enum rtype	 type;		/* RTYPE_INVALID if not cacheable */
+	size_t		 len;		/* length of serialized object */
+	unsigned char	 serial[20];	/* of the EE cert, checked on reuse */
+	size_t		 serialsz;
+};
+
+#define OBJCACHE_FILE	".objcache"
+#define MFTCACHE_FILE	".mftcache"
+#define OUTPUTSTATE_FILE	".outputstate"
+#define REPOHIST_FILE	".repohist"
+#define REDIRECT_FILE	".redirects"
+#define RRDPSTATE_FILE	".rrdpstate"
+#define SIGCACHE_FILE	".sigcache"
+#define STAMPCACHE_FILE	".stampcache"
+#define FILEINDEX_FILE	".fileindex"
+#define LOCK_FILE	".lock"
+#define TLS_SESSION_DIR	".tls"
+/*
+ * Revision of the cache file layouts and of the serialized objects in them.
+ * Bump it with every change to either so old caches are thrown away.
+ */
+#define CACHE_FORMAT	"2"
+#define CACHE_MAGIC	"rpki-client " RPKI_VERSION " cache " CACHE_FORMAT "\n"
+
+/*
+ * A file whose hash matched its manifest entry. The file is not read
+ * again while device, inode, size, modification and change time are
+ * the same.
+ */
+struct file_stamp {
+	unsigned char	 hash[SHA256_DIGEST_LENGTH];
+	dev_t		 dev;
+	ino_t		 ino;
+	off_t		 size;
+	struct timespec	 mtime;
+	struct timespec	 ctime;
+};
+
 /*
  * An entity (MFT, ROA, certificate, etc.) that needs to be downloaded
  * and parsed.
@@ -569,6 +696,7 @@ enum stype {
 	STYPE_FAIL,
 	STYPE_INVALID,
 	STYPE_BGPSEC,
+	STYPE_SKIP,
 	STYPE_TOTAL,
 	STYPE_UNIQUE,
 	STYPE_DEC_UNIQUE,
@@ -577,8 +705,7 @@ enum stype {
 };
 
 struct repo;
-struct filepath;
-RB_HEAD(filepath_tree, filepath);
+struct filepath_tree;
 
 
 /*
@@ -599,6 +726,7 @@ struct repotalstats {
 	uint32_t	 crls; /* revocation lists */
 	uint32_t	 gbrs; /* ghostbuster records */
 	uint32_t	 taks; /* signed TAL objects */
+	uint32_t	 skipped; /* GBRs and TAKs not validated */
 	uint32_t	 vaps; /* total number of Validated ASPA Payloads */
 	uint32_t	 vaps_uniqs; /* total number of unique VAPs */
 	uint32_t	 vaps_pas; /* total number of providers */
@@ -619,6 +747,66 @@ struct repostats {
 	uint32_t	 del_dirs;	/* number of dirs removed in cleanup */
 	uint32_t	 new_files;	/* moved from DIR_TEMP to DIR_VALID */
 	struct timespec	 sync_time;	/* time to sync repo */
+	/* only collected with -u */
+	long long	 bytes;		/* RRDP data received */
+	uint32_t	 http_reqs;	/* HTTP requests made */
+	uint32_t	 snapshots;	/* RRDP snapshots applied */
+	uint32_t	 deltas;	/* RRDP deltas applied */
+	uint32_t	 objects;	/* handled by the parsers */
+	struct timespec	 parse_time;	/* parser CPU time */
+};
+
+/*
+ * Parser CPU time spent on the objects of one repository, sent by the
+ * parsers as RTYPE_RTIMES with -u.
+ */
+struct repo_ptime {
+	unsigned int	 repoid;
+	uint32_t	 objects;
+	struct timespec	 time;
+};
+
+/*
+ * CPU time used by one kind of process, children are summed up.
+ */
+enum proc_type {
+	PROC_MAIN,
+	PROC_PARSER,
+	PROC_RSYNC,
+	PROC_HTTP,
+	PROC_RRDP,
+	PROC__MAX
+};
+
+struct proc_times {
+	struct timespec		user_time;
+	struct timespec		system_time;
+	long long		maxrss;		/* peak RSS in KB */
+};
+
+/*
+ * Distribution of durations in seconds for the metrics output. The
+ * upper bounds of the buckets are time_hist_bounds, the last bucket
+ * holds everything above.
+ */
+#define TIME_HIST_BUCKETS	10
+
+struct time_hist {
+	uint64_t		counts[TIME_HIST_BUCKETS + 1];
+	uint64_t		count;
+	double			sum;
+};
+
+extern const double	time_hist_bounds[TIME_HIST_BUCKETS];
+
+/*
+ * Bytes held by the validated data of main at the end of the run.
+ */
+struct mem_stats {
+	size_t			vrps;
+	size_t			vaps;
+	size_t			vsps;
+	size_t			brks;
 };
 
 struct stats {
@@ -637,13 +825,45 @@ struct stats {
 	struct timespec		elapsed_time;
 	struct timespec		user_time;
 	struct timespec		system_time;
+	struct timespec		process_time;	/* fetching and parsing */
+	struct timespec		cleanup_time;	/* cache save and cleanup */
+	struct proc_times	proc_times[PROC__MAX];
+	struct mem_stats	mem_stats;
+	time_t			next_expiry;	/* of the validated data */
+	struct time_hist	parse_times[RTYPE_SIG + 1]; /* per object */
+	struct time_hist	http_ttfb;	/* to the response status */
+	struct time_hist	rrdp_parse;	/* per snapshot or deltas */
 };
 
+/*
+ * Progress of a running validation, written to PROGRESS_FILE in the
+ * output directory every PROGRESS_INTERVAL seconds with -m and logged
+ * with -vv or on SIGINFO.
+ */
+struct progress {
+	size_t		 queued;	/* entities not yet processed */
+	size_t		 waiting;	/* entities waiting for a parser */
+	size_t		 parsing;	/* entities in the parsers */
+	size_t		 processed;	/* entities done */
+	size_t		 parserq;	/* messages queued per process */
+	size_t		 rrdpq;
+	size_t		 rsyncq;
+	size_t		 httpq;
+	unsigned int	 rrdp_syncs;	/* syncs going on per protocol */
+	unsigned int	 rsync_syncs;
+	unsigned int	 http_syncs;
+	struct timespec	 elapsed_time;
+};
+
+#define PROGRESS_FILE		"metrics.progress"
+#define PROGRESS_INTERVAL	10
+
 struct ibuf;
 struct msgbuf;
 
 /* global variables */
 extern int verbose;
+extern const char *proc_names[PROC__MAX];
 extern int filemode;
 extern int excludeaspa;
 extern const char *tals[];
@@ -661,8 +881,10 @@ struct tal	*tal_read(struct ibuf *);
 
 void		 cert_buffer(struct ibuf *, const struct cert *);
 void		 cert_free(struct cert *);
+void		 cert_compact(struct cert *);
 void		 auth_tree_free(struct auth_tree *);
 struct cert	*cert_parse_ee_cert(const char *, int, X509 *);
+int		 cert_any_inherits(const struct cert *);
 struct cert	*cert_parse_pre(const char *, const unsigned char *, size_t);
 struct cert	*cert_parse(const char *, struct cert *);
 struct cert	*ta_parse(const char *, struct cert *, const unsigned char *,
@@ -684,8 +906,11 @@ void		 roa_free(struct roa *);
 struct roa	*roa_parse(X509 **, const char *, int, const unsigned char *,
 		    size_t);
 struct roa	*roa_read(struct ibuf *);
-void		 roa_insert_vrps(struct vrp_tree *, struct roa *,
+void		 roa_insert_vrps(struct vrp_array *, struct roa *,
 		    struct repo *);
+void		 vrp_sort(struct vrp_array *);
+void		 vrp_tal_subset(struct vrp_array *, const struct vrp_array *,
+		    int);
 
 void		 spl_buffer(struct ibuf *, const struct spl *);
 void		 spl_free(struct spl *);
@@ -735,6 +960,10 @@ int		 valid_ta(const char *, struct auth_tree *,
 int		 valid_cert(const char *, struct auth *, const struct cert *);
 int		 valid_roa(const char *, struct cert *, struct roa *);
 int		 valid_filehash(int, const char *, size_t);
+void		 valid_stamps_load(const char *);
+int		 valid_stamps_pending(void);
+void		 valid_stamps_buffer(struct ibuf *);
+const struct file_stamp *valid_stamps_take(size_t *);
 int		 valid_hash(unsigned char *, size_t, const char *, size_t);
 int		 valid_filename(const char *, size_t);
 int		 valid_uri(const char *, size_t, const char *);
@@ -757,6 +986,10 @@ unsigned char	*cms_parse_validate(X509 **, const char *,
 int		 cms_parse_validate_detached(X509 **, const char *,
 		    const unsigned char *, size_t,
 		    const ASN1_OBJECT *, BIO *, time_t *);
+void		 cms_sigcache_load(const char *);
+int		 cms_sigcache_pending(void);
+void		 cms_sigcache_buffer(struct ibuf *);
+void		 cms_sigcache_keep(const unsigned char *);
 
 /* Work with RFC 3779 IP addresses, prefixes, ranges. */
 
@@ -766,10 +999,16 @@ int		 ip_addr_parse(const ASN1_BIT_STRING *,
 		    enum afi, const char *, struct ip_addr *);
 void		 ip_addr_print(const struct ip_addr *, enum afi, char *,
 		    size_t);
-int		 ip_addr_check_overlap(const struct cert_ip *,
-		    const char *, const struct cert_ip *, size_t, int);
+int		 ip_addr_check_overlap(const char *, const struct cert_ip *,
+		    size_t);
 int		 ip_addr_check_covered(enum afi, const unsigned char *,
 		    const unsigned char *, const struct cert_ip *, size_t);
+void		 ip_index_build(struct res_index *, const struct cert_ip *,
+		    size_t);
+int		 ip_index_covered(const struct res_index *, enum afi,
+		    const unsigned char *, const unsigned char *);
+int		 ip_index_overlaps(const struct res_index *, enum afi,
+		    const unsigned char *, const unsigned char *);
 int		 ip_cert_compose_ranges(struct cert_ip *);
 void		 ip_roa_compose_ranges(struct roa_ip *);
 void		 ip_warn(const char *, const char *, const struct cert_ip *);
@@ -785,10 +1024,16 @@ int		 sbgp_parse_ipaddrblk(const char *, const IPAddrBlocks *,
 /* Work with RFC 3779 AS numbers, ranges. */
 
 int		 as_id_parse(const ASN1_INTEGER *, uint32_t *);
-int		 as_check_overlap(const struct cert_as *, const char *,
-		    const struct cert_as *, size_t, int);
+int		 as_check_overlap(const char *, const struct cert_as *,
+		    size_t);
 int		 as_check_covered(uint32_t, uint32_t,
 		    const struct cert_as *, size_t);
+void		 as_index_build(struct res_index *, const struct cert_as *,
+		    size_t);
+int		 as_index_covered(const struct res_index *, uint32_t,
+		    uint32_t);
+int		 as_index_overlaps(const struct res_index *, uint32_t,
+		    uint32_t);
 void		 as_warn(const char *, const char *, const struct cert_as *);
 
 int		 sbgp_as_id(const char *, struct cert_as *, size_t *,
@@ -804,6 +1049,7 @@ void		 constraints_load(void);
 void		 constraints_unload(void);
 void		 constraints_parse(void);
 int		 constraints_validate(const char *, const struct cert *);
+int		 constraints_active(int);
 
 /* Parser-specific */
 void		 entity_free(struct entity *);
@@ -815,61 +1061,106 @@ void		 proc_filemode(int) __attribute__((noreturn));
 /* Rsync-specific. */
 
 char		*rsync_base_uri(const char *);
-void		 proc_rsync(char *, char *, int) __attribute__((noreturn));
+void		 proc_rsync(char *, char **, int, int)
+		    __attribute__((noreturn));
 
 /* HTTP and RRDP processes. */
 
-void		 proc_http(char *, int) __attribute__((noreturn));
+void		 proc_http(char **, unsigned int, unsigned int, int)
+		    __attribute__((noreturn));
 void		 proc_rrdp(int) __attribute__((noreturn));
 
+/* Readahead of the valid cache. */
+
+extern int	 readaheadfd;
+void		 readahead_add(const char *);
+void		 proc_readahead(int) __attribute__((noreturn));
+
 /* Repository handling */
+extern FILE		*changelog;
+extern int		 changelog_failed;
+extern const char	*repo_mirror;
+struct filepath_tree	*filepath_new(void);
 int		 filepath_add(struct filepath_tree *, char *, time_t);
 void		 rrdp_clear(unsigned int);
+void		 rrdp_stats_add(unsigned int, const struct repostats *);
 void		 rrdp_session_save(unsigned int, struct rrdp_session *);
 void		 rrdp_session_free(struct rrdp_session *);
 void		 rrdp_session_buffer(struct ibuf *,
 		    const struct rrdp_session *);
 struct rrdp_session	*rrdp_session_read(struct ibuf *);
 int		 rrdp_handle_file(unsigned int, enum publish_type, char *,
-		    char *, size_t, char *, size_t);
+		    char *, size_t, const char *, char *, size_t);
 char		*repo_basedir(const struct repo *, int);
+int		 repo_temp_used(const struct repo *);
 unsigned int	 repo_id(const struct repo *);
 const char	*repo_uri(const struct repo *);
 void		 repo_fetch_uris(const struct repo *, const char **,
 		    const char **);
 int		 repo_synced(const struct repo *);
+int		 repo_loading(const struct repo *);
+void		 repo_progress(struct progress *);
 const char	*repo_proto(const struct repo *);
 int		 repo_talid(const struct repo *);
 struct repo	*ta_lookup(int, struct tal *);
 struct repo	*repo_lookup(int, const char *, const char *);
+void		 repo_prefetch(int, const char *, const char *);
+void		 repo_prefetch_collect(void (*)(int, const char *,
+		    const char *));
+void		 repo_warm(void);
 struct repo	*repo_byid(unsigned int);
 int		 repo_queued(struct repo *, struct entity *);
-void		 repo_cleanup(struct filepath_tree *, int);
+void		 repo_move_file(struct filepath_tree *, char *);
+void		 repo_cleanup_start(struct filepath_tree *, int);
+void		 repo_cleanup_finish(struct filepath_tree *, int);
+void		 repo_checkpoint(struct filepath_tree *);
 int		 repo_check_timeout(int);
 void		 repostats_new_files_inc(struct repo *, const char *);
+void		 repostats_parse_add(struct repo *, const struct repo_ptime *);
 void		 repo_stat_inc(struct repo *, int, enum rtype, enum stype);
 void		 repo_tal_stats_collect(void (*)(const struct repo *,
 		    const struct repotalstats *, void *), int, void *);
+const struct repotalstats *repo_tal_stats(const struct repo *, int);
 void		 repo_stats_collect(void (*)(const struct repo *,
 		    const struct repostats *, void *), void *);
 void		 repo_free(void);
+void		 cache_open(void);
+void		 objcache_add(const struct cache_rec *, const void *);
+void		 mftcache_add(const struct cache_rec *, const void *);
+void		 sigcache_add(const void *, size_t);
+void		 stampcache_add(const void *, size_t);
+void		 cache_save(void);
+unsigned int	 repo_fetch_prio(unsigned int);
+unsigned int	 repo_newid(void);
+const char	*repo_redirect(unsigned int, const char *);
+void		 repo_redirect_done(unsigned int, enum http_result,
+		    const char *, const char *);
 
 void		 rsync_finish(unsigned int, int);
-void		 http_finish(unsigned int, enum http_result, const char *);
+void		 http_finish(unsigned int, enum http_result, const char *,
+		    const char *);
 void		 rrdp_finish(unsigned int, int);
 
 void		 rsync_fetch(unsigned int, const char *, const char *,
-		    const char *);
+		    const char *, unsigned int);
 void		 rsync_abort(unsigned int);
-void		 http_fetch(unsigned int, const char *, const char *, int);
+void		 http_abort(unsigned int);
+void		 http_fetch(unsigned int, const char *, const char *,
+		    const char *, long long, unsigned int, int);
+void		 http_prewarm(const char *);
 void		 rrdp_fetch(unsigned int, const char *, const char *,
-		    struct rrdp_session *);
+		    struct rrdp_session *, int);
 void		 rrdp_abort(unsigned int);
-void		 rrdp_http_done(unsigned int, enum http_result, const char *);
+void		 rrdp_http_done(unsigned int, enum http_result, const char *,
+		    const char *);
 
 /* Encoding functions for hex and base64. */
 
 unsigned char	*load_file(const char *, size_t *);
+unsigned char	*map_file(const char *, size_t *);
+void		 unmap_file(unsigned char *, size_t);
+int		 load_cache_file(const char *,
+		    void (*)(struct cache_rec *, unsigned char *));
 int		 base64_decode_len(size_t, size_t *);
 int		 base64_decode(const unsigned char *, size_t,
 		    unsigned char **, size_t *);
@@ -878,6 +1169,26 @@ int		 base64_encode(const unsigned char *, size_t, char **);
 char		*hex_encode(const unsigned char *, size_t);
 int		 hex_decode(const char *, char *, size_t);
 
+/* Minimal DER reader, see der.c. */
+
+#define DER_INTEGER	0x02
+#define DER_BIT_STRING	0x03
+#define DER_OCTET_STRING 0x04
+#define DER_OID		0x06
+#define DER_IA5STRING	0x16
+#define DER_GENTIME	0x18
+#define DER_SEQUENCE	0x30
+#define DER_EXPLICIT0	0xa0
+
+struct der {
+	const unsigned char	*p;
+	size_t			 len;
+};
+
+int		 der_get(struct der *, unsigned char, struct der *);
+int		 der_peek(const struct der *, unsigned char);
+int		 der_get_uint32(struct der *, uint32_t *);
+
 
 /* Functions for moving data between processes. */
 
@@ -885,11 +1196,18 @@ struct ibuf	*io_new_buffer(void);
 void		 io_simple_buffer(struct ibuf *, const void *, size_t);
 void		 io_buf_buffer(struct ibuf *, const void *, size_t);
 void		 io_str_buffer(struct ibuf *, const char *);
+void		 io_strz_buffer(struct ibuf *, const char *);
 void		 io_close_buffer(struct msgbuf *, struct ibuf *);
+struct ibuf	*io_new_batch(void);
+void		 io_batch_add(struct ibuf *, struct ibuf *);
+int		 io_batch_get(struct ibuf *, struct ibuf *);
 void		 io_read_buf(struct ibuf *, void *, size_t);
 void		 io_read_str(struct ibuf *, char **);
+void		 io_read_strz(struct ibuf *, char **);
 void		 io_read_buf_alloc(struct ibuf *, void **, size_t *);
 struct ibuf	*io_buf_read(int, struct ibuf **);
+void		 io_buf_fill(int, struct ibuf **);
+struct ibuf	*io_buf_next(struct ibuf *);
 struct ibuf	*io_buf_recvfd(int, struct ibuf **);
 
 /* X509 helpers. */
@@ -902,6 +1220,14 @@ int		 x509_get_ski(X509 *, const char *, char **);
 int		 x509_get_notbefore(X509 *, const char *, time_t *);
 int		 x509_get_notafter(X509 *, const char *, time_t *);
 int		 x509_get_crl(X509 *, const char *, char **);
+int		 x509_ext_get_aia(X509 *, X509_EXTENSION *, const char *,
+		    char **);
+int		 x509_ext_get_aki(X509 *, X509_EXTENSION *, const char *,
+		    char **);
+int		 x509_ext_get_ski(X509 *, X509_EXTENSION *, const char *,
+		    char **);
+int		 x509_ext_get_crl(X509 *, X509_EXTENSION *, const char *,
+		    char **);
 char		*x509_crl_get_aki(X509_CRL *, const char *);
 char		*x509_crl_get_number(X509_CRL *, const char *);
 char		*x509_get_pubkey(X509 *, const char *);
@@ -912,7 +1238,6 @@ char		*x509_convert_seqnum(const char *, const ASN1_INTEGER *);
 int		 x509_location(const char *, const char *, const char *,
 		    GENERAL_NAME *, char **);
 int		 x509_inherits(X509 *);
-int		 x509_any_inherits(X509 *);
 int		 x509_valid_subject(const char *, const X509 *);
 time_t		 x509_find_expires(time_t, struct auth *, struct crl_tree *);
 
@@ -932,6 +1257,32 @@ void		 tak_print(const X509 *, const struct tak *);
 void		 geofeed_print(const X509 *, const struct geofeed *);
 void		 spl_print(const X509 *, const struct spl *);
 
+/* Entity lifecycle tracing, disabled unless a trace file is given. */
+enum trace_type {
+	TRACE_QUEUE,
+	TRACE_DISPATCH,
+	TRACE_RECEIVE,
+	TRACE_PARSE,
+	TRACE_PROCESS,
+};
+
+extern int	 tracefd;
+#define TRACE(type, ph, file)	do {			\
+	if (tracefd != -1)				\
+		trace_event((type), (ph), (file));	\
+} while (0)
+
+void		 trace_open(const char *);
+void		 trace_reset(void);
+void		 trace_event(enum trace_type, char, const char *);
+void		 trace_dump(void);
+
+/* Sampling CPU profiler, disabled unless a profile file is given. */
+extern int	 proffd;
+void		 prof_open(const char *, void *);
+void		 prof_start(const char *);
+void		 prof_dump(void);
+
 /* Missing RFC 3779 API */
 IPAddrBlocks *IPAddrBlocks_new(void);
 void IPAddrBlocks_free(IPAddrBlocks *);
@@ -939,34 +1290,66 @@ void IPAddrBlocks_free(IPAddrBlocks *);
 /* Output! */
 
 extern int	 outformats;
+extern int	 outputgzip;
 #define FORMAT_OPENBGPD	0x01
 #define FORMAT_BIRD	0x02
 #define FORMAT_CSV	0x04
 #define FORMAT_JSON	0x08
 #define FORMAT_OMETRIC	0x10
+#define FORMAT_DELTA	0x20
+#define FORMAT_BINARY	0x40
+#define FORMAT_ROV	0x80
+
+extern FILE	*rov_input;
 
-int		 outputfiles(struct vrp_tree *v, struct brk_tree *b,
+int		 outputfiles(struct vrp_array *v, struct brk_tree *b,
 		    struct vap_tree *, struct vsp_tree *, struct stats *);
+int		 outputfile_tal(int, struct vrp_array *);
+int		 outputfile_progress(const struct progress *);
 int		 outputheader(FILE *, struct stats *);
-int		 output_bgpd(FILE *, struct vrp_tree *, struct brk_tree *,
+void		 output_state_save(struct vrp_array *, struct vap_tree *);
+int		 output_state_load(int, struct vrp_array *, struct vap_tree *);
+void		 output_state_free(struct vrp_array *, struct vap_tree *);
+extern int	 slurm_talid;
+void		 slurm_load(const char *);
+void		 slurm_filter_vrps(struct vrp_array *);
+void		 slurm_apply(struct vrp_array *, struct brk_tree *,
+		    struct vap_tree *);
+char		*fmt_str(char *, const char *);
+char		*fmt_uint(char *, unsigned long long);
+char		*fmt_prefix(char *, const struct ip_addr *, enum afi);
+void		 brk_iter_init(struct brk_iter *, struct brk_tree *);
+const struct brk *brk_iter_next(struct brk_iter *, uint32_t *);
+void		 brk_iter_free(struct brk_iter *);
+int		 output_bgpd(FILE *, struct vrp_array *, struct brk_tree *,
+		    struct vap_tree *, struct vsp_tree *, struct stats *);
+int		 output_bird1v4(FILE *, struct vrp_array *, struct brk_tree *,
 		    struct vap_tree *, struct vsp_tree *, struct stats *);
-int		 output_bird1v4(FILE *, struct vrp_tree *, struct brk_tree *,
+int		 output_bird1v6(FILE *, struct vrp_array *, struct brk_tree *,
 		    struct vap_tree *, struct vsp_tree *, struct stats *);
-int		 output_bird1v6(FILE *, struct vrp_tree *, struct brk_tree *,
+int		 output_binary(FILE *, struct vrp_array *, struct brk_tree *,
 		    struct vap_tree *, struct vsp_tree *, struct stats *);
-int		 output_bird2(FILE *, struct vrp_tree *, struct brk_tree *,
+int		 output_rov(FILE *, struct vrp_array *, struct brk_tree *,
 		    struct vap_tree *, struct vsp_tree *, struct stats *);
-int		 output_csv(FILE *, struct vrp_tree *, struct brk_tree *,
+int		 output_bird2(FILE *, struct vrp_array *, struct brk_tree *,
 		    struct vap_tree *, struct vsp_tree *, struct stats *);
-int		 output_json(FILE *, struct vrp_tree *, struct brk_tree *,
+int		 output_csv(FILE *, struct vrp_array *, struct brk_tree *,
 		    struct vap_tree *, struct vsp_tree *, struct stats *);
-int		 output_ometric(FILE *, struct vrp_tree *, struct brk_tree *,
+int		 output_delta(FILE *, struct vrp_array *, struct brk_tree *,
 		    struct vap_tree *, struct vsp_tree *, struct stats *);
+int		 output_json(FILE *, struct vrp_array *, struct brk_tree *,
+		    struct vap_tree *, struct vsp_tree *, struct stats *);
+int		 output_ometric(FILE *, struct vrp_array *, struct brk_tree *,
+		    struct vap_tree *, struct vsp_tree *, struct stats *);
+int		 output_ometric_progress(FILE *, const struct progress *);
 
 void		 logx(const char *fmt, ...)
 		    __attribute__((format(printf, 1, 2)));
 time_t		 getmonotime(void);
+const char	*fmt_rate(char *, size_t, long long, const struct timespec *);
 time_t		 get_current_time(void);
+void		 time_hist_add(struct time_hist *, double);
+void		 time_hist_merge(struct time_hist *, const struct time_hist *);
 
 int	mkpath(const char *);
 int	mkpathat(int, const char *);
@@ -993,6 +1376,9 @@ int	mkpathat(int, const char *);
 #define MIN_FILE_SIZE		100
 #define MAX_FILE_SIZE		4000000
 
+/* Files of at least this size are mapped instead of read by the parser. */
+#define MMAP_MIN_SIZE		(16 * 1024)
+
 /* Maximum number of FileNameAndHash entries per RSC checklist. */
 #define MAX_CHECKLIST_ENTRIES	100000
 
@@ -1005,9 +1391,39 @@ int	mkpathat(int, const char *);
 /* Maximum depth of the RPKI tree. */
 #define MAX_CERT_DEPTH		12
 
-/* Maximum number of concurrent http and rsync requests. */
-#define MAX_HTTP_REQUESTS	64
-#define MAX_RSYNC_REQUESTS	16
+/* Default and maximum number of concurrent http and rsync requests. */
+#define HTTP_REQUESTS		64
+#define MAX_HTTP_REQUESTS	256
+#define RSYNC_REQUESTS		16
+#define MAX_RSYNC_REQUESTS	64
+
+/* Number of RRDP hosts connected to ahead of their first request. */
+#define HTTP_WARM_HOSTS		8
+
+/* Maximum number of source addresses given with -b. */
+#define MAX_BIND_ADDRS		8
+
+/* Maximum number of concurrent rsync requests to the same host. */
+#define RSYNC_HOST_REQUESTS	4
+
+/* Maximum number of parser processes. */
+#define MAX_PARSERS		64
+
+/* Maximum number of rrdp processes. */
+#define MAX_RRDP_PROCS		16
+
+/* Number of processes walking the cache directory during cleanup. */
+#define CLEANUP_PROCS		4
+
+/* Number of index based cleanups between two full cleanup walks. */
+#define CLEANUP_FULL_RUNS	24
+
+/* Maximum number of entities and bytes sent in one batch to or from parsers. */
+#define MAX_BATCH_ENTITIES	256
+#define MAX_BATCH_SIZE		(1024 * 1024)
+
+/* Maximum number of entities in flight per parser, the rest waits in main. */
+#define MAX_PARSER_LOAD		(4 * MAX_BATCH_ENTITIES)
 
 /* How many seconds to wait for a connection to succeed. */
 #define MAX_CONN_TIMEOUT	15
@@ -1015,9 +1431,47 @@ int	mkpathat(int, const char *);
 /* How many seconds to wait for IO from a remote server. */
 #define MAX_IO_TIMEOUT		30
 
+/* Default seconds before a slow TA is also fetched from its next URI. */
+#define TA_DELAY		5
+
+/* Minimum seconds before a slow RRDP sync is hedged with rsync (-F). */
+#define RRDP_HEDGE_MIN		30
+
+/* Seconds a permanent HTTP redirect is followed without asking the origin. */
+#define REDIRECT_TTL		(7 * 24 * 60 * 60)
+
 /* Maximum number of delegated hosting locations (repositories) for each TAL. */
 #define MAX_REPO_PER_TAL	10
 
+/*
+ * Partially downloaded RRDP snapshot in the temp repo, it is resumed if
+ * at least RRDP_PARTIAL_MIN bytes were fetched.
+ */
+#define RRDP_PARTIAL		".snapshot"
+#define RRDP_PARTIAL_MIN	(1024 * 1024)
+
+/* Maximum number of bytes and files an RRDP repository may sync per run. */
+#define MAX_REPO_SIZE		(2LL * 1024 * 1024 * 1024)
+#define MAX_REPO_FILES		2000000
+
+/*
+ * After REPO_FAIL_MAX failed syncs in a row a repository is served from
+ * the cache and only probed again after REPO_BACKOFF seconds, doubling up
+ * to REPO_BACKOFF_MAX with every further failure.
+ */
+#define REPO_FAIL_MAX		3
+#define REPO_BACKOFF		(60 * 60)
+#define REPO_BACKOFF_MAX	(7 * 24 * 60 * 60)
+
+/*
+ * With -x an rsync repository which did not change in REPO_QUIET_MIN
+ * syncs in a row is served from the cache for REPO_QUIET_DELAY seconds,
+ * doubling up to REPO_QUIET_DELAY_MAX while it stays unchanged.
+ */
+#define REPO_QUIET_MIN		4
+#define REPO_QUIET_DELAY	(15 * 60)
+#define REPO_QUIET_DELAY_MAX	(2 * 60 * 60)
+
 #define HTTP_PROTO		"http://"
 #define HTTP_PROTO_LEN		(sizeof(HTTP_PROTO) - 1)
 #define HTTPS_PROTO		"https://"
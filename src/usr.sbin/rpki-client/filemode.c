@@ -17,6 +17,7 @@
  */
 
 #include <sys/queue.h>
+#include <sys/time.h>
 #include <sys/tree.h>
 #include <sys/types.h>
 
@@ -28,6 +29,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <limits.h>
+#include <time.h>
 #include <unistd.h>
 #include <imsg.h>
 
@@ -42,12 +44,74 @@
 #include "json.h"
 
 extern int		 verbose;
+extern int		 jsonlines;
 
 static X509_STORE_CTX	*ctx;
 static struct auth_tree	 auths = RB_INITIALIZER(&auths);
 static struct crl_tree	 crlt = RB_INITIALIZER(&crlt);
 
 struct tal		*talobj[TALSZ_MAX];
+static EVP_PKEY		*talkeys[TALSZ_MAX];	/* decoded TAL keys */
+static char		*talskis[TALSZ_MAX];	/* SKI of the TAL keys */
+static int		 talloaded[TALSZ_MAX];	/* TA loaded on demand */
+
+/*
+ * Time spent per object type, reported with -vv to compare libcrypto
+ * versions and to spot regressions. Validation includes loading the
+ * certificate chain from the cache.
+ */
+static struct file_times {
+	unsigned int	 files;
+	struct timespec	 parse;
+	struct timespec	 valid;
+} ftimes[RTYPE_SIG + 1];
+
+static const char *ftime_names[RTYPE_SIG + 1] = {
+	[RTYPE_TAL] = "tal",
+	[RTYPE_MFT] = "mft",
+	[RTYPE_ROA] = "roa",
+	[RTYPE_CER] = "cer",
+	[RTYPE_CRL] = "crl",
+	[RTYPE_GBR] = "gbr",
+	[RTYPE_RSC] = "rsc",
+	[RTYPE_ASPA] = "asa",
+	[RTYPE_TAK] = "tak",
+	[RTYPE_GEOFEED] = "geofeed",
+	[RTYPE_SPL] = "spl",
+};
+
+static void
+ftime_add(struct timespec *sum, const struct timespec *start,
+    struct timespec *now)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, now);
+	timespecsub(now, start, &ts);
+	timespecadd(sum, &ts, sum);
+}
+
+static void
+ftime_print(void)
+{
+	const struct file_times	*ft;
+	double			 secs;
+	int			 i;
+
+	for (i = 0; i <= RTYPE_SIG; i++) {
+		ft = &ftimes[i];
+		if (ft->files == 0 || ftime_names[i] == NULL)
+			continue;
+		secs = ft->parse.tv_sec + ft->parse.tv_nsec / 1e9;
+		fprintf(stderr, "%-8s %8u files, parse %lld.%06ld s",
+		    ftime_names[i], ft->files, (long long)ft->parse.tv_sec,
+		    ft->parse.tv_nsec / 1000);
+		if (secs > 0)
+			fprintf(stderr, " (%.0f/s)", ft->files / secs);
+		fprintf(stderr, ", validation %lld.%06ld s\n",
+		    (long long)ft->valid.tv_sec, ft->valid.tv_nsec / 1000);
+	}
+}
 
 /*
  * Use the X509 CRL Distribution Points to locate the CRL needed for
@@ -128,10 +192,12 @@ parse_load_cert(char *uri)
 	return NULL;
 }
 
+static struct auth	*auth_find_ta(const char *);
+
 /*
  * Build the certificate chain by using the Authority Information Access.
- * This requires that the TA are already validated and added to the auths
- * tree. Once the TA is located in the chain the chain is validated in
+ * The TA is loaded and added to the auths tree once the chain reaches
+ * it. Once the TA is located in the chain the chain is validated in
  * reverse order.
  */
 static void
@@ -156,7 +222,7 @@ parse_load_certchain(char *uri)
 			assert(i == 0);
 			goto fail;
 		}
-		if ((a = auth_find(&auths, cert->aki)) != NULL)
+		if ((a = auth_find_ta(cert->aki)) != NULL)
 			break;	/* found chain to TA */
 		uri = cert->aia;
 	}
@@ -229,31 +295,45 @@ out:
 	free(f);
 }
 
+/*
+ * Find the authority for aki. A TA is only loaded and validated once a
+ * chain reaches it, that is when aki is the SKI of its TAL key. Nothing
+ * is loaded for any other aki.
+ */
+static struct auth *
+auth_find_ta(const char *aki)
+{
+	struct auth	*a;
+	int		 i;
+
+	if ((a = auth_find(&auths, aki)) != NULL)
+		return a;
+
+	for (i = 0; i < TALSZ_MAX && talobj[i] != NULL; i++) {
+		if (talloaded[i] || talskis[i] == NULL || aki == NULL ||
+		    strcmp(talskis[i], aki) != 0)
+			continue;
+		talloaded[i] = 1;
+		parse_load_ta(talobj[i]);
+		return auth_find(&auths, aki);
+	}
+	return NULL;
+}
+
 static struct tal *
 find_tal(struct cert *cert)
 {
-	EVP_PKEY	*pk, *opk;
-	struct tal	*tal;
+	EVP_PKEY	*opk;
 	int		 i;
 
 	if ((opk = X509_get0_pubkey(cert->x509)) == NULL)
 		return NULL;
 
 	for (i = 0; i < TALSZ_MAX; i++) {
-		const unsigned char *pkey;
-
 		if (talobj[i] == NULL)
 			break;
-		tal = talobj[i];
-		pkey = tal->pkey;
-		pk = d2i_PUBKEY(NULL, &pkey, tal->pkeysz);
-		if (pk == NULL)
-			continue;
-		if (EVP_PKEY_cmp(pk, opk) == 1) {
-			EVP_PKEY_free(pk);
-			return tal;
-		}
-		EVP_PKEY_free(pk);
+		if (talkeys[i] != NULL && EVP_PKEY_cmp(talkeys[i], opk) == 1)
+			return talobj[i];
 	}
 	return NULL;
 }
@@ -309,9 +389,12 @@ proc_parser_file(char *file, unsigned char *buf, size_t len)
 	char filehash[SHA256_DIGEST_LENGTH];
 	char *hash;
 	enum rtype type;
+	struct timespec start, now;
 	int is_ta = 0;
 
-	if (outformats & FORMAT_JSON) {
+	if (jsonlines) {
+		json_do_start_compact(stdout);
+	} else if (outformats & FORMAT_JSON) {
 		json_do_start(stdout);
 	} else {
 		if (num++ > 0)
@@ -344,6 +427,7 @@ proc_parser_file(char *file, unsigned char *buf, size_t len)
 	free(hash);
 
 	type = rtype_from_file_extension(file);
+	clock_gettime(CLOCK_MONOTONIC, &start);
 
 	switch (type) {
 	case RTYPE_ASPA:
@@ -452,10 +536,20 @@ proc_parser_file(char *file, unsigned char *buf, size_t len)
 		break;
 	}
 
+	ftimes[type].files++;
+	ftime_add(&ftimes[type].parse, &start, &now);
+	start = now;
+
 	if (aia != NULL) {
 		x509_get_crl(x509, file, &crl_uri);
-		parse_load_crl(crl_uri);
-		if (auth_find(&auths, aki) == NULL)
+		/* the chain and CRL stay loaded for objects of the same CA */
+		a = auth_find(&auths, aki);
+		/* an object issued by a TA needs only that TA */
+		if (a == NULL)
+			a = auth_find_ta(aki);
+		if (a == NULL || crl_get(&crlt, a) == NULL)
+			parse_load_crl(crl_uri);
+		if (a == NULL)
 			parse_load_certchain(aia);
 		a = auth_find(&auths, aki);
 		c = crl_get(&crlt, a);
@@ -509,6 +603,8 @@ proc_parser_file(char *file, unsigned char *buf, size_t len)
 		}
 	}
 
+	ftime_add(&ftimes[type].valid, &start, &now);
+
 	if (expires != NULL) {
 		if (status && aia != NULL)
 			*expires = x509_find_expires(*notafter, a, &crlt);
@@ -563,9 +659,12 @@ proc_parser_file(char *file, unsigned char *buf, size_t len)
 			printf(", %s", errstr);
 	}
 
-	if (outformats & FORMAT_JSON)
+	if (outformats & FORMAT_JSON) {
 		json_do_finish();
-	else {
+		/* consumers can pick up each record right away */
+		if (jsonlines)
+			fflush(stdout);
+	} else {
 		printf("\n");
 
 		if (status && aia != NULL) {
@@ -613,10 +712,16 @@ static void
 parse_file(struct entityq *q, struct msgbuf *msgq)
 {
 	struct entity	*entp;
-	struct ibuf	*b;
+	struct ibuf	*b, *batch;
 	struct tal	*tal;
+	X509_PUBKEY	*pubkey;
+	const unsigned char *pkey;
 	time_t		 dummy = 0;
 
+	if (TAILQ_EMPTY(q))
+		return;
+
+	batch = io_new_buffer();
 	while ((entp = TAILQ_FIRST(q)) != NULL) {
 		TAILQ_REMOVE(q, entp, entries);
 
@@ -631,7 +736,15 @@ parse_file(struct entityq *q, struct msgbuf *msgq)
 				    entp->file);
 			tal->id = entp->talid;
 			talobj[tal->id] = tal;
-			parse_load_ta(tal);
+			pkey = tal->pkey;
+			talkeys[tal->id] = d2i_PUBKEY(NULL, &pkey, tal->pkeysz);
+			pkey = tal->pkey;
+			if ((pubkey = d2i_X509_PUBKEY(NULL, &pkey,
+			    tal->pkeysz)) != NULL) {
+				talskis[tal->id] = x509_pubkey_get_ski(pubkey,
+				    entp->file);
+				X509_PUBKEY_free(pubkey);
+			}
 			break;
 		default:
 			errx(1, "unhandled entity type %d", entp->type);
@@ -643,9 +756,10 @@ parse_file(struct entityq *q, struct msgbuf *msgq)
 		io_simple_buffer(b, &entp->talid, sizeof(entp->talid));
 		io_str_buffer(b, entp->file);
 		io_simple_buffer(b, &dummy, sizeof(dummy));
-		io_close_buffer(msgq, b);
+		io_batch_add(batch, b);
 		entity_free(entp);
 	}
+	io_close_buffer(msgq, batch);
 }
 
 /*
@@ -663,6 +777,7 @@ proc_filemode(int fd)
 	struct pollfd	 pfd;
 	struct entity	*entp;
 	struct ibuf	*b, *inbuf = NULL;
+	struct ibuf	 msg;
 
 	/* Only allow access to the cache directory. */
 	if (unveil(".", "r") == -1)
@@ -674,7 +789,6 @@ proc_filemode(int fd)
 	OpenSSL_add_all_ciphers();
 	OpenSSL_add_all_digests();
 	x509_init_oid();
-	constraints_parse();
 
 	if ((ctx = X509_STORE_CTX_new()) == NULL)
 		err(1, "X509_STORE_CTX_new");
@@ -704,13 +818,15 @@ proc_filemode(int fd)
 			break;
 
 		if ((pfd.revents & POLLIN)) {
-			b = io_buf_read(fd, &inbuf);
-			if (b != NULL) {
-				entp = calloc(1, sizeof(struct entity));
-				if (entp == NULL)
-					err(1, NULL);
-				entity_read_req(b, entp);
-				TAILQ_INSERT_TAIL(&q, entp, entries);
+			io_buf_fill(fd, &inbuf);
+			while ((b = io_buf_next(inbuf)) != NULL) {
+				while (io_batch_get(b, &msg)) {
+					entp = calloc(1, sizeof(struct entity));
+					if (entp == NULL)
+						err(1, NULL);
+					entity_read_req(&msg, entp);
+					TAILQ_INSERT_TAIL(&q, entp, entries);
+				}
 				ibuf_free(b);
 			}
 		}
@@ -739,5 +855,8 @@ proc_filemode(int fd)
 	X509_STORE_CTX_free(ctx);
 	ibuf_free(inbuf);
 
+	if (verbose > 1)
+		ftime_print();
+
 	exit(0);
 }
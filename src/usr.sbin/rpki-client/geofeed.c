@@ -34,57 +34,69 @@
 extern ASN1_OBJECT	*geofeed_oid;
 
 /*
- * Take a CIDR prefix (in presentation format) and add it to parse results.
+ * Take a "prefix[,location]" record and add it to parse results.
  * Returns 1 on success, 0 on failure.
  */
 static int
-geofeed_parse_geoip(struct geofeed *geofeed, char *cidr, char *loc)
+geofeed_parse_geoip(struct geofeed *geofeed, size_t *geoipmax,
+    const char *line, size_t linelen)
 {
 	struct geoip	*geoip;
-	struct ip_addr	*ipaddr;
+	struct ip_addr	 ipaddr;
+	const char	*delim, *loc = "";
+	char		 cidr[80];
+	size_t		 cidrlen, loclen = 0, max, n;
 	enum afi	 afi;
 	int		 plen;
 
-	if ((ipaddr = calloc(1, sizeof(struct ip_addr))) == NULL)
-		err(1, NULL);
+	/* Split prefix and location info */
+	cidrlen = linelen;
+	if ((delim = memchr(line, ',', linelen)) != NULL) {
+		cidrlen = delim - line;
+		loc = delim + 1;
+		loclen = linelen - cidrlen - 1;
+	}
+	n = cidrlen < sizeof(cidr) ? cidrlen : sizeof(cidr) - 1;
+	memcpy(cidr, line, n);
+	cidr[n] = '\0';
 
-	if ((plen = inet_net_pton(AF_INET, cidr, ipaddr->addr,
-	    sizeof(ipaddr->addr))) != -1)
+	memset(&ipaddr, 0, sizeof(ipaddr));
+	if (n == cidrlen && (plen = inet_net_pton(AF_INET, cidr, ipaddr.addr,
+	    sizeof(ipaddr.addr))) != -1)
 		afi = AFI_IPV4;
-	else if ((plen = inet_net_pton(AF_INET6, cidr, ipaddr->addr,
-	    sizeof(ipaddr->addr))) != -1)
+	else if (n == cidrlen && (plen = inet_net_pton(AF_INET6, cidr,
+	    ipaddr.addr, sizeof(ipaddr.addr))) != -1)
 		afi = AFI_IPV6;
 	else {
 		static char buf[80];
 
 		if (strnvis(buf, cidr, sizeof(buf), VIS_SAFE)
-		    >= (int)sizeof(buf)) {
+		    >= (int)sizeof(buf) || n != cidrlen) {
 			memcpy(buf + sizeof(buf) - 4, "...", 4);
 		}
 		warnx("invalid address: %s", buf);
-		free(ipaddr);
 		return 0;
 	}
-
-	ipaddr->prefixlen = plen;
-
-	geofeed->geoips = recallocarray(geofeed->geoips, geofeed->geoipsz,
-	    geofeed->geoipsz + 1, sizeof(struct geoip));
-	if (geofeed->geoips == NULL)
-		err(1, NULL);
+	ipaddr.prefixlen = plen;
+
+	if (geofeed->geoipsz == *geoipmax) {
+		max = *geoipmax == 0 ? 64 : *geoipmax * 2;
+		geofeed->geoips = recallocarray(geofeed->geoips, *geoipmax,
+		    max, sizeof(struct geoip));
+		if (geofeed->geoips == NULL)
+			err(1, NULL);
+		*geoipmax = max;
+	}
 	geoip = &geofeed->geoips[geofeed->geoipsz++];
 
-	if ((geoip->ip = calloc(1, sizeof(struct cert_ip))) == NULL)
-		err(1, NULL);
-
-	geoip->ip->type = CERT_IP_ADDR;
-	geoip->ip->ip = *ipaddr;
-	geoip->ip->afi = afi;
+	geoip->ip.type = CERT_IP_ADDR;
+	geoip->ip.ip = ipaddr;
+	geoip->ip.afi = afi;
 
-	if ((geoip->loc = strdup(loc)) == NULL)
+	if ((geoip->loc = strndup(loc, loclen)) == NULL)
 		err(1, NULL);
 
-	if (!ip_cert_compose_ranges(geoip->ip))
+	if (!ip_cert_compose_ranges(&geoip->ip))
 		return 0;
 
 	return 1;
@@ -92,27 +104,25 @@ geofeed_parse_geoip(struct geofeed *geofeed, char *cidr, char *loc)
 
 /*
  * Parse a full RFC 9092 file.
+ * The CSV records are parsed in place and are the detached content of
+ * the signature as they are, so the buffer is never modified.
  * Returns the Geofeed, or NULL if the object was malformed.
  */
 struct geofeed *
 geofeed_parse(X509 **x509, const char *fn, int talid, char *buf, size_t len)
 {
 	struct geofeed	*geofeed;
-	char		*delim, *line, *loc, *nl;
-	ssize_t		 linelen;
-	BIO		*bio;
+	char		*delim, *line, *nl, *content = buf;
+	size_t		 linelen, contentlen = 0, geoipmax = 0;
+	BIO		*bio = NULL;
 	char		*b64 = NULL;
-	size_t		 b64sz = 0;
+	size_t		 b64len = 0;
 	unsigned char	*der = NULL;
 	size_t		 dersz;
 	struct cert	*cert = NULL;
 	int		 rpki_signature_seen = 0, end_signature_seen = 0;
 	int		 rc = 0;
 
-	bio = BIO_new(BIO_s_mem());
-	if (bio == NULL)
-		errx(1, "BIO_new");
-
 	if ((geofeed = calloc(1, sizeof(*geofeed))) == NULL)
 		err(1, NULL);
 
@@ -123,17 +133,18 @@ geofeed_parse(X509 **x509, const char *fn, int talid, char *buf, size_t len)
 		len -= nl + 1 - buf;
 		buf = nl + 1;
 
-		/* replace LF and CR with NUL, point nl at first NUL */
-		*nl = '\0';
+		/* strip CRLF from the line */
 		if (nl > line && nl[-1] == '\r') {
-			nl[-1] = '\0';
-			nl--;
-			linelen = nl - line;
+			linelen = nl - 1 - line;
 		} else {
 			warnx("%s: malformed file, expected CRLF line"
 			    " endings", fn);
 			goto out;
 		}
+		if (memchr(line, '\0', linelen) != NULL) {
+			warnx("%s: malformed file, NUL in line", fn);
+			goto out;
+		}
 
 		if (end_signature_seen) {
 			warnx("%s: trailing data after signature section", fn);
@@ -141,7 +152,8 @@ geofeed_parse(X509 **x509, const char *fn, int talid, char *buf, size_t len)
 		}
 
 		if (rpki_signature_seen) {
-			if (strncmp(line, "# End Signature:",
+			if (linelen >= strlen("# End Signature:") &&
+			    strncmp(line, "# End Signature:",
 			    strlen("# End Signature:")) == 0) {
 				end_signature_seen = 1;
 				continue;
@@ -152,47 +164,36 @@ geofeed_parse(X509 **x509, const char *fn, int talid, char *buf, size_t len)
 				    fn);
 				goto out;
 			}
-			if (strncmp(line, "# ", strlen("# ")) != 0) {
+			if (linelen < 2 || strncmp(line, "# ", 2) != 0) {
 				warnx("%s: line in signature section too "
 				    "short", fn);
 				goto out;
 			}
 
 			/* skip over "# " */
-			line += 2;
-			strlcat(b64, line, b64sz);
+			memcpy(b64 + b64len, line + 2, linelen - 2);
+			b64len += linelen - 2;
 			continue;
 		}
 
-		if (strncmp(line, "# RPKI Signature:",
+		if (linelen >= strlen("# RPKI Signature:") &&
+		    strncmp(line, "# RPKI Signature:",
 		    strlen("# RPKI Signature:")) == 0) {
 			rpki_signature_seen = 1;
+			contentlen = line - content;
 
-			if ((b64 = calloc(1, len)) == NULL)
+			if ((b64 = calloc(1, len + 1)) == NULL)
 				err(1, NULL);
-			b64sz = len;
 
 			continue;
 		}
 
-		/*
-		 * Read the Geofeed CSV records into a BIO to later on
-		 * calculate the message digest and compare with the one
-		 * in the detached CMS signature.
-		 */
-		if (BIO_puts(bio, line) != linelen ||
-		    BIO_puts(bio, "\r\n") != 2) {
-			warnx("%s: BIO_puts failed", fn);
-			goto out;
-		}
-
-		/* Zap comments and whitespace before them. */
+		/* Skip comments and whitespace before them. */
 		delim = memchr(line, '#', linelen);
 		if (delim != NULL) {
 			while (delim > line &&
 			    isspace((unsigned char)delim[-1]))
 				delim--;
-			*delim = '\0';
 			linelen = delim - line;
 		}
 
@@ -200,16 +201,8 @@ geofeed_parse(X509 **x509, const char *fn, int talid, char *buf, size_t len)
 		if (linelen == 0)
 			continue;
 
-		/* Split prefix and location info */
-		delim = memchr(line, ',', linelen);
-		if (delim != NULL) {
-			*delim = '\0';
-			loc = delim + 1;
-		} else
-			loc = "";
-
 		/* read each prefix  */
-		if (!geofeed_parse_geoip(geofeed, line, loc))
+		if (!geofeed_parse_geoip(geofeed, &geoipmax, line, linelen))
 			goto out;
 	}
 
@@ -218,11 +211,18 @@ geofeed_parse(X509 **x509, const char *fn, int talid, char *buf, size_t len)
 		goto out;
 	}
 
-	if ((base64_decode(b64, strlen(b64), &der, &dersz)) == -1) {
+	if ((base64_decode(b64, b64len, &der, &dersz)) == -1) {
 		warnx("%s: base64_decode failed", fn);
 		goto out;
 	}
 
+	/*
+	 * The CSV records up to the signature section are the content
+	 * the detached CMS signature is over, hash them where they are.
+	 */
+	if ((bio = BIO_new_mem_buf(content, contentlen)) == NULL)
+		errx(1, "BIO_new_mem_buf");
+
 	if (!cms_parse_validate_detached(x509, fn, der, dersz, geofeed_oid,
 	    bio, &geofeed->signtime))
 		goto out;
@@ -248,7 +248,7 @@ geofeed_parse(X509 **x509, const char *fn, int talid, char *buf, size_t len)
 	if ((cert = cert_parse_ee_cert(fn, talid, *x509)) == NULL)
 		goto out;
 
-	if (x509_any_inherits(*x509)) {
+	if (cert_any_inherits(cert)) {
 		warnx("%s: inherit elements not allowed in EE cert", fn);
 		goto out;
 	}
@@ -288,10 +288,8 @@ geofeed_free(struct geofeed *p)
 	if (p == NULL)
 		return;
 
-	for (i = 0; i < p->geoipsz; i++) {
-		free(p->geoips[i].ip);
+	for (i = 0; i < p->geoipsz; i++)
 		free(p->geoips[i].loc);
-	}
 
 	free(p->geoips);
 	free(p->aia);
@@ -47,11 +47,15 @@
 #include <sys/types.h>
 #include <sys/queue.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
 
+#include <asr.h>
 #include <assert.h>
 #include <ctype.h>
 #include <err.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <imsg.h>
 #include <limits.h>
 #include <netdb.h>
@@ -60,6 +64,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <vis.h>
 #include <zlib.h>
@@ -70,9 +75,17 @@
 
 #define HTTP_USER_AGENT		"OpenBSD rpki-client"
 #define HTTP_BUF_SIZE		(32 * 1024)
+#define HTTP_BUF_MAX		(512 * 1024)
 #define HTTP_IDLE_TIMEOUT	10
+#define HTTP_PROXY_IDLE_TIMEOUT	30	/* tunnels take longer to set up */
+#define HTTP_WARM_TIMEOUT	30	/* idle time before the first request */
+#define MAX_HOST_CONNS		8	/* connections per host and port */
+#define INIT_HOST_CONNS		2
+#define MAX_PROXY_CONNS		32	/* tunnels through the proxy */
 #define MAX_CONTENTLEN		(2 * 1024 * 1024 * 1024UL)
+#define MAX_ETAG_LEN		256
 #define NPFDS			(MAX_HTTP_REQUESTS + 1)
+#define HTTP_BW_TICK		100	/* ms to wait for bandwidth tokens */
 
 enum res {
 	DONE,
@@ -82,6 +95,7 @@ enum res {
 
 enum http_state {
 	STATE_FREE,
+	STATE_RESOLVE,
 	STATE_CONNECT,
 	STATE_TLSCONNECT,
 	STATE_PROXY_REQUEST,
@@ -106,10 +120,12 @@ struct http_proxy {
 } proxy;
 
 struct http_zlib {
+	LIST_ENTRY(http_zlib)	 entry;
 	z_stream		 zs;
 	char			*zbuf;
 	size_t			 zbufsz;
 	size_t			 zbufpos;
+	size_t			 zbufoff;	/* already written out */
 	size_t			 zinsz;
 	int			 zdone;
 };
@@ -119,10 +135,12 @@ struct http_connection {
 	char			*host;
 	char			*port;
 	char			*last_modified;
+	char			*etag;
 	char			*redir_uri;
 	struct http_request	*req;
 	struct pollfd		*pfd;
-	struct addrinfo		*res0;
+	struct asr_query	*asrq;
+	struct addrinfo		*res0;	/* owned by the address cache */
 	struct addrinfo		*res;
 	struct tls		*tls;
 	char			*buf;
@@ -131,13 +149,18 @@ struct http_connection {
 	size_t			bufpos;
 	size_t			iosz;
 	size_t			totalsz;
+	size_t			rbudget;	/* bytes to read this turn */
+	long long		skip;	/* data already received before */
+	long long		range;	/* first byte of a 206 response */
 	time_t			idle_time;
 	time_t			io_time;
 	int			status;
 	int			fd;
+	int			asrfd;
 	int			chunked;
 	int			gzipped;
 	int			keep_alive;
+	int			throttled;	/* waits for rbudget */
 	short			events;
 	enum http_state		state;
 };
@@ -148,43 +171,132 @@ struct http_request {
 	TAILQ_ENTRY(http_request)	entry;
 	char			*uri;
 	char			*modified_since;
+	char			*etag;		/* sent as If-None-Match */
+	char			*permuri;	/* before permanent redirects */
 	char			*host;
 	char			*port;
 	const char		*path;	/* points into uri */
+	long long		 offset;	/* sent as Range */
 	unsigned int		 id;
+	unsigned int		 prio;	/* higher prio requests start first */
 	int			 outfd;
 	int			 redirect_loop;
+	int			 temporary;	/* temporary redirect seen */
+	struct timespec		 start;		/* when main sent it */
+	struct timespec		 sent;		/* when written to the server */
+	long long		 ttfb;		/* usec to the status or -1 */
 };
 
 TAILQ_HEAD(http_req_queue, http_request);
 
+/*
+ * TLS configuration per host and port, each with its own session file
+ * so that later connections to the same server resume the TLS session.
+ */
+struct http_tls_session {
+	LIST_ENTRY(http_tls_session)	entry;
+	char			*host;
+	char			*port;
+	struct tls_config	*config;
+};
+
+/*
+ * Adaptive connection limit for a host and port. It grows by one for every
+ * limit requests finished and is halved on timeouts and overload responses.
+ */
+struct http_host {
+	LIST_ENTRY(http_host)	entry;
+	char			*host;
+	char			*port;
+	unsigned int		 limit;
+	unsigned int		 good;
+	unsigned int		 nextbind;	/* source address to use next */
+};
+
+static LIST_HEAD(, http_host)	hosts = LIST_HEAD_INITIALIZER(hosts);
+
+/*
+ * Addresses of host and port, resolved once per run and shared by all
+ * connections to it.
+ */
+struct http_addr {
+	LIST_ENTRY(http_addr)	entry;
+	char			*host;
+	char			*port;
+	struct addrinfo		*res0;
+};
+
+static LIST_HEAD(, http_addr)	addr_cache = LIST_HEAD_INITIALIZER(addr_cache);
+
+static LIST_HEAD(, http_tls_session)	tls_sessions =
+    LIST_HEAD_INITIALIZER(tls_sessions);
+static int				tls_sessions_ok;
+
+/*
+ * Decompression contexts of closed connections, reset and ready for the
+ * next compressed response.
+ */
+static LIST_HEAD(, http_zlib)	zlib_pool = LIST_HEAD_INITIALIZER(zlib_pool);
+static unsigned int		zlib_poolsz;
+
 static struct http_conn_list	active = LIST_HEAD_INITIALIZER(active);
 static struct http_conn_list	idle = LIST_HEAD_INITIALIZER(idle);
 static struct http_req_queue	queue = TAILQ_HEAD_INITIALIZER(queue);
 static unsigned int		http_conn_count;
+static unsigned int		http_max_conns = MAX_HTTP_REQUESTS;
+
+/*
+ * Request statistics, logged with -v when the process exits. Request
+ * times are counted in buckets of powers of two milliseconds.
+ */
+#define HTTP_TIME_BUCKETS	20
+
+static struct {
+	unsigned int	 reqs;		/* finished requests */
+	unsigned int	 failed;	/* of which failed */
+	unsigned int	 aborted;	/* dropped without a response */
+	unsigned int	 conns;		/* connections opened */
+	unsigned int	 reused;	/* requests on an open connection */
+	unsigned int	 times[HTTP_TIME_BUCKETS];
+} http_stats;
+
+/*
+ * Bandwidth limit of all response data in bytes per second, 0 if none.
+ * The tokens collected since the last turn of the main loop are shared
+ * among the connections reading response data by http_bw_share().
+ */
+static size_t			http_bwlimit;
+static size_t			http_bwtokens;
+static struct timespec		http_bwtime;
 
 static struct msgbuf msgq;
-static struct sockaddr_storage http_bindaddr;
+static struct sockaddr_storage http_bindaddrs[MAX_BIND_ADDRS];
+static size_t http_nbindaddrs;
 static struct tls_config *tls_config;
 static uint8_t *tls_ca_mem;
 static size_t tls_ca_size;
 
 /* HTTP request API */
-static void	http_req_new(unsigned int, char *, char *, int, int);
+static struct http_request *http_req_new(unsigned int, char *, char *, char *,
+		    long long, int, unsigned int, int);
 static void	http_req_free(struct http_request *);
-static void	http_req_done(unsigned int, enum http_result, const char *);
+static void	http_req_done(unsigned int, enum http_result, const char *,
+		    const char *, const char *, const char *, long long);
 static void	http_req_fail(unsigned int);
+static void	http_req_stat(struct http_request *, int);
 static int	http_req_schedule(struct http_request *);
 
 /* HTTP decompression helper */
 static int	http_inflate_new(struct http_connection *);
 static void	http_inflate_free(struct http_connection *);
+static void	http_inflate_destroy(struct http_zlib *);
 static void	http_inflate_done(struct http_connection *);
 static int	http_inflate_data(struct http_connection *);
 static enum res	http_inflate_advance(struct http_connection *);
 
 /* HTTP connection API */
 static void	http_new(struct http_request *);
+static void	http_warm(char *);
 static void	http_free(struct http_connection *);
 
 static enum res http_done(struct http_connection *, enum http_result);
@@ -195,6 +307,7 @@ static void	http_do(struct http_connection *,
 		    enum res (*)(struct http_connection *));
 
 /* These functions can be used with http_do() */
+static enum res	http_resolve(struct http_connection *);
 static enum res	http_connect(struct http_connection *);
 static enum res	http_request(struct http_connection *);
 static enum res	http_close(struct http_connection *);
@@ -534,49 +647,188 @@ http_parse_uri(char *uri, char **ohost, char **oport, char **opath)
 }
 
 /*
- * Lookup the IP addresses for host:port.
+ * Reorder the address list so that the address families alternate,
+ * starting with the family of the first address (RFC 8305 section 4).
+ * A host that is unreachable over one family is then not tried on every
+ * address of that family first.
+ */
+static struct addrinfo *
+http_addr_interleave(struct addrinfo *res0)
+{
+	struct addrinfo *first = NULL, *other = NULL, **fp, **op, *res, *next;
+	struct addrinfo *head = NULL, **hp = &head;
+	int family = res0->ai_family;
+
+	fp = &first;
+	op = &other;
+	for (res = res0; res != NULL; res = next) {
+		next = res->ai_next;
+		res->ai_next = NULL;
+		if (res->ai_family == family) {
+			*fp = res;
+			fp = &res->ai_next;
+		} else {
+			*op = res;
+			op = &res->ai_next;
+		}
+	}
+
+	while (first != NULL || other != NULL) {
+		if (first != NULL) {
+			*hp = first;
+			hp = &first->ai_next;
+			first = first->ai_next;
+		}
+		if (other != NULL) {
+			*hp = other;
+			hp = &other->ai_next;
+			other = other->ai_next;
+		}
+	}
+	*hp = NULL;
+
+	return head;
+}
+
+/*
+ * Return the cached addresses of host:port or NULL if not yet resolved.
+ */
+static struct addrinfo *
+http_addr_find(const char *host, const char *port)
+{
+	struct http_addr *ha;
+
+	LIST_FOREACH(ha, &addr_cache, entry)
+		if (strcmp(ha->host, host) == 0 &&
+		    strcmp(ha->port, port) == 0)
+			return ha->res0;
+	return NULL;
+}
+
+/*
+ * Add the lookup result res0 of host:port to the address cache.
+ * If a concurrent lookup was faster its result is used and res0 is freed.
+ */
+static struct addrinfo *
+http_addr_add(const char *host, const char *port, struct addrinfo *res0)
+{
+	struct http_addr *ha;
+	struct addrinfo *res;
+
+	if ((res = http_addr_find(host, port)) != NULL) {
+		freeaddrinfo(res0);
+		return res;
+	}
+
+	if ((ha = calloc(1, sizeof(*ha))) == NULL)
+		err(1, NULL);
+	if ((ha->host = strdup(host)) == NULL ||
+	    (ha->port = strdup(port)) == NULL)
+		err(1, NULL);
+	ha->res0 = http_addr_interleave(res0);
+	LIST_INSERT_HEAD(&addr_cache, ha, entry);
+
+	return ha->res0;
+}
+
+/*
+ * Start an asynchronous lookup of host:port.
  * Returns 0 on success and -1 on failure.
  */
 static int
-http_resolv(struct addrinfo **res, const char *host, const char *port)
+http_resolve_start(struct http_connection *conn, const char *host,
+    const char *port)
 {
 	struct addrinfo hints;
-	int error;
 
 	memset(&hints, 0, sizeof(hints));
 	hints.ai_family = PF_UNSPEC;
 	hints.ai_socktype = SOCK_STREAM;
-	error = getaddrinfo(host, port, &hints, res);
+	conn->asrq = getaddrinfo_async(host, port, &hints, NULL);
+	if (conn->asrq == NULL) {
+		warn("%s: getaddrinfo_async", host);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Lookup the IP addresses of the host or proxy without blocking the
+ * process. Results are cached for the rest of the run.
+ */
+static enum res
+http_resolve(struct http_connection *conn)
+{
+	struct asr_result ar;
+	const char *host, *port;
+
+	if (proxy.proxyhost != NULL) {
+		host = proxy.proxyhost;
+		port = proxy.proxyport;
+	} else {
+		host = conn->host;
+		port = conn->port;
+	}
+
+	if (conn->asrq == NULL) {
+		if ((conn->res0 = http_addr_find(host, port)) != NULL)
+			return http_connect(conn);
+		conn->state = STATE_RESOLVE;
+		if (http_resolve_start(conn, host, port) == -1)
+			return http_failed(conn);
+	}
+
+	if (asr_run(conn->asrq, &ar) == 0) {
+		conn->asrfd = ar.ar_fd;
+		if (ar.ar_timeout > 0)
+			conn->io_time = getmonotime() +
+			    (ar.ar_timeout + 999) / 1000;
+		else
+			conn->io_time = getmonotime();
+		if (ar.ar_cond == ASR_WANT_READ)
+			return WANT_POLLIN;
+		return WANT_POLLOUT;
+	}
+	conn->asrq = NULL;
+	conn->asrfd = -1;
+	conn->io_time = 0;
+
 	/*
 	 * If the services file is corrupt/missing, fall back
 	 * on our hard-coded defines.
 	 */
-	if (error == EAI_SERVICE)
-		error = getaddrinfo(host, "443", &hints, res);
-	if (error != 0) {
-		warnx("%s: %s", host, gai_strerror(error));
-		return -1;
+	if (ar.ar_gai_errno == EAI_SERVICE && strcmp(port, "443") != 0) {
+		if (http_resolve_start(conn, host, "443") == -1)
+			return http_failed(conn);
+		return http_resolve(conn);
+	}
+	if (ar.ar_gai_errno != 0) {
+		warnx("%s: %s", host, gai_strerror(ar.ar_gai_errno));
+		return http_failed(conn);
 	}
 
-	return 0;
+	conn->res0 = http_addr_add(host, port, ar.ar_addrinfo);
+	return http_connect(conn);
 }
 
 /*
- * Create and queue a new request.
+ * Create and queue a new request. Returns NULL if the request failed.
  */
-static void
-http_req_new(unsigned int id, char *uri, char *modified_since, int count,
-    int outfd)
+static struct http_request *
+http_req_new(unsigned int id, char *uri, char *modified_since, char *etag,
+    long long offset, int count, unsigned int prio, int outfd)
 {
-	struct http_request *req;
+	struct http_request *req, *r;
 	char *host, *port, *path;
 
 	if (http_parse_uri(uri, &host, &port, &path) == -1) {
 		free(uri);
 		free(modified_since);
+		free(etag);
 		close(outfd);
+		http_req_stat(NULL, 1);
 		http_req_fail(id);
-		return;
+		return NULL;
 	}
 
 	if ((req = calloc(1, sizeof(*req))) == NULL)
@@ -589,9 +841,77 @@ http_req_new(unsigned int id, char *uri, char *modified_since, int count,
 	req->path = path;
 	req->uri = uri;
 	req->modified_since = modified_since;
+	req->etag = etag;
+	req->offset = offset;
 	req->redirect_loop = count;
+	req->prio = prio;
+	req->ttfb = -1;
+	clock_gettime(CLOCK_MONOTONIC, &req->start);
+
+	/* keep the queue sorted by prio, equal prios in request order */
+	TAILQ_FOREACH(r, &queue, entry)
+		if (r->prio < prio)
+			break;
+	if (r != NULL)
+		TAILQ_INSERT_BEFORE(r, req, entry);
+	else
+		TAILQ_INSERT_TAIL(&queue, req, entry);
+	return req;
+}
 
-	TAILQ_INSERT_TAIL(&queue, req, entry);
+/*
+ * Account a finished request. A request that failed before it was
+ * queued is passed as NULL and counts with a time of 0.
+ */
+static void
+http_req_stat(struct http_request *req, int failed)
+{
+	struct timespec	 now;
+	long long	 ms = 0;
+	int		 i;
+
+	if (req != NULL) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		timespecsub(&now, &req->start, &now);
+		ms = now.tv_sec * 1000LL + now.tv_nsec / 1000000;
+	}
+	for (i = 0; i < HTTP_TIME_BUCKETS - 1 && ms >= (1LL << i); i++)
+		;
+	http_stats.times[i]++;
+	http_stats.reqs++;
+	if (failed)
+		http_stats.failed++;
+}
+
+/*
+ * Return the upper bound in milliseconds of the request time of the
+ * given per mille of the requests.
+ */
+static long long
+http_stat_time(unsigned int permille)
+{
+	unsigned int	 n = 0, want;
+	int		 i;
+
+	want = (unsigned long long)http_stats.reqs * permille / 1000;
+	for (i = 0; i < HTTP_TIME_BUCKETS - 1; i++) {
+		n += http_stats.times[i];
+		if (n > want)
+			break;
+	}
+	return 1LL << i;
+}
+
+static void
+http_stat_log(void)
+{
+	if (http_stats.reqs == 0 && http_stats.aborted == 0)
+		return;
+	logx("http: %u requests (%u failed) and %u aborted on %u "
+	    "connections, %u reused, request time p50 %lldms p99 %lldms",
+	    http_stats.reqs, http_stats.failed, http_stats.aborted,
+	    http_stats.conns, http_stats.reused, http_stat_time(500),
+	    http_stat_time(990));
 }
 
 /*
@@ -608,16 +928,21 @@ http_req_free(struct http_request *req)
 	/* no need to free req->path it points into req->uri */
 	free(req->uri);
 	free(req->modified_since);
+	free(req->etag);
+	free(req->permuri);
 
 	if (req->outfd != -1)
 		close(req->outfd);
 }
 
 /*
- * Enqueue request response
+ * Enqueue request response. If the request was only redirected permanently
+ * from and to are the original and the final URI, else both are NULL.
+ * ttfb is the time to the response status in microseconds or -1.
  */
 static void
-http_req_done(unsigned int id, enum http_result res, const char *last_modified)
+http_req_done(unsigned int id, enum http_result res, const char *last_modified,
+    const char *etag, const char *from, const char *to, long long ttfb)
 {
 	struct ibuf *b;
 
@@ -625,6 +950,10 @@ http_req_done(unsigned int id, enum http_result res, const char *last_modified)
 	io_simple_buffer(b, &id, sizeof(id));
 	io_simple_buffer(b, &res, sizeof(res));
 	io_str_buffer(b, last_modified);
+	io_str_buffer(b, etag);
+	io_str_buffer(b, from);
+	io_str_buffer(b, to);
+	io_simple_buffer(b, &ttfb, sizeof(ttfb));
 	io_close_buffer(&msgq, b);
 }
 
@@ -636,38 +965,178 @@ http_req_fail(unsigned int id)
 {
 	struct ibuf *b;
 	enum http_result res = HTTP_FAILED;
+	long long ttfb = -1;
 
 	b = io_new_buffer();
 	io_simple_buffer(b, &id, sizeof(id));
 	io_simple_buffer(b, &res, sizeof(res));
 	io_str_buffer(b, NULL);
+	io_str_buffer(b, NULL);
+	io_str_buffer(b, NULL);
+	io_str_buffer(b, NULL);
+	io_simple_buffer(b, &ttfb, sizeof(ttfb));
 	io_close_buffer(&msgq, b);
 }
 
 /*
- * Schedule new requests until maximum number of connections is reached.
- * Try to reuse an idle connection if one exists that matches host and port.
+ * Drop the request id, no response is sent. A request that is already
+ * running closes its connection.
  */
-static int
-http_req_schedule(struct http_request *req)
+static void
+http_req_abort(unsigned int id)
+{
+	struct http_connection *conn;
+	struct http_request *req;
+
+	TAILQ_FOREACH(req, &queue, entry) {
+		if (req->id == id) {
+			http_stats.aborted++;
+			TAILQ_REMOVE(&queue, req, entry);
+			http_req_free(req);
+			free(req);
+			return;
+		}
+	}
+	LIST_FOREACH(conn, &active, entry) {
+		if (conn->req != NULL && conn->req->id == id) {
+			http_stats.aborted++;
+			http_req_free(conn->req);
+			free(conn->req);
+			conn->req = NULL;
+			conn->state = STATE_FREE;
+			http_free(conn);
+			return;
+		}
+	}
+}
+
+/*
+ * Return the connection limit state of host and port, create it if needed.
+ */
+static struct http_host *
+http_host_get(const char *host, const char *port)
+{
+	struct http_host *h;
+
+	LIST_FOREACH(h, &hosts, entry)
+		if (strcmp(h->host, host) == 0 && strcmp(h->port, port) == 0)
+			return h;
+
+	if ((h = calloc(1, sizeof(*h))) == NULL)
+		err(1, NULL);
+	if ((h->host = strdup(host)) == NULL ||
+	    (h->port = strdup(port)) == NULL)
+		err(1, NULL);
+	h->limit = INIT_HOST_CONNS;
+	LIST_INSERT_HEAD(&hosts, h, entry);
+	return h;
+}
+
+/*
+ * A request on conn finished, allow one more connection to the host
+ * once a full window of requests went through.
+ */
+static void
+http_host_success(struct http_connection *conn)
+{
+	struct http_host *h;
+
+	h = http_host_get(conn->host, conn->port);
+	if (++h->good >= h->limit) {
+		h->good = 0;
+		if (h->limit < MAX_HOST_CONNS)
+			h->limit++;
+	}
+}
+
+/*
+ * The host of conn timed out or is overloaded, halve its connection limit.
+ */
+static void
+http_host_backoff(struct http_connection *conn)
+{
+	struct http_host *h;
+
+	h = http_host_get(conn->host, conn->port);
+	h->good = 0;
+	h->limit /= 2;
+	if (h->limit == 0)
+		h->limit = 1;
+	if (verbose > 1)
+		warnx("%s:%s: connection limit lowered to %u", h->host,
+		    h->port, h->limit);
+}
+
+/*
+ * Return the source address for the next connection of conn to an address
+ * of the given family. The -b addresses of that family are used in turn
+ * per host so its connections are spread over all of them.
+ * Returns NULL if there is none.
+ */
+static const struct sockaddr_storage *
+http_host_bindaddr(struct http_connection *conn, int family)
+{
+	struct http_host *h;
+	size_t i, n;
+
+	if (http_nbindaddrs == 0)
+		return NULL;
+
+	h = http_host_get(conn->host, conn->port);
+	for (i = 0; i < http_nbindaddrs; i++) {
+		n = h->nextbind++ % http_nbindaddrs;
+		if (http_bindaddrs[n].ss_family == family)
+			return &http_bindaddrs[n];
+	}
+	return NULL;
+}
+
+/*
+ * Return the number of active connections to host and port of req.
+ */
+static unsigned int
+http_host_conns(struct http_request *req)
 {
 	struct http_connection *conn;
+	unsigned int n = 0;
+
+	LIST_FOREACH(conn, &active, entry)
+		if (strcmp(conn->host, req->host) == 0 &&
+		    strcmp(conn->port, req->port) == 0)
+			n++;
+	return n;
+}
 
-	TAILQ_REMOVE(&queue, req, entry);
+/*
+ * Schedule a request if possible, returns 1 if the request was started.
+ * Idle connections that match host and port are reused first. Requests
+ * to a host that already uses up its adaptive connection limit wait for
+ * one of these to become idle instead of opening yet another connection.
+ * If all slots are used up the idle connection closest to its timeout is
+ * closed to make room for other hosts.
+ */
+static int
+http_req_schedule(struct http_request *req)
+{
+	struct http_connection *conn, *old = NULL;
 
 	/* check list of idle connections first */
 	LIST_FOREACH(conn, &idle, entry) {
-		if (strcmp(conn->host, req->host) != 0)
-			continue;
-		if (strcmp(conn->port, req->port) != 0)
+		if (strcmp(conn->host, req->host) != 0 ||
+		    strcmp(conn->port, req->port) != 0) {
+			if (old == NULL || conn->idle_time < old->idle_time)
+				old = conn;
 			continue;
+		}
 
+		TAILQ_REMOVE(&queue, req, entry);
 		LIST_REMOVE(conn, entry);
 		LIST_INSERT_HEAD(&active, conn, entry);
 
 		/* use established connection */
 		conn->req = req;
 		conn->idle_time = 0;
+		http_stats.reused++;
 
 		/* start request */
 		http_do(conn, http_request);
@@ -676,16 +1145,109 @@ http_req_schedule(struct http_request *req)
 		return 1;
 	}
 
-	if (http_conn_count < MAX_HTTP_REQUESTS) {
+	/* keep the request for a warm connection of this host */
+	if (http_host_conns(req) >= http_host_get(req->host, req->port)->limit)
+		return 0;
+
+	if (http_conn_count >= http_max_conns && old != NULL) {
+		old->io_time = 0;
+		http_do(old, http_close);
+		if (old->state == STATE_FREE)
+			http_free(old);
+	}
+
+	if (http_conn_count < http_max_conns) {
+		TAILQ_REMOVE(&queue, req, entry);
 		http_new(req);
 		return 1;
 	}
 
-	/* no more slots free, requeue */
-	TAILQ_INSERT_HEAD(&queue, req, entry);
+	/* no more slots free, keep queued */
 	return 0;
 }
 
+/*
+ * Add the tokens for the time since the last call, at most a second worth.
+ */
+static void
+http_bw_refill(void)
+{
+	struct timespec now, diff;
+	unsigned long long ms, add;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &now) != 0)
+		err(1, "clock_gettime");
+	timespecsub(&now, &http_bwtime, &diff);
+	if (diff.tv_sec >= 1)
+		ms = 1000;
+	else
+		ms = diff.tv_nsec / 1000000;
+	if ((add = ms * http_bwlimit / 1000) == 0)
+		return;
+
+	http_bwtime = now;
+	http_bwtokens += add;
+	if (http_bwtokens > http_bwlimit)
+		http_bwtokens = http_bwlimit;
+}
+
+/*
+ * Return the number of response bytes conn still waits for, the size of
+ * chunked responses is not known up front.
+ */
+static size_t
+http_bw_remaining(const struct http_connection *conn)
+{
+	if (conn->chunked)
+		return SIZE_MAX;
+	if (conn->iosz > conn->bufpos)
+		return conn->iosz - conn->bufpos;
+	return 0;
+}
+
+static int
+http_bw_cmp(const void *a, const void *b)
+{
+	size_t ra, rb;
+
+	ra = http_bw_remaining(*(struct http_connection * const *)a);
+	rb = http_bw_remaining(*(struct http_connection * const *)b);
+	if (ra < rb)
+		return -1;
+	if (ra > rb)
+		return 1;
+	return 0;
+}
+
+/*
+ * Split the tokens among the connections reading response data. Going
+ * from the smallest remaining transfer up, each one gets an equal share
+ * of what is left or less if it needs less. Small and nearly complete
+ * transfers finish right away, the big ones split the rest.
+ */
+static void
+http_bw_share(void)
+{
+	static struct http_connection *readers[NPFDS];
+	struct http_connection *conn;
+	size_t i, n = 0, tokens, share, need;
+
+	LIST_FOREACH(conn, &active, entry) {
+		conn->rbudget = 0;
+		if (conn->state == STATE_RESPONSE_DATA && n < NPFDS)
+			readers[n++] = conn;
+	}
+	qsort(readers, n, sizeof(readers[0]), http_bw_cmp);
+
+	tokens = http_bwtokens;
+	for (i = 0; i < n; i++) {
+		share = tokens / (n - i);
+		need = http_bw_remaining(readers[i]);
+		readers[i]->rbudget = need < share ? need : share;
+		tokens -= readers[i]->rbudget;
+	}
+}
+
 /*
  * Allocate everything to allow inline decompression during write out.
  * Returns 0 on success, -1 on failure.
@@ -698,6 +1260,13 @@ http_inflate_new(struct http_connection *conn)
 	if (conn->zlibctx != NULL)
 		return 0;
 
+	if ((zctx = LIST_FIRST(&zlib_pool)) != NULL) {
+		LIST_REMOVE(zctx, entry);
+		zlib_poolsz--;
+		conn->zlibctx = zctx;
+		return 0;
+	}
+
 	if ((zctx = calloc(1, sizeof(*zctx))) == NULL)
 		goto fail;
 	zctx->zbufsz = HTTP_BUF_SIZE;
@@ -716,29 +1285,61 @@ http_inflate_new(struct http_connection *conn)
 	return -1;
 }
 
-/* Free all memory used by the decompression API */
+/*
+ * Release the decompression state of the connection, it is kept for
+ * reuse if it can be reset.
+ */
 static void
 http_inflate_free(struct http_connection *conn)
 {
-	if (conn->zlibctx == NULL)
+	struct http_zlib *zctx = conn->zlibctx;
+
+	if (zctx == NULL)
 		return;
-	inflateEnd(&conn->zlibctx->zs);
-	free(conn->zlibctx->zbuf);
-	free(conn->zlibctx);
 	conn->zlibctx = NULL;
+
+	if (zlib_poolsz < MAX_HTTP_REQUESTS &&
+	    inflateReset(&zctx->zs) == Z_OK) {
+		zctx->zs.avail_in = 0;
+		zctx->zbufpos = 0;
+		zctx->zbufoff = 0;
+		zctx->zinsz = 0;
+		zctx->zdone = 0;
+		LIST_INSERT_HEAD(&zlib_pool, zctx, entry);
+		zlib_poolsz++;
+		return;
+	}
+	http_inflate_destroy(zctx);
 }
 
-/* Reset the decompression state to allow a new request to use it */
+/* Free all memory used by a decompression context */
+static void
+http_inflate_destroy(struct http_zlib *zctx)
+{
+	inflateEnd(&zctx->zs);
+	free(zctx->zbuf);
+	free(zctx);
+}
+
+/*
+ * Reset the decompression state to allow a new request to use it.
+ * A context that fails to reset is not put back into the pool.
+ */
 static void
 http_inflate_done(struct http_connection *conn)
 {
-	if (inflateReset(&conn->zlibctx->zs) != Z_OK)
-		http_inflate_free(conn);
+	conn->zlibctx->zs.avail_in = 0;
+	if (inflateReset(&conn->zlibctx->zs) != Z_OK) {
+		http_inflate_destroy(conn->zlibctx);
+		conn->zlibctx = NULL;
+	}
 }
 
 /*
  * Inflate the data from conn->buf into zctx->zbuf. The number of bytes
  * available in zctx->zbuf is stored in zctx->zbufpos.
+ * If the previous call filled zctx->zbuf before all of conn->buf was
+ * consumed, continue where it stopped.
  * Returns -1 on failure.
  */
 static int
@@ -753,9 +1354,12 @@ http_inflate_data(struct http_connection *conn)
 
 	zctx->zdone = 0;
 	zctx->zbufpos = 0;
-	zctx->zinsz = bsz;
-	zctx->zs.next_in = conn->buf;
-	zctx->zs.avail_in = bsz;
+	zctx->zbufoff = 0;
+	if (zctx->zs.avail_in == 0) {
+		zctx->zinsz = bsz;
+		zctx->zs.next_in = conn->buf;
+		zctx->zs.avail_in = bsz;
+	}
 	zctx->zs.next_out = zctx->zbuf;
 	zctx->zs.avail_out = zctx->zbufsz;
 
@@ -790,6 +1394,8 @@ http_inflate_advance(struct http_connection *conn)
 	struct http_zlib *zctx = conn->zlibctx;
 	size_t bsz = zctx->zinsz - zctx->zs.avail_in;
 
+	zctx->zs.avail_in = 0;
+
 	/* adjust compressed input buffer */
 	conn->bufpos -= bsz;
 	conn->iosz -= bsz;
@@ -834,6 +1440,7 @@ http_new(struct http_request *req)
 		err(1, NULL);
 
 	conn->fd = -1;
+	conn->asrfd = -1;
 	conn->req = req;
 	if ((conn->host = strdup(req->host)) == NULL)
 		err(1, NULL);
@@ -842,24 +1449,57 @@ http_new(struct http_request *req)
 
 	LIST_INSERT_HEAD(&active, conn, entry);
 	http_conn_count++;
+	http_stats.conns++;
 
-	if (proxy.proxyhost != NULL) {
-		if (http_resolv(&conn->res0, proxy.proxyhost,
-		    proxy.proxyport) == -1) {
-			http_req_fail(req->id);
-			http_free(conn);
-			return;
-		}
-	} else {
-		if (http_resolv(&conn->res0, conn->host, conn->port) == -1) {
-			http_req_fail(req->id);
-			http_free(conn);
-			return;
-		}
+	/* resolve, connect and start request */
+	http_do(conn, http_resolve);
+	if (conn->state == STATE_FREE)
+		http_free(conn);
+}
+
+/*
+ * Open a connection to the host of uri without a request. Once the TLS
+ * handshake is done it waits on the idle list for the first request to
+ * the host. Nothing is done if the host already has a connection or no
+ * slot is free.
+ */
+static void
+http_warm(char *uri)
+{
+	struct http_connection *conn;
+	char *host, *port, *path;
+
+	if (http_parse_uri(uri, &host, &port, &path) == -1)
+		return;
+
+	LIST_FOREACH(conn, &active, entry)
+		if (strcmp(conn->host, host) == 0 &&
+		    strcmp(conn->port, port) == 0)
+			break;
+	if (conn == NULL)
+		LIST_FOREACH(conn, &idle, entry)
+			if (strcmp(conn->host, host) == 0 &&
+			    strcmp(conn->port, port) == 0)
+				break;
+	if (conn != NULL || http_conn_count >= http_max_conns) {
+		free(host);
+		free(port);
+		return;
 	}
 
-	/* connect and start request */
-	http_do(conn, http_connect);
+	if ((conn = calloc(1, sizeof(*conn))) == NULL)
+		err(1, NULL);
+
+	conn->fd = -1;
+	conn->asrfd = -1;
+	conn->host = host;
+	conn->port = port;
+
+	LIST_INSERT_HEAD(&active, conn, entry);
+	http_conn_count++;
+	http_stats.conns++;
+
+	http_do(conn, http_resolve);
 	if (conn->state == STATE_FREE)
 		http_free(conn);
 }
@@ -881,11 +1521,12 @@ http_free(struct http_connection *conn)
 	free(conn->host);
 	free(conn->port);
 	free(conn->last_modified);
+	free(conn->etag);
 	free(conn->redir_uri);
 	free(conn->buf);
 
-	if (conn->res0 != NULL)
-		freeaddrinfo(conn->res0);
+	if (conn->asrq != NULL)
+		asr_abort(conn->asrq);
 
 	tls_free(conn->tls);
 
@@ -914,14 +1555,33 @@ http_done(struct http_connection *conn, enum http_result res)
 	}
 
 	conn->state = STATE_IDLE;
-	conn->idle_time = getmonotime() + HTTP_IDLE_TIMEOUT;
+	conn->throttled = 0;
+	if (proxy.proxyhost != NULL)
+		conn->idle_time = getmonotime() + HTTP_PROXY_IDLE_TIMEOUT;
+	else
+		conn->idle_time = getmonotime() + HTTP_IDLE_TIMEOUT;
 
 	if (conn->req) {
-		http_req_done(conn->req->id, res, conn->last_modified);
+		const char *from = NULL, *to = NULL;
+
+		if (conn->req->permuri != NULL && !conn->req->temporary) {
+			from = conn->req->permuri;
+			to = conn->req->uri;
+		}
+		http_host_success(conn);
+		http_req_stat(conn->req, res == HTTP_FAILED);
+		http_req_done(conn->req->id, res, conn->last_modified,
+		    conn->etag, from, to, conn->req->ttfb);
 		http_req_free(conn->req);
 		conn->req = NULL;
 	}
 
+	/* validators belong to this response only */
+	free(conn->last_modified);
+	free(conn->etag);
+	conn->last_modified = NULL;
+	conn->etag = NULL;
+
 	if (!conn->keep_alive)
 		return http_close(conn);
 
@@ -946,6 +1606,7 @@ http_failed(struct http_connection *conn)
 	conn->state = STATE_FREE;
 
 	if (conn->req) {
+		http_req_stat(conn->req, 1);
 		http_req_fail(conn->req->id);
 		http_req_free(conn->req);
 		conn->req = NULL;
@@ -989,6 +1650,62 @@ http_do(struct http_connection *conn, enum res (*f)(struct http_connection *))
 	}
 }
 
+/*
+ * Return the TLS configuration for the host and port of conn. The session
+ * data is kept in the TLS_SESSION_DIR of the cache so it survives runs.
+ * Falls back to the shared configuration if no session file can be used.
+ */
+static struct tls_config *
+http_tls_config(struct http_connection *conn)
+{
+	struct http_tls_session *ts;
+	struct tls_config *config;
+	char *fn;
+	int fd;
+
+	if (!tls_sessions_ok)
+		return tls_config;
+
+	LIST_FOREACH(ts, &tls_sessions, entry)
+		if (strcmp(ts->host, conn->host) == 0 &&
+		    strcmp(ts->port, conn->port) == 0)
+			return ts->config;
+
+	if (asprintf(&fn, "%s/%s:%s", TLS_SESSION_DIR, conn->host,
+	    conn->port) == -1)
+		err(1, NULL);
+	fd = open(fn, O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC, 0600);
+	if (fd == -1) {
+		if (verbose > 1)
+			warn("open %s", fn);
+		free(fn);
+		return tls_config;
+	}
+
+	if ((config = tls_config_new()) == NULL)
+		errx(1, "tls config failed");
+	tls_config_set_ca_mem(config, tls_ca_mem, tls_ca_size);
+	if (tls_config_set_session_fd(config, fd) == -1) {
+		/* e.g. a file with the wrong owner or permissions */
+		warnx("%s: %s", fn, tls_config_error(config));
+		tls_config_free(config);
+		close(fd);
+		free(fn);
+		return tls_config;
+	}
+	free(fn);
+
+	if ((ts = calloc(1, sizeof(*ts))) == NULL)
+		err(1, NULL);
+	if ((ts->host = strdup(conn->host)) == NULL ||
+	    (ts->port = strdup(conn->port)) == NULL)
+		err(1, NULL);
+	ts->config = config;
+	LIST_INSERT_HEAD(&tls_sessions, ts, entry);
+
+	return config;
+}
+
 /*
  * Connection successfully establish, initiate TLS handshake or proxy request.
  */
@@ -1006,6 +1723,7 @@ http_connect_done(struct http_connection *conn)
 static enum res
 http_connect(struct http_connection *conn)
 {
+	const struct sockaddr_storage *ss;
 	const char *cause = NULL;
 	struct addrinfo *res;
 
@@ -1029,8 +1747,8 @@ http_connect(struct http_connection *conn)
 		}
 		conn->fd = fd;
 
-		if (http_bindaddr.ss_family == res->ai_family) {
-			if (bind(conn->fd, (struct sockaddr *)&http_bindaddr,
+		if ((ss = http_host_bindaddr(conn, res->ai_family)) != NULL) {
+			if (bind(conn->fd, (const struct sockaddr *)ss,
 			    res->ai_addrlen) == -1) {
 				save_errno = errno;
 				close(conn->fd);
@@ -1105,7 +1823,7 @@ http_tls_connect(struct http_connection *conn)
 		warn("tls_client");
 		return http_failed(conn);
 	}
-	if (tls_configure(conn->tls, tls_config) == -1) {
+	if (tls_configure(conn->tls, http_tls_config(conn)) == -1) {
 		warnx("%s: TLS configuration: %s", conn_info(conn),
 		    tls_error(conn->tls));
 		return http_failed(conn);
@@ -1136,6 +1854,14 @@ http_tls_handshake(struct http_connection *conn)
 		return WANT_POLLOUT;
 	}
 
+	/* a warm connection waits for its first request */
+	if (conn->req == NULL) {
+		conn->keep_alive = 1;
+		http_done(conn, HTTP_OK);
+		conn->idle_time = getmonotime() + HTTP_WARM_TIMEOUT;
+		return WANT_POLLIN;
+	}
+
 	return http_request(conn);
 }
 
@@ -1178,11 +1904,12 @@ proxy_connect(struct http_connection *conn)
 static enum res
 http_request(struct http_connection *conn)
 {
-	char *host, *epath, *modified_since;
+	char *host, *epath, *modified_since, *none_match, *range;
 	int r, with_port = 0;
 
 	assert(conn->state == STATE_IDLE || conn->state == STATE_TLSCONNECT);
 	conn->state = STATE_REQUEST;
+	clock_gettime(CLOCK_MONOTONIC, &conn->req->sent);
 
 	/*
 	 * Send port number only if it's specified and does not equal
@@ -1215,30 +1942,51 @@ http_request(struct http_connection *conn)
 		    conn->req->modified_since) == -1)
 			err(1, NULL);
 	}
+	none_match = NULL;
+	if (conn->req->etag != NULL) {
+		if (asprintf(&none_match, "If-None-Match: %s\r\n",
+		    conn->req->etag) == -1)
+			err(1, NULL);
+	}
+	/* the offset counts decoded bytes, so ask for the data as is */
+	range = NULL;
+	if (conn->req->offset > 0) {
+		if (asprintf(&range, "Range: bytes=%lld-\r\n",
+		    conn->req->offset) == -1)
+			err(1, NULL);
+	}
+
+	conn->range = -1;
+	conn->skip = 0;
 
 	free(conn->buf);
 	conn->bufpos = 0;
 	if ((r = asprintf(&conn->buf,
 	    "GET /%s HTTP/1.1\r\n"
 	    "Host: %s\r\n"
-	    "Accept-Encoding: gzip, deflate\r\n"
+	    "Accept-Encoding: %s\r\n"
 	    "User-Agent: " HTTP_USER_AGENT "\r\n"
-	    "%s\r\n",
+	    "%s%s%s\r\n",
 	    epath, host,
-	    modified_since ? modified_since : "")) == -1)
+	    range ? "identity" : "gzip, deflate",
+	    modified_since ? modified_since : "",
+	    none_match ? none_match : "",
+	    range ? range : "")) == -1)
 		err(1, NULL);
 	conn->bufsz = r;
 
 	free(epath);
 	free(host);
 	free(modified_since);
+	free(none_match);
+	free(range);
 
 	return http_write(conn);
 }
 
 /*
  * Parse the HTTP status line.
- * Return 0 for status codes 100, 103, 200, 203, 301-304, 307-308.
+ * Return 0 for status codes 100, 103, 200, 203, 206, 301-304, 307-308.
  * The other 1xx and 2xx status codes are explicitly not handled and are
  * considered an error.
  * Failure codes and other errors return -1.
@@ -1290,6 +2038,7 @@ http_parse_status(struct http_connection *conn, char *buf)
 		/* FALLTHROUGH */
 	case 200:	/* Success: OK */
 	case 203:	/* Success: non-authoritative information (proxy) */
+	case 206:	/* Success: partial content */
 	case 304:	/* Redirect: not modified */
 		conn->status = status;
 		break;
@@ -1323,10 +2072,31 @@ http_isok(struct http_connection *conn)
 	return 0;
 }
 
+/*
+ * Check the response to a request with an offset. Partial content must
+ * start at the offset, a full response is used by skipping the data up
+ * to the offset. Return -1 if the response does not fit the request.
+ */
+static int
+http_range(struct http_connection *conn)
+{
+	if (conn->status == 206) {
+		if (conn->req->offset == 0 ||
+		    conn->range != conn->req->offset) {
+			warnx("%s: bad partial content", conn_info(conn));
+			return -1;
+		}
+	} else if (conn->req->offset > 0)
+		conn->skip = conn->req->offset;
+	return 0;
+}
+
 static void
 http_redirect(struct http_connection *conn)
 {
-	char *uri, *mod_since = NULL;
+	struct http_request *req;
+	char *uri, *mod_since = NULL, *etag = NULL;
+	const char *from;
 	int outfd;
 
 	/* move uri and fd out for new request */
@@ -1339,16 +2109,55 @@ http_redirect(struct http_connection *conn)
 	if (conn->req->modified_since)
 		if ((mod_since = strdup(conn->req->modified_since)) == NULL)
 			err(1, NULL);
+	if (conn->req->etag)
+		if ((etag = strdup(conn->req->etag)) == NULL)
+			err(1, NULL);
 
 	logx("redirect to %s", http_info(uri));
-	http_req_new(conn->req->id, uri, mod_since, conn->req->redirect_loop,
+	req = http_req_new(conn->req->id, uri, mod_since, etag,
+	    conn->req->offset, conn->req->redirect_loop, conn->req->prio,
 	    outfd);
 
+	/* remember where a chain of permanent redirects started */
+	if (req != NULL) {
+		if (conn->req->temporary ||
+		    (conn->status != 301 && conn->status != 308))
+			req->temporary = 1;
+		from = conn->req->permuri;
+		if (from == NULL)
+			from = conn->req->uri;
+		if ((req->permuri = strdup(from)) == NULL)
+			err(1, NULL);
+		req->start = conn->req->start;
+	}
+
 	/* clear request before moving connection to idle */
 	http_req_free(conn->req);
 	conn->req = NULL;
 }
 
+/*
+ * Check that the entity tag etag is of the form "tag" or W/"tag".
+ * Return 1 if valid else 0.
+ */
+static int
+http_valid_etag(const char *etag)
+{
+	size_t i, len;
+
+	if (strncmp(etag, "W/", 2) == 0)
+		etag += 2;
+	len = strlen(etag);
+	if (len < 2 || len > MAX_ETAG_LEN)
+		return 0;
+	if (etag[0] != '"' || etag[len - 1] != '"')
+		return 0;
+	for (i = 1; i < len - 1; i++)
+		if (!isgraph((unsigned char)etag[i]) || etag[i] == '"')
+			return 0;
+	return 1;
+}
+
 static int
 http_parse_header(struct http_connection *conn, char *buf)
 {
@@ -1358,6 +2167,8 @@ http_parse_header(struct http_connection *conn, char *buf)
 #define TRANSFER_ENCODING "Transfer-Encoding:"
 #define CONTENT_ENCODING "Content-Encoding:"
 #define LAST_MODIFIED "Last-Modified:"
+#define ETAG "ETag:"
+#define CONTENT_RANGE "Content-Range:"
 	const char *errstr;
 	char *cp, *redirurl;
 	char *locbase, *loctail;
@@ -1452,11 +2263,54 @@ http_parse_header(struct http_connection *conn, char *buf)
 		free(conn->last_modified);
 		if ((conn->last_modified = strdup(cp)) == NULL)
 			err(1, NULL);
+	} else if (strncasecmp(cp, CONTENT_RANGE,
+	    sizeof(CONTENT_RANGE) - 1) == 0) {
+		cp += sizeof(CONTENT_RANGE) - 1;
+		cp += strspn(cp, " \t");
+		/* only the first byte position matters, "bytes 42-99/100" */
+		if (strncasecmp(cp, "bytes ", 6) == 0) {
+			cp += 6;
+			cp[strcspn(cp, "-")] = '\0';
+			conn->range = strtonum(cp, 0, LLONG_MAX, &errstr);
+			if (errstr != NULL)
+				conn->range = -1;
+		}
+	} else if (strncasecmp(cp, ETAG, sizeof(ETAG) - 1) == 0) {
+		cp += sizeof(ETAG) - 1;
+		cp += strspn(cp, " \t");
+		/* the tag is sent back later, only keep well formed ones */
+		if (http_valid_etag(cp)) {
+			free(conn->etag);
+			if ((conn->etag = strdup(cp)) == NULL)
+				err(1, NULL);
+		}
 	}
 
 	return 1;
 }
 
+/*
+ * The read buffer was filled before the data could be written out,
+ * double it while the body has more data left than fits in it.
+ */
+static void
+http_grow_buf(struct http_connection *conn)
+{
+	char *buf;
+	size_t sz;
+
+	if (conn->bufsz >= HTTP_BUF_MAX || conn->iosz <= conn->bufsz)
+		return;
+
+	sz = conn->bufsz * 2;
+	if (sz > HTTP_BUF_MAX)
+		sz = HTTP_BUF_MAX;
+	if ((buf = realloc(conn->buf, sz)) == NULL)
+		err(1, NULL);
+	conn->buf = buf;
+	conn->bufsz = sz;
+}
+
 /*
  * Return one line from the HTTP response.
  * The line returned has any possible '\r' and '\n' at the end stripped.
@@ -1517,15 +2371,25 @@ static enum res
 http_read(struct http_connection *conn)
 {
 	ssize_t s;
+	size_t len;
 	char *buf;
-	int done;
+	int done, limited;
 
 	if (conn->bufpos > 0)
 		goto again;
 
 read_more:
-	s = tls_read(conn->tls, conn->buf + conn->bufpos,
-	    conn->bufsz - conn->bufpos);
+	len = conn->bufsz - conn->bufpos;
+	limited = http_bwlimit != 0 && conn->state == STATE_RESPONSE_DATA;
+	if (limited) {
+		if (conn->rbudget == 0) {
+			conn->throttled = 1;
+			return WANT_POLLIN;
+		}
+		if (len > conn->rbudget)
+			len = conn->rbudget;
+	}
+	s = tls_read(conn->tls, conn->buf + conn->bufpos, len);
 	if (s == -1) {
 		warnx("%s: TLS read: %s", conn_info(conn),
 		    tls_error(conn->tls));
@@ -1543,6 +2407,10 @@ read_more:
 		return http_failed(conn);
 	}
 
+	if (limited) {
+		conn->rbudget -= s;
+		http_bwtokens -= s;
+	}
 	conn->bufpos += s;
 
 again:
@@ -1586,6 +2454,14 @@ again:
 			return http_failed(conn);
 		}
 		free(buf);
+		if (conn->req->ttfb == -1) {
+			struct timespec now;
+
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			timespecsub(&now, &conn->req->sent, &now);
+			conn->req->ttfb = now.tv_sec * 1000000LL +
+			    now.tv_nsec / 1000;
+		}
 		conn->state = STATE_RESPONSE_HEADER;
 		goto again;
 	case STATE_RESPONSE_HEADER:
@@ -1610,6 +2486,8 @@ again:
 		if (http_isok(conn) || http_isredirect(conn)) {
 			if (http_isredirect(conn))
 				http_redirect(conn);
+			else if (http_range(conn) == -1)
+				return http_failed(conn);
 
 			conn->totalsz = 0;
 			if (conn->chunked)
@@ -1621,6 +2499,9 @@ again:
 			conn->state = STATE_RESPONSE_STATUS;
 		} else if (conn->status == 304) {
 			return http_done(conn, HTTP_NOT_MOD);
+		} else if (conn->status == 429 || conn->status == 503) {
+			/* server asks for less load */
+			http_host_backoff(conn);
 		}
 
 		return http_failed(conn);
@@ -1630,6 +2511,8 @@ again:
 			goto read_more;
 
 		/* got a buffer full of data */
+		if (conn->bufpos == conn->bufsz)
+			http_grow_buf(conn);
 		if (conn->req == NULL) {
 			/*
 			 * After redirects all data needs to be discarded.
@@ -1790,6 +2673,9 @@ again:
 		}
 		/* proxy is ready, connect to remote */
 		if (conn->status == 200) {
+			/* keep-alive is up to the server, not the proxy */
+			conn->status = 0;
+			conn->keep_alive = 0;
 			conn->state = STATE_CONNECT;
 			return http_tls_connect(conn);
 		}
@@ -1875,8 +2761,11 @@ data_write(struct http_connection *conn)
 	if (conn->iosz < bsz)
 		bsz = conn->iosz;
 
-	s = write(conn->req->outfd, conn->buf, bsz);
-	if (s == -1) {
+	if (conn->skip > 0) {
+		/* drop the data before the requested offset */
+		s = (long long)bsz < conn->skip ? (ssize_t)bsz : conn->skip;
+		conn->skip -= s;
+	} else if ((s = write(conn->req->outfd, conn->buf, bsz)) == -1) {
 		warn("%s: data write", conn_info(conn));
 		return http_failed(conn);
 	}
@@ -1913,6 +2802,8 @@ data_write(struct http_connection *conn)
  * This is a simplified version of data_write() that just writes out the
  * decompressed file stream. All the buffer handling is done by
  * http_inflate_data() and http_inflate_advance().
+ * As long as the pipe accepts data all of the compressed input buffered
+ * is inflated and written out before more is read from the connection.
  */
 static enum res
 data_inflate_write(struct http_connection *conn)
@@ -1922,33 +2813,46 @@ data_inflate_write(struct http_connection *conn)
 
 	assert(conn->state == STATE_WRITE_DATA);
 
-	/* no decompressed data, get more */
-	if (zctx->zbufpos == 0)
-		if (http_inflate_data(conn) == -1)
-			return http_failed(conn);
-
-	s = write(conn->req->outfd, zctx->zbuf, zctx->zbufpos);
-	if (s == -1) {
-		warn("%s: data write", conn_info(conn));
-		return http_failed(conn);
-	}
+	for (;;) {
+		/* no decompressed data, get more */
+		if (zctx->zbufpos == 0)
+			if (http_inflate_data(conn) == -1)
+				return http_failed(conn);
 
-	conn->totalsz += s;
-	if (conn->totalsz > MAX_CONTENTLEN) {
-		warn("%s: too much decompressed data offered", conn_info(conn));
-		return http_failed(conn);
-	}
+		s = zctx->zbufpos - zctx->zbufoff;
+		if (conn->skip > 0) {
+			/* drop the data before the requested offset */
+			if (s > conn->skip)
+				s = conn->skip;
+			conn->skip -= s;
+		} else
+			s = write(conn->req->outfd,
+			    zctx->zbuf + zctx->zbufoff, s);
+		if (s == -1) {
+			if (errno == EAGAIN)
+				return WANT_POLLOUT;
+			warn("%s: data write", conn_info(conn));
+			return http_failed(conn);
+		}
 
-	/* adjust output buffer */
-	zctx->zbufpos -= s;
-	memmove(zctx->zbuf, zctx->zbuf + s, zctx->zbufpos);
+		conn->totalsz += s;
+		if (conn->totalsz > MAX_CONTENTLEN) {
+			warn("%s: too much decompressed data offered",
+			    conn_info(conn));
+			return http_failed(conn);
+		}
 
-	/* all decompressed data written, progress input */
-	if (zctx->zbufpos == 0)
-		return http_inflate_advance(conn);
+		/* adjust output buffer */
+		zctx->zbufoff += s;
+		if (zctx->zbufoff < zctx->zbufpos)
+			/* still more data to write in buffer */
+			return WANT_POLLOUT;
+		zctx->zbufpos = 0;
 
-	/* still more data to write in buffer */
-	return WANT_POLLOUT;
+		/* all decompressed data written, progress input */
+		if (zctx->zdone || zctx->zs.avail_in == 0)
+			return http_inflate_advance(conn);
+	}
 }
 
 /*
@@ -1965,6 +2869,8 @@ http_handle(struct http_connection *conn)
 	conn->io_time = 0;
 
 	switch (conn->state) {
+	case STATE_RESOLVE:
+		return http_resolve(conn);
 	case STATE_CONNECT:
 		return http_finish_connect(conn);
 	case STATE_TLSCONNECT:
@@ -2037,31 +2943,53 @@ http_setup(void)
 }
 
 void
-proc_http(char *bind_addr, int fd)
+proc_http(char **bind_addrs, unsigned int maxconns, unsigned int bwlimit,
+    int fd)
 {
 	struct pollfd pfds[NPFDS];
 	struct http_connection *conn, *nc;
 	struct http_request *req, *nr;
 	struct ibuf *b, *inbuf = NULL;
 
-	if (pledge("stdio rpath inet dns recvfd", NULL) == -1)
+	if (pledge("stdio rpath wpath cpath inet dns recvfd unveil",
+	    NULL) == -1)
 		err(1, "pledge");
 
-	if (bind_addr != NULL) {
+	for (; *bind_addrs != NULL; bind_addrs++) {
 		struct addrinfo hints, *res;
 
 		bzero(&hints, sizeof(hints));
 		hints.ai_family = AF_UNSPEC;
 		hints.ai_socktype = SOCK_DGRAM; /*dummy*/
 		hints.ai_flags = AI_NUMERICHOST;
-		if (getaddrinfo(bind_addr, NULL, &hints, &res) == 0) {
-			memcpy(&http_bindaddr, res->ai_addr, res->ai_addrlen);
+		if (getaddrinfo(*bind_addrs, NULL, &hints, &res) == 0) {
+			memcpy(&http_bindaddrs[http_nbindaddrs++],
+			    res->ai_addr, res->ai_addrlen);
 			freeaddrinfo(res);
 		}
 	}
 	http_setup();
+	http_max_conns = maxconns;
+	http_bwlimit = (size_t)bwlimit * 1024;
+
+	/*
+	 * With a proxy every connection is a CONNECT tunnel to the same
+	 * proxy host, these get their own lower limit.
+	 */
+	if (proxy.proxyhost != NULL && http_max_conns > MAX_PROXY_CONNS)
+		http_max_conns = MAX_PROXY_CONNS;
 
-	if (pledge("stdio inet dns recvfd", NULL) == -1)
+	/* TLS session data is only written to the session directory */
+	if (mkdir(TLS_SESSION_DIR, 0700) == -1 && errno != EEXIST)
+		warn("mkdir %s", TLS_SESSION_DIR);
+	else
+		tls_sessions_ok = 1;
+	if (unveil(TLS_SESSION_DIR, "rwc") == -1)
+		err(1, "unveil %s", TLS_SESSION_DIR);
+
+	/* drop unveil, this also locks the view set up above */
+
+	if (pledge("stdio rpath wpath cpath inet dns recvfd", NULL) == -1)
 		err(1, "pledge");
 
 	msgbuf_init(&msgq);
@@ -2081,10 +3009,41 @@ proc_http(char *bind_addr, int fd)
 		i = 1;
 		timeout = INFTIM;
 		now = getmonotime();
+		if (http_bwlimit != 0) {
+			http_bw_refill();
+			http_bw_share();
+		}
 		LIST_FOREACH(conn, &active, entry) {
 			if (i >= NPFDS)
 				errx(1, "too many connections");
 
+			if (conn->throttled) {
+				/* waits for bandwidth, not for the server */
+				conn->io_time = now + MAX_IO_TIMEOUT;
+				if (conn->rbudget > 0)
+					timeout = 0;
+				else if (timeout == INFTIM ||
+				    timeout > HTTP_BW_TICK)
+					timeout = HTTP_BW_TICK;
+				pfds[i].fd = -1;
+				conn->pfd = &pfds[i];
+				i++;
+				continue;
+			}
+
+			if (conn->state == STATE_WRITE_DATA) {
+				/*
+				 * Waits for the local reader, which may hold
+				 * back a prefetched delta, not for the server.
+				 */
+				conn->io_time = 0;
+				pfds[i].fd = conn->req->outfd;
+				pfds[i].events = conn->events;
+				conn->pfd = &pfds[i];
+				i++;
+				continue;
+			}
+
 			if (conn->io_time == 0) {
 				if (conn->state == STATE_CONNECT)
 					conn->io_time = now + MAX_CONN_TIMEOUT;
@@ -2100,8 +3059,8 @@ proc_http(char *bind_addr, int fd)
 				if (timeout == INFTIM || diff < timeout)
 					timeout = diff;
 			}
-			if (conn->state == STATE_WRITE_DATA)
-				pfds[i].fd = conn->req->outfd;
+			if (conn->state == STATE_RESOLVE)
+				pfds[i].fd = conn->asrfd;
 			else
 				pfds[i].fd = conn->fd;
 
@@ -2146,16 +3105,34 @@ proc_http(char *bind_addr, int fd)
 		if (pfds[0].revents & POLLIN) {
 			b = io_buf_recvfd(fd, &inbuf);
 			if (b != NULL) {
-				unsigned int id;
+				unsigned int id, prio;
+				long long offset;
 				char *uri;
-				char *mod;
+				char *mod, *etag;
+				int outfd;
 
 				io_read_buf(b, &id, sizeof(id));
+				io_read_buf(b, &prio, sizeof(prio));
+				io_read_buf(b, &offset, sizeof(offset));
 				io_read_str(b, &uri);
 				io_read_str(b, &mod);
-
-				/* queue up new requests */
-				http_req_new(id, uri, mod, 0, ibuf_fd_get(b));
+				io_read_str(b, &etag);
+
+				/*
+				 * Requests without a file only warm up, those
+				 * without URI abort the request.
+				 */
+				if ((outfd = ibuf_fd_get(b)) == -1) {
+					if (uri == NULL)
+						http_req_abort(id);
+					else
+						http_warm(uri);
+					free(uri);
+					free(mod);
+					free(etag);
+				} else
+					http_req_new(id, uri, mod, etag,
+					    offset, 0, prio, outfd);
 				ibuf_free(b);
 			}
 		}
@@ -2177,17 +3154,27 @@ proc_http(char *bind_addr, int fd)
 		/* then active http requests */
 		LIST_FOREACH_SAFE(conn, &active, entry, nc) {
 			/* check if event is ready */
-			if (conn->pfd != NULL && conn->pfd->revents != 0)
+			if (conn->throttled) {
+				if (conn->rbudget > 0) {
+					conn->throttled = 0;
+					http_do(conn, http_read);
+				}
+			} else if (conn->pfd != NULL && conn->pfd->revents != 0)
 				http_do(conn, http_handle);
 			else if (conn->io_time != 0 && conn->io_time <= now) {
 				conn->io_time = 0;
-				if (conn->state == STATE_CONNECT) {
+				if (conn->state == STATE_RESOLVE) {
+					/* the resolver has its own timeouts */
+					http_do(conn, http_resolve);
+				} else if (conn->state == STATE_CONNECT) {
 					warnx("%s: connect timeout",
 					    conn_info(conn));
+					http_host_backoff(conn);
 					http_do(conn, http_connect_failed);
 				} else {
 					warnx("%s: timeout, connection closed",
 					    conn_info(conn));
+					http_host_backoff(conn);
 					http_do(conn, http_failed);
 				}
 			}
@@ -2196,10 +3183,11 @@ proc_http(char *bind_addr, int fd)
 				http_free(conn);
 		}
 
+		/* requests that can't be scheduled yet stay in order */
 		TAILQ_FOREACH_SAFE(req, &queue, entry, nr)
-			if (!http_req_schedule(req))
-				break;
+			http_req_schedule(req);
 	}
 
+	http_stat_log();
 	exit(0);
 }
@@ -30,6 +30,25 @@
 
 #include "extern.h"
 
+#define IO_READSZ	(64 * 1024)
+#define IO_POOLSZ	64
+#define IO_POOLMAX	(16 * 1024)
+
+/*
+ * Messages added to a batch are copied and done with right away. They are
+ * kept here and handed out again by io_new_buffer(), they already have
+ * grown to the size of a typical message. Buffers enqueued on a msgbuf
+ * are freed by msgbuf_write() and can not be recycled.
+ */
+static struct ibuf	*io_pool[IO_POOLSZ];
+static size_t		 io_poolcnt;
+
+/*
+ * Initial size of a new batch. It follows the size of the recent batches
+ * so a batch does not grow in many small steps.
+ */
+static size_t		 io_batchhint = 64;
+
 /*
  * Create new io buffer, call io_close() when done with it.
  * Function always returns a new buffer.
@@ -39,12 +58,34 @@ io_new_buffer(void)
 {
 	struct ibuf *b;
 
-	if ((b = ibuf_dynamic(64, INT32_MAX)) == NULL)
+	if (io_poolcnt > 0) {
+		b = io_pool[--io_poolcnt];
+		ibuf_truncate(b, 0);	/* can not fail */
+	} else if ((b = ibuf_dynamic(64, INT32_MAX)) == NULL)
 		err(1, NULL);
 	ibuf_add_zero(b, sizeof(size_t));	/* can not fail */
 	return b;
 }
 
+/*
+ * Create a new io buffer for a batch, see io_batch_add().
+ */
+struct ibuf *
+io_new_batch(void)
+{
+	struct ibuf *b;
+
+	if ((b = ibuf_dynamic(io_batchhint, INT32_MAX)) == NULL)
+		err(1, NULL);
+	ibuf_add_zero(b, sizeof(size_t));	/* can not fail */
+
+	/* shrink back if the batches get smaller, io_batch_add() grows it */
+	io_batchhint -= io_batchhint / 4;
+	if (io_batchhint < 64)
+		io_batchhint = 64;
+	return b;
+}
+
 /*
  * Add a simple object of static size to the io buffer.
  */
@@ -79,6 +120,18 @@ io_str_buffer(struct ibuf *b, const char *p)
 	io_buf_buffer(b, p, sz);
 }
 
+/*
+ * Add a string including its NUL terminator into the io buffer.
+ * The other side reads it back with io_read_strz() without a copy.
+ */
+void
+io_strz_buffer(struct ibuf *b, const char *p)
+{
+	size_t sz = (p == NULL) ? 0 : strlen(p) + 1;
+
+	io_buf_buffer(b, p, sz);
+}
+
 /*
  * Finish and enqueue a io buffer.
  */
@@ -92,6 +145,45 @@ io_close_buffer(struct msgbuf *msgbuf, struct ibuf *b)
 	ibuf_close(msgbuf, b);
 }
 
+/*
+ * Finish a io buffer and append it to a batch, a io buffer itself which
+ * is enqueued with io_close_buffer() once it is full.
+ */
+void
+io_batch_add(struct ibuf *batch, struct ibuf *b)
+{
+	size_t len;
+
+	len = ibuf_size(b) - sizeof(len);
+	ibuf_set(b, 0, &len, sizeof(len));
+	if (ibuf_add_ibuf(batch, b) == -1)
+		err(1, NULL);
+	if (ibuf_size(batch) > io_batchhint)
+		io_batchhint = ibuf_size(batch);
+
+	if (io_poolcnt < IO_POOLSZ && ibuf_size(b) <= IO_POOLMAX)
+		io_pool[io_poolcnt++] = b;
+	else
+		ibuf_free(b);
+}
+
+/*
+ * Extract the next message of a batch into b, which points into batch.
+ * Return 1 if a message was extracted or 0 once the batch is empty.
+ */
+int
+io_batch_get(struct ibuf *batch, struct ibuf *b)
+{
+	size_t len;
+
+	if (ibuf_size(batch) == 0)
+		return 0;
+	io_read_buf(batch, &len, sizeof(len));
+	if (ibuf_get_ibuf(batch, len, b) == -1)
+		err(1, "bad internal framing");
+	return 1;
+}
+
 /*
  * Read of an ibuf and extract sz byte from there.
  * Does nothing if "sz" is zero.
@@ -126,6 +218,30 @@ io_read_str(struct ibuf *b, char **res)
 	io_read_buf(b, *res, sz);
 }
 
+/*
+ * Read a string written by io_strz_buffer() (returns NULL for NULL
+ * strings). The result points into the buffer and is only valid as
+ * long as the buffer is, it must not be freed.
+ */
+void
+io_read_strz(struct ibuf *b, char **res)
+{
+	size_t	 sz;
+
+	io_read_buf(b, &sz, sizeof(sz));
+	if (sz == 0) {
+		*res = NULL;
+		return;
+	}
+	if (sz > ibuf_size(b))
+		errx(1, "bad internal framing");
+	*res = ibuf_data(b);
+	if ((*res)[sz - 1] != '\0')
+		errx(1, "bad internal framing");
+	if (ibuf_skip(b, sz) == -1)
+		err(1, "bad internal framing");
+}
+
 /*
  * Read a binary buffer, allocating space for it.
  * If the buffer is zero-sized, this won't allocate "res", but
@@ -219,6 +335,83 @@ io_buf_read(int fd, struct ibuf **ib)
 	return NULL;
 }
 
+/*
+ * Read as much data as there is space for into the receive buffer *rb,
+ * allocating it on first use. Messages are then extracted from it with
+ * io_buf_next(), so a single read can deliver many small messages.
+ */
+void
+io_buf_fill(int fd, struct ibuf **rb)
+{
+	struct ibuf *b = *rb;
+	ssize_t n;
+	size_t left, sz;
+
+	if (b == NULL) {
+		if ((b = ibuf_dynamic(IO_READSZ, INT32_MAX)) == NULL)
+			err(1, NULL);
+		*rb = b;
+	}
+
+	/* move the partial message to the front */
+	left = b->wpos - b->rpos;
+	if (b->rpos > 0) {
+		memmove(b->buf, b->buf + b->rpos, left);
+		b->rpos = 0;
+		b->wpos = left;
+	}
+
+	/* make room for a message larger than the buffer */
+	if (left >= sizeof(sz)) {
+		memcpy(&sz, b->buf, sizeof(sz));
+		if (sz == 0 || sz > INT32_MAX)
+			errx(1, "bad internal framing, bad size");
+		if (sizeof(sz) + sz > b->size &&
+		    ibuf_realloc(b, sizeof(sz) + sz - b->wpos) == -1)
+			err(1, "ibuf_realloc");
+	}
+	if (b->wpos == b->size && ibuf_realloc(b, IO_READSZ) == -1)
+		err(1, "ibuf_realloc");
+
+	while ((n = read(fd, b->buf + b->wpos, b->size - b->wpos)) == -1) {
+		if (errno == EINTR)
+			continue;
+		if (errno == EAGAIN)
+			return;
+		err(1, "read");
+	}
+
+	if (n == 0)
+		errx(1, "read: unexpected end of file");
+	b->wpos += n;
+}
+
+/*
+ * Return the next complete message from a receive buffer filled by
+ * io_buf_fill() or NULL if more data is needed.
+ */
+struct ibuf *
+io_buf_next(struct ibuf *rb)
+{
+	struct ibuf *b;
+	size_t sz;
+
+	if (rb == NULL || rb->wpos - rb->rpos < sizeof(sz))
+		return NULL;
+	memcpy(&sz, rb->buf + rb->rpos, sizeof(sz));
+	if (sz == 0 || sz > INT32_MAX)
+		errx(1, "bad internal framing, bad size");
+	if (rb->wpos - rb->rpos - sizeof(sz) < sz)
+		return NULL;
+
+	if ((b = ibuf_open(sz)) == NULL)
+		err(1, NULL);
+	if (ibuf_add(b, rb->buf + rb->rpos + sizeof(sz), sz) == -1)
+		err(1, NULL);
+	rb->rpos += sizeof(sz) + sz;
+	return b;
+}
+
 /*
  * Read data from socket but receive a file descriptor at the same time.
  */
@@ -96,71 +96,204 @@ ip_addr_check_covered(enum afi afi,
 }
 
 /*
- * Given a newly-parsed IP address or range "ip", make sure that "ip"
- * does not overlap with any addresses or ranges in the "ips" array.
- * This is defined by RFC 3779 section 2.2.3.6.
- * Returns zero on failure, non-zero on success.
+ * The comparison functions below are only used to sort ranges of the
+ * same AFI, ranges of IPv4 addresses are zero padded.
+ */
+static int
+ip_index_cmp(const void *a, const void *b)
+{
+	const struct cert_ip_range *ra = a, *rb = b;
+
+	return memcmp(ra->min, rb->min, sizeof(ra->min));
+}
+
+static int
+ip_ptr_cmp(const void *a, const void *b)
+{
+	const struct cert_ip *ia = *(const struct cert_ip * const *)a;
+	const struct cert_ip *ib = *(const struct cert_ip * const *)b;
+
+	return memcmp(ia->min, ib->min, ia->afi == AFI_IPV4 ? 4 : 16);
+}
+
+/*
+ * Build the per AFI index of the IP resources in ips. The ranges are
+ * copied so the index stays valid once ips is freed. Since the ranges
+ * of a cert do not overlap, the range covering an address is the last
+ * one starting at or below it.
+ */
+void
+ip_index_build(struct res_index *ri, const struct cert_ip *ips, size_t ipsz)
+{
+	struct cert_ip_range	*r;
+	size_t			 i, sz, n[2] = { 0, 0 };
+	int			 a;
+
+	for (i = 0; i < ipsz; i++) {
+		a = ips[i].afi - 1;
+		if (ips[i].type == CERT_IP_INHERIT)
+			ri->ipinherit[a] = 1;
+		else
+			n[a]++;
+	}
+
+	for (a = 0; a < 2; a++) {
+		ri->ipsz[a] = 0;
+		ri->ips[a] = NULL;
+		if (n[a] == 0)
+			continue;
+		if ((ri->ips[a] = calloc(n[a], sizeof(*ri->ips[a]))) == NULL)
+			err(1, NULL);
+	}
+	for (i = 0; i < ipsz; i++) {
+		if (ips[i].type == CERT_IP_INHERIT)
+			continue;
+		a = ips[i].afi - 1;
+		sz = a == AFI_IPV4 - 1 ? 4 : 16;
+		r = &ri->ips[a][ri->ipsz[a]++];
+		memcpy(r->min, ips[i].min, sz);
+		memcpy(r->max, ips[i].max, sz);
+	}
+	for (a = 0; a < 2; a++)
+		if (ri->ipsz[a] > 1)
+			qsort(ri->ips[a], ri->ipsz[a], sizeof(*ri->ips[a]),
+			    ip_index_cmp);
+}
+
+/*
+ * Same as ip_addr_check_covered() but using the index built by
+ * ip_index_build().
  */
 int
-ip_addr_check_overlap(const struct cert_ip *ip, const char *fn,
-    const struct cert_ip *ips, size_t ipsz, int quiet)
+ip_index_covered(const struct res_index *ri, enum afi afi,
+    const unsigned char *min, const unsigned char *max)
 {
-	size_t	 i, sz = ip->afi == AFI_IPV4 ? 4 : 16;
-	int	 inherit_v4 = 0, inherit_v6 = 0;
-	int	 has_v4 = 0, has_v6 = 0;
+	const struct cert_ip_range	*ips;
+	size_t				 lo, hi, mid;
+	size_t				 sz = AFI_IPV4 == afi ? 4 : 16;
+	int				 a = afi - 1;
 
-	/*
-	 * FIXME: cache this by having a flag on the cert_ip, else we're
-	 * going to need to do a lot of scanning for big allocations.
-	 */
+	if (ri->ipinherit[a])
+		return 0;
 
-	for (i = 0; i < ipsz; i++)
-		if (ips[i].type == CERT_IP_INHERIT) {
-			if (ips[i].afi == AFI_IPV4)
-				inherit_v4 = 1;
-			else
-				inherit_v6 = 1;
-		} else {
-			if (ips[i].afi == AFI_IPV4)
-				has_v4 = 1;
-			else
-				has_v6 = 1;
-		}
+	ips = ri->ips[a];
+	lo = 0;
+	hi = ri->ipsz[a];
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (memcmp(ips[mid].min, min, sz) <= 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo > 0 && memcmp(ips[lo - 1].max, max, sz) >= 0)
+		return 1;
+
+	return -1;
+}
+
+/*
+ * Return 1 if min--max overlaps a range in the index built by
+ * ip_index_build(), 0 otherwise, see as_index_overlaps().
+ */
+int
+ip_index_overlaps(const struct res_index *ri, enum afi afi,
+    const unsigned char *min, const unsigned char *max)
+{
+	const struct cert_ip_range	*ips;
+	size_t				 lo, hi, mid;
+	size_t				 sz = AFI_IPV4 == afi ? 4 : 16;
+	int				 a = afi - 1;
+
+	ips = ri->ips[a];
+	lo = 0;
+	hi = ri->ipsz[a];
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (memcmp(ips[mid].min, max, sz) <= 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo > 0 && memcmp(ips[lo - 1].max, min, sz) >= 0;
+}
+
+/*
+ * Make sure that the IP addresses and ranges in the "ips" array do not
+ * overlap and that inheritance is not mixed with addresses of the same
+ * class. This is defined by RFC 3779 section 2.2.3.5 and 2.2.3.6.
+ * The ranges are sorted by their lower bound per AFI, see
+ * as_check_overlap().
+ * Returns zero on failure, non-zero on success.
+ */
+int
+ip_addr_check_overlap(const char *fn, const struct cert_ip *ips,
+    size_t ipsz)
+{
+	const struct cert_ip	**sorted[2] = { NULL, NULL }, *max;
+	size_t			 i, sz, n[2] = { 0, 0 }, ninherit[2] = { 0, 0 };
+	int			 a, rc = 1;
 
 	/* Disallow multiple inheritance per type. */
 
-	if ((inherit_v4 && ip->afi == AFI_IPV4) ||
-	    (inherit_v6 && ip->afi == AFI_IPV6) ||
-	    (has_v4 && ip->afi == AFI_IPV4 &&
-	     ip->type == CERT_IP_INHERIT) ||
-	    (has_v6 && ip->afi == AFI_IPV6 &&
-	     ip->type == CERT_IP_INHERIT)) {
-		if (!quiet) {
+	for (i = 0; i < ipsz; i++) {
+		a = ips[i].afi - 1;
+		if (ips[i].type == CERT_IP_INHERIT)
+			ninherit[a]++;
+		else
+			n[a]++;
+	}
+
+	for (a = 0; a < 2; a++) {
+		if (ninherit[a] > 1 || (ninherit[a] > 0 && n[a] > 0)) {
 			warnx("%s: RFC 3779 section 2.2.3.5: "
 			    "cannot have multiple inheritance or inheritance "
 			    "and addresses of the same class", fn);
+			return 0;
 		}
-		return 0;
 	}
 
-	/* Check our ranges. */
-
-	for (i = 0; i < ipsz; i++) {
-		if (ips[i].afi != ip->afi)
+	for (a = 0; a < 2; a++) {
+		if (n[a] == 0)
 			continue;
-		if (memcmp(ips[i].max, ip->min, sz) <= 0 ||
-		    memcmp(ips[i].min, ip->max, sz) >= 0)
+		if ((sorted[a] = calloc(n[a], sizeof(*sorted[a]))) == NULL)
+			err(1, NULL);
+		n[a] = 0;
+	}
+	for (i = 0; i < ipsz; i++) {
+		if (ips[i].type == CERT_IP_INHERIT)
 			continue;
-		if (!quiet) {
-			warnx("%s: RFC 3779 section 2.2.3.5: "
-			    "cannot have overlapping IP addresses", fn);
-			ip_warn(fn, "certificate IP", ip);
-			ip_warn(fn, "offending IP", &ips[i]);
+		a = ips[i].afi - 1;
+		sorted[a][n[a]++] = &ips[i];
+	}
+
+	/* Check our ranges. */
+
+	for (a = 0; a < 2; a++) {
+		if (n[a] > 1)
+			qsort(sorted[a], n[a], sizeof(*sorted[a]), ip_ptr_cmp);
+		sz = a == AFI_IPV4 - 1 ? 4 : 16;
+		max = NULL;
+		for (i = 0; i < n[a]; i++) {
+			if (max != NULL &&
+			    memcmp(max->max, sorted[a][i]->min, sz) > 0) {
+				warnx("%s: RFC 3779 section 2.2.3.5: "
+				    "cannot have overlapping IP addresses", fn);
+				ip_warn(fn, "certificate IP", sorted[a][i]);
+				ip_warn(fn, "offending IP", max);
+				rc = 0;
+				goto out;
+			}
+			if (max == NULL ||
+			    memcmp(sorted[a][i]->max, max->max, sz) > 0)
+				max = sorted[a][i];
 		}
-		return 0;
 	}
 
-	return 1;
+ out:
+	free(sorted[0]);
+	free(sorted[1]);
+	return rc;
 }
 
 /*
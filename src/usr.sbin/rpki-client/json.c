@@ -27,6 +27,7 @@
 #include "json.h"
 
 #define JSON_MAX_STACK	16
+#define JSON_BUF_SIZE	(64 * 1024)
 
 enum json_type {
 	NONE,
@@ -45,8 +46,65 @@ static struct json_stack {
 static char indent[JSON_MAX_STACK + 1];
 static int level;
 static int eb;
+static int oneline;
 static FILE *jsonfh;
 
+/* output is collected here and written out in big chunks */
+static char jsonbuf[JSON_BUF_SIZE];
+static size_t jsonlen;
+
+static void
+do_flush(void)
+{
+	if (jsonlen > 0 && !eb)
+		eb = fwrite(jsonbuf, jsonlen, 1, jsonfh) != 1;
+	jsonlen = 0;
+}
+
+static void
+do_write(const char *s, size_t len)
+{
+	if (eb)
+		return;
+	if (len > sizeof(jsonbuf) - jsonlen) {
+		do_flush();
+		if (len > sizeof(jsonbuf)) {
+			if (!eb)
+				eb = fwrite(s, len, 1, jsonfh) != 1;
+			return;
+		}
+	}
+	memcpy(jsonbuf + jsonlen, s, len);
+	jsonlen += len;
+}
+
+static void
+do_puts(const char *s)
+{
+	do_write(s, strlen(s));
+}
+
+static void
+do_putc(char c)
+{
+	if (jsonlen == sizeof(jsonbuf))
+		do_flush();
+	if (!eb)
+		jsonbuf[jsonlen++] = c;
+}
+
+static void
+do_uint(unsigned long long v)
+{
+	char buf[24], *p = buf + sizeof(buf);
+
+	do {
+		*--p = '0' + v % 10;
+		v /= 10;
+	} while (v != 0);
+	do_write(p, buf + sizeof(buf) - p);
+}
+
 static void
 do_comma_indent(void)
 {
@@ -56,14 +114,14 @@ do_comma_indent(void)
 		sp = ' ';
 
 	if (stack[level].count++ > 0) {
-		if (!eb)
-			eb = fprintf(jsonfh, ",%c", sp) < 0;
+		do_putc(',');
+		do_putc(sp);
 	}
 
 	if (stack[level].compact)
 		return;
-	if (!eb)
-		eb = fprintf(jsonfh, "\t%.*s", level, indent) < 0;
+	do_putc('\t');
+	do_write(indent, level);
 }
 
 static void
@@ -71,8 +129,9 @@ do_name(const char *name)
 {
 	if (stack[level].type == ARRAY)
 		return;
-	if (!eb)
-		eb = fprintf(jsonfh, "\"%s\": ", name) < 0;
+	do_putc('"');
+	do_puts(name);
+	do_write("\": ", 3);
 }
 
 static int
@@ -89,17 +148,39 @@ do_find(enum json_type type, const char *name)
 	return -1;
 }
 
-void
-json_do_start(FILE *fh)
+static void
+do_start(FILE *fh, int compact)
 {
+	/* output of an unfinished previous document */
+	if (jsonfh != NULL)
+		do_flush();
+
 	memset(indent, '\t', JSON_MAX_STACK);
 	memset(stack, 0, sizeof(stack));
 	level = 0;
 	stack[level].type = START;
+	stack[level].compact = compact;
+	oneline = compact;
 	jsonfh = fh;
 	eb = 0;
 
-	eb = fprintf(jsonfh, "{\n") < 0;
+	do_write(compact ? "{ " : "{\n", 2);
+}
+
+void
+json_do_start(FILE *fh)
+{
+	do_start(fh, 0);
+}
+
+/*
+ * Same as json_do_start() but the whole document ends up on a single
+ * line, all objects are compact.
+ */
+void
+json_do_start_compact(FILE *fh)
+{
+	do_start(fh, 1);
 }
 
 int
@@ -107,8 +188,11 @@ json_do_finish(void)
 {
 	while (level > 0)
 		json_do_end();
-	if (!eb)
-		eb = fprintf(jsonfh, "\n}\n") < 0;
+	if (oneline)
+		do_write(" }\n", 3);
+	else
+		do_write("\n}\n", 3);
+	do_flush();
 
 	return -eb;
 }
@@ -133,8 +217,8 @@ json_do_array(const char *name)
 		sp = ' ';
 	do_comma_indent();
 	do_name(name);
-	if (!eb)
-		eb = fprintf(jsonfh, "[%c", sp) < 0;
+	do_putc('[');
+	do_putc(sp);
 
 	if (++level >= JSON_MAX_STACK)
 		errx(1, "json stack too deep");
@@ -158,12 +242,12 @@ json_do_object(const char *name, int compact)
 			json_do_end();
 	}
 
-	if (compact)
+	if (compact || oneline)
 		sp = ' ';
 	do_comma_indent();
 	do_name(name);
-	if (!eb)
-		eb = fprintf(jsonfh, "{%c", sp) < 0;
+	do_putc('{');
+	do_putc(sp);
 
 	if (++level >= JSON_MAX_STACK)
 		errx(1, "json stack too deep");
@@ -171,7 +255,7 @@ json_do_object(const char *name, int compact)
 	stack[level].name = name;
 	stack[level].type = OBJECT;
 	stack[level].count = 0;
-	stack[level].compact = compact;
+	stack[level].compact = compact || oneline;
 }
 
 void
@@ -187,12 +271,11 @@ json_do_end(void)
 		errx(1, "json bad stack state");
 
 	if (!stack[level].compact) {
-		if (!eb)
-			eb = fprintf(jsonfh, "\n%.*s%c", level, indent, c) < 0;
-	} else {
-		if (!eb)
-			eb = fprintf(jsonfh, " %c", c) < 0;
-	}
+		do_putc('\n');
+		do_write(indent, level);
+	} else
+		do_putc(' ');
+	do_putc(c);
 
 	stack[level].name = NULL;
 	stack[level].type = NONE;
@@ -224,62 +307,64 @@ json_do_printf(const char *name, const char *fmt, ...)
 void
 json_do_string(const char *name, const char *v)
 {
+	const char *run;
 	unsigned char c;
 
 	do_comma_indent();
 	do_name(name);
-	if (!eb)
-		eb = fprintf(jsonfh, "\"") < 0;
-	while ((c = *v++) != '\0' && !eb) {
+	do_putc('"');
+	for (run = v; (c = *v) != '\0'; v++) {
 		/* skip escaping '/' since our use case does not require it */
+		if (c != '"' && c != '\\' && !iscntrl(c))
+			continue;
+
+		/* copy the characters that need no escaping in one go */
+		do_write(run, v - run);
+		run = v + 1;
+		do_putc('\\');
 		switch (c) {
 		case '"':
-			eb = fprintf(jsonfh, "\\\"") < 0;
-			break;
 		case '\\':
-			eb = fprintf(jsonfh, "\\\\") < 0;
+			do_putc(c);
 			break;
 		case '\b':
-			eb = fprintf(jsonfh, "\\b") < 0;
+			do_putc('b');
 			break;
 		case '\f':
-			eb = fprintf(jsonfh, "\\f") < 0;
+			do_putc('f');
 			break;
 		case '\n':
-			eb = fprintf(jsonfh, "\\n") < 0;
+			do_putc('n');
 			break;
 		case '\r':
-			eb = fprintf(jsonfh, "\\r") < 0;
+			do_putc('r');
 			break;
 		case '\t':
-			eb = fprintf(jsonfh, "\\t") < 0;
+			do_putc('t');
 			break;
 		default:
-			if (iscntrl(c))
-				errx(1, "bad control character in string");
-			eb = putc(c, jsonfh) == EOF;
-			break;
+			errx(1, "bad control character in string");
 		}
 	}
-	if (!eb)
-		eb = fprintf(jsonfh, "\"") < 0;
+	do_write(run, v - run);
+	do_putc('"');
 }
 
 void
 json_do_hexdump(const char *name, void *buf, size_t len)
 {
+	static const char hex[] = "0123456789abcdef";
 	uint8_t *data = buf;
 	size_t i;
 
 	do_comma_indent();
 	do_name(name);
-	if (!eb)
-		eb = fprintf(jsonfh, "\"") < 0;
-	for (i = 0; i < len; i++)
-		if (!eb)
-			eb = fprintf(jsonfh, "%02x", *(data + i)) < 0;
-	if (!eb)
-		eb = fprintf(jsonfh, "\"") < 0;
+	do_putc('"');
+	for (i = 0; i < len; i++) {
+		do_putc(hex[data[i] >> 4]);
+		do_putc(hex[data[i] & 0xf]);
+	}
+	do_putc('"');
 }
 
 void
@@ -287,13 +372,10 @@ json_do_bool(const char *name, int v)
 {
 	do_comma_indent();
 	do_name(name);
-	if (v) {
-		if (!eb)
-			eb = fprintf(jsonfh, "true") < 0;
-	} else {
-		if (!eb)
-			eb = fprintf(jsonfh, "false") < 0;
-	}
+	if (v)
+		do_write("true", 4);
+	else
+		do_write("false", 5);
 }
 
 void
@@ -301,8 +383,7 @@ json_do_uint(const char *name, unsigned long long v)
 {
 	do_comma_indent();
 	do_name(name);
-	if (!eb)
-		eb = fprintf(jsonfh, "%llu", v) < 0;
+	do_uint(v);
 }
 
 void
@@ -310,15 +391,23 @@ json_do_int(const char *name, long long v)
 {
 	do_comma_indent();
 	do_name(name);
-	if (!eb)
-		eb = fprintf(jsonfh, "%lld", v) < 0;
+	if (v < 0) {
+		do_putc('-');
+		do_uint(-(unsigned long long)v);
+	} else
+		do_uint(v);
 }
 
 void
 json_do_double(const char *name, double v)
 {
+	char buf[512];
+	int n;
+
 	do_comma_indent();
 	do_name(name);
-	if (!eb)
-		eb = fprintf(jsonfh, "%f", v) < 0;
+	n = snprintf(buf, sizeof(buf), "%f", v);
+	if (n < 0 || (size_t)n >= sizeof(buf))
+		errx(1, "json double too large");
+	do_write(buf, n);
 }
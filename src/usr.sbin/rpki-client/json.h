@@ -20,6 +20,7 @@
 #include <stdio.h>
 
 void	json_do_start(FILE *);
+void	json_do_start_compact(FILE *);
 int	json_do_finish(void);
 void	json_do_array(const char *);
 void	json_do_object(const char *, int);
@@ -17,6 +17,7 @@
  */
 
 #include <sys/types.h>
+#include <sys/file.h>
 #include <sys/queue.h>
 #include <sys/resource.h>
 #include <sys/socket.h>
@@ -55,24 +56,159 @@ struct repotalstats talstats[TALSZ_MAX];
 int		 talsz;
 
 size_t	entity_queue;
+size_t	entity_processed;
+size_t	talqueue[TALSZ_MAX];	/* outstanding entities per TAL */
 int	timeout = 60*60;
-volatile sig_atomic_t killme;
+volatile sig_atomic_t killme, infome;
 void	suicide(int sig);
+void	siginfo(int sig);
 
-static struct filepath_tree	fpt = RB_INITIALIZER(&fpt);
-static struct msgbuf		procq, rsyncq, httpq, rrdpq;
+static struct filepath_tree	*fpt;
+static struct msgbuf		rsyncq, httpq;
 static int			cachefd, outdirfd;
+static int			taloutput, taldone[TALSZ_MAX];
+static int			earlyoutput;
+
+struct parser {
+	struct msgbuf	 msgq;
+	struct ibuf	*buf;
+	struct ibuf	*batch;		/* entities not yet enqueued */
+	size_t		 batchcnt;
+	size_t		 load;		/* number of entities in flight */
+	pid_t		 pid;
+};
+
+static struct parser		parsers[MAX_PARSERS];
+static int			nparsers = 1;
+static int			parsernice;
+
+/*
+ * Entities waiting for room in the parsers. Leaf objects of loaded
+ * manifests go first so that the work below a CA finishes, and its
+ * memory is released, before more CAs are descended into. CAs are
+ * taken newest first which walks the tree depth-first.
+ * Each TAL has queues of its own which are served in turn, so a large
+ * or slow hierarchy does not hold up the others.
+ * With -K the leaf objects beyond the memory limit are appended to a spill
+ * file of the TAL and read back in order once its leafq runs empty.
+ */
+struct talq {
+	struct entityq		 leafq;
+	struct entityq		 caq;
+	FILE			*spillw;
+	FILE			*spillr;
+	size_t			 spilled;	/* entities in the spill file */
+};
+static struct talq		talqs[TALSZ_MAX];
+static int			talq_next;
+static size_t			leafq_mem;	/* bytes held by the leafqs */
+static size_t			leafq_max;	/* limit, 0 if none */
+
+/*
+ * RRDP syncs are spread over several rrdp processes so that the XML of
+ * independent repositories is parsed in parallel. All messages of a
+ * sync go to the same process, picked by its id.
+ */
+struct rrdpproc {
+	struct msgbuf	 msgq;
+	struct ibuf	*buf;
+	pid_t		 pid;
+};
+
+static struct rrdpproc		rrdps[MAX_RRDP_PROCS];
+static int			nrrdps = 1;
+
+/*
+ * A repository can have several http requests in flight, each is sent
+ * to the http process with its own id and mapped back to the slot of
+ * the rrdp session.
+ */
+struct rrdp_httpreq {
+	LIST_ENTRY(rrdp_httpreq)	 entry;
+	unsigned int			 reqid;
+	unsigned int			 id;
+	unsigned int			 slot;
+};
+
+static LIST_HEAD(, rrdp_httpreq) rrdpreqs =
+    LIST_HEAD_INITIALIZER(rrdpreqs);
+
+/*
+ * The results of the leaf objects (ROA, ASPA, SPL, GBR and TAK) of a
+ * manifest are kept in the manifest cache. If a later run validates the
+ * same manifest under the same issuers and CRLs these results are replayed
+ * and only the child certificates are passed on to the parsers.
+ */
+struct mftsubtree {
+	RB_ENTRY(mftsubtree)	 entry;
+	struct cache_rec	 rec;
+	unsigned char		*data;		/* results from the last run */
+	struct ibuf		*body;		/* results of this run */
+	size_t			 pending;	/* results outstanding */
+	int			 failed;
+};
+
+struct mftchild {
+	RB_ENTRY(mftchild)	 entry;
+	char			*file;		/* path used by the parser */
+	char			*name;		/* file name on the manifest */
+	struct mftsubtree	*st;
+};
+
+static RB_HEAD(mftsubtree_tree, mftsubtree) mftcache =
+    RB_INITIALIZER(&mftcache);
+static RB_HEAD(mftchild_tree, mftchild) mftchildren =
+    RB_INITIALIZER(&mftchildren);
+static TAILQ_HEAD(, ibuf) replayq = TAILQ_HEAD_INITIALIZER(replayq);
+
+static inline int
+mftsubtreecmp(struct mftsubtree *a, struct mftsubtree *b)
+{
+	int rv;
+
+	if ((rv = memcmp(a->rec.hash, b->rec.hash, sizeof(a->rec.hash))) != 0)
+		return rv;
+	return memcmp(a->rec.chain, b->rec.chain, sizeof(a->rec.chain));
+}
+
+RB_GENERATE_STATIC(mftsubtree_tree, mftsubtree, entry, mftsubtreecmp);
+
+static inline int
+mftchildcmp(struct mftchild *a, struct mftchild *b)
+{
+	return strcmp(a->file, b->file);
+}
+
+RB_GENERATE_STATIC(mftchild_tree, mftchild, entry, mftchildcmp);
 
 const char	*bird_tablename = "ROAS";
 
 int	verbose;
+
+const char	*proc_names[PROC__MAX] = {
+	[PROC_MAIN] = "main",
+	[PROC_PARSER] = "parser",
+	[PROC_RSYNC] = "rsync",
+	[PROC_HTTP] = "http",
+	[PROC_RRDP] = "rrdp",
+};
+
 int	noop;
+int	fetchonly;
 int	excludeaspa;
+int	skipinfo;
 int	filemode;
+int	jsonlines;
 int	shortlistmode;
 int	rrdpon = 1;
+int	rrdphedge;
 int	repo_timeout;
+int	ta_delay = TA_DELAY;
 int	experimental;
+int	rrdpscan;
+int	rsyncrest;
+int	rrdpwrite;
+int	repometrics;
 time_t	deadline;
 
 /* 9999-12-31 23:59:59 UTC */
@@ -85,13 +221,30 @@ int64_t  evaluation_time = X509_TIME_MIN;
 struct stats	 stats;
 
 struct fqdnlistentry {
-	LIST_ENTRY(fqdnlistentry)	 entry;
-	char				*fqdn;
+	RB_ENTRY(fqdnlistentry)	 entry;
+	char			*fqdn;
+	size_t			 len;
 };
-LIST_HEAD(fqdns, fqdnlistentry);
+RB_HEAD(fqdns, fqdnlistentry);
+
+static struct fqdns shortlist = RB_INITIALIZER(&shortlist);
+static struct fqdns skiplist = RB_INITIALIZER(&skiplist);
+
+/* Hostnames are compared case insensitive and without a terminator. */
+static inline int
+fqdncmp(struct fqdnlistentry *a, struct fqdnlistentry *b)
+{
+	int rv;
+
+	rv = strncasecmp(a->fqdn, b->fqdn, a->len < b->len ? a->len : b->len);
+	if (rv != 0)
+		return rv;
+	if (a->len < b->len)
+		return -1;
+	return a->len > b->len;
+}
 
-struct fqdns shortlist = LIST_HEAD_INITIALIZER(fqdns);
-struct fqdns skiplist = LIST_HEAD_INITIALIZER(fqdns);
+RB_GENERATE_STATIC(fqdns, fqdnlistentry, entry, fqdncmp);
 
 /*
  * Log a message to stderr if and only if "verbose" is non-zero.
@@ -119,6 +272,49 @@ getmonotime(void)
 	return (ts.tv_sec);
 }
 
+/*
+ * Format the duration ts and the rate of the bytes handled in it into
+ * buf as "S.mmm seconds (R KB/s)". Returns buf.
+ */
+const char *
+fmt_rate(char *buf, size_t bufsz, long long bytes, const struct timespec *ts)
+{
+	long long	 ms;
+
+	ms = ts->tv_sec * 1000LL + ts->tv_nsec / 1000000;
+	snprintf(buf, bufsz, "%lld.%03lld seconds (%lld KB/s)", ms / 1000,
+	    ms % 1000, bytes / (ms > 0 ? ms : 1));
+	return buf;
+}
+
+const double time_hist_bounds[TIME_HIST_BUCKETS] = {
+	0.0001, 0.001, 0.01, 0.05, 0.1, 0.5, 1, 5, 10, 60
+};
+
+void
+time_hist_add(struct time_hist *th, double secs)
+{
+	size_t	b;
+
+	for (b = 0; b < TIME_HIST_BUCKETS; b++)
+		if (secs <= time_hist_bounds[b])
+			break;
+	th->counts[b]++;
+	th->count++;
+	th->sum += secs;
+}
+
+void
+time_hist_merge(struct time_hist *to, const struct time_hist *from)
+{
+	size_t	b;
+
+	for (b = 0; b <= TIME_HIST_BUCKETS; b++)
+		to->counts[b] += from->counts[b];
+	to->count += from->count;
+	to->sum += from->sum;
+}
+
 /*
  * Time - Evaluation time is used as the current time if it is
  * larger than X509_TIME_MIN, otherwise the system time is used.
@@ -163,11 +359,57 @@ entity_read_req(struct ibuf *b, struct entity *ent)
 }
 
 /*
- * Write the queue entity.
- * Matched by entity_read_req().
+ * Pick the parser process with the least amount of work queued.
+ * All parsers share the same view of CA certificates and CRLs so any
+ * entity can be handed to any of them.
+ */
+static struct parser *
+parser_next(void)
+{
+	struct parser	*p;
+	int		 i;
+
+	p = &parsers[0];
+	for (i = 1; i < nparsers; i++)
+		if (parsers[i].load < p->load)
+			p = &parsers[i];
+	return p;
+}
+
+/*
+ * Enqueue the pending batch of entities of a parser.
  */
 static void
-entity_write_req(const struct entity *ent)
+parser_flush(struct parser *p)
+{
+	if (p->batch == NULL)
+		return;
+	io_close_buffer(&p->msgq, p->batch);
+	p->batch = NULL;
+	p->batchcnt = 0;
+}
+
+/*
+ * Add a message to the batch of a parser. Full batches are enqueued
+ * right away, the rest is flushed before the next poll.
+ */
+static void
+parser_write(struct parser *p, struct ibuf *b)
+{
+	if (p->batch == NULL)
+		p->batch = io_new_batch();
+	io_batch_add(p->batch, b);
+	if (++p->batchcnt >= MAX_BATCH_ENTITIES ||
+	    ibuf_size(p->batch) >= MAX_BATCH_SIZE)
+		parser_flush(p);
+}
+
+/*
+ * Serialise a queue entity into a new buffer.
+ * Matched by entity_read_req().
+ */
+static struct ibuf *
+entity_buffer(const struct entity *ent)
 {
 	struct ibuf *b;
 
@@ -180,7 +422,22 @@ entity_write_req(const struct entity *ent)
 	io_str_buffer(b, ent->file);
 	io_str_buffer(b, ent->mftaki);
 	io_buf_buffer(b, ent->data, ent->datasz);
-	io_close_buffer(&procq, b);
+	return b;
+}
+
+/*
+ * Write the queue entity.
+ */
+static void
+entity_write_req(const struct entity *ent)
+{
+	struct parser *p;
+
+	p = parser_next();
+	p->load++;
+	TRACE(TRACE_DISPATCH, 'i', ent->file);
+
+	parser_write(p, entity_buffer(ent));
 }
 
 static void
@@ -191,25 +448,205 @@ entity_write_repo(const struct repo *rp)
 	enum location loc = DIR_UNKNOWN;
 	unsigned int repoid;
 	char *path, *altpath;
-	int talid = 0;
+	int i, talid = 0;
 
 	repoid = repo_id(rp);
-	path = repo_basedir(rp, 0);
+	/* without a temp dir the parser only looks in the valid one */
+	path = repo_temp_used(rp) ? repo_basedir(rp, 0) : NULL;
 	altpath = repo_basedir(rp, 1);
-	b = io_new_buffer();
-	io_simple_buffer(b, &type, sizeof(type));
-	io_simple_buffer(b, &loc, sizeof(loc));
-	io_simple_buffer(b, &repoid, sizeof(repoid));
-	io_simple_buffer(b, &talid, sizeof(talid));
-	io_str_buffer(b, path);
-	io_str_buffer(b, altpath);
-	io_buf_buffer(b, NULL, 0); /* ent->mftaki */
-	io_buf_buffer(b, NULL, 0); /* ent->data */
-	io_close_buffer(&procq, b);
+	for (i = 0; i < nparsers; i++) {
+		b = io_new_buffer();
+		io_simple_buffer(b, &type, sizeof(type));
+		io_simple_buffer(b, &loc, sizeof(loc));
+		io_simple_buffer(b, &repoid, sizeof(repoid));
+		io_simple_buffer(b, &talid, sizeof(talid));
+		io_str_buffer(b, path);
+		io_str_buffer(b, altpath);
+		io_buf_buffer(b, NULL, 0); /* ent->mftaki */
+		io_buf_buffer(b, NULL, 0); /* ent->data */
+		parser_write(&parsers[i], b);
+	}
 	free(path);
 	free(altpath);
 }
 
+/*
+ * Pass a validated CA certificate or CRL to all parsers but the one
+ * that produced it. Since the object is queued before any of its children
+ * every parser knows about the issuer and CRL once the children arrive.
+ */
+static void
+entity_write_replica(enum rtype type, const char *file, unsigned int repoid,
+    int talid, int from)
+{
+	struct ibuf *b;
+	enum location loc = DIR_UNKNOWN;
+	int i;
+
+	for (i = 0; i < nparsers; i++) {
+		if (i == from)
+			continue;
+		b = io_new_buffer();
+		io_simple_buffer(b, &type, sizeof(type));
+		io_simple_buffer(b, &loc, sizeof(loc));
+		io_simple_buffer(b, &repoid, sizeof(repoid));
+		io_simple_buffer(b, &talid, sizeof(talid));
+		io_str_buffer(b, NULL);	/* ent->path */
+		io_str_buffer(b, file);
+		io_buf_buffer(b, NULL, 0); /* ent->mftaki */
+		io_buf_buffer(b, NULL, 0); /* ent->data */
+		parser_write(&parsers[i], b);
+	}
+}
+
+static size_t
+entity_mem(const struct entity *p)
+{
+	size_t	 sz = sizeof(*p) + p->datasz;
+
+	if (p->path != NULL)
+		sz += strlen(p->path) + 1;
+	if (p->file != NULL)
+		sz += strlen(p->file) + 1;
+	if (p->mftaki != NULL)
+		sz += strlen(p->mftaki) + 1;
+	return sz;
+}
+
+/*
+ * Append a leaf entity to the spill file of its TAL, in the format of
+ * entity_buffer(). The file is unlinked right after it is created.
+ */
+static void
+entity_spill(struct talq *tq, struct entity *p)
+{
+	struct ibuf	*b;
+	char		 name[32];
+	size_t		 len;
+	int		 fd, rfd;
+
+	if (tq->spillw == NULL) {
+		snprintf(name, sizeof(name), ".spill.%d", (int)(tq - talqs));
+		fd = openat(cachefd, name, O_RDWR | O_CREAT | O_TRUNC |
+		    O_CLOEXEC, 0600);
+		if (fd == -1)
+			err(1, "spill file %s", name);
+		if ((rfd = openat(cachefd, name, O_RDONLY | O_CLOEXEC)) == -1)
+			err(1, "spill file %s", name);
+		unlinkat(cachefd, name, 0);
+		if ((tq->spillw = fdopen(fd, "w")) == NULL ||
+		    (tq->spillr = fdopen(rfd, "r")) == NULL)
+			err(1, "fdopen");
+	}
+
+	b = entity_buffer(p);
+	len = ibuf_size(b) - sizeof(len);
+	ibuf_set(b, 0, &len, sizeof(len));
+	if (fwrite(ibuf_data(b), ibuf_size(b), 1, tq->spillw) != 1)
+		err(1, "spill file write");
+	ibuf_free(b);
+	tq->spilled++;
+}
+
+/*
+ * Move spilled entities back into the empty leafq of the TAL, as many
+ * as fit into a parser. Once all are read the file starts over.
+ */
+static void
+entity_unspill(struct talq *tq)
+{
+	struct entity	*p;
+	struct ibuf	 b;
+	void		*data;
+	size_t		 len, n;
+
+	if (fflush(tq->spillw) != 0)
+		err(1, "spill file write");
+	clearerr(tq->spillr);
+	for (n = 0; n < MAX_PARSER_LOAD && tq->spilled > 0; n++) {
+		if (fread(&len, sizeof(len), 1, tq->spillr) != 1)
+			errx(1, "spill file short read");
+		if ((data = malloc(len)) == NULL)
+			err(1, NULL);
+		if (len > 0 && fread(data, len, 1, tq->spillr) != 1)
+			errx(1, "spill file short read");
+		ibuf_from_buffer(&b, data, len);
+		if ((p = calloc(1, sizeof(struct entity))) == NULL)
+			err(1, NULL);
+		entity_read_req(&b, p);
+		free(data);
+		tq->spilled--;
+		leafq_mem += entity_mem(p);
+		TAILQ_INSERT_TAIL(&tq->leafq, p, entries);
+	}
+
+	if (tq->spilled == 0) {
+		if (ftruncate(fileno(tq->spillw), 0) == -1)
+			err(1, "spill file truncate");
+		rewind(tq->spillw);
+		rewind(tq->spillr);
+	}
+}
+
+/*
+ * Send waiting entities to the parsers as long as they have room.
+ */
+static void
+entity_dispatch(void)
+{
+	struct entity	*p;
+	struct talq	*tq;
+	int		 i;
+
+	while (parser_next()->load < MAX_PARSER_LOAD) {
+		for (i = 0, p = NULL; i < talsz && p == NULL; i++) {
+			tq = &talqs[(talq_next + i) % talsz];
+			if (TAILQ_EMPTY(&tq->leafq) && tq->spilled > 0)
+				entity_unspill(tq);
+			if ((p = TAILQ_FIRST(&tq->leafq)) != NULL) {
+				TAILQ_REMOVE(&tq->leafq, p, entries);
+				leafq_mem -= entity_mem(p);
+			} else if ((p = TAILQ_FIRST(&tq->caq)) != NULL)
+				TAILQ_REMOVE(&tq->caq, p, entries);
+		}
+		if (p == NULL)
+			break;
+		talq_next = (talq_next + i) % talsz;
+		entity_write_req(p);
+		entity_free(p);
+	}
+}
+
+/*
+ * Hand an entity to the parsers, it is freed once written.
+ */
+static void
+entity_schedule(struct entity *p)
+{
+	struct talq	*tq;
+
+	tq = &talqs[p->talid >= 0 && p->talid < talsz ? p->talid : 0];
+	switch (p->type) {
+	case RTYPE_TAL:
+	case RTYPE_CER:
+	case RTYPE_MFT:
+		TAILQ_INSERT_HEAD(&tq->caq, p, entries);
+		break;
+	default:
+		/* keep the order, once spilling the rest follows */
+		if (leafq_max != 0 &&
+		    (tq->spilled > 0 || leafq_mem >= leafq_max)) {
+			entity_spill(tq, p);
+			entity_free(p);
+			break;
+		}
+		leafq_mem += entity_mem(p);
+		TAILQ_INSERT_TAIL(&tq->leafq, p, entries);
+		break;
+	}
+	entity_dispatch();
+}
+
 /*
  * Scan through all queued requests and see which ones are in the given
  * repo, then flush those into the parser process.
@@ -222,12 +659,31 @@ entityq_flush(struct entityq *q, struct repo *rp)
 	entity_write_repo(rp);
 
 	TAILQ_FOREACH_SAFE(p, q, entries, np) {
-		entity_write_req(p);
 		TAILQ_REMOVE(q, p, entries);
-		entity_free(p);
+		entity_schedule(p);
 	}
 }
 
+/*
+ * Account for an entity of TAL talid until entity_done() is called.
+ */
+static void
+entity_add(int talid)
+{
+	entity_queue++;
+	if (talid >= 0 && talid < talsz)
+		talqueue[talid]++;
+}
+
+static void
+entity_done(int talid)
+{
+	entity_queue--;
+	entity_processed++;
+	if (talid >= 0 && talid < talsz && talqueue[talid] > 0)
+		talqueue[talid]--;
+}
+
 /*
  * Add the heap-allocated file to the queue for processing.
  */
@@ -252,17 +708,22 @@ entityq_add(char *path, char *file, enum rtype type, enum location loc,
 	p->data = data;
 	p->datasz = (data != NULL) ? datasz : 0;
 
-	entity_queue++;
+	entity_add(talid);
+	TRACE(TRACE_QUEUE, 'i', file);
 
 	/*
 	 * Write to the queue if there's no repo or the repo has already
 	 * been loaded else enqueue it for later.
 	 */
 
-	if (rp == NULL || !repo_queued(rp, p)) {
-		entity_write_req(p);
-		entity_free(p);
-	}
+	if (rp == NULL || !repo_queued(rp, p))
+		entity_schedule(p);
+}
+
+static struct msgbuf *
+rrdp_queue(unsigned int id)
+{
+	return &rrdps[id % nrrdps].msgq;
 }
 
 static void
@@ -275,12 +736,16 @@ rrdp_file_resp(unsigned int id, int ok)
 	io_simple_buffer(b, &type, sizeof(type));
 	io_simple_buffer(b, &id, sizeof(id));
 	io_simple_buffer(b, &ok, sizeof(ok));
-	io_close_buffer(&rrdpq, b);
+	io_close_buffer(rrdp_queue(id), b);
 }
 
+/*
+ * Start a RRDP sync. If dirfd is not -1 it is passed to the rrdp process
+ * which then writes the files of the sync to the temp repo on its own.
+ */
 void
 rrdp_fetch(unsigned int id, const char *uri, const char *local,
-    struct rrdp_session *s)
+    struct rrdp_session *s, int dirfd)
 {
 	enum rrdp_msg type = RRDP_START;
 	struct ibuf *b;
@@ -292,7 +757,9 @@ rrdp_fetch(unsigned int id, const char *uri, const char *local,
 	io_str_buffer(b, uri);
 
 	rrdp_session_buffer(b, s);
-	io_close_buffer(&rrdpq, b);
+	if (dirfd != -1)
+		ibuf_fd_set(b, dirfd);
+	io_close_buffer(rrdp_queue(id), b);
 }
 
 void
@@ -304,7 +771,7 @@ rrdp_abort(unsigned int id)
 	b = io_new_buffer();
 	io_simple_buffer(b, &type, sizeof(type));
 	io_simple_buffer(b, &id, sizeof(id));
-	io_close_buffer(&rrdpq, b);
+	io_close_buffer(rrdp_queue(id), b);
 }
 
 /*
@@ -312,12 +779,13 @@ rrdp_abort(unsigned int id)
  */
 void
 rsync_fetch(unsigned int id, const char *uri, const char *local,
-    const char *base)
+    const char *base, unsigned int prio)
 {
 	struct ibuf	*b;
 
 	b = io_new_buffer();
 	io_simple_buffer(b, &id, sizeof(id));
+	io_simple_buffer(b, &prio, sizeof(prio));
 	io_str_buffer(b, local);
 	io_str_buffer(b, base);
 	io_str_buffer(b, uri);
@@ -328,88 +796,403 @@ void
 rsync_abort(unsigned int id)
 {
 	struct ibuf	*b;
+	unsigned int	 prio = 0;
 
 	b = io_new_buffer();
 	io_simple_buffer(b, &id, sizeof(id));
+	io_simple_buffer(b, &prio, sizeof(prio));
 	io_str_buffer(b, NULL);
 	io_str_buffer(b, NULL);
 	io_str_buffer(b, NULL);
 	io_close_buffer(&rsyncq, b);
 }
 
+/*
+ * Abort the http request id, like rsync_abort() a request without URI.
+ * The http process sends no answer for a dropped request.
+ */
+void
+http_abort(unsigned int id)
+{
+	struct ibuf	*b;
+	unsigned int	 prio = 0;
+	long long	 offset = 0;
+
+	b = io_new_buffer();
+	io_simple_buffer(b, &id, sizeof(id));
+	io_simple_buffer(b, &prio, sizeof(prio));
+	io_simple_buffer(b, &offset, sizeof(offset));
+	io_str_buffer(b, NULL);
+	io_str_buffer(b, NULL);
+	io_str_buffer(b, NULL);
+	io_close_buffer(&httpq, b);
+}
+
 /*
  * Request a file from a https uri, data is written to the file descriptor fd.
+ * If offset is not 0 only the data from there on is requested.
+ * Queued requests with a higher prio are started first.
  */
 void
-http_fetch(unsigned int id, const char *uri, const char *last_mod, int fd)
+http_fetch(unsigned int id, const char *uri, const char *last_mod,
+    const char *etag, long long offset, unsigned int prio, int fd)
 {
 	struct ibuf	*b;
 
 	b = io_new_buffer();
 	io_simple_buffer(b, &id, sizeof(id));
-	io_str_buffer(b, uri);
+	io_simple_buffer(b, &prio, sizeof(prio));
+	io_simple_buffer(b, &offset, sizeof(offset));
+	io_str_buffer(b, repo_redirect(id, uri));
 	io_str_buffer(b, last_mod);
+	io_str_buffer(b, etag);
 	/* pass file as fd */
 	ibuf_fd_set(b, fd);
 	io_close_buffer(&httpq, b);
 }
 
+/*
+ * Ask the http process to connect to the host of uri before the first
+ * request for it shows up. The request carries no file descriptor.
+ */
+void
+http_prewarm(const char *uri)
+{
+	struct ibuf	*b;
+	unsigned int	 id = 0, prio = 0;
+	long long	 offset = 0;
+
+	b = io_new_buffer();
+	io_simple_buffer(b, &id, sizeof(id));
+	io_simple_buffer(b, &prio, sizeof(prio));
+	io_simple_buffer(b, &offset, sizeof(offset));
+	io_str_buffer(b, uri);
+	io_str_buffer(b, NULL);
+	io_str_buffer(b, NULL);
+	io_close_buffer(&httpq, b);
+}
+
 /*
  * Request some XML file on behalf of the rrdp parser.
  * Create a pipe and pass the pipe endpoints to the http and rrdp process.
  */
 static void
-rrdp_http_fetch(unsigned int id, const char *uri, const char *last_mod)
+rrdp_http_fetch(unsigned int id, unsigned int slot, const char *uri,
+    const char *last_mod, const char *etag, long long offset)
 {
 	enum rrdp_msg type = RRDP_HTTP_INI;
+	struct rrdp_httpreq *req;
 	struct ibuf *b;
 	int pi[2];
 
 	if (pipe2(pi, O_CLOEXEC | O_NONBLOCK) == -1)
 		err(1, "pipe");
 
+	if ((req = calloc(1, sizeof(*req))) == NULL)
+		err(1, NULL);
+	req->reqid = repo_newid();
+	req->id = id;
+	req->slot = slot;
+	LIST_INSERT_HEAD(&rrdpreqs, req, entry);
+
+	if (repometrics) {
+		struct repostats rs = { .http_reqs = 1 };
+
+		rrdp_stats_add(id, &rs);
+	}
+
 	b = io_new_buffer();
 	io_simple_buffer(b, &type, sizeof(type));
 	io_simple_buffer(b, &id, sizeof(id));
+	io_simple_buffer(b, &slot, sizeof(slot));
 	ibuf_fd_set(b, pi[0]);
-	io_close_buffer(&rrdpq, b);
+	io_close_buffer(rrdp_queue(id), b);
 
-	http_fetch(id, uri, last_mod, pi[1]);
+	http_fetch(req->reqid, uri, last_mod, etag, offset,
+	    repo_fetch_prio(id), pi[1]);
 }
 
 void
-rrdp_http_done(unsigned int id, enum http_result res, const char *last_mod)
+rrdp_http_done(unsigned int reqid, enum http_result res, const char *last_mod,
+    const char *etag)
 {
 	enum rrdp_msg type = RRDP_HTTP_FIN;
+	struct rrdp_httpreq *req;
 	struct ibuf *b;
 
+	LIST_FOREACH(req, &rrdpreqs, entry)
+		if (req->reqid == reqid)
+			break;
+	if (req == NULL)
+		errx(1, "http request %u does not exist", reqid);
+	LIST_REMOVE(req, entry);
+
 	/* RRDP request, relay response over to the rrdp process */
 	b = io_new_buffer();
 	io_simple_buffer(b, &type, sizeof(type));
-	io_simple_buffer(b, &id, sizeof(id));
+	io_simple_buffer(b, &req->id, sizeof(req->id));
+	io_simple_buffer(b, &req->slot, sizeof(req->slot));
 	io_simple_buffer(b, &res, sizeof(res));
 	io_str_buffer(b, last_mod);
-	io_close_buffer(&rrdpq, b);
+	io_str_buffer(b, etag);
+	io_close_buffer(rrdp_queue(req->id), b);
+	free(req);
+}
+
+static void
+mftcache_insert(struct cache_rec *rec, unsigned char *data)
+{
+	struct mftsubtree *st;
+
+	if ((st = calloc(1, sizeof(*st))) == NULL)
+		err(1, NULL);
+	st->rec = *rec;
+	st->data = data;
+	if (RB_INSERT(mftsubtree_tree, &mftcache, st) != NULL) {
+		free(st->data);
+		free(st);
+	}
+}
+
+/*
+ * Build the path of a file on the manifest the same way the parser does.
+ */
+static char *
+mft_file_path(const struct mft *mft, const struct mftfile *f)
+{
+	struct repo	*rp;
+	char		*base, *fn;
+
+	rp = repo_byid(mft->repoid);
+	if ((base = repo_basedir(rp, f->location == DIR_VALID)) == NULL)
+		return NULL;
+
+	if (mft->path == NULL) {
+		if (asprintf(&fn, "%s/%s", base, f->file) == -1)
+			err(1, NULL);
+	} else {
+		if (asprintf(&fn, "%s/%s/%s", base, mft->path, f->file) == -1)
+			err(1, NULL);
+	}
+	free(base);
+	return fn;
+}
+
+/*
+ * Queue the cached results of the leaf objects of mft for processing.
+ * Returns 0 if the cached results can't be used.
+ */
+static int
+mftcache_replay(const struct mft *mft, struct mftsubtree *st)
+{
+	struct ibuf		 body, *b;
+	const struct mftfile	*f;
+	enum rtype		 type;
+	time_t			 mtime;
+	size_t			 i, restsz;
+	void			*rest;
+	char			*name, *file;
+	int			 talid, ok;
+
+	/*
+	 * First make sure all results still belong to the manifest and
+	 * that the files still match their hash on the manifest. Files
+	 * whose stamp did not change since they were hashed are not read.
+	 */
+	ibuf_from_buffer(&body, st->data, st->rec.len);
+	while (ibuf_size(&body) > 0) {
+		io_read_str(&body, &name);
+		io_read_buf(&body, &type, sizeof(type));
+		io_read_buf(&body, &talid, sizeof(talid));
+		io_read_buf(&body, &mtime, sizeof(mtime));
+		io_read_buf_alloc(&body, &rest, &restsz);
+		for (i = 0; i < mft->filesz; i++)
+			if (name != NULL &&
+			    strcmp(mft->files[i].file, name) == 0)
+				break;
+		free(name);
+		free(rest);
+		if (i == mft->filesz || mft->files[i].type != type)
+			return 0;
+
+		f = &mft->files[i];
+		if ((file = mft_file_path(mft, f)) == NULL)
+			return 0;
+		ok = valid_filehash(open(file, O_RDONLY | O_CLOEXEC),
+		    f->hash, sizeof(f->hash));
+		free(file);
+		if (!ok)
+			return 0;
+	}
+
+	ibuf_from_buffer(&body, st->data, st->rec.len);
+	while (ibuf_size(&body) > 0) {
+		io_read_str(&body, &name);
+		io_read_buf(&body, &type, sizeof(type));
+		io_read_buf(&body, &talid, sizeof(talid));
+		io_read_buf(&body, &mtime, sizeof(mtime));
+		io_read_buf_alloc(&body, &rest, &restsz);
+		/* the objects belong to the TAL of their manifest */
+		talid = mft->talid;
+
+		for (i = 0; i < mft->filesz; i++)
+			if (strcmp(mft->files[i].file, name) == 0)
+				break;
+		f = &mft->files[i];
+		if ((file = mft_file_path(mft, f)) == NULL)
+			errx(1, "%s: no path to file", name);
+
+		/* keep the verified signature in the cache, see cms.c */
+		if (mtime != 0 && type != RTYPE_CER && type != RTYPE_CRL)
+			sigcache_add(f->hash, sizeof(f->hash));
+
+		/* fake a parser response */
+		if ((b = ibuf_dynamic(64, INT32_MAX)) == NULL)
+			err(1, NULL);
+		io_simple_buffer(b, &type, sizeof(type));
+		io_simple_buffer(b, &mft->repoid, sizeof(mft->repoid));
+		io_simple_buffer(b, &talid, sizeof(talid));
+		io_str_buffer(b, file);
+		io_simple_buffer(b, &mtime, sizeof(mtime));
+		io_simple_buffer(b, rest, restsz);
+		TAILQ_INSERT_TAIL(&replayq, b, entry);
+		entity_add(talid);
+
+		free(name);
+		free(file);
+		free(rest);
+	}
+
+	/* carry the results over into the new cache */
+	mftcache_add(&st->rec, st->data);
+	return 1;
+}
+
+/*
+ * Remember that the result of file belongs to the subtree st.
+ */
+static void
+mftcache_expect(struct mftsubtree *st, const struct mft *mft,
+    const struct mftfile *f)
+{
+	struct mftchild	*mc;
+
+	if ((mc = calloc(1, sizeof(*mc))) == NULL)
+		err(1, NULL);
+	if ((mc->file = mft_file_path(mft, f)) == NULL ||
+	    (mc->name = strdup(f->file)) == NULL ||
+	    RB_INSERT(mftchild_tree, &mftchildren, mc) != NULL) {
+		st->failed = 1;
+		free(mc->file);
+		free(mc->name);
+		free(mc);
+		return;
+	}
+	mc->st = st;
+	st->pending++;
+}
+
+static void
+mftcache_finish(struct mftsubtree *st)
+{
+	if (!st->failed && ibuf_size(st->body) > 0) {
+		st->rec.len = ibuf_size(st->body);
+		mftcache_add(&st->rec, ibuf_data(st->body));
+	}
+	ibuf_free(st->body);
+	free(st);
+}
+
+/*
+ * Add the result of a leaf object to the subtree of its manifest.
+ * The result consists of rest, everything after the common header.
+ * An expires value of 0 means the result carries no expiry time.
+ */
+static void
+mftcache_collect(const char *file, enum rtype type, int talid, time_t mtime,
+    const void *rest, size_t restsz, time_t expires, int ok)
+{
+	struct mftchild		*mc, needle;
+	struct mftsubtree	*st;
+
+	needle.file = (char *)file;
+	if ((mc = RB_FIND(mftchild_tree, &mftchildren, &needle)) == NULL)
+		return;
+	RB_REMOVE(mftchild_tree, &mftchildren, mc);
+	st = mc->st;
+
+	if (!ok)
+		st->failed = 1;
+	else {
+		if (expires != 0 && expires < st->rec.expires)
+			st->rec.expires = expires;
+		io_str_buffer(st->body, mc->name);
+		io_simple_buffer(st->body, &type, sizeof(type));
+		io_simple_buffer(st->body, &talid, sizeof(talid));
+		io_simple_buffer(st->body, &mtime, sizeof(mtime));
+		io_buf_buffer(st->body, rest, restsz);
+	}
+
+	free(mc->file);
+	free(mc->name);
+	free(mc);
+
+	if (--st->pending == 0)
+		mftcache_finish(st);
 }
 
 /*
  * Add a file (CER, ROA, CRL) from an MFT file, RFC 6486.
  * These are always relative to the directory in which "mft" sits.
+ * If the results of the leaf objects are cached only the certificates
+ * are queued, otherwise the results are collected for the next run.
  */
 static void
-queue_add_from_mft(const struct mft *mft)
+queue_add_from_mft(const struct mft *mft, const struct cache_rec *rec)
 {
 	size_t			 i;
 	struct repo		*rp;
+	struct mftsubtree	*st = NULL, needle;
 	const struct mftfile	*f;
 	char			*mftaki, *nfile, *npath = NULL;
+	time_t			 now;
+	int			 replayed = 0;
+
+	if (rec->type == RTYPE_MFT) {
+		now = get_current_time();
+		memcpy(&needle.rec, rec, sizeof(*rec));
+		st = RB_FIND(mftsubtree_tree, &mftcache, &needle);
+		if (st != NULL && now >= st->rec.vtime &&
+		    now < st->rec.expires)
+			replayed = mftcache_replay(mft, st);
+		if (!replayed) {
+			if ((st = calloc(1, sizeof(*st))) == NULL)
+				err(1, NULL);
+			st->rec = *rec;
+			if ((st->body = ibuf_dynamic(64, INT32_MAX)) == NULL)
+				err(1, NULL);
+		}
+	}
 
+	/*
+	 * Queue the child certificates ahead of the leaf objects, they may
+	 * point at repositories whose fetch should start as soon as possible.
+	 */
 	rp = repo_byid(mft->repoid);
-	for (i = 0; i < mft->filesz; i++) {
-		f = &mft->files[i];
+	for (i = 0; i < 2 * mft->filesz; i++) {
+		f = &mft->files[i % mft->filesz];
 
 		if (f->type == RTYPE_INVALID || f->type == RTYPE_CRL)
 			continue;
+		if ((f->type == RTYPE_CER) != (i < mft->filesz))
+			continue;
+
+		if (f->type != RTYPE_CER) {
+			if (replayed)
+				continue;
+			if (st != NULL)
+				mftcache_expect(st, mft, f);
+		}
 
 		if (mft->path != NULL)
 			if ((npath = strdup(mft->path)) == NULL)
@@ -421,6 +1204,9 @@ queue_add_from_mft(const struct mft *mft)
 		entityq_add(npath, nfile, f->type, f->location, rp, NULL, 0,
 		    mft->talid, mftaki);
 	}
+
+	if (st != NULL && !replayed && st->pending == 0)
+		mftcache_finish(st);
 }
 
 /*
@@ -446,6 +1232,28 @@ queue_add_file(const char *file, enum rtype type, int talid)
 	    NULL);
 }
 
+/*
+ * Add the files named on each line of f, for filemode.
+ */
+static void
+queue_add_file_list(FILE *f)
+{
+	char	*line = NULL;
+	size_t	 linesize = 0;
+	ssize_t	 n;
+
+	while ((n = getline(&line, &linesize, f)) != -1) {
+		if (n > 0 && line[n - 1] == '\n')
+			line[--n] = '\0';
+		if (n == 0)
+			continue;
+		queue_add_file(line, RTYPE_FILE, 0);
+	}
+	if (ferror(f))
+		err(1, "file list");
+	free(line);
+}
+
 /*
  * Add URIs (CER) from a TAL file, RFC 8630.
  */
@@ -488,30 +1296,22 @@ static void
 queue_add_from_cert(const struct cert *cert)
 {
 	struct repo		*repo;
-	struct fqdnlistentry	*le;
-	char			*nfile, *npath, *host;
+	struct fqdnlistentry	 key;
+	char			*nfile, *npath;
 	const char		*uri, *repouri, *file;
 	size_t			 repourisz;
-	int			 shortlisted = 0;
 
 	if (strncmp(cert->repo, RSYNC_PROTO, RSYNC_PROTO_LEN) != 0)
 		errx(1, "unexpected protocol");
-	host = cert->repo + 8;
+	key.fqdn = cert->repo + 8;
+	key.len = strcspn(key.fqdn, "/");
 
-	LIST_FOREACH(le, &skiplist, entry) {
-		if (strncasecmp(host, le->fqdn, strcspn(host, "/")) == 0) {
-			warnx("skipping %s (listed in skiplist)", cert->repo);
-			return;
-		}
+	if (RB_FIND(fqdns, &skiplist, &key) != NULL) {
+		warnx("skipping %s (listed in skiplist)", cert->repo);
+		return;
 	}
 
-	LIST_FOREACH(le, &shortlist, entry) {
-		if (strncasecmp(host, le->fqdn, strcspn(host, "/")) == 0) {
-			shortlisted = 1;
-			break;
-		}
-	}
-	if (shortlistmode && shortlisted == 0) {
+	if (shortlistmode && RB_FIND(fqdns, &shortlist, &key) == NULL) {
 		if (verbose)
 			warnx("skipping %s (not shortlisted)", cert->repo);
 		return;
@@ -550,6 +1350,40 @@ queue_add_from_cert(const struct cert *cert)
 	    cert->talid, NULL);
 }
 
+/*
+ * Start fetching a repository of the previous run before the certificate
+ * referencing it shows up, see repo_prefetch().
+ */
+static void
+queue_prefetch(int talid, const char *uri, const char *notify)
+{
+	struct fqdnlistentry	 key;
+
+	key.fqdn = uri + RSYNC_PROTO_LEN;
+	key.len = strcspn(key.fqdn, "/");
+	if (RB_FIND(fqdns, &skiplist, &key) != NULL)
+		return;
+	if (shortlistmode && RB_FIND(fqdns, &shortlist, &key) == NULL)
+		return;
+
+	repo_prefetch(talid, uri, rrdpon ? notify : NULL);
+}
+
+/*
+ * Read the cache record which follows a parsed object and pass it, together
+ * with the serialized object starting at obj, to the object cache.
+ */
+static void
+entity_cache(struct ibuf *b, const unsigned char *obj, struct cache_rec *rec)
+{
+	io_read_buf(b, rec, sizeof(*rec));
+	if (rec->type != RTYPE_INVALID &&
+	    rec->len != (size_t)((unsigned char *)ibuf_data(b) - obj) -
+	    sizeof(*rec))
+		errx(1, "bad cache record");
+	objcache_add(rec, obj);
+}
+
 /*
  * Process parsed content.
  * For non-ROAs, we grok for more data.
@@ -557,8 +1391,8 @@ queue_add_from_cert(const struct cert *cert)
  * In all cases, we gather statistics.
  */
 static void
-entity_process(struct ibuf *b, struct stats *st, struct vrp_tree *tree,
-    struct brk_tree *brktree, struct vap_tree *vaptree,
+entity_process(struct ibuf *b, int from, struct stats *st,
+    struct vrp_array *tree, struct brk_tree *brktree, struct vap_tree *vaptree,
     struct vsp_tree *vsptree)
 {
 	enum rtype	 type;
@@ -569,11 +1403,14 @@ entity_process(struct ibuf *b, struct stats *st, struct vrp_tree *tree,
 	struct aspa	*aspa;
 	struct spl	*spl;
 	struct repo	*rp;
+	struct cache_rec rec;
+	unsigned char	*obj, *rest;
 	char		*file;
+	size_t		 objsz;
 	time_t		 mtime;
 	unsigned int	 id;
 	int		 talid;
-	int		 c;
+	int		 c, ok = 0;
 
 	/*
 	 * For most of these, we first read whether there's any content
@@ -582,23 +1419,86 @@ entity_process(struct ibuf *b, struct stats *st, struct vrp_tree *tree,
 	 * We follow that up with whether the resources didn't parse.
 	 */
 	io_read_buf(b, &type, sizeof(type));
+
+	/* verified signatures of the batch, not an entity */
+	if (type == RTYPE_SIG) {
+		io_read_buf_alloc(b, (void **)&obj, &objsz);
+		if (objsz % SHA256_DIGEST_LENGTH != 0)
+			errx(1, "bad signature digests");
+		if (!filemode)
+			sigcache_add(obj, objsz);
+		free(obj);
+		return;
+	}
+
+	/* stamps of the files verified in the batch, not an entity */
+	if (type == RTYPE_STAMP) {
+		io_read_buf_alloc(b, (void **)&obj, &objsz);
+		if (objsz % sizeof(struct file_stamp) != 0)
+			errx(1, "bad file stamps");
+		if (!filemode)
+			stampcache_add(obj, objsz);
+		free(obj);
+		return;
+	}
+
+	/* parse times of the batch, not an entity */
+	if (type == RTYPE_PTIMES) {
+		struct time_hist th;
+
+		while (ibuf_size(b) > 0) {
+			io_read_buf(b, &type, sizeof(type));
+			io_read_buf(b, &th, sizeof(th));
+			if (type > RTYPE_SIG)
+				errx(1, "bad parse times");
+			time_hist_merge(&st->parse_times[type], &th);
+		}
+		return;
+	}
+
+	/* parser CPU time per repository of the batch, not an entity */
+	if (type == RTYPE_RTIMES) {
+		struct repo_ptime pt;
+
+		while (ibuf_size(b) > 0) {
+			io_read_buf(b, &pt, sizeof(pt));
+			if ((rp = repo_byid(pt.repoid)) != NULL)
+				repostats_parse_add(rp, &pt);
+		}
+		return;
+	}
+
 	io_read_buf(b, &id, sizeof(id));
 	io_read_buf(b, &talid, sizeof(talid));
 	io_read_str(b, &file);
 	io_read_buf(b, &mtime, sizeof(mtime));
+	rest = ibuf_data(b);
+	TRACE(TRACE_PROCESS, 'B', file);
+	rec.expires = 0;
+
+	/* CRLs are sent together with MFT and don't count as extra work */
+	if (type != RTYPE_CRL && from != -1)
+		parsers[from].load--;
 
 	/* in filemode messages can be ignored, only the accounting matters */
 	if (filemode)
 		goto done;
 
-	if (filepath_add(&fpt, file, mtime) == 0) {
+	if (filepath_add(fpt, file, mtime) == 0) {
 		warnx("%s: File already visited", file);
 		goto done;
 	}
 
 	rp = repo_byid(id);
-	repo_stat_inc(rp, talid, type, STYPE_OK);
+	/* with -k unparsed GBRs and TAKs only count as skipped */
+	if (skipinfo && mtime == 0 &&
+	    (type == RTYPE_GBR || type == RTYPE_TAK))
+		repo_stat_inc(rp, talid, type, STYPE_SKIP);
+	else
+		repo_stat_inc(rp, talid, type, STYPE_OK);
 	repostats_new_files_inc(rp, file);
+	if (!noop)
+		repo_move_file(fpt, file);
 	switch (type) {
 	case RTYPE_TAL:
 		st->tals++;
@@ -615,6 +1515,8 @@ entity_process(struct ibuf *b, struct stats *st, struct vrp_tree *tree,
 		cert = cert_read(b);
 		switch (cert->purpose) {
 		case CERT_PURPOSE_CA:
+			entity_write_replica(RTYPE_AUTH, file, id,
+			    cert->talid, from);
 			queue_add_from_cert(cert);
 			break;
 		case CERT_PURPOSE_BGPSEC_ROUTER:
@@ -634,12 +1536,14 @@ entity_process(struct ibuf *b, struct stats *st, struct vrp_tree *tree,
 			break;
 		}
 		mft = mft_read(b);
-		queue_add_from_mft(mft);
+		io_read_buf(b, &rec, sizeof(rec));
+		queue_add_from_mft(mft, &rec);
 		mft_free(mft);
 		break;
 	case RTYPE_CRL:
 		/* CRLs are sent together with MFT and not accounted for */
-		entity_queue++;
+		entity_add(talid);
+		entity_write_replica(RTYPE_CRL, file, id, talid, from);
 		break;
 	case RTYPE_ROA:
 		io_read_buf(b, &c, sizeof(c));
@@ -647,7 +1551,10 @@ entity_process(struct ibuf *b, struct stats *st, struct vrp_tree *tree,
 			repo_stat_inc(rp, talid, type, STYPE_FAIL);
 			break;
 		}
+		obj = ibuf_data(b);
 		roa = roa_read(b);
+		entity_cache(b, obj, &rec);
+		ok = (rec.type != RTYPE_INVALID);
 		if (roa->valid)
 			roa_insert_vrps(tree, roa, rp);
 		else
@@ -655,6 +1562,8 @@ entity_process(struct ibuf *b, struct stats *st, struct vrp_tree *tree,
 		roa_free(roa);
 		break;
 	case RTYPE_GBR:
+		/* only the manifest hash was checked, see proc_parser() */
+		ok = (mtime != 0);
 		break;
 	case RTYPE_ASPA:
 		io_read_buf(b, &c, sizeof(c));
@@ -662,7 +1571,10 @@ entity_process(struct ibuf *b, struct stats *st, struct vrp_tree *tree,
 			repo_stat_inc(rp, talid, type, STYPE_FAIL);
 			break;
 		}
+		obj = ibuf_data(b);
 		aspa = aspa_read(b);
+		entity_cache(b, obj, &rec);
+		ok = (rec.type != RTYPE_INVALID);
 		if (aspa->valid)
 			aspa_insert_vaps(file, vaptree, aspa, rp);
 		else
@@ -676,7 +1588,10 @@ entity_process(struct ibuf *b, struct stats *st, struct vrp_tree *tree,
 				repo_stat_inc(rp, talid, type, STYPE_FAIL);
 			break;
 		}
+		obj = ibuf_data(b);
 		spl = spl_read(b);
+		entity_cache(b, obj, &rec);
+		ok = (rec.type != RTYPE_INVALID);
 		if (spl->valid)
 			spl_insert_vsps(vsptree, spl, rp);
 		else
@@ -684,6 +1599,7 @@ entity_process(struct ibuf *b, struct stats *st, struct vrp_tree *tree,
 		spl_free(spl);
 		break;
 	case RTYPE_TAK:
+		ok = (mtime != 0);
 		break;
 	case RTYPE_FILE:
 		break;
@@ -693,8 +1609,92 @@ entity_process(struct ibuf *b, struct stats *st, struct vrp_tree *tree,
 	}
 
 done:
+	if (from != -1 && !filemode)
+		mftcache_collect(file, type, talid, mtime, rest,
+		    (unsigned char *)ibuf_data(b) - rest, rec.expires, ok);
 	free(file);
-	entity_queue--;
+	entity_done(talid);
+	TRACE(TRACE_PROCESS, 'E', NULL);
+}
+
+/*
+ * Write the VRPs of each TAL which has no outstanding entities left
+ * into a file of its own, before the rest of the run is done.
+ */
+static void
+tal_output(struct vrp_array *vrps)
+{
+	struct vrp_array	 va;
+	int			 i;
+
+	for (i = 0; i < talsz; i++) {
+		if (taldone[i] || talqueue[i] > 0)
+			continue;
+		taldone[i] = 1;
+
+		vrp_tal_subset(&va, vrps, i);
+		slurm_filter_vrps(&va);
+		if (fchdir(outdirfd) == -1)
+			err(1, "fchdir output dir");
+		if (outputfile_tal(i, &va) != 0)
+			warnx("%s: TAL output failed", taldescs[i]);
+		if (fchdir(cachefd) == -1)
+			err(1, "fchdir");
+		free(va.v);
+		logx("%s: all files parsed", taldescs[i]);
+	}
+}
+
+/*
+ * Report the progress of the run so a slow run can be watched while it
+ * is still going on. The queues show whether it waits for the fetches,
+ * the parsers or the main process itself.
+ */
+static void
+progress_report(const struct timespec *start_time, int log)
+{
+	struct progress	 pg;
+	struct timespec	 now_time;
+	struct entity	*e;
+	int		 i;
+
+	memset(&pg, 0, sizeof(pg));
+	pg.queued = entity_queue;
+	for (i = 0; i < talsz; i++) {
+		TAILQ_FOREACH(e, &talqs[i].leafq, entries)
+			pg.waiting++;
+		TAILQ_FOREACH(e, &talqs[i].caq, entries)
+			pg.waiting++;
+		pg.waiting += talqs[i].spilled;
+	}
+	for (i = 0; i < nparsers; i++) {
+		pg.parsing += parsers[i].load;
+		pg.parserq += parsers[i].msgq.queued;
+	}
+	pg.processed = entity_processed;
+	for (i = 0; i < nrrdps; i++)
+		pg.rrdpq += rrdps[i].msgq.queued;
+	pg.rsyncq = rsyncq.queued;
+	pg.httpq = httpq.queued;
+	repo_progress(&pg);
+	clock_gettime(CLOCK_MONOTONIC, &now_time);
+	timespecsub(&now_time, start_time, &pg.elapsed_time);
+
+	if (log)
+		logx("progress: %zu entities queued, %zu waiting, %zu parsing, "
+		    "%zu processed; syncs: %u rrdp, %u rsync, %u http; "
+		    "queued messages: %zu parser, %zu rrdp, %zu rsync, "
+		    "%zu http", pg.queued, pg.waiting, pg.parsing,
+		    pg.processed, pg.rrdp_syncs, pg.rsync_syncs,
+		    pg.http_syncs, pg.parserq, pg.rrdpq, pg.rsyncq, pg.httpq);
+
+	if (!(outformats & FORMAT_OMETRIC) || noop || filemode)
+		return;
+	if (fchdir(outdirfd) == -1)
+		err(1, "fchdir output dir");
+	outputfile_progress(&pg);
+	if (fchdir(cachefd) == -1)
+		err(1, "fchdir");
 }
 
 static void
@@ -703,11 +1703,14 @@ rrdp_process(struct ibuf *b)
 	enum rrdp_msg type;
 	enum publish_type pt;
 	struct rrdp_session *s;
-	char *uri, *last_mod, *data;
+	struct repostats rs = { 0 };
+	char *uri, *last_mod, *etag, *data, *staged;
 	char hash[SHA256_DIGEST_LENGTH];
 	size_t dsz;
-	unsigned int id;
-	int ok;
+	long long offset;
+	double secs;
+	unsigned int id, slot;
+	int ok, snapshot;
 
 	io_read_buf(b, &type, sizeof(type));
 	io_read_buf(b, &id, sizeof(id));
@@ -717,10 +1720,27 @@ rrdp_process(struct ibuf *b)
 		io_read_buf(b, &ok, sizeof(ok));
 		rrdp_finish(id, ok);
 		break;
+	case RRDP_PARSED:
+		io_read_buf(b, &secs, sizeof(secs));
+		time_hist_add(&stats.rrdp_parse, secs);
+		io_read_buf(b, &rs.bytes, sizeof(rs.bytes));
+		io_read_buf(b, &snapshot, sizeof(snapshot));
+		io_read_buf(b, &rs.deltas, sizeof(rs.deltas));
+		if (repometrics) {
+			rs.snapshots = snapshot;
+			rrdp_stats_add(id, &rs);
+		}
+		break;
 	case RRDP_HTTP_REQ:
+		io_read_buf(b, &slot, sizeof(slot));
 		io_read_str(b, &uri);
 		io_read_str(b, &last_mod);
-		rrdp_http_fetch(id, uri, last_mod);
+		io_read_str(b, &etag);
+		io_read_buf(b, &offset, sizeof(offset));
+		rrdp_http_fetch(id, slot, uri, last_mod, etag, offset);
+		free(uri);
+		free(last_mod);
+		free(etag);
 		break;
 	case RRDP_SESSION:
 		s = rrdp_session_read(b);
@@ -732,13 +1752,15 @@ rrdp_process(struct ibuf *b)
 		if (pt != PUB_ADD)
 			io_read_buf(b, &hash, sizeof(hash));
 		io_read_str(b, &uri);
+		io_read_str(b, &staged);
 		io_read_buf_alloc(b, (void **)&data, &dsz);
 
 		ok = rrdp_handle_file(id, pt, uri, hash, sizeof(hash),
-		    data, dsz);
+		    staged, data, dsz);
 		rrdp_file_resp(id, ok);
 
 		free(uri);
+		free(staged);
 		free(data);
 		break;
 	case RRDP_CLEAR:
@@ -768,6 +1790,7 @@ sum_stats(const struct repo *rp, const struct repotalstats *in, void *arg)
 	out->crls += in->crls;
 	out->gbrs += in->gbrs;
 	out->taks += in->taks;
+	out->skipped += in->skipped;
 	out->vrps += in->vrps;
 	out->vrps_uniqs += in->vrps_uniqs;
 	out->vaps += in->vaps;
@@ -866,8 +1889,13 @@ load_skiplist(const char *slf)
 			err(1, NULL);
 		if ((le->fqdn = strdup(line)) == NULL)
 			err(1, NULL);
+		le->len = linelen;
 
-		LIST_INSERT_HEAD(&skiplist, le, entry);
+		if (RB_INSERT(fqdns, &skiplist, le) != NULL) {
+			free(le->fqdn);
+			free(le);
+			continue;
+		}
 		stats.skiplistentries++;
 	}
 
@@ -891,8 +1919,64 @@ load_shortlist(const char *fqdn)
 
 	if ((le->fqdn = strdup(fqdn)) == NULL)
 		err(1, NULL);
+	le->len = strlen(fqdn);
 
-	LIST_INSERT_HEAD(&shortlist, le, entry);
+	if (RB_INSERT(fqdns, &shortlist, le) != NULL) {
+		free(le->fqdn);
+		free(le);
+	}
+}
+
+/*
+ * Count the entries of the change log written by earlier fetch-only
+ * runs. The count is only reported, the entries are not used to limit
+ * the validation.
+ */
+static size_t
+changes_count(FILE *f, const char *fn)
+{
+	char	*line = NULL;
+	size_t	 linesize = 0, n = 0;
+
+	while (getline(&line, &linesize, f) != -1)
+		n++;
+	if (ferror(f))
+		err(1, "change log %s", fn);
+	free(line);
+	return n;
+}
+
+/*
+ * Runs sharing a cache directory moved and removed each other's files,
+ * so only one run at a time gets to use it. A second run waits for the
+ * lock and then starts with the repositories the first one synced; with
+ * -l those are not fetched again right away. The wait is bounded by the
+ * runtime timeout. The lock is held until the last process of the run
+ * exits.
+ */
+static void
+cache_lock(int fd, const char *cachedir)
+{
+	time_t	 giveup;
+	int	 lockfd;
+
+	lockfd = openat(fd, LOCK_FILE, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (lockfd == -1)
+		err(1, "%s/%s", cachedir, LOCK_FILE);
+	if (flock(lockfd, LOCK_EX | LOCK_NB) == 0)
+		return;
+	if (errno != EWOULDBLOCK)
+		err(1, "%s/%s", cachedir, LOCK_FILE);
+	logx("waiting for another run using %s", cachedir);
+	giveup = getmonotime() + timeout;
+	while (flock(lockfd, LOCK_EX | LOCK_NB) == -1) {
+		if (errno != EWOULDBLOCK)
+			err(1, "%s/%s", cachedir, LOCK_FILE);
+		if (timeout > 0 && getmonotime() >= giveup)
+			errx(1, "gave up waiting for another run using %s "
+			    "after %d seconds", cachedir, timeout);
+		sleep(1);
+	}
 }
 
 static void
@@ -921,6 +2005,87 @@ check_fs_size(int fd, const char *cachedir)
 	}
 }
 
+static void
+proc_times_add(struct proc_times *pt, const struct rusage *ru)
+{
+	struct timespec ts;
+
+	TIMEVAL_TO_TIMESPEC(&ru->ru_utime, &ts);
+	timespecadd(&pt->user_time, &ts, &pt->user_time);
+	TIMEVAL_TO_TIMESPEC(&ru->ru_stime, &ts);
+	timespecadd(&pt->system_time, &ts, &pt->system_time);
+	/* the largest of all processes of this kind */
+	if (pt->maxrss < ru->ru_maxrss)
+		pt->maxrss = ru->ru_maxrss;
+}
+
+/*
+ * Account the memory of the validated data, which is the bulk of what
+ * main holds once all files are processed.
+ */
+static void
+mem_stats_collect(struct mem_stats *ms, struct vrp_array *vrps,
+    struct brk_tree *brks, struct vap_tree *vaps, struct vsp_tree *vsps)
+{
+	struct brk	*b;
+	struct vap	*v;
+	struct vsp	*p;
+
+	ms->vrps = vrps->max * sizeof(*vrps->v);
+	RB_FOREACH(v, vap_tree, vaps)
+		ms->vaps += sizeof(*v) + v->providersz * sizeof(*v->providers);
+	RB_FOREACH(p, vsp_tree, vsps)
+		ms->vsps += sizeof(*p) + p->prefixesz * sizeof(*p->prefixes);
+	RB_FOREACH(b, brk_tree, brks)
+		ms->brks += sizeof(*b) + strlen(b->ski) + strlen(b->pubkey) + 2;
+}
+
+/*
+ * Return the first moment a part of the validated data expires or 0 if
+ * there is no data. Until then the output stays valid without a new run.
+ */
+static time_t
+next_expiry(struct vrp_array *vrps, struct brk_tree *brks,
+    struct vap_tree *vaps, struct vsp_tree *vsps)
+{
+	struct vrp	*r;
+	struct brk	*b;
+	struct vap	*v;
+	struct vsp	*p;
+	time_t		 t = 0;
+
+	VRP_FOREACH(r, vrps)
+		if (t == 0 || r->expires < t)
+			t = r->expires;
+	RB_FOREACH(v, vap_tree, vaps)
+		if (t == 0 || v->expires < t)
+			t = v->expires;
+	RB_FOREACH(p, vsp_tree, vsps)
+		if (t == 0 || p->expires < t)
+			t = p->expires;
+	RB_FOREACH(b, brk_tree, brks)
+		if (t == 0 || b->expires < t)
+			t = b->expires;
+	return t;
+}
+
+#define IPC_SOCKBUF	(256 * 1024)
+
+/*
+ * Grow the socket buffers of a process pipe, with the default size a
+ * busy pipe needs a poll wakeup for every few messages.
+ */
+static void
+set_sockbuf(int fd)
+{
+	int	 sz = IPC_SOCKBUF;
+
+	if (setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sz, sizeof(sz)) == -1)
+		warn("setsockopt SO_SNDBUF");
+	if (setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &sz, sizeof(sz)) == -1)
+		warn("setsockopt SO_RCVBUF");
+}
+
 static pid_t
 process_start(const char *title, int *fd)
 {
@@ -930,11 +2095,15 @@ process_start(const char *title, int *fd)
 
 	if (socketpair(AF_UNIX, fl, 0, pair) == -1)
 		err(1, "socketpair");
+	set_sockbuf(pair[0]);
+	set_sockbuf(pair[1]);
 	if ((pid = fork()) == -1)
 		err(1, "fork");
 
 	if (pid == 0) {
 		setproctitle("%s", title);
+		trace_reset();
+		prof_start(title);
 		/* change working directory to the cache directory */
 		if (fchdir(cachefd) == -1)
 			err(1, "fchdir");
@@ -949,36 +2118,118 @@ process_start(const char *title, int *fd)
 	return pid;
 }
 
+#define EARLY_EXCLUDED	(FORMAT_OMETRIC | FORMAT_DELTA | FORMAT_ROV)
+
+/*
+ * Write the outputs from the state of the previous run, in a child so
+ * that the fetches start right away. The formats which only make sense
+ * for the current run are left out.
+ */
+static pid_t
+output_early(void)
+{
+	struct vrp_array	 vrps = { 0 };
+	struct brk_tree		 brks = RB_INITIALIZER(&brks);
+	struct vap_tree		 vaps = RB_INITIALIZER(&vaps);
+	struct vsp_tree		 vsps = RB_INITIALIZER(&vsps);
+	struct stats		 st;
+	pid_t			 pid;
+
+	if ((outformats & ~EARLY_EXCLUDED) == 0)
+		return -1;
+
+	/* don't let the child flush pending output a second time */
+	fflush(NULL);
+
+	if ((pid = fork()) == -1) {
+		warn("fork");
+		return -1;
+	}
+	if (pid != 0)
+		return pid;
+
+	setproctitle("early output");
+	if (pledge("stdio rpath wpath cpath fattr proc", NULL) == -1)
+		err(1, "pledge");
+	outformats &= ~EARLY_EXCLUDED;
+
+	if (output_state_load(cachefd, &vrps, &vaps) == -1)
+		exit(0);
+	if (fchdir(outdirfd) == -1)
+		err(1, "fchdir output dir");
+
+	memset(&st, 0, sizeof(st));
+	st.tals = talsz;
+	logx("early output from the previous run: %zu VRPs", vrps.num);
+	exit(outputfiles(&vrps, &brks, &vaps, &vsps, &st));
+}
+
 void
 suicide(int sig __attribute__((unused)))
 {
 	killme = 1;
 }
 
-#define NPFD	4
+void
+siginfo(int sig __attribute__((unused)))
+{
+	infome = 1;
+}
+
+/*
+ * Close the parent side of all parser connections.
+ */
+static void
+parsers_close(void)
+{
+	int i;
+
+	for (i = 0; i < nparsers; i++)
+		close(parsers[i].msgq.fd);
+}
+
+/*
+ * Close the parent side of all rrdp connections.
+ */
+static void
+rrdps_close(void)
+{
+	int i;
+
+	for (i = 0; i < nrrdps; i++)
+		close(rrdps[i].msgq.fd);
+}
+
+#define NPFD	(2 + MAX_RRDP_PROCS + MAX_PARSERS)
 
 int
 main(int argc, char *argv[])
 {
-	int		 rc, c, i, st, proc, rsync, http, rrdp, hangup = 0;
-	pid_t		 pid, procpid, rsyncpid, httppid, rrdppid;
+	int		 rc, c, i, st, proc, rsync, http, npfd, pbase;
+	int		 hangup = 0, progress;
+	int		 httpconns = HTTP_REQUESTS, rsyncprocs = RSYNC_REQUESTS;
+	unsigned int	 bwlimit = 0;
+	time_t		 progress_next;
+	pid_t		 pid, rsyncpid, httppid;
+	pid_t		 readaheadpid = -1, earlypid = -1;
 	struct pollfd	 pfd[NPFD];
 	struct msgbuf	*queues[NPFD];
-	struct ibuf	*b, *httpbuf = NULL, *procbuf = NULL;
-	struct ibuf	*rrdpbuf = NULL, *rsyncbuf = NULL;
+	struct ibuf	*b, *httpbuf = NULL;
+	struct ibuf	*rsyncbuf = NULL;
 	char		*rsync_prog = "openrsync";
-	char		*bind_addr = NULL;
+	char		*bind_addrs[MAX_BIND_ADDRS + 1] = { NULL };
 	const char	*cachedir = NULL, *outputdir = NULL;
 	const char	*errs, *name;
-	const char	*skiplistfile = NULL;
-	struct vrp_tree	 vrps = RB_INITIALIZER(&vrps);
+	const char	*skiplistfile = NULL, *tracefile = NULL;
+	const char	*proffile = NULL;
+	const char	*slurmfile = NULL, *changesfile = NULL;
+	struct vrp_array vrps = { 0 };
 	struct vsp_tree	 vsps = RB_INITIALIZER(&vsps);
 	struct brk_tree	 brks = RB_INITIALIZER(&brks);
 	struct vap_tree	 vaps = RB_INITIALIZER(&vaps);
 	struct rusage	 ru;
-	struct timespec	 start_time, now_time;
-
-	clock_gettime(CLOCK_MONOTONIC, &start_time);
+	struct timespec	 start_time, now_time, cleanup_time;
+	size_t		 changes = 0;
 
 	/* If started as root, priv-drop to _rpki-client */
 	if (getuid() == 0) {
@@ -998,46 +2249,128 @@ main(int argc, char *argv[])
 	skiplistfile = DEFAULT_SKIPLIST_FILE;
 
 	if (pledge("stdio rpath wpath cpath inet fattr dns sendfd recvfd "
-	    "proc exec unveil", NULL) == -1)
+	    "proc exec unveil flock", NULL) == -1)
 		err(1, "pledge");
 
-	while ((c = getopt(argc, argv, "Ab:Bcd:e:fH:jmnoP:rRs:S:t:T:vVx")) != -1)
+	while ((c = getopt(argc, argv,
+	    "Aa:b:BC:cDd:E:e:FfG:g:H:I:iJjK:kLlM:mN:nOoP:p:"
+	    "rRs:S:t:T:uU:vVW:wxX:Y:Zz"))
+	    != -1)
 		switch (c) {
 		case 'A':
 			excludeaspa = 1;
 			break;
+		case 'a':
+			ta_delay = strtonum(optarg, 0, 24*60*60, &errs);
+			if (errs)
+				errx(1, "-a: %s", errs);
+			break;
 		case 'b':
-			bind_addr = optarg;
+			for (i = 0; bind_addrs[i] != NULL; i++)
+				;
+			if (i >= MAX_BIND_ADDRS)
+				errx(1, "-b: too many source addresses");
+			bind_addrs[i] = optarg;
 			break;
 		case 'B':
 			outformats |= FORMAT_BIRD;
 			break;
+		case 'C':
+			httpconns = strtonum(optarg, 1, MAX_HTTP_REQUESTS,
+			    &errs);
+			if (errs)
+				errx(1, "-C: %s", errs);
+			break;
 		case 'c':
 			outformats |= FORMAT_CSV;
 			break;
+		case 'D':
+			outformats |= FORMAT_DELTA;
+			break;
 		case 'd':
 			cachedir = optarg;
 			break;
+		case 'E':
+			rsyncprocs = strtonum(optarg, 1, MAX_RSYNC_REQUESTS,
+			    &errs);
+			if (errs)
+				errx(1, "-E: %s", errs);
+			break;
 		case 'e':
 			rsync_prog = optarg;
 			break;
+		case 'F':
+			rrdphedge = 1;
+			break;
 		case 'f':
 			filemode = 1;
 			noop = 1;
 			break;
+		case 'G':
+			proffile = optarg;
+			break;
+		case 'g':
+			tracefile = optarg;
+			break;
 		case 'H':
 			shortlistmode = 1;
 			load_shortlist(optarg);
 			break;
+		case 'I':
+			if ((rov_input = fopen(optarg, "r")) == NULL)
+				err(1, "routes file %s", optarg);
+			outformats |= FORMAT_ROV;
+			break;
+		case 'i':
+			rrdpscan = 1;
+			break;
+		case 'J':
+			jsonlines = 1;
+			outformats |= FORMAT_JSON;
+			break;
+		case 'K':
+			/* the limit in bytes must fit a size_t */
+			leafq_max = strtonum(optarg, 1,
+			    SIZE_MAX / (1024 * 1024) < 1024 * 1024 ?
+			    SIZE_MAX / (1024 * 1024) : 1024 * 1024, &errs);
+			if (errs)
+				errx(1, "-K: %s", errs);
+			leafq_max *= 1024 * 1024;
+			break;
 		case 'j':
 			outformats |= FORMAT_JSON;
 			break;
+		case 'k':
+			skipinfo = 1;
+			break;
+		case 'L':
+			taloutput = 1;
+			break;
+		case 'l':
+			rsyncrest = 1;
+			break;
+		case 'M':
+			if (strncasecmp(optarg, RSYNC_PROTO,
+			    RSYNC_PROTO_LEN) != 0 ||
+			    !valid_uri(optarg, strlen(optarg), NULL) ||
+			    optarg[strlen(optarg) - 1] == '/')
+				errx(1, "invalid mirror URI: %s", optarg);
+			repo_mirror = optarg;
+			break;
 		case 'm':
 			outformats |= FORMAT_OMETRIC;
 			break;
+		case 'N':
+			nrrdps = strtonum(optarg, 1, MAX_RRDP_PROCS, &errs);
+			if (errs)
+				errx(1, "-N: %s", errs);
+			break;
 		case 'n':
 			noop = 1;
 			break;
+		case 'O':
+			earlyoutput = 1;
+			break;
 		case 'o':
 			outformats |= FORMAT_OPENBGPD;
 			break;
@@ -1047,6 +2380,11 @@ main(int argc, char *argv[])
 			if (errs)
 				errx(1, "-P: time in seconds %s", errs);
 			break;
+		case 'p':
+			nparsers = strtonum(optarg, 1, MAX_PARSERS, &errs);
+			if (errs)
+				errx(1, "-p: %s", errs);
+			break;
 		case 'R':
 			rrdpon = 0;
 			break;
@@ -1073,15 +2411,43 @@ main(int argc, char *argv[])
 		case 'T':
 			bird_tablename = optarg;
 			break;
+		case 'u':
+			repometrics = 1;
+			break;
+		case 'U':
+			changesfile = optarg;
+			break;
 		case 'v':
 			verbose++;
 			break;
 		case 'V':
 			fprintf(stderr, "rpki-client %s\n", RPKI_VERSION);
 			return 0;
+		case 'W':
+			bwlimit = strtonum(optarg, 1, UINT_MAX / 1024, &errs);
+			if (errs)
+				errx(1, "-W: %s", errs);
+			break;
+		case 'w':
+			rrdpwrite = 1;
+			break;
 		case 'x':
 			experimental = 1;
 			break;
+		case 'X':
+			slurmfile = optarg;
+			break;
+		case 'Y':
+			parsernice = strtonum(optarg, 0, PRIO_MAX, &errs);
+			if (errs)
+				errx(1, "-Y: %s", errs);
+			break;
+		case 'Z':
+			outputgzip = 1;
+			break;
+		case 'z':
+			outformats |= FORMAT_BINARY;
+			break;
 		default:
 			goto usage;
 		}
@@ -1104,6 +2470,15 @@ main(int argc, char *argv[])
 			goto usage;
 		outputdir = NULL;
 	}
+	if (jsonlines && !filemode)
+		goto usage;
+	if (rov_input != NULL && filemode)
+		goto usage;
+	if (slurmfile != NULL && filemode)
+		goto usage;
+	if (changesfile != NULL && filemode)
+		goto usage;
+	fetchonly = changesfile != NULL && !noop;
 
 	if (cachedir == NULL) {
 		warnx("cache directory required");
@@ -1114,35 +2489,78 @@ main(int argc, char *argv[])
 
 	if ((cachefd = open(cachedir, O_RDONLY | O_DIRECTORY)) == -1)
 		err(1, "cache directory %s", cachedir);
+	if (tracefile != NULL)
+		trace_open(tracefile);
+	if (proffile != NULL) {
+		prof_open(proffile, __builtin_frame_address(0));
+		prof_start("main");
+	}
 	if (outputdir != NULL) {
 		if ((outdirfd = open(outputdir, O_RDONLY | O_DIRECTORY)) == -1)
 			err(1, "output directory %s", outputdir);
 		if (outformats == 0)
 			outformats = FORMAT_OPENBGPD;
-	}
+	} else
+		taloutput = 0;
 
+	if (!filemode)
+		cache_lock(cachefd, cachedir);
+	/* time spent waiting for the lock does not count as runtime */
+	clock_gettime(CLOCK_MONOTONIC, &start_time);
 	check_fs_size(cachefd, cachedir);
 
+	if (changesfile != NULL) {
+		if ((changelog = fopen(changesfile, noop ? "r+e" : "ae")) ==
+		    NULL)
+			err(1, "change log %s", changesfile);
+		if (noop)
+			changes = changes_count(changelog, changesfile);
+	}
+
 	if (talsz == 0)
 		talsz = tal_load_default();
 	if (talsz == 0)
 		err(1, "no TAL files found in %s", "/etc/rpki");
 
-	/* Load optional constraint files sitting next to the TALs. */
+	/*
+	 * Load optional constraint files sitting next to the TALs.
+	 * They are parsed once here, the parsers inherit the result.
+	 */
 	constraints_load();
+	constraints_parse();
+
+	if (slurmfile != NULL)
+		slurm_load(slurmfile);
+
+	if (earlyoutput && !filemode && !fetchonly && outputdir != NULL)
+		earlypid = output_early();
+
+	/* filemode keeps its own state and only runs a single parser */
+	if (filemode)
+		nparsers = 1;
 
 	/*
-	 * Create the file reader as a jailed child process.
-	 * It will be responsible for reading all of the files (ROAs,
+	 * Create the file readers as jailed child processes.
+	 * They will be responsible for reading all of the files (ROAs,
 	 * manifests, certificates, etc.) and returning contents.
 	 */
 
-	procpid = process_start("parser", &proc);
-	if (procpid == 0) {
-		if (!filemode)
-			proc_parser(proc);
-		else
-			proc_filemode(proc);
+	for (i = 0; i < nparsers; i++) {
+		parsers[i].pid = process_start("parser", &proc);
+		if (parsers[i].pid == 0) {
+			if (parsernice != 0 &&
+			    setpriority(PRIO_PROCESS, 0, parsernice) == -1)
+				warn("setpriority");
+			/* drop the connections to the other parsers */
+			nparsers = i;
+			parsers_close();
+			if (!filemode)
+				proc_parser(proc);
+			else
+				proc_filemode(proc);
+		}
+		msgbuf_init(&parsers[i].msgq);
+		parsers[i].msgq.fd = proc;
 	}
 
 	/* Constraints are only needed in the filemode and parser processes. */
@@ -1158,8 +2576,8 @@ main(int argc, char *argv[])
 	if (!noop) {
 		rsyncpid = process_start("rsync", &rsync);
 		if (rsyncpid == 0) {
-			close(proc);
-			proc_rsync(rsync_prog, bind_addr, rsync);
+			parsers_close();
+			proc_rsync(rsync_prog, bind_addrs, rsyncprocs, rsync);
 		}
 	} else {
 		rsync = -1;
@@ -1176,9 +2594,11 @@ main(int argc, char *argv[])
 		httppid = process_start("http", &http);
 
 		if (httppid == 0) {
-			close(proc);
+			parsers_close();
 			close(rsync);
-			proc_http(bind_addr, http);
+			if (fchdir(cachefd) == -1)
+				err(1, "fchdir");
+			proc_http(bind_addrs, httpconns, bwlimit, http);
 		}
 	} else {
 		http = -1;
@@ -1186,22 +2606,50 @@ main(int argc, char *argv[])
 	}
 
 	/*
-	 * Create a process that will process RRDP.
-	 * The rrdp process requires the http process to fetch the various
-	 * XML files and does this via the main process.
+	 * Create the processes that will process RRDP.
+	 * The rrdp processes require the http process to fetch the various
+	 * XML files and do this via the main process.
 	 */
 
 	if (!noop && rrdpon) {
-		rrdppid = process_start("rrdp", &rrdp);
-		if (rrdppid == 0) {
-			close(proc);
+		for (i = 0; i < nrrdps; i++) {
+			rrdps[i].pid = process_start("rrdp", &proc);
+			if (rrdps[i].pid == 0) {
+				parsers_close();
+				/* drop the connections to the other ones */
+				nrrdps = i;
+				rrdps_close();
+				close(rsync);
+				close(http);
+				if (fchdir(cachefd) == -1)
+					err(1, "fchdir");
+				proc_rrdp(proc);
+			}
+			msgbuf_init(&rrdps[i].msgq);
+			rrdps[i].msgq.fd = proc;
+		}
+	} else {
+		nrrdps = 1;
+		msgbuf_init(&rrdps[0].msgq);
+		rrdps[0].msgq.fd = -1;
+		rrdps[0].pid = -1;
+	}
+
+	/*
+	 * Create a process that reads the valid cache of repositories
+	 * while they are fetched, the parsers find it in memory later.
+	 */
+
+	if (!noop && !filemode) {
+		readaheadpid = process_start("readahead", &proc);
+		if (readaheadpid == 0) {
+			parsers_close();
+			rrdps_close();
 			close(rsync);
 			close(http);
-			proc_rrdp(rrdp);
+			proc_readahead(proc);
 		}
-	} else {
-		rrdp = -1;
-		rrdppid = -1;
+		readaheadfd = proc;
 	}
 
 	if (!filemode && timeout > 0) {
@@ -1220,14 +2668,10 @@ main(int argc, char *argv[])
 	if (pledge("stdio rpath wpath cpath fattr sendfd unveil", NULL) == -1)
 		err(1, "pledge");
 
-	msgbuf_init(&procq);
 	msgbuf_init(&rsyncq);
 	msgbuf_init(&httpq);
-	msgbuf_init(&rrdpq);
-	procq.fd = proc;
 	rsyncq.fd = rsync;
 	httpq.fd = http;
-	rrdpq.fd = rrdp;
 
 	/*
 	 * The main process drives the top-down scan to leaf ROAs using
@@ -1235,14 +2679,20 @@ main(int argc, char *argv[])
 	 * parsing process.
 	 */
 
-	pfd[0].fd = proc;
-	queues[0] = &procq;
-	pfd[1].fd = rsync;
-	queues[1] = &rsyncq;
-	pfd[2].fd = http;
-	queues[2] = &httpq;
-	pfd[3].fd = rrdp;
-	queues[3] = &rrdpq;
+	pfd[0].fd = rsync;
+	queues[0] = &rsyncq;
+	pfd[1].fd = http;
+	queues[1] = &httpq;
+	for (i = 0; i < nrrdps; i++) {
+		pfd[2 + i].fd = rrdps[i].msgq.fd;
+		queues[2 + i] = &rrdps[i].msgq;
+	}
+	pbase = 2 + nrrdps;
+	for (i = 0; i < nparsers; i++) {
+		pfd[pbase + i].fd = parsers[i].msgq.fd;
+		queues[pbase + i] = &parsers[i].msgq;
+	}
+	npfd = pbase + nparsers;
 
 	load_skiplist(skiplistfile);
 
@@ -1252,12 +2702,20 @@ main(int argc, char *argv[])
 	 * can get the ball rolling.
 	 */
 
+	for (i = 0; i < TALSZ_MAX; i++) {
+		TAILQ_INIT(&talqs[i].leafq);
+		TAILQ_INIT(&talqs[i].caq);
+	}
 	for (i = 0; i < talsz; i++)
 		queue_add_file(tals[i], RTYPE_TAL, i);
 
 	if (filemode) {
-		while (*argv != NULL)
-			queue_add_file(*argv++, RTYPE_FILE, 0);
+		if (argc == 1 && strcmp(argv[0], "-") == 0)
+			queue_add_file_list(stdin);
+		else {
+			while (*argv != NULL)
+				queue_add_file(*argv++, RTYPE_FILE, 0);
+		}
 
 		if (unveil(cachedir, "r") == -1)
 			err(1, "unveil cachedir");
@@ -1267,31 +2725,60 @@ main(int argc, char *argv[])
 		if (unveil(cachedir, "rwc") == -1)
 			err(1, "unveil cachedir");
 	}
-	if (pledge("stdio rpath wpath cpath fattr sendfd", NULL) == -1)
+	if (pledge("stdio rpath wpath cpath fattr proc sendfd", NULL) == -1)
 		err(1, "unveil");
 
 	/* change working directory to the cache directory */
 	if (fchdir(cachefd) == -1)
 		err(1, "fchdir");
 
+	fpt = filepath_new();
+	if (!filemode) {
+		load_cache_file(MFTCACHE_FILE, mftcache_insert);
+		cache_open();
+		repo_prefetch_collect(queue_prefetch);
+		repo_warm();
+	}
+
+	progress = !filemode &&
+	    (((outformats & FORMAT_OMETRIC) && !noop) || verbose > 1);
+	progress_next = getmonotime();
+	signal(SIGINFO, siginfo);
+
 	while (entity_queue > 0 && !killme) {
 		int polltim;
 
-		for (i = 0; i < NPFD; i++) {
+		if (progress && getmonotime() >= progress_next) {
+			progress_report(&start_time, verbose > 1 || infome);
+			progress_next = getmonotime() + PROGRESS_INTERVAL;
+			infome = 0;
+		}
+		if (infome) {
+			progress_report(&start_time, 1);
+			infome = 0;
+		}
+
+		for (i = 0; i < nparsers; i++)
+			parser_flush(&parsers[i]);
+
+		for (i = 0; i < npfd; i++) {
 			pfd[i].events = POLLIN;
 			if (queues[i]->queued)
 				pfd[i].events |= POLLOUT;
 		}
 
-		polltim = repo_check_timeout(INFTIM);
+		polltim = INFTIM;
+		if (progress)
+			polltim = (progress_next - getmonotime()) * 1000;
+		polltim = repo_check_timeout(polltim);
 
-		if (poll(pfd, NPFD, polltim) == -1) {
+		if (poll(pfd, npfd, polltim) == -1) {
 			if (errno == EINTR)
 				continue;
 			err(1, "poll");
 		}
 
-		for (i = 0; i < NPFD; i++) {
+		for (i = 0; i < npfd; i++) {
 			if (pfd[i].revents & (POLLERR|POLLNVAL)) {
 				warnx("poll[%d]: bad fd", i);
 				hangup = 1;
@@ -1322,9 +2809,9 @@ main(int argc, char *argv[])
 		 * the parser process.
 		 */
 
-		if ((pfd[1].revents & POLLIN)) {
-			b = io_buf_read(rsync, &rsyncbuf);
-			if (b != NULL) {
+		if ((pfd[0].revents & POLLIN)) {
+			io_buf_fill(rsync, &rsyncbuf);
+			while ((b = io_buf_next(rsyncbuf)) != NULL) {
 				unsigned int id;
 				int ok;
 
@@ -1335,18 +2822,30 @@ main(int argc, char *argv[])
 			}
 		}
 
-		if ((pfd[2].revents & POLLIN)) {
-			b = io_buf_read(http, &httpbuf);
-			if (b != NULL) {
+		if ((pfd[1].revents & POLLIN)) {
+			io_buf_fill(http, &httpbuf);
+			while ((b = io_buf_next(httpbuf)) != NULL) {
 				unsigned int id;
 				enum http_result res;
-				char *last_mod;
+				char *last_mod, *etag, *from, *to;
+				long long ttfb;
 
 				io_read_buf(b, &id, sizeof(id));
 				io_read_buf(b, &res, sizeof(res));
 				io_read_str(b, &last_mod);
-				http_finish(id, res, last_mod);
+				io_read_str(b, &etag);
+				io_read_str(b, &from);
+				io_read_str(b, &to);
+				io_read_buf(b, &ttfb, sizeof(ttfb));
+				if (ttfb >= 0)
+					time_hist_add(&stats.http_ttfb,
+					    ttfb / 1e6);
+				repo_redirect_done(id, res, from, to);
+				http_finish(id, res, last_mod, etag);
 				free(last_mod);
+				free(etag);
+				free(from);
+				free(to);
 				ibuf_free(b);
 			}
 		}
@@ -1354,33 +2853,58 @@ main(int argc, char *argv[])
 		/*
 		 * Handle RRDP requests here.
 		 */
-		if ((pfd[3].revents & POLLIN)) {
-			b = io_buf_read(rrdp, &rrdpbuf);
-			if (b != NULL) {
+		for (i = 0; i < nrrdps; i++) {
+			if (!(pfd[2 + i].revents & POLLIN))
+				continue;
+			io_buf_fill(rrdps[i].msgq.fd, &rrdps[i].buf);
+			while ((b = io_buf_next(rrdps[i].buf)) != NULL) {
 				rrdp_process(b);
 				ibuf_free(b);
 			}
 		}
 
 		/*
-		 * The parser has finished something for us.
-		 * Dequeue these one by one.
+		 * The parsers have finished something for us.
+		 * Results arrive in batches, dequeue these one by one.
 		 */
 
-		if ((pfd[0].revents & POLLIN)) {
-			b = io_buf_read(proc, &procbuf);
-			if (b != NULL) {
-				entity_process(b, &stats, &vrps, &brks, &vaps,
-				    &vsps);
+		for (i = 0; i < nparsers; i++) {
+			struct ibuf msg;
+
+			if (!(pfd[pbase + i].revents & POLLIN))
+				continue;
+			io_buf_fill(parsers[i].msgq.fd, &parsers[i].buf);
+			while ((b = io_buf_next(parsers[i].buf)) != NULL) {
+				while (io_batch_get(b, &msg))
+					entity_process(&msg, i, &stats, &vrps,
+					    &brks, &vaps, &vsps);
+				ibuf_free(b);
+			}
+
+			/* results replayed from the manifest cache */
+			while ((b = TAILQ_FIRST(&replayq)) != NULL) {
+				TAILQ_REMOVE(&replayq, b, entry);
+				entity_process(b, -1, &stats, &vrps, &brks,
+				    &vaps, &vsps);
 				ibuf_free(b);
 			}
 		}
+		entity_dispatch();
+
+		if (taloutput)
+			tal_output(&vrps);
 	}
 
 	signal(SIGALRM, SIG_DFL);
+	signal(SIGINFO, SIG_DFL);
+	if (progress && unlinkat(outdirfd, PROGRESS_FILE, 0) == -1 &&
+	    errno != ENOENT)
+		warn("unlink %s", PROGRESS_FILE);
 	if (killme) {
 		syslog(LOG_CRIT|LOG_DAEMON,
 		    "excessive runtime (%d seconds), giving up", timeout);
+		if (!filemode && !noop)
+			repo_checkpoint(fpt);
 		errx(1, "excessive runtime (%d seconds), giving up", timeout);
 	}
 
@@ -1390,14 +2914,19 @@ main(int argc, char *argv[])
 	 * This will cause them to exit, then we reap them.
 	 */
 
-	close(proc);
+	parsers_close();
 	close(rsync);
 	close(http);
-	close(rrdp);
+	rrdps_close();
+	if (readaheadfd != -1)
+		close(readaheadfd);
+
+	clock_gettime(CLOCK_MONOTONIC, &now_time);
+	timespecsub(&now_time, &start_time, &stats.process_time);
 
 	rc = 0;
 	for (;;) {
-		pid = waitpid(WAIT_ANY, &st, 0);
+		pid = wait4(WAIT_ANY, &st, 0, &ru);
 		if (pid == -1) {
 			if (errno == EINTR)
 				continue;
@@ -1406,14 +2935,25 @@ main(int argc, char *argv[])
 			err(1, "wait");
 		}
 
-		if (pid == procpid)
-			name = "parser";
-		else if (pid == rsyncpid)
-			name = "rsync";
+		proc = PROC__MAX;
+		for (i = 0; i < nparsers; i++)
+			if (pid == parsers[i].pid)
+				proc = PROC_PARSER;
+		for (i = 0; i < nrrdps; i++)
+			if (pid == rrdps[i].pid)
+				proc = PROC_RRDP;
+		if (pid == rsyncpid)
+			proc = PROC_RSYNC;
 		else if (pid == httppid)
-			name = "http";
-		else if (pid == rrdppid)
-			name = "rrdp";
+			proc = PROC_HTTP;
+
+		if (proc != PROC__MAX) {
+			name = proc_names[proc];
+			proc_times_add(&stats.proc_times[proc], &ru);
+		} else if (pid == readaheadpid)
+			name = "readahead";
+		else if (pid == earlypid)
+			name = "early output";
 		else
 			name = "unknown";
 
@@ -1436,14 +2976,41 @@ main(int argc, char *argv[])
 
 	logx("all files parsed: generating output");
 
+	clock_gettime(CLOCK_MONOTONIC, &cleanup_time);
+
+	cache_save();
+
+	if (!noop)
+		repo_cleanup_start(fpt, cachefd);
+	if (fetchonly) {
+		if (fclose(changelog) == EOF)
+			err(1, "change log %s", changesfile);
+		changelog = NULL;
+		if (changelog_failed) {
+			warnx("change log %s is incomplete", changesfile);
+			rc = 1;
+		}
+	}
+
+	/* prepare the output while the cleanup processes walk the cache */
+	slurm_apply(&vrps, &brks, &vaps);
+	vrp_sort(&vrps);
+	mem_stats_collect(&stats.mem_stats, &vrps, &brks, &vaps, &vsps);
+	stats.next_expiry = next_expiry(&vrps, &brks, &vaps, &vsps);
+
 	if (!noop)
-		repo_cleanup(&fpt, cachefd);
+		repo_cleanup_finish(fpt, cachefd);
+	/* the walk would remove the temporary file of the state */
+	if (earlyoutput)
+		output_state_save(&vrps, &vaps);
 
 	clock_gettime(CLOCK_MONOTONIC, &now_time);
 	timespecsub(&now_time, &start_time, &stats.elapsed_time);
+	timespecsub(&now_time, &cleanup_time, &stats.cleanup_time);
 	if (getrusage(RUSAGE_SELF, &ru) == 0) {
 		TIMEVAL_TO_TIMESPEC(&ru.ru_utime, &stats.user_time);
 		TIMEVAL_TO_TIMESPEC(&ru.ru_stime, &stats.system_time);
+		proc_times_add(&stats.proc_times[PROC_MAIN], &ru);
 	}
 	if (getrusage(RUSAGE_CHILDREN, &ru) == 0) {
 		struct timespec ts;
@@ -1454,6 +3021,10 @@ main(int argc, char *argv[])
 		timespecadd(&stats.system_time, &ts, &stats.system_time);
 	}
 
+	if (verbose > 0 && stats.next_expiry != 0)
+		logx("validated data expires in %lld seconds",
+		    (long long)(stats.next_expiry - get_current_time()));
+
 	/* change working directory to the output directory */
 	if (fchdir(outdirfd) == -1)
 		err(1, "fchdir output dir");
@@ -1464,8 +3035,19 @@ main(int argc, char *argv[])
 	}
 	repo_stats_collect(sum_repostats, &stats.repo_stats);
 
-	if (outputfiles(&vrps, &brks, &vaps, &vsps, &stats))
+	if (fetchonly)
+		logx("fetch only: no output generated");
+	else if (outputfiles(&vrps, &brks, &vaps, &vsps, &stats))
 		rc = 1;
+	else if (changelog != NULL) {
+		/*
+		 * Validate only: the change log was only counted, the whole
+		 * cache was validated. Start a new log for the next fetches.
+		 */
+		if (ftruncate(fileno(changelog), 0) == -1)
+			warn("change log %s", changesfile);
+		fclose(changelog);
+	}
 
 	printf("Processing time %lld seconds "
 	    "(%lld seconds user, %lld seconds system)\n",
@@ -1497,6 +3079,8 @@ main(int argc, char *argv[])
 	printf("Repositories: %u\n", stats.repos);
 	printf("New files moved into validated cache: %u\n",
 	    stats.repo_stats.new_files);
+	if (changesfile != NULL && noop)
+		printf("Changed files since last validation: %zu\n", changes);
 	printf("Cleanup: removed %u files, %u directories\n"
 	    "Repository cleanup: kept %u and removed %u superfluous files\n",
 	    stats.repo_stats.del_files, stats.repo_stats.del_dirs,
@@ -1512,16 +3096,26 @@ main(int argc, char *argv[])
 	/* Memory cleanup. */
 	repo_free();
 
+	trace_dump();
 	return rc;
 
 usage:
 	fprintf(stderr,
-	    "usage: rpki-client [-ABcjmnoRrVvx] [-b sourceaddr] [-d cachedir]"
-	    " [-e rsync_prog]\n"
-	    "                   [-H fqdn] [-P epoch] [-S skiplist] [-s timeout]"
-	    " [-T table]\n"
-	    "                   [-t tal] [outputdir]\n"
-	    "       rpki-client [-Vv] [-d cachedir] [-j] [-t tal] -f file ..."
+	    "usage: rpki-client [-ABcDFijkLlmnOoRruVvwxZz] [-a ta_delay]"
+	    " [-b sourceaddr]\n"
+	    "                   [-C http_conns] [-d cachedir] [-E rsync_procs]"
+	    "\n"
+	    "                   [-e rsync_prog] [-G profile] [-g tracefile]"
+	    " [-H fqdn]\n"
+	    "                   [-I routes] [-K maxmem] [-M mirror]"
+	    " [-N rrdp_procs]\n"
+	    "                   [-P epoch] [-p parsers] [-S skiplist]"
+	    " [-s timeout]\n"
+	    "                   [-T table] [-t tal] [-U changes] [-W bwlimit]"
+	    "\n"
+	    "                   [-X slurm] [-Y nice] [outputdir]\n"
+	    "       rpki-client [-Vv] [-d cachedir] [-J | -j] [-t tal]"
+	    " -f file ..."
 	    "\n");
 	return 1;
 }
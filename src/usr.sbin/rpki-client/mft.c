@@ -228,63 +228,57 @@ mft_parse_filehash(const char *fn, struct mft *mft, const FileAndHash *fh,
 }
 
 static int
-mft_fh_cmp_name(const FileAndHash *const *a, const FileAndHash *const *b)
+mftfile_cmp_name(const void *a, const void *b)
 {
-	if ((*a)->file->length < (*b)->file->length)
-		return -1;
-	if ((*a)->file->length > (*b)->file->length)
-		return 1;
+	const struct mftfile *fa = *(const struct mftfile * const *)a;
+	const struct mftfile *fb = *(const struct mftfile * const *)b;
 
-	return memcmp((*a)->file->data, (*b)->file->data, (*b)->file->length);
+	return strcmp(fa->file, fb->file);
 }
 
 static int
-mft_fh_cmp_hash(const FileAndHash *const *a, const FileAndHash *const *b)
+mftfile_cmp_hash(const void *a, const void *b)
 {
-	assert((*a)->hash->length == SHA256_DIGEST_LENGTH);
-	assert((*b)->hash->length == SHA256_DIGEST_LENGTH);
+	const struct mftfile *fa = *(const struct mftfile * const *)a;
+	const struct mftfile *fb = *(const struct mftfile * const *)b;
 
-	return memcmp((*a)->hash->data, (*b)->hash->data, (*b)->hash->length);
+	return memcmp(fa->hash, fb->hash, sizeof(fa->hash));
 }
 
 /*
- * Assuming that the hash lengths are validated, this checks that all file names
- * and hashes in a manifest are unique. Returns 1 on success, 0 on failure.
+ * Check that all file names and hashes of the parsed manifest entries
+ * are unique. An index of the entries is sorted by name and then by
+ * hash, duplicates end up next to each other.
+ * Returns 1 on success, 0 on failure.
  */
 static int
-mft_has_unique_names_and_hashes(const char *fn, const Manifest *mft)
+mft_has_unique_names_and_hashes(const char *fn, const struct mft *mft)
 {
-	STACK_OF(FileAndHash)	*fhs;
-	int			 i, ret = 0;
-
-	if ((fhs = sk_FileAndHash_dup(mft->fileList)) == NULL)
-		err(1, NULL);
+	const struct mftfile	**idx;
+	size_t			 i;
+	int			 ret = 0;
 
-	(void)sk_FileAndHash_set_cmp_func(fhs, mft_fh_cmp_name);
-	sk_FileAndHash_sort(fhs);
+	if (mft->filesz < 2)
+		return 1;
 
-	for (i = 0; i < sk_FileAndHash_num(fhs) - 1; i++) {
-		const FileAndHash *curr = sk_FileAndHash_value(fhs, i);
-		const FileAndHash *next = sk_FileAndHash_value(fhs, i + 1);
+	if ((idx = calloc(mft->filesz, sizeof(*idx))) == NULL)
+		err(1, NULL);
+	for (i = 0; i < mft->filesz; i++)
+		idx[i] = &mft->files[i];
 
-		if (mft_fh_cmp_name(&curr, &next) == 0) {
-			warnx("%s: duplicate name: %.*s", fn,
-			    curr->file->length, curr->file->data);
+	qsort(idx, mft->filesz, sizeof(*idx), mftfile_cmp_name);
+	for (i = 0; i < mft->filesz - 1; i++) {
+		if (mftfile_cmp_name(&idx[i], &idx[i + 1]) == 0) {
+			warnx("%s: duplicate name: %s", fn, idx[i]->file);
 			goto err;
 		}
 	}
 
-	(void)sk_FileAndHash_set_cmp_func(fhs, mft_fh_cmp_hash);
-	sk_FileAndHash_sort(fhs);
-
-	for (i = 0; i < sk_FileAndHash_num(fhs) - 1; i++) {
-		const FileAndHash *curr = sk_FileAndHash_value(fhs, i);
-		const FileAndHash *next = sk_FileAndHash_value(fhs, i + 1);
-
-		if (mft_fh_cmp_hash(&curr, &next) == 0) {
-			warnx("%s: duplicate hash for %.*s and %.*s", fn,
-			    curr->file->length, curr->file->data,
-			    next->file->length, next->file->data);
+	qsort(idx, mft->filesz, sizeof(*idx), mftfile_cmp_hash);
+	for (i = 0; i < mft->filesz - 1; i++) {
+		if (mftfile_cmp_hash(&idx[i], &idx[i + 1]) == 0) {
+			warnx("%s: duplicate hash for %s and %s", fn,
+			    idx[i]->file, idx[i + 1]->file);
 			goto err;
 		}
 	}
@@ -292,11 +286,146 @@ mft_has_unique_names_and_hashes(const char *fn, const Manifest *mft)
 	ret = 1;
 
  err:
-	sk_FileAndHash_free(fhs);
+	free(idx);
 
 	return ret;
 }
 
+/*
+ * Decode a GeneralizedTime of the manifest with a fast path decoder.
+ */
+static int
+mft_der_time(struct der *d, time_t *t)
+{
+	ASN1_GENERALIZEDTIME	*at;
+	const unsigned char	*p = d->p;
+	struct der		 c;
+	int			 rc;
+
+	if (!der_get(d, DER_GENTIME, &c) || c.len != GENTIME_LENGTH)
+		return 0;
+	if ((at = d2i_ASN1_GENERALIZEDTIME(NULL, &p, d->p - p)) == NULL)
+		return 0;
+	rc = x509_get_time(at, t);
+	ASN1_GENERALIZEDTIME_free(at);
+	return rc;
+}
+
+/*
+ * Decode the manifest eContent without the templates. The fileList is
+ * walked in place, the file names all go into mft->filenames so there
+ * is a constant number of allocations per manifest.
+ * Only handles well-formed strict DER, returns zero for anything else
+ * and leaves the diagnostics to the template decoder.
+ */
+static int
+mft_parse_econtent_der(const char *fn, struct mft *mft, const unsigned char *d,
+    size_t dsz)
+{
+	static const unsigned char sha256_oid[] = {
+		0x60, 0x86, 0x48, 0x01, 0x65, 0x03, 0x04, 0x02, 0x01
+	};
+	struct der		 der, econ, num, oid, list, tmp, fh, name, hash;
+	struct mftfile		*fent;
+	ASN1_INTEGER		*seqnum;
+	const unsigned char	*p;
+	char			*names;
+	size_t			 filesz, namesz, new_idx;
+	enum rtype		 type;
+	int			 found_crl = 0;
+
+	der.p = d;
+	der.len = dsz;
+	if (!der_get(&der, DER_SEQUENCE, &econ) || der.len != 0)
+		return 0;
+	if (der_peek(&econ, DER_EXPLICIT0))
+		return 0;
+
+	/* positive, minimally encoded and at most 20 octets */
+	p = econ.p;
+	if (!der_get(&econ, DER_INTEGER, &num) || num.len == 0 ||
+	    (num.p[0] & 0x80))
+		return 0;
+	if (num.len > 1 && num.p[0] == 0) {
+		if ((num.p[1] & 0x80) == 0 || num.len > 21)
+			return 0;
+	} else if (num.len > 20)
+		return 0;
+	if ((seqnum = d2i_ASN1_INTEGER(NULL, &p, econ.p - p)) == NULL)
+		return 0;
+	mft->seqnum = x509_convert_seqnum(fn, seqnum);
+	ASN1_INTEGER_free(seqnum);
+	if (mft->seqnum == NULL)
+		return 0;
+
+	if (!mft_der_time(&econ, &mft->thisupdate) ||
+	    !mft_der_time(&econ, &mft->nextupdate))
+		return 0;
+	if (mft->thisupdate > mft->nextupdate)
+		return 0;
+
+	if (!der_get(&econ, DER_OID, &oid) || oid.len != sizeof(sha256_oid) ||
+	    memcmp(oid.p, sha256_oid, sizeof(sha256_oid)) != 0)
+		return 0;
+
+	if (!der_get(&econ, DER_SEQUENCE, &list) || econ.len != 0)
+		return 0;
+
+	/* size the arrays first */
+	filesz = namesz = 0;
+	for (tmp = list; tmp.len > 0; filesz++) {
+		if (!der_get(&tmp, DER_SEQUENCE, &fh) ||
+		    !der_get(&fh, DER_IA5STRING, &name))
+			return 0;
+		namesz += name.len + 1;
+	}
+	if (filesz >= MAX_MANIFEST_ENTRIES)
+		return 0;
+
+	if ((mft->files = calloc(filesz, sizeof(struct mftfile))) == NULL)
+		err(1, NULL);
+	if ((mft->filenames = malloc(namesz)) == NULL)
+		err(1, NULL);
+	mft->filesref = 1;
+	names = mft->filenames;
+
+	while (list.len > 0) {
+		if (!der_get(&list, DER_SEQUENCE, &fh) ||
+		    !der_get(&fh, DER_IA5STRING, &name) ||
+		    !der_get(&fh, DER_BIT_STRING, &hash) || fh.len != 0)
+			return 0;
+		if (!valid_mft_filename((const char *)name.p, name.len))
+			return 0;
+		if (hash.len != SHA256_DIGEST_LENGTH + 1 || hash.p[0] != 0)
+			return 0;
+		memcpy(names, name.p, name.len);
+		names[name.len] = '\0';
+
+		type = rtype_from_mftfile(names);
+		/* remember the filehash for the CRL in struct mft */
+		if (type == RTYPE_CRL && strcmp(names, mft->crl) == 0) {
+			memcpy(mft->crlhash, hash.p + 1, SHA256_DIGEST_LENGTH);
+			found_crl = 1;
+		}
+
+		if (filemode)
+			fent = &mft->files[mft->filesz++];
+		else {
+			/* Fisher-Yates shuffle */
+			new_idx = arc4random_uniform(mft->filesz + 1);
+			mft->files[mft->filesz++] = mft->files[new_idx];
+			fent = &mft->files[new_idx];
+		}
+
+		fent->type = type;
+		fent->file = names;
+		memcpy(fent->hash, hash.p + 1, SHA256_DIGEST_LENGTH);
+		names += name.len + 1;
+	}
+
+	return found_crl;
+}
+
 /*
  * Handle the eContent of the manifest object, RFC 6486 sec. 4.2.
  * Returns 0 on failure and 1 on success.
@@ -310,6 +439,19 @@ mft_parse_econtent(const char *fn, struct mft *mft, const unsigned char *d,
 	FileAndHash		*fh;
 	int			 found_crl, i, rc = 0;
 
+	if (mft_parse_econtent_der(fn, mft, d, dsz))
+		return mft_has_unique_names_and_hashes(fn, mft);
+
+	/* Redo it with the templates for proper diagnostics. */
+	free(mft->seqnum);
+	free(mft->files);
+	free(mft->filenames);
+	mft->seqnum = NULL;
+	mft->files = NULL;
+	mft->filenames = NULL;
+	mft->filesz = 0;
+	mft->filesref = 0;
+
 	oder = d;
 	if ((mft_asn1 = d2i_Manifest(NULL, &d, dsz)) == NULL) {
 		warnx("%s: RFC 6486 section 4: failed to parse Manifest", fn);
@@ -387,7 +529,7 @@ mft_parse_econtent(const char *fn, struct mft *mft, const unsigned char *d,
 		goto out;
 	}
 
-	if (!mft_has_unique_names_and_hashes(fn, mft_asn1))
+	if (!mft_has_unique_names_and_hashes(fn, mft))
 		goto out;
 
 	rc = 1;
@@ -503,7 +645,7 @@ mft_free(struct mft *p)
 	if (p == NULL)
 		return;
 
-	if (p->files != NULL)
+	if (p->files != NULL && !p->filesref)
 		for (i = 0; i < p->filesz; i++)
 			free(p->files[i].file);
 
@@ -513,6 +655,7 @@ mft_free(struct mft *p)
 	free(p->ski);
 	free(p->path);
 	free(p->files);
+	free(p->filenames);
 	free(p->seqnum);
 	free(p);
 }
@@ -536,7 +679,7 @@ mft_buffer(struct ibuf *b, const struct mft *p)
 
 	io_simple_buffer(b, &p->filesz, sizeof(size_t));
 	for (i = 0; i < p->filesz; i++) {
-		io_str_buffer(b, p->files[i].file);
+		io_strz_buffer(b, p->files[i].file);
 		io_simple_buffer(b, &p->files[i].type,
 		    sizeof(p->files[i].type));
 		io_simple_buffer(b, &p->files[i].location,
@@ -547,6 +690,8 @@ mft_buffer(struct ibuf *b, const struct mft *p)
 
 /*
  * Read an MFT structure from the file descriptor.
+ * The file names are not copied but point into the buffer, which must
+ * outlive the result.
  * Result must be passed to mft_free().
  */
 struct mft *
@@ -570,9 +715,10 @@ mft_read(struct ibuf *b)
 	io_read_buf(b, &p->filesz, sizeof(size_t));
 	if ((p->files = calloc(p->filesz, sizeof(struct mftfile))) == NULL)
 		err(1, NULL);
+	p->filesref = 1;
 
 	for (i = 0; i < p->filesz; i++) {
-		io_read_str(b, &p->files[i].file);
+		io_read_strz(b, &p->files[i].file);
 		io_read_buf(b, &p->files[i].type, sizeof(p->files[i].type));
 		io_read_buf(b, &p->files[i].location,
 		    sizeof(p->files[i].location));
@@ -49,6 +49,12 @@ mkpathat(int fd, const char *dir)
 	char *path, *slash;
 	int done;
 
+	/* usually only the last component is missing */
+	if (mkdirat(fd, dir, 0755) == 0 || errno == EEXIST)
+		return 0;
+	if (errno != ENOENT)
+		return -1;
+
 	if ((path = strdup(dir)) == NULL)
 		return -1;
 
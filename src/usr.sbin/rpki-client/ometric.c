@@ -44,6 +44,7 @@ enum ovalue_type {
 	OVT_INTEGER,
 	OVT_DOUBLE,
 	OVT_TIMESPEC,
+	OVT_HISTOGRAM,
 };
 
 struct ovalue {
@@ -53,6 +54,11 @@ struct ovalue {
 		unsigned long long	i;
 		double			f;
 		struct timespec		ts;
+		struct {
+			unsigned long long	*counts; /* per bucket */
+			unsigned long long	 count;
+			double			 sum;
+		}			h;
 	}			 value;
 	enum ovalue_type	 valtype;
 };
@@ -66,6 +72,8 @@ struct ometric {
 	const char		*help;
 	const char *const	*stateset;
 	size_t			 setsize;
+	const double		*buckets; /* upper bounds, ascending */
+	size_t			 nbuckets;
 	enum ometric_type	 type;
 };
 
@@ -158,6 +166,35 @@ ometric_new_state(const char * const *states, size_t statecnt, const char *name,
 	return om;
 }
 
+/*
+ * Same as above but for a histogram. The buckets is an array of nbuckets
+ * upper bounds in ascending order, the +Inf bucket is implicit. The
+ * buckets, name and help pointers need to remain valid until the ometric
+ * is freed.
+ */
+struct ometric *
+ometric_new_histogram(const double *buckets, size_t nbuckets,
+    const char *name, const char *help)
+{
+	struct ometric *om;
+
+	ometric_check(name);
+
+	if ((om = calloc(1, sizeof(*om))) == NULL)
+		err(1, NULL);
+
+	om->name = name;
+	om->help = help;
+	om->type = OMT_HISTOGRAM;
+	om->buckets = buckets;
+	om->nbuckets = nbuckets;
+	STAILQ_INIT(&om->vals);
+
+	STAILQ_INSERT_TAIL(&ometrics, om, entry);
+
+	return om;
+}
+
 void
 ometric_free_all(void)
 {
@@ -169,6 +206,8 @@ ometric_free_all(void)
 		while ((ov = STAILQ_FIRST(&om->vals)) != NULL) {
 			STAILQ_REMOVE_HEAD(&om->vals, entry);
 			olabels_free(ov->labels);
+			if (ov->valtype == OVT_HISTOGRAM)
+				free(ov->value.h.counts);
 			free(ov);
 		}
 		free(om);
@@ -287,13 +326,16 @@ ometric_type(enum ometric_type type)
 	}
 }
 
+/*
+ * Output the labels, le is the extra bucket label of a histogram or NULL.
+ */
 static int
-ometric_output_labels(FILE *out, const struct olabels *ol)
+ometric_output_labels(FILE *out, const struct olabels *ol, const char *le)
 {
 	struct olabel *l;
 	const char *comma = "";
 
-	if (ol == NULL)
+	if (ol == NULL && le == NULL)
 		return fprintf(out, " ");
 
 	if (fprintf(out, "{") < 0)
@@ -308,6 +350,9 @@ ometric_output_labels(FILE *out, const struct olabels *ol)
 		}
 		ol = ol->next;
 	}
+	if (le != NULL)
+		if (fprintf(out, "%sle=\"%s\"", comma, le) < 0)
+			return -1;
 
 	return fprintf(out, "} ");
 }
@@ -323,10 +368,55 @@ ometric_output_value(FILE *out, const struct ovalue *ov)
 	case OVT_TIMESPEC:
 		return fprintf(out, "%lld.%09ld",
 		    (long long)ov->value.ts.tv_sec, ov->value.ts.tv_nsec);
+	case OVT_HISTOGRAM:
+		break;
 	}
 	return -1;
 }
 
+/*
+ * A histogram value is made of one line per bucket with the cumulative
+ * count, including +Inf, followed by the sum and count lines.
+ */
+static int
+ometric_output_histogram(FILE *out, const struct ometric *om,
+    const struct ovalue *ov)
+{
+	char le[32];
+	unsigned long long cum = 0;
+	size_t i;
+
+	for (i = 0; i <= om->nbuckets; i++) {
+		if (i < om->nbuckets) {
+			snprintf(le, sizeof(le), "%g", om->buckets[i]);
+			cum += ov->value.h.counts[i];
+		} else {
+			strlcpy(le, "+Inf", sizeof(le));
+			cum = ov->value.h.count;
+		}
+		if (fprintf(out, "%s_bucket", om->name) < 0)
+			return -1;
+		if (ometric_output_labels(out, ov->labels, le) < 0)
+			return -1;
+		if (fprintf(out, "%llu\n", cum) < 0)
+			return -1;
+	}
+
+	if (fprintf(out, "%s_sum", om->name) < 0)
+		return -1;
+	if (ometric_output_labels(out, ov->labels, NULL) < 0)
+		return -1;
+	if (fprintf(out, "%g\n", ov->value.h.sum) < 0)
+		return -1;
+	if (fprintf(out, "%s_count", om->name) < 0)
+		return -1;
+	if (ometric_output_labels(out, ov->labels, NULL) < 0)
+		return -1;
+	if (fprintf(out, "%llu\n", ov->value.h.count) < 0)
+		return -1;
+	return 0;
+}
+
 static int
 ometric_output_name(FILE *out, const struct ometric *om)
 {
@@ -366,9 +456,14 @@ ometric_output_all(FILE *out)
 			return -1;
 
 		STAILQ_FOREACH(ov, &om->vals, entry) {
+			if (ov->valtype == OVT_HISTOGRAM) {
+				if (ometric_output_histogram(out, om, ov) < 0)
+					return -1;
+				continue;
+			}
 			if (ometric_output_name(out, om) < 0)
 				return -1;
-			if (ometric_output_labels(out, ov->labels) < 0)
+			if (ometric_output_labels(out, ov->labels, NULL) < 0)
 				return -1;
 			if (ometric_output_value(out, ov) < 0)
 				return -1;
@@ -500,6 +595,71 @@ ometric_set_state(struct ometric *om, const char *state, struct olabels *ol)
 	}
 }
 
+/*
+ * Set a histogram from the nvals observations in vals with label ol.
+ * ol can be NULL.
+ */
+void
+ometric_set_histogram(struct ometric *om, const double *vals, size_t nvals,
+    struct olabels *ol)
+{
+	struct ovalue *ov;
+	size_t i, b;
+
+	if (om->type != OMT_HISTOGRAM)
+		errx(1, "%s incorrect ometric type", __func__);
+
+	if ((ov = malloc(sizeof(*ov))) == NULL)
+		err(1, NULL);
+	if ((ov->value.h.counts = calloc(om->nbuckets + 1,
+	    sizeof(*ov->value.h.counts))) == NULL)
+		err(1, NULL);
+
+	ov->value.h.count = nvals;
+	ov->value.h.sum = 0;
+	for (i = 0; i < nvals; i++) {
+		for (b = 0; b < om->nbuckets; b++)
+			if (vals[i] <= om->buckets[b])
+				break;
+		ov->value.h.counts[b]++;
+		ov->value.h.sum += vals[i];
+	}
+	ov->valtype = OVT_HISTOGRAM;
+	ov->labels = olabels_ref(ol);
+
+	STAILQ_INSERT_TAIL(&om->vals, ov, entry);
+}
+
+/*
+ * Same as above but from the counts of observations per bucket, counts
+ * has one entry per bucket of om plus one for +Inf.
+ */
+void
+ometric_set_histogram_counts(struct ometric *om, const uint64_t *counts,
+    uint64_t count, double sum, struct olabels *ol)
+{
+	struct ovalue *ov;
+	size_t b;
+
+	if (om->type != OMT_HISTOGRAM)
+		errx(1, "%s incorrect ometric type", __func__);
+
+	if ((ov = malloc(sizeof(*ov))) == NULL)
+		err(1, NULL);
+	if ((ov->value.h.counts = calloc(om->nbuckets + 1,
+	    sizeof(*ov->value.h.counts))) == NULL)
+		err(1, NULL);
+
+	for (b = 0; b <= om->nbuckets; b++)
+		ov->value.h.counts[b] = counts[b];
+	ov->value.h.count = count;
+	ov->value.h.sum = sum;
+	ov->valtype = OVT_HISTOGRAM;
+	ov->labels = olabels_ref(ol);
+
+	STAILQ_INSERT_TAIL(&om->vals, ov, entry);
+}
+
 /*
  * Set a value with an extra label, the key should be a constant string while
  * the value is copied into the extra label.
@@ -32,6 +32,8 @@ struct olabels;
 struct ometric	*ometric_new(enum ometric_type, const char *, const char *);
 struct ometric	*ometric_new_state(const char * const *, size_t, const char *,
 		    const char *);
+struct ometric	*ometric_new_histogram(const double *, size_t, const char *,
+		    const char *);
 void		 ometric_free_all(void);
 struct olabels	*olabels_new(const char * const *, const char **);
 void		 olabels_free(struct olabels *);
@@ -46,6 +48,10 @@ void	ometric_set_timespec(struct ometric *, const struct timespec *,
 void	ometric_set_info(struct ometric *, const char **, const char **,
 	    struct olabels *);
 void	ometric_set_state(struct ometric *, const char *, struct olabels *);
+void	ometric_set_histogram(struct ometric *, const double *, size_t,
+	    struct olabels *);
+void	ometric_set_histogram_counts(struct ometric *, const uint64_t *,
+	    uint64_t, double, struct olabels *);
 void	ometric_set_int_with_labels(struct ometric *, uint64_t, const char **,
 	    const char **, struct olabels *);
 void	ometric_set_timespec_with_labels(struct ometric *, struct timespec *,
@@ -15,12 +15,13 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <stddef.h>
 #include <stdlib.h>
 
 #include "extern.h"
 
 int
-output_bgpd(FILE *out, struct vrp_tree *vrps, struct brk_tree *brks,
+output_bgpd(FILE *out, struct vrp_array *vrps, struct brk_tree *brks,
     struct vap_tree *vaps, struct vsp_tree *vsps, struct stats *st)
 {
 	struct vrp	*vrp;
@@ -33,19 +34,21 @@ output_bgpd(FILE *out, struct vrp_tree *vrps, struct brk_tree *brks,
 	if (fprintf(out, "roa-set {\n") < 0)
 		return -1;
 
-	RB_FOREACH(vrp, vrp_tree, vrps) {
-		char ipbuf[64], maxlenbuf[100];
+	VRP_FOREACH(vrp, vrps) {
+		char buf[160], *p = buf;
 
-		ip_addr_print(&vrp->addr, vrp->afi, ipbuf, sizeof(ipbuf));
+		*p++ = '\t';
+		p = fmt_prefix(p, &vrp->addr, vrp->afi);
 		if (vrp->maxlength > vrp->addr.prefixlen) {
-			int ret = snprintf(maxlenbuf, sizeof(maxlenbuf),
-			    "maxlen %u ", vrp->maxlength);
-			if (ret < 0 || (size_t)ret > sizeof(maxlenbuf))
-				return -1;
-		} else
-			maxlenbuf[0] = '\0';
-		if (fprintf(out, "\t%s %ssource-as %u expires %lld\n",
-		    ipbuf, maxlenbuf, vrp->asid, (long long)vrp->expires) < 0)
+			p = fmt_str(p, " maxlen ");
+			p = fmt_uint(p, vrp->maxlength);
+		}
+		p = fmt_str(p, " source-as ");
+		p = fmt_uint(p, vrp->asid);
+		p = fmt_str(p, " expires ");
+		p = fmt_uint(p, vrp->expires);
+		*p++ = '\n';
+		if (fwrite(buf, p - buf, 1, out) != 1)
 			return -1;
 	}
 
@@ -58,21 +61,28 @@ output_bgpd(FILE *out, struct vrp_tree *vrps, struct brk_tree *brks,
 	if (fprintf(out, "\naspa-set {\n") < 0)
 		return -1;
 	RB_FOREACH(vap, vap_tree, vaps) {
+		char buf[1024], *p = buf;
+
 		if (vap->overflowed)
 			continue;
-		if (fprintf(out, "\tcustomer-as %d expires %lld "
-		    "provider-as { ", vap->custasid,
-		    (long long)vap->expires) < 0)
-			return -1;
+		p = fmt_str(p, "\tcustomer-as ");
+		p = fmt_uint(p, vap->custasid);
+		p = fmt_str(p, " expires ");
+		p = fmt_uint(p, vap->expires);
+		p = fmt_str(p, " provider-as { ");
 		for (i = 0; i < vap->providersz; i++) {
-			if (fprintf(out, "%u", vap->providers[i]) < 0)
-				return -1;
-			if (i + 1 < vap->providersz)
-				if (fprintf(out, ", ") < 0)
+			/* room for an AS number, separator and the end */
+			if (p - buf > (ptrdiff_t)sizeof(buf) - 16) {
+				if (fwrite(buf, p - buf, 1, out) != 1)
 					return -1;
+				p = buf;
+			}
+			p = fmt_uint(p, vap->providers[i]);
+			if (i + 1 < vap->providersz)
+				p = fmt_str(p, ", ");
 		}
-
-		if (fprintf(out, " }\n") < 0)
+		p = fmt_str(p, " }\n");
+		if (fwrite(buf, p - buf, 1, out) != 1)
 			return -1;
 	}
 	if (fprintf(out, "}\n") < 0)
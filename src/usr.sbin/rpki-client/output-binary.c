@@ -0,0 +1,348 @@
+/*	$OpenBSD$ */
+/*
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * The binary output is meant to be mapped and searched in place by its
+ * consumers. All values are in host byte order, the header carries a
+ * byte order mark. The header is followed by an index of the sections
+ * and then the sections themselves, each starting 8 byte aligned.
+ * The fixed size records refer to the variable sized data (providers,
+ * prefixes, strings) by index into the respective section.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "extern.h"
+
+extern int experimental;
+
+#define BIN_MAGIC	"RPKIBIN"
+#define BIN_VERSION	1
+#define BIN_BYTEORDER	0x01020304
+
+enum bin_section_type {
+	BIN_TAL = 1,	/* struct bin_str, indexed by talid */
+	BIN_VRP,	/* struct bin_vrp, sorted like vrpcmp() */
+	BIN_BRK,	/* struct bin_brk, sorted by asid */
+	BIN_VAP,	/* struct bin_vap, sorted by customer asid */
+	BIN_PROVIDER,	/* uint32_t provider asid */
+	BIN_VSP,	/* struct bin_vsp, sorted by asid */
+	BIN_PREFIX,	/* struct bin_prefix */
+	BIN_STRING,	/* NUL terminated strings, count is in bytes */
+	BIN_NSECTIONS = BIN_STRING
+};
+
+struct bin_header {
+	char		magic[8];
+	uint32_t	version;
+	uint32_t	byteorder;
+	int64_t		buildtime;
+	uint32_t	nsections;
+	uint32_t	pad;
+};
+
+struct bin_section {
+	uint32_t	type;
+	uint32_t	recsize;
+	uint64_t	offset;
+	uint64_t	count;
+};
+
+struct bin_str {
+	uint32_t	off;	/* into BIN_STRING */
+	uint32_t	len;	/* without the NUL */
+};
+
+struct bin_vrp {
+	uint8_t		addr[16];
+	uint32_t	asid;
+	uint8_t		afi;
+	uint8_t		prefixlen;
+	uint8_t		maxlength;
+	uint8_t		pad;
+	int64_t		expires;
+	uint32_t	talid;
+	uint32_t	pad2;
+};
+
+struct bin_brk {
+	uint32_t	asid;
+	uint32_t	talid;
+	int64_t		expires;
+	uint8_t		ski[20];
+	struct bin_str	pubkey;
+	uint32_t	pad;
+};
+
+struct bin_vap {
+	uint32_t	custasid;
+	uint32_t	talid;
+	int64_t		expires;
+	uint32_t	provider;	/* first one in BIN_PROVIDER */
+	uint32_t	providersz;
+};
+
+struct bin_vsp {
+	uint32_t	asid;
+	uint32_t	talid;
+	int64_t		expires;
+	uint32_t	prefix;		/* first one in BIN_PREFIX */
+	uint32_t	prefixsz;
+};
+
+struct bin_prefix {
+	uint8_t		addr[16];
+	uint8_t		afi;
+	uint8_t		prefixlen;
+	uint8_t		pad[2];
+};
+
+static int
+bin_write(FILE *out, const void *p, size_t len)
+{
+	if (len == 0)
+		return 0;
+	return fwrite(p, len, 1, out) == 1 ? 0 : -1;
+}
+
+static int
+bin_pad(FILE *out, uint64_t len)
+{
+	static const char zero[8];
+
+	return bin_write(out, zero, (8 - len % 8) % 8);
+}
+
+static uint64_t
+bin_align(uint64_t len)
+{
+	return (len + 7) & ~(uint64_t)7;
+}
+
+static int
+bin_str(const char *s, uint64_t *off, struct bin_str *bs)
+{
+	size_t len = strlen(s);
+
+	if (*off + len + 1 > UINT32_MAX)
+		return -1;
+	bs->off = *off;
+	bs->len = len;
+	*off += len + 1;
+	return 0;
+}
+
+int
+output_binary(FILE *out, struct vrp_array *vrps, struct brk_tree *brks,
+    struct vap_tree *vaps, struct vsp_tree *vsps, struct stats *st)
+{
+	struct bin_header	 hdr;
+	struct bin_section	 sect[BIN_NSECTIONS];
+	struct bin_str		 bs;
+	struct bin_vrp		 bv;
+	struct bin_brk		 bb;
+	struct bin_vap		 bp;
+	struct bin_vsp		 bsp;
+	struct bin_prefix	 bx;
+	struct brk_iter		 it;
+	struct vrp		*v;
+	const struct brk	*b;
+	struct vap		*vap;
+	struct vsp		*vsp;
+	uint64_t		 count[BIN_NSECTIONS + 1] = { 0 };
+	uint64_t		 off, stroff, idx;
+	size_t			 i;
+	uint32_t		 provider, asid;
+	int			 n, ntal = talsz;
+
+	/* count everything first, the index comes before the data */
+	if (slurm_talid != -1)
+		ntal = slurm_talid + 1;
+	count[BIN_TAL] = ntal;
+	for (n = 0; n < ntal; n++)
+		count[BIN_STRING] += strlen(taldescs[n]) + 1;
+	count[BIN_VRP] = vrps->num;
+	brk_iter_init(&it, brks);
+	while ((b = brk_iter_next(&it, &asid)) != NULL) {
+		count[BIN_BRK]++;
+		count[BIN_STRING] += strlen(b->pubkey) + 1;
+	}
+	brk_iter_free(&it);
+	if (!excludeaspa) {
+		RB_FOREACH(vap, vap_tree, vaps) {
+			if (vap->overflowed)
+				continue;
+			count[BIN_VAP]++;
+			count[BIN_PROVIDER] += vap->providersz;
+		}
+	}
+	if (experimental) {
+		RB_FOREACH(vsp, vsp_tree, vsps) {
+			count[BIN_VSP]++;
+			count[BIN_PREFIX] += vsp->prefixesz;
+		}
+	}
+	if (count[BIN_STRING] > UINT32_MAX ||
+	    count[BIN_PROVIDER] > UINT32_MAX || count[BIN_PREFIX] > UINT32_MAX)
+		return -1;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, BIN_MAGIC, sizeof(BIN_MAGIC));
+	hdr.version = BIN_VERSION;
+	hdr.byteorder = BIN_BYTEORDER;
+	hdr.buildtime = time(NULL);
+	hdr.nsections = BIN_NSECTIONS;
+
+	memset(sect, 0, sizeof(sect));
+	sect[BIN_TAL - 1].recsize = sizeof(struct bin_str);
+	sect[BIN_VRP - 1].recsize = sizeof(struct bin_vrp);
+	sect[BIN_BRK - 1].recsize = sizeof(struct bin_brk);
+	sect[BIN_VAP - 1].recsize = sizeof(struct bin_vap);
+	sect[BIN_PROVIDER - 1].recsize = sizeof(uint32_t);
+	sect[BIN_VSP - 1].recsize = sizeof(struct bin_vsp);
+	sect[BIN_PREFIX - 1].recsize = sizeof(struct bin_prefix);
+	sect[BIN_STRING - 1].recsize = 1;
+
+	off = sizeof(hdr) + sizeof(sect);
+	for (n = 0; n < BIN_NSECTIONS; n++) {
+		sect[n].type = n + 1;
+		sect[n].count = count[n + 1];
+		sect[n].offset = off;
+		off = bin_align(off + sect[n].count * sect[n].recsize);
+	}
+
+	if (bin_write(out, &hdr, sizeof(hdr)) == -1 ||
+	    bin_write(out, sect, sizeof(sect)) == -1)
+		return -1;
+
+	/* the TAL names are at the start of the string section */
+	stroff = 0;
+	for (n = 0; n < ntal; n++) {
+		if (bin_str(taldescs[n], &stroff, &bs) == -1 ||
+		    bin_write(out, &bs, sizeof(bs)) == -1)
+			return -1;
+	}
+	if (bin_pad(out, count[BIN_TAL] * sizeof(bs)) == -1)
+		return -1;
+
+	VRP_FOREACH(v, vrps) {
+		memset(&bv, 0, sizeof(bv));
+		memcpy(bv.addr, v->addr.addr, sizeof(bv.addr));
+		bv.asid = v->asid;
+		bv.afi = v->afi;
+		bv.prefixlen = v->addr.prefixlen;
+		bv.maxlength = v->maxlength;
+		bv.expires = v->expires;
+		bv.talid = v->talid;
+		if (bin_write(out, &bv, sizeof(bv)) == -1)
+			return -1;
+	}
+
+	brk_iter_init(&it, brks);
+	while ((b = brk_iter_next(&it, &asid)) != NULL) {
+		memset(&bb, 0, sizeof(bb));
+		bb.asid = asid;
+		bb.talid = b->talid;
+		bb.expires = b->expires;
+		if (hex_decode(b->ski, (char *)bb.ski, sizeof(bb.ski)) == -1 ||
+		    bin_str(b->pubkey, &stroff, &bb.pubkey) == -1 ||
+		    bin_write(out, &bb, sizeof(bb)) == -1) {
+			brk_iter_free(&it);
+			return -1;
+		}
+	}
+	brk_iter_free(&it);
+
+	idx = 0;
+	if (!excludeaspa) {
+		RB_FOREACH(vap, vap_tree, vaps) {
+			if (vap->overflowed)
+				continue;
+			memset(&bp, 0, sizeof(bp));
+			bp.custasid = vap->custasid;
+			bp.talid = vap->talid;
+			bp.expires = vap->expires;
+			bp.provider = idx;
+			bp.providersz = vap->providersz;
+			idx += vap->providersz;
+			if (bin_write(out, &bp, sizeof(bp)) == -1)
+				return -1;
+		}
+		if (bin_pad(out, count[BIN_VAP] * sizeof(bp)) == -1)
+			return -1;
+		RB_FOREACH(vap, vap_tree, vaps) {
+			if (vap->overflowed)
+				continue;
+			for (i = 0; i < vap->providersz; i++) {
+				provider = vap->providers[i];
+				if (bin_write(out, &provider,
+				    sizeof(provider)) == -1)
+					return -1;
+			}
+		}
+		if (bin_pad(out, count[BIN_PROVIDER] * sizeof(provider)) == -1)
+			return -1;
+	}
+
+	idx = 0;
+	if (experimental) {
+		RB_FOREACH(vsp, vsp_tree, vsps) {
+			memset(&bsp, 0, sizeof(bsp));
+			bsp.asid = vsp->asid;
+			bsp.talid = vsp->talid;
+			bsp.expires = vsp->expires;
+			bsp.prefix = idx;
+			bsp.prefixsz = vsp->prefixesz;
+			idx += vsp->prefixesz;
+			if (bin_write(out, &bsp, sizeof(bsp)) == -1)
+				return -1;
+		}
+		RB_FOREACH(vsp, vsp_tree, vsps) {
+			for (i = 0; i < vsp->prefixesz; i++) {
+				const struct spl_pfx *pfx = &vsp->prefixes[i];
+
+				memset(&bx, 0, sizeof(bx));
+				memcpy(bx.addr, pfx->prefix.addr,
+				    sizeof(bx.addr));
+				bx.afi = pfx->afi;
+				bx.prefixlen = pfx->prefix.prefixlen;
+				if (bin_write(out, &bx, sizeof(bx)) == -1)
+					return -1;
+			}
+		}
+		if (bin_pad(out, count[BIN_PREFIX] * sizeof(bx)) == -1)
+			return -1;
+	}
+
+	for (n = 0; n < ntal; n++)
+		if (bin_write(out, taldescs[n], strlen(taldescs[n]) + 1) == -1)
+			return -1;
+	brk_iter_init(&it, brks);
+	while ((b = brk_iter_next(&it, &asid)) != NULL)
+		if (bin_write(out, b->pubkey, strlen(b->pubkey) + 1) == -1) {
+			brk_iter_free(&it);
+			return -1;
+		}
+	brk_iter_free(&it);
+	if (bin_pad(out, count[BIN_STRING]) == -1)
+		return -1;
+
+	return 0;
+}
@@ -21,7 +21,7 @@
 #include "extern.h"
 
 int
-output_bird1v4(FILE *out, struct vrp_tree *vrps, struct brk_tree *brks,
+output_bird1v4(FILE *out, struct vrp_array *vrps, struct brk_tree *brks,
     struct vap_tree *vaps, struct vsp_tree *vsps, struct stats *st)
 {
 	extern		const char *bird_tablename;
@@ -33,15 +33,20 @@ output_bird1v4(FILE *out, struct vrp_tree *vrps, struct brk_tree *brks,
 	if (fprintf(out, "\nroa table %s {\n", bird_tablename) < 0)
 		return -1;
 
-	RB_FOREACH(v, vrp_tree, vrps) {
-		char buf[64];
-
-		if (v->afi == AFI_IPV4) {
-			ip_addr_print(&v->addr, v->afi, buf, sizeof(buf));
-			if (fprintf(out, "\troa %s max %u as %u;\n", buf,
-			    v->maxlength, v->asid) < 0)
-				return -1;
-		}
+	VRP_FOREACH(v, vrps) {
+		char buf[128], *p = buf;
+
+		if (v->afi != AFI_IPV4)
+			continue;
+		p = fmt_str(p, "\troa ");
+		p = fmt_prefix(p, &v->addr, v->afi);
+		p = fmt_str(p, " max ");
+		p = fmt_uint(p, v->maxlength);
+		p = fmt_str(p, " as ");
+		p = fmt_uint(p, v->asid);
+		p = fmt_str(p, ";\n");
+		if (fwrite(buf, p - buf, 1, out) != 1)
+			return -1;
 	}
 
 	if (fprintf(out, "}\n") < 0)
@@ -50,7 +55,7 @@ output_bird1v4(FILE *out, struct vrp_tree *vrps, struct brk_tree *brks,
 }
 
 int
-output_bird1v6(FILE *out, struct vrp_tree *vrps, struct brk_tree *brks,
+output_bird1v6(FILE *out, struct vrp_array *vrps, struct brk_tree *brks,
     struct vap_tree *vaps, struct vsp_tree *vsps, struct stats *st)
 {
 	extern		const char *bird_tablename;
@@ -62,15 +67,20 @@ output_bird1v6(FILE *out, struct vrp_tree *vrps, struct brk_tree *brks,
 	if (fprintf(out, "\nroa table %s {\n", bird_tablename) < 0)
 		return -1;
 
-	RB_FOREACH(v, vrp_tree, vrps) {
-		char buf[64];
-
-		if (v->afi == AFI_IPV6) {
-			ip_addr_print(&v->addr, v->afi, buf, sizeof(buf));
-			if (fprintf(out, "\troa %s max %u as %u;\n", buf,
-			    v->maxlength, v->asid) < 0)
-				return -1;
-		}
+	VRP_FOREACH(v, vrps) {
+		char buf[128], *p = buf;
+
+		if (v->afi != AFI_IPV6)
+			continue;
+		p = fmt_str(p, "\troa ");
+		p = fmt_prefix(p, &v->addr, v->afi);
+		p = fmt_str(p, " max ");
+		p = fmt_uint(p, v->maxlength);
+		p = fmt_str(p, " as ");
+		p = fmt_uint(p, v->asid);
+		p = fmt_str(p, ";\n");
+		if (fwrite(buf, p - buf, 1, out) != 1)
+			return -1;
 	}
 
 	if (fprintf(out, "}\n") < 0)
@@ -79,7 +89,7 @@ output_bird1v6(FILE *out, struct vrp_tree *vrps, struct brk_tree *brks,
 }
 
 int
-output_bird2(FILE *out, struct vrp_tree *vrps, struct brk_tree *brks,
+output_bird2(FILE *out, struct vrp_array *vrps, struct brk_tree *brks,
     struct vap_tree *vaps, struct vsp_tree *vsps, struct stats *st)
 {
 	extern		const char *bird_tablename;
@@ -96,30 +106,40 @@ output_bird2(FILE *out, struct vrp_tree *vrps, struct brk_tree *brks,
 	    bird_tablename) < 0)
 		return -1;
 
-	RB_FOREACH(v, vrp_tree, vrps) {
-		char buf[64];
-
-		if (v->afi == AFI_IPV4) {
-			ip_addr_print(&v->addr, v->afi, buf, sizeof(buf));
-			if (fprintf(out, "\troute %s max %u as %u;\n", buf,
-			    v->maxlength, v->asid) < 0)
-				return -1;
-		}
+	VRP_FOREACH(v, vrps) {
+		char buf[128], *p = buf;
+
+		if (v->afi != AFI_IPV4)
+			continue;
+		p = fmt_str(p, "\troute ");
+		p = fmt_prefix(p, &v->addr, v->afi);
+		p = fmt_str(p, " max ");
+		p = fmt_uint(p, v->maxlength);
+		p = fmt_str(p, " as ");
+		p = fmt_uint(p, v->asid);
+		p = fmt_str(p, ";\n");
+		if (fwrite(buf, p - buf, 1, out) != 1)
+			return -1;
 	}
 
 	if (fprintf(out, "}\n\nprotocol static {\n\troa6 { table %s6; };\n\n",
 	    bird_tablename) < 0)
 		return -1;
 
-	RB_FOREACH(v, vrp_tree, vrps) {
-		char buf[64];
-
-		if (v->afi == AFI_IPV6) {
-			ip_addr_print(&v->addr, v->afi, buf, sizeof(buf));
-			if (fprintf(out, "\troute %s max %u as %u;\n", buf,
-			    v->maxlength, v->asid) < 0)
-				return -1;
-		}
+	VRP_FOREACH(v, vrps) {
+		char buf[128], *p = buf;
+
+		if (v->afi != AFI_IPV6)
+			continue;
+		p = fmt_str(p, "\troute ");
+		p = fmt_prefix(p, &v->addr, v->afi);
+		p = fmt_str(p, " max ");
+		p = fmt_uint(p, v->maxlength);
+		p = fmt_str(p, " as ");
+		p = fmt_uint(p, v->asid);
+		p = fmt_str(p, ";\n");
+		if (fwrite(buf, p - buf, 1, out) != 1)
+			return -1;
 	}
 
 	if (fprintf(out, "}\n") < 0)
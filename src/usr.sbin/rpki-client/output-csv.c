@@ -20,7 +20,7 @@
 #include "extern.h"
 
 int
-output_csv(FILE *out, struct vrp_tree *vrps, struct brk_tree *brks,
+output_csv(FILE *out, struct vrp_array *vrps, struct brk_tree *brks,
     struct vap_tree *vaps, struct vsp_tree *vsps, struct stats *st)
 {
 	struct vrp	*v;
@@ -28,14 +28,25 @@ output_csv(FILE *out, struct vrp_tree *vrps, struct brk_tree *brks,
 	if (fprintf(out, "ASN,IP Prefix,Max Length,Trust Anchor,Expires\n") < 0)
 		return -1;
 
-	RB_FOREACH(v, vrp_tree, vrps) {
-		char buf[64];
+	VRP_FOREACH(v, vrps) {
+		char buf[128], *p = buf;
 
-		ip_addr_print(&v->addr, v->afi, buf, sizeof(buf));
+		p = fmt_str(p, "AS");
+		p = fmt_uint(p, v->asid);
+		*p++ = ',';
+		p = fmt_prefix(p, &v->addr, v->afi);
+		*p++ = ',';
+		p = fmt_uint(p, v->maxlength);
+		*p++ = ',';
+		if (fwrite(buf, p - buf, 1, out) != 1 ||
+		    fputs(taldescs[v->talid], out) == EOF)
+			return -1;
 
-		if (fprintf(out, "AS%u,%s,%u,%s,%lld\n", v->asid, buf,
-		    v->maxlength, taldescs[v->talid],
-		    (long long)v->expires) < 0)
+		p = buf;
+		*p++ = ',';
+		p = fmt_uint(p, v->expires);
+		*p++ = '\n';
+		if (fwrite(buf, p - buf, 1, out) != 1)
 			return -1;
 	}
 	return 0;
@@ -0,0 +1,254 @@
+/*	$OpenBSD$ */
+/*
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/stat.h>
+
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "extern.h"
+
+#define DELTA_STATE	"vrp-delta.state"
+#define DELTA_MAGIC	"rpki-client vrp-delta 1\n"
+
+/*
+ * A VRP as stored in the state file, fixed size and free of padding.
+ */
+struct delta_rec {
+	uint8_t		addr[16];
+	uint32_t	asid;
+	uint8_t		afi;
+	uint8_t		prefixlen;
+	uint8_t		maxlength;
+	uint8_t		pad;
+};
+
+static void
+delta_rec_set(struct delta_rec *r, const struct vrp *v)
+{
+	memset(r, 0, sizeof(*r));
+	memcpy(r->addr, v->addr.addr, v->afi == AFI_IPV4 ? 4 : 16);
+	r->asid = v->asid;
+	r->afi = v->afi;
+	r->prefixlen = v->addr.prefixlen;
+	r->maxlength = v->maxlength;
+}
+
+/*
+ * Same order as vrpcmp(), which the VRP array is sorted by.
+ */
+static int
+delta_rec_cmp(const struct delta_rec *a, const struct delta_rec *b)
+{
+	int rv;
+
+	if (a->afi != b->afi)
+		return a->afi > b->afi ? 1 : -1;
+	rv = memcmp(a->addr, b->addr, a->afi == AFI_IPV4 ? 4 : 16);
+	if (rv)
+		return rv;
+	if (a->prefixlen != b->prefixlen)
+		return a->prefixlen < b->prefixlen ? 1 : -1;
+	if (a->maxlength != b->maxlength)
+		return a->maxlength < b->maxlength ? 1 : -1;
+	if (a->asid != b->asid)
+		return a->asid > b->asid ? 1 : -1;
+	return 0;
+}
+
+static int
+delta_rec_print(FILE *out, char op, const struct delta_rec *r)
+{
+	struct ip_addr	addr;
+	char		buf[64];
+
+	memcpy(addr.addr, r->addr, sizeof(addr.addr));
+	addr.prefixlen = r->prefixlen;
+	ip_addr_print(&addr, r->afi, buf, sizeof(buf));
+
+	if (fprintf(out, "%c %s maxlen %u source-as %u\n", op, buf,
+	    r->maxlength, r->asid) < 0)
+		return -1;
+	return 0;
+}
+
+/*
+ * Open the state of the previous run and return its serial in serial.
+ * Returns NULL, with serial set to 0, if there is no usable state.
+ */
+static FILE *
+delta_state_open(uint32_t *serial)
+{
+	struct stat	 st;
+	FILE		*f;
+	char		*line = NULL;
+	const char	*errs;
+	size_t		 linesize = 0;
+	off_t		 off;
+
+	*serial = 0;
+
+	if ((f = fopen(DELTA_STATE, "r")) == NULL)
+		return NULL;
+	if (getline(&line, &linesize, f) == -1 ||
+	    strcmp(line, DELTA_MAGIC) != 0)
+		goto fail;
+	if (getline(&line, &linesize, f) == -1)
+		goto fail;
+	line[strcspn(line, "\n")] = '\0';
+	*serial = strtonum(line, 1, UINT32_MAX, &errs);
+	if (errs != NULL)
+		goto fail;
+
+	/* a truncated file would show up as withdrawn VRPs */
+	if (fstat(fileno(f), &st) == -1 || (off = ftello(f)) == -1 ||
+	    (st.st_size - off) % sizeof(struct delta_rec) != 0)
+		goto fail;
+
+	free(line);
+	return f;
+
+ fail:
+	free(line);
+	fclose(f);
+	*serial = 0;
+	return NULL;
+}
+
+static int
+delta_state_next(FILE *f, struct delta_rec *r)
+{
+	if (f == NULL)
+		return 0;
+	return fread(r, sizeof(*r), 1, f) == 1;
+}
+
+/*
+ * Store the VRPs of this run for the next one.
+ * The state is renamed into place before the delta itself, a consumer
+ * that misses a delta notices the gap in the serial numbers.
+ */
+static int
+delta_state_write(struct vrp_array *vrps, uint32_t serial)
+{
+	char		 tmpname[PATH_MAX];
+	struct delta_rec r;
+	struct vrp	*v;
+	FILE		*f;
+	int		 fd, n;
+
+	n = snprintf(tmpname, sizeof(tmpname), "%s.XXXXXXXXXXX",
+	    DELTA_STATE);
+	if (n < 0 || (size_t)n >= sizeof(tmpname))
+		return -1;
+	if ((fd = mkostemp(tmpname, O_CLOEXEC)) == -1)
+		return -1;
+	(void)fchmod(fd, 0644);
+	if ((f = fdopen(fd, "w")) == NULL) {
+		close(fd);
+		unlink(tmpname);
+		return -1;
+	}
+
+	if (fprintf(f, "%s%u\n", DELTA_MAGIC, serial) < 0)
+		goto fail;
+	VRP_FOREACH(v, vrps) {
+		delta_rec_set(&r, v);
+		if (fwrite(&r, sizeof(r), 1, f) != 1)
+			goto fail;
+	}
+	if (fclose(f) != 0) {
+		unlink(tmpname);
+		return -1;
+	}
+	if (rename(tmpname, DELTA_STATE) == -1) {
+		unlink(tmpname);
+		return -1;
+	}
+	return 0;
+
+ fail:
+	fclose(f);
+	unlink(tmpname);
+	return -1;
+}
+
+/*
+ * Write the VRPs added and removed since the previous run. Both sets are
+ * sorted the same way so a single merge walk finds the differences.
+ */
+int
+output_delta(FILE *out, struct vrp_array *vrps, struct brk_tree *brks,
+    struct vap_tree *vaps, struct vsp_tree *vsps, struct stats *st)
+{
+	struct delta_rec	 old, cur;
+	FILE			*f;
+	size_t			 i = 0;
+	uint32_t		 prev, serial;
+	int			 cmp, have, rc = -1;
+
+	f = delta_state_open(&prev);
+	if ((serial = prev + 1) == 0)
+		serial = 1;
+
+	if (prev == 0) {
+		if (fprintf(out, "# serial %u reset\n", serial) < 0)
+			goto out;
+	} else {
+		if (fprintf(out, "# serial %u previous %u\n", serial,
+		    prev) < 0)
+			goto out;
+	}
+
+	have = delta_state_next(f, &old);
+	while (have || i < vrps->num) {
+		if (i < vrps->num)
+			delta_rec_set(&cur, &vrps->v[i]);
+		if (!have)
+			cmp = 1;
+		else if (i == vrps->num)
+			cmp = -1;
+		else
+			cmp = delta_rec_cmp(&old, &cur);
+
+		if (cmp < 0) {
+			if (delta_rec_print(out, '-', &old) == -1)
+				goto out;
+			have = delta_state_next(f, &old);
+		} else if (cmp > 0) {
+			if (delta_rec_print(out, '+', &cur) == -1)
+				goto out;
+			i++;
+		} else {
+			have = delta_state_next(f, &old);
+			i++;
+		}
+	}
+
+	if (delta_state_write(vrps, serial) == -1)
+		goto out;
+	rc = 0;
+
+ out:
+	if (f != NULL)
+		fclose(f);
+	return rc;
+}
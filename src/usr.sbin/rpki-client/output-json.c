@@ -24,6 +24,70 @@
 #include "json.h"
 
 extern int experimental;
+extern int repometrics;
+
+static void
+print_repo(const struct repo *rp, const struct repostats *in, void *arg)
+{
+	const struct repotalstats	*ts;
+	const char			*carepo, *notify;
+	int				 i;
+
+	repo_fetch_uris(rp, &carepo, &notify);
+
+	json_do_object("repository", 0);
+	json_do_string("carepo", carepo);
+	if (notify != NULL)
+		json_do_string("notify", notify);
+	json_do_bool("synced", repo_synced(rp));
+	if (repo_synced(rp))
+		json_do_string("protocol", repo_proto(rp));
+	json_do_double("sync_time", in->sync_time.tv_sec +
+	    in->sync_time.tv_nsec / 1000000000.0);
+	json_do_int("bytes", in->bytes);
+	json_do_int("http_requests", in->http_reqs);
+	json_do_int("rrdp_snapshots", in->snapshots);
+	json_do_int("rrdp_deltas", in->deltas);
+	json_do_int("objects", in->objects);
+	json_do_double("parse_time", in->parse_time.tv_sec +
+	    in->parse_time.tv_nsec / 1000000000.0);
+	json_do_int("new_files", in->new_files);
+	json_do_int("del_files", in->del_files);
+	json_do_int("del_dirs", in->del_dirs);
+	json_do_int("superfluous_files", in->extra_files);
+	json_do_int("del_superfluous_files", in->del_extra_files);
+
+	json_do_array("tals");
+	for (i = 0; i < talsz; i++) {
+		if ((ts = repo_tal_stats(rp, i)) == NULL)
+			continue;
+		json_do_object("tal", 1);
+		json_do_string("name", taldescs[i]);
+		json_do_int("certificates", ts->certs);
+		json_do_int("invalidcertificates", ts->certs_fail);
+		json_do_int("manifests", ts->mfts);
+		json_do_int("failedmanifests", ts->mfts_fail);
+		json_do_int("crls", ts->crls);
+		json_do_int("roas", ts->roas);
+		json_do_int("failedroas", ts->roas_fail);
+		json_do_int("invalidroas", ts->roas_invalid);
+		json_do_int("aspas", ts->aspas);
+		json_do_int("failedaspas", ts->aspas_fail);
+		json_do_int("invalidaspas", ts->aspas_invalid);
+		json_do_int("spls", ts->spls);
+		json_do_int("failedspls", ts->spls_fail);
+		json_do_int("invalidspls", ts->spls_invalid);
+		json_do_int("bgpsec_pubkeys", ts->brks);
+		json_do_int("gbrs", ts->gbrs);
+		json_do_int("taks", ts->taks);
+		json_do_int("skipped", ts->skipped);
+		json_do_int("vrps", ts->vrps);
+		json_do_end();
+	}
+	json_do_end();
+
+	json_do_end();
+}
 
 static void
 outputheader_json(struct stats *st)
@@ -46,6 +110,26 @@ outputheader_json(struct stats *st)
 	json_do_int("elapsedtime", st->elapsed_time.tv_sec);
 	json_do_int("usertime", st->user_time.tv_sec);
 	json_do_int("systemtime", st->system_time.tv_sec);
+	json_do_int("processtime", st->process_time.tv_sec);
+	json_do_int("cleanuptime", st->cleanup_time.tv_sec);
+	json_do_int("nextexpiry", st->next_expiry);
+	json_do_array("processes");
+	for (i = 0; i < PROC__MAX; i++) {
+		json_do_object("process", 1);
+		json_do_string("name", proc_names[i]);
+		json_do_int("usertime", st->proc_times[i].user_time.tv_sec);
+		json_do_int("systemtime",
+		    st->proc_times[i].system_time.tv_sec);
+		json_do_int("maxrss", st->proc_times[i].maxrss * 1024);
+		json_do_end();
+	}
+	json_do_end();
+	json_do_object("memory", 0);
+	json_do_int("vrps", st->mem_stats.vrps);
+	json_do_int("vaps", st->mem_stats.vaps);
+	json_do_int("vsps", st->mem_stats.vsps);
+	json_do_int("bgpsec_pubkeys", st->mem_stats.brks);
+	json_do_end();
 	json_do_int("roas", st->repo_tal_stats.roas);
 	json_do_int("failedroas", st->repo_tal_stats.roas_fail);
 	json_do_int("invalidroas", st->repo_tal_stats.roas_invalid);
@@ -59,6 +143,7 @@ outputheader_json(struct stats *st)
 	json_do_int("certificates", st->repo_tal_stats.certs);
 	json_do_int("invalidcertificates", st->repo_tal_stats.certs_fail);
 	json_do_int("taks", st->repo_tal_stats.taks);
+	json_do_int("skipped", st->repo_tal_stats.skipped);
 	json_do_int("tals", st->tals);
 	json_do_int("invalidtals", talsz - st->tals);
 
@@ -85,6 +170,12 @@ outputheader_json(struct stats *st)
 	json_do_int("cachedir_del_superfluous_files",
 	    st->repo_stats.del_extra_files);
 
+	if (repometrics) {
+		json_do_array("repository_stats");
+		repo_stats_collect(print_repo, NULL);
+		json_do_end();
+	}
+
 	json_do_end();
 }
 
@@ -144,18 +235,20 @@ output_spl(struct vsp_tree *vsps)
 }
 
 int
-output_json(FILE *out, struct vrp_tree *vrps, struct brk_tree *brks,
+output_json(FILE *out, struct vrp_array *vrps, struct brk_tree *brks,
     struct vap_tree *vaps, struct vsp_tree *vsps, struct stats *st)
 {
 	char		 buf[64];
+	struct brk_iter	 it;
 	struct vrp	*v;
-	struct brk	*b;
+	const struct brk *b;
+	uint32_t	 asid;
 
 	json_do_start(out);
 	outputheader_json(st);
 
 	json_do_array("roas");
-	RB_FOREACH(v, vrp_tree, vrps) {
+	VRP_FOREACH(v, vrps) {
 		ip_addr_print(&v->addr, v->afi, buf, sizeof(buf));
 
 		json_do_object("roa", 1);
@@ -169,15 +262,17 @@ output_json(FILE *out, struct vrp_tree *vrps, struct brk_tree *brks,
 	json_do_end();
 
 	json_do_array("bgpsec_keys");
-	RB_FOREACH(b, brk_tree, brks) {
+	brk_iter_init(&it, brks);
+	while ((b = brk_iter_next(&it, &asid)) != NULL) {
 		json_do_object("brks", 0);
-		json_do_int("asn", b->asid);
+		json_do_int("asn", asid);
 		json_do_string("ski", b->ski);
 		json_do_string("pubkey", b->pubkey);
 		json_do_string("ta", taldescs[b->talid]);
 		json_do_int("expires", b->expires);
 		json_do_end();
 	}
+	brk_iter_free(&it);
 	json_do_end();
 
 	if (!excludeaspa)
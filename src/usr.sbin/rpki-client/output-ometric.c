@@ -30,9 +30,30 @@ static struct ometric *rpki_info, *rpki_completion_time, *rpki_duration;
 static struct ometric *rpki_repo, *rpki_obj, *rpki_ta_obj;
 static struct ometric *rpki_repo_obj, *rpki_repo_duration;
 static struct ometric *rpki_repo_state, *rpki_repo_proto;
+static struct ometric *rpki_repo_sync;
+static struct ometric *rpki_parse_time, *rpki_http_ttfb, *rpki_rrdp_parse;
+static struct ometric *rpki_memory, *rpki_maxrss, *rpki_next_expiry;
 
 static const char * const repo_states[2] = { "failed", "synced" };
 static const char * const repo_protos[3] = { "rrdp", "rsync", "https" };
+static const char * const parse_names[RTYPE_SIG + 1] = {
+	[RTYPE_MFT] = "mft",
+	[RTYPE_ROA] = "roa",
+	[RTYPE_CER] = "cer",
+	[RTYPE_GBR] = "gbr",
+	[RTYPE_ASPA] = "aspa",
+	[RTYPE_TAK] = "tak",
+	[RTYPE_SPL] = "spl",
+};
+static const double repo_sync_buckets[] = {
+	1, 5, 10, 30, 60, 120, 300, 600, 1800
+};
+
+/* sync times of the synced repositories per protocol */
+struct repo_sync_times {
+	double	*times[3];
+	size_t	 num[3];
+};
 
 static void
 set_common_stats(const struct repotalstats *in, struct ometric *metric,
@@ -70,6 +91,8 @@ set_common_stats(const struct repotalstats *in, struct ometric *metric,
 	    OKV("type", "state"), OKV("gbr", "valid"), ol);
 	ometric_set_int_with_labels(metric, in->taks,
 	    OKV("type", "state"), OKV("tak", "valid"), ol);
+	ometric_set_int_with_labels(metric, in->skipped,
+	    OKV("type", "state"), OKV("gbr_tak", "skipped"), ol);
 
 	ometric_set_int_with_labels(metric, in->vrps,
 	    OKV("type", "state"), OKV("vrp", "total"), ol);
@@ -114,7 +137,8 @@ ta_stats(int id)
 }
 
 static void
-repo_tal_stats(const struct repo *rp, const struct repotalstats *in, void *arg)
+repo_tal_obj_stats(const struct repo *rp, const struct repotalstats *in,
+    void *arg)
 {
 	struct olabels *ol;
 	const char *keys[4] = { "name", "carepo", "notify", NULL };
@@ -130,9 +154,44 @@ repo_tal_stats(const struct repo *rp, const struct repotalstats *in, void *arg)
 	olabels_free(ol);
 }
 
+static void
+repo_sync_add(struct repo_sync_times *rst, const char *proto,
+    const struct timespec *ts)
+{
+	double	*t;
+	size_t	 i;
+
+	for (i = 0; i < 3; i++)
+		if (strcmp(proto, repo_protos[i]) == 0)
+			break;
+	if (i == 3)
+		return;
+	t = reallocarray(rst->times[i], rst->num[i] + 1, sizeof(*t));
+	if (t == NULL)
+		err(1, NULL);
+	t[rst->num[i]++] = ts->tv_sec + ts->tv_nsec / 1000000000.0;
+	rst->times[i] = t;
+}
+
+static void
+repo_sync_stats(struct repo_sync_times *rst)
+{
+	struct olabels *ol;
+	size_t i;
+
+	for (i = 0; i < 3; i++) {
+		ol = olabels_new(OKV("proto"), OKV(repo_protos[i]));
+		ometric_set_histogram(rpki_repo_sync, rst->times[i],
+		    rst->num[i], ol);
+		olabels_free(ol);
+		free(rst->times[i]);
+	}
+}
+
 static void
 repo_stats(const struct repo *rp, const struct repostats *in, void *arg)
 {
+	struct repo_sync_times *rst = arg;
 	struct olabels *ol;
 	const char *keys[3] = { "carepo", "notify", NULL };
 	const char *values[3];
@@ -155,15 +214,18 @@ repo_stats(const struct repo *rp, const struct repostats *in, void *arg)
 	    OKV("type", "state"), OKV("dirs", "deleted"), ol);
 
 	ometric_set_state(rpki_repo_state, repo_states[repo_synced(rp)], ol);
-	if (repo_synced(rp))
+	if (repo_synced(rp)) {
 		ometric_set_state(rpki_repo_proto, repo_proto(rp), ol);
+		repo_sync_add(rst, repo_proto(rp), &in->sync_time);
+	}
 	olabels_free(ol);
 }
 
 int
-output_ometric(FILE *out, struct vrp_tree *vrps, struct brk_tree *brks,
+output_ometric(FILE *out, struct vrp_array *vrps, struct brk_tree *brks,
     struct vap_tree *vaps, struct vsp_tree *vsps, struct stats *st)
 {
+	struct repo_sync_times rst = { 0 };
 	struct olabels *ol;
 	const char *keys[4] = { "nodename", "domainname", "release", NULL };
 	const char *values[4];
@@ -177,6 +239,9 @@ output_ometric(FILE *out, struct vrp_tree *vrps, struct brk_tree *brks,
 	rpki_completion_time = ometric_new(OMT_GAUGE,
 	    "rpki_client_job_completion_time",
 	    "end of this run as epoch timestamp");
+	rpki_next_expiry = ometric_new(OMT_GAUGE,
+	    "rpki_client_next_expiry_time",
+	    "first expiry of the validated data as epoch timestamp");
 
 	rpki_repo = ometric_new(OMT_GAUGE, "rpki_client_repository",
 	    "total number of repositories");
@@ -201,6 +266,25 @@ output_ometric(FILE *out, struct vrp_tree *vrps, struct brk_tree *brks,
 	    sizeof(repo_protos) / sizeof(repo_protos[0]),
 	    "rpki_client_repository_protos",
 	    "used protocol to sync repository");
+	rpki_repo_sync = ometric_new_histogram(repo_sync_buckets,
+	    sizeof(repo_sync_buckets) / sizeof(repo_sync_buckets[0]),
+	    "rpki_client_repository_sync_seconds",
+	    "distribution of the repository sync times per protocol");
+
+	rpki_parse_time = ometric_new_histogram(time_hist_bounds,
+	    TIME_HIST_BUCKETS, "rpki_client_object_parse_seconds",
+	    "distribution of the parse and validation times per object type");
+	rpki_http_ttfb = ometric_new_histogram(time_hist_bounds,
+	    TIME_HIST_BUCKETS, "rpki_client_http_ttfb_seconds",
+	    "distribution of the HTTP times from request to response status");
+	rpki_rrdp_parse = ometric_new_histogram(time_hist_bounds,
+	    TIME_HIST_BUCKETS, "rpki_client_rrdp_parse_seconds",
+	    "distribution of the XML parse times per RRDP snapshot or deltas");
+
+	rpki_memory = ometric_new(OMT_GAUGE, "rpki_client_memory_bytes",
+	    "bytes held by the validated data");
+	rpki_maxrss = ometric_new(OMT_GAUGE, "rpki_client_process_maxrss_bytes",
+	    "peak resident set size per process");
 
 	/*
 	 * Dump statistics
@@ -220,10 +304,11 @@ output_ometric(FILE *out, struct vrp_tree *vrps, struct brk_tree *brks,
 	olabels_free(ol);
 
 	for (i = 0; i < talsz; i++) {
-		repo_tal_stats_collect(repo_tal_stats, i, &i);
+		repo_tal_stats_collect(repo_tal_obj_stats, i, &i);
 		ta_stats(i);
 	}
-	repo_stats_collect(repo_stats, NULL);
+	repo_stats_collect(repo_stats, &rst);
+	repo_sync_stats(&rst);
 	set_common_stats(&st->repo_tal_stats, rpki_obj, NULL);
 
 	ometric_set_int_with_labels(rpki_repo, st->rsync_repos,
@@ -245,9 +330,135 @@ output_ometric(FILE *out, struct vrp_tree *vrps, struct brk_tree *brks,
 	    OKV("type"), OKV("user"), NULL);
 	ometric_set_timespec_with_labels(rpki_duration, &st->system_time,
 	    OKV("type"), OKV("system"), NULL);
+	ometric_set_timespec_with_labels(rpki_duration, &st->process_time,
+	    OKV("type"), OKV("process"), NULL);
+	ometric_set_timespec_with_labels(rpki_duration, &st->cleanup_time,
+	    OKV("type"), OKV("cleanup"), NULL);
+	for (i = 0; i < PROC__MAX; i++) {
+		ometric_set_timespec_with_labels(rpki_duration,
+		    &st->proc_times[i].user_time,
+		    OKV("type", "process"), OKV("user", proc_names[i]), NULL);
+		ometric_set_timespec_with_labels(rpki_duration,
+		    &st->proc_times[i].system_time,
+		    OKV("type", "process"), OKV("system", proc_names[i]), NULL);
+		ometric_set_int_with_labels(rpki_maxrss,
+		    st->proc_times[i].maxrss * 1024, OKV("process"),
+		    OKV(proc_names[i]), NULL);
+	}
+
+	ometric_set_int_with_labels(rpki_memory, st->mem_stats.vrps,
+	    OKV("type"), OKV("vrp"), NULL);
+	ometric_set_int_with_labels(rpki_memory, st->mem_stats.vaps,
+	    OKV("type"), OKV("vap"), NULL);
+	ometric_set_int_with_labels(rpki_memory, st->mem_stats.vsps,
+	    OKV("type"), OKV("vsp"), NULL);
+	ometric_set_int_with_labels(rpki_memory, st->mem_stats.brks,
+	    OKV("type"), OKV("router_key"), NULL);
+
+	for (i = 0; i <= RTYPE_SIG; i++) {
+		if (parse_names[i] == NULL || st->parse_times[i].count == 0)
+			continue;
+		ol = olabels_new(OKV("type"), OKV(parse_names[i]));
+		ometric_set_histogram_counts(rpki_parse_time,
+		    st->parse_times[i].counts, st->parse_times[i].count,
+		    st->parse_times[i].sum, ol);
+		olabels_free(ol);
+	}
+	ometric_set_histogram_counts(rpki_http_ttfb, st->http_ttfb.counts,
+	    st->http_ttfb.count, st->http_ttfb.sum, NULL);
+	ometric_set_histogram_counts(rpki_rrdp_parse, st->rrdp_parse.counts,
+	    st->rrdp_parse.count, st->rrdp_parse.sum, NULL);
 
 	clock_gettime(CLOCK_REALTIME, &now_time);
 	ometric_set_timespec(rpki_completion_time, &now_time, NULL);
+	if (st->next_expiry != 0)
+		ometric_set_int(rpki_next_expiry, st->next_expiry, NULL);
+
+	rv = ometric_output_all(out);
+	ometric_free_all();
+
+	return rv;
+}
+
+static const char * const progress_states[3] = {
+	"loading", "failed", "synced"
+};
+
+static void
+progress_repo(const struct repo *rp, const struct repostats *in, void *arg)
+{
+	struct ometric *metric = arg;
+	struct olabels *ol;
+	const char *keys[3] = { "carepo", "notify", NULL };
+	const char *values[3];
+	const char *state;
+
+	repo_fetch_uris(rp, &values[0], &values[1]);
+	values[2] = NULL;
+
+	if (repo_loading(rp))
+		state = progress_states[0];
+	else
+		state = progress_states[1 + repo_synced(rp)];
+
+	ol = olabels_new(keys, values);
+	ometric_set_state(metric, state, ol);
+	olabels_free(ol);
+}
+
+/*
+ * Metrics of a run which is still going on. These use their own names
+ * so they can not be mistaken for the ones of a finished run.
+ */
+int
+output_ometric_progress(FILE *out, const struct progress *pg)
+{
+	struct ometric *entities, *syncs, *queues, *duration, *repos, *update;
+	struct timespec now_time;
+	int rv;
+
+	entities = ometric_new(OMT_GAUGE, "rpki_client_progress_entities",
+	    "number of entities of the running validation");
+	syncs = ometric_new(OMT_GAUGE, "rpki_client_progress_syncs",
+	    "number of repository syncs going on per protocol");
+	queues = ometric_new(OMT_GAUGE, "rpki_client_progress_queued_messages",
+	    "number of messages queued by main per process");
+	duration = ometric_new(OMT_GAUGE, "rpki_client_progress_duration",
+	    "runtime of the running validation in seconds");
+	repos = ometric_new_state(progress_states,
+	    sizeof(progress_states) / sizeof(progress_states[0]),
+	    "rpki_client_progress_repository_state",
+	    "repository state of the running validation");
+	update = ometric_new(OMT_GAUGE, "rpki_client_progress_update_time",
+	    "time of this update as epoch timestamp");
+
+	ometric_set_int_with_labels(entities, pg->queued,
+	    OKV("state"), OKV("queued"), NULL);
+	ometric_set_int_with_labels(entities, pg->waiting,
+	    OKV("state"), OKV("waiting"), NULL);
+	ometric_set_int_with_labels(entities, pg->parsing,
+	    OKV("state"), OKV("parsing"), NULL);
+	ometric_set_int_with_labels(entities, pg->processed,
+	    OKV("state"), OKV("processed"), NULL);
+	ometric_set_int_with_labels(syncs, pg->rrdp_syncs,
+	    OKV("proto"), OKV("rrdp"), NULL);
+	ometric_set_int_with_labels(syncs, pg->rsync_syncs,
+	    OKV("proto"), OKV("rsync"), NULL);
+	ometric_set_int_with_labels(syncs, pg->http_syncs,
+	    OKV("proto"), OKV("https"), NULL);
+	ometric_set_int_with_labels(queues, pg->parserq,
+	    OKV("process"), OKV("parser"), NULL);
+	ometric_set_int_with_labels(queues, pg->rrdpq,
+	    OKV("process"), OKV("rrdp"), NULL);
+	ometric_set_int_with_labels(queues, pg->rsyncq,
+	    OKV("process"), OKV("rsync"), NULL);
+	ometric_set_int_with_labels(queues, pg->httpq,
+	    OKV("process"), OKV("http"), NULL);
+	ometric_set_timespec(duration, &pg->elapsed_time, NULL);
+	repo_stats_collect(progress_repo, repos);
+
+	clock_gettime(CLOCK_REALTIME, &now_time);
+	ometric_set_timespec(update, &now_time, NULL);
 
 	rv = ometric_output_all(out);
 	ometric_free_all();
@@ -0,0 +1,291 @@
+/*	$OpenBSD$ */
+/*
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Route origin validation, RFC 6811, of the routes read from rov_input.
+ * The VRPs are indexed in a path compressed binary trie per address
+ * family. Every node refers to the run of VRPs with its prefix in the
+ * sorted VRP array, so a lookup walks down the covering prefixes of a
+ * route only once.
+ */
+
+#include <sys/socket.h>
+
+#include <arpa/inet.h>
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "extern.h"
+
+FILE	*rov_input;
+
+struct rov_node {
+	struct rov_node	*child[2];
+	const struct vrp *vrp;		/* first VRP with this prefix */
+	size_t		 nvrp;		/* 0 for glue nodes */
+	unsigned char	 addr[16];
+	unsigned char	 plen;
+};
+
+enum rov_state {
+	ROV_NOTFOUND,
+	ROV_VALID,
+	ROV_INVALID,
+};
+
+static const char *rov_states[] = {
+	[ROV_NOTFOUND] = "not-found",
+	[ROV_VALID] = "valid",
+	[ROV_INVALID] = "invalid",
+};
+
+static int
+rov_bit(const unsigned char *addr, unsigned int bit)
+{
+	return (addr[bit / 8] >> (7 - bit % 8)) & 1;
+}
+
+/*
+ * Return the number of leading bits of a and b which are equal,
+ * looking at most at max bits.
+ */
+static unsigned int
+rov_common(const unsigned char *a, const unsigned char *b, unsigned int max)
+{
+	unsigned int	 i;
+	unsigned char	 diff;
+
+	for (i = 0; i < max; i += 8) {
+		if ((diff = a[i / 8] ^ b[i / 8]) == 0)
+			continue;
+		while ((diff & 0x80) == 0) {
+			diff <<= 1;
+			i++;
+		}
+		break;
+	}
+	return i < max ? i : max;
+}
+
+static struct rov_node *
+rov_node_new(const unsigned char *addr, unsigned int plen)
+{
+	struct rov_node	*n;
+	unsigned int	 i;
+
+	if ((n = calloc(1, sizeof(*n))) == NULL)
+		err(1, NULL);
+	memcpy(n->addr, addr, (plen + 7) / 8);
+	if (plen % 8)
+		n->addr[plen / 8] &= 0xff << (8 - plen % 8);
+	for (i = (plen + 7) / 8; i < sizeof(n->addr); i++)
+		n->addr[i] = 0;
+	n->plen = plen;
+	return n;
+}
+
+static void
+rov_insert(struct rov_node **link, const struct vrp *v, size_t nvrp)
+{
+	struct rov_node	*n, *new;
+	const unsigned char *addr = v->addr.addr;
+	unsigned int	 plen = v->addr.prefixlen, common;
+
+	while ((n = *link) != NULL) {
+		common = rov_common(n->addr, addr,
+		    n->plen < plen ? n->plen : plen);
+		if (common == n->plen && common == plen) {
+			n->vrp = v;
+			n->nvrp = nvrp;
+			return;
+		}
+		if (common == n->plen) {
+			link = &n->child[rov_bit(addr, n->plen)];
+			continue;
+		}
+
+		/* the new prefix covers n or the two diverge */
+		if (common == plen)
+			new = rov_node_new(addr, plen);
+		else
+			new = rov_node_new(addr, common);
+		new->child[rov_bit(n->addr, common)] = n;
+		*link = new;
+		if (common == plen) {
+			new->vrp = v;
+			new->nvrp = nvrp;
+			return;
+		}
+		link = &new->child[rov_bit(addr, common)];
+	}
+
+	n = rov_node_new(addr, plen);
+	n->vrp = v;
+	n->nvrp = nvrp;
+	*link = n;
+}
+
+static void
+rov_free(struct rov_node *n)
+{
+	if (n == NULL)
+		return;
+	rov_free(n->child[0]);
+	rov_free(n->child[1]);
+	free(n);
+}
+
+/*
+ * The VRP array is sorted by prefix first, VRPs with the same prefix
+ * are next to each other and go into the same node.
+ */
+static void
+rov_build(struct rov_node **roots, struct vrp_array *vrps)
+{
+	size_t	 i, j;
+
+	for (i = 0; i < vrps->num; i = j) {
+		for (j = i + 1; j < vrps->num; j++) {
+			if (vrps->v[j].afi != vrps->v[i].afi ||
+			    vrps->v[j].addr.prefixlen !=
+			    vrps->v[i].addr.prefixlen ||
+			    memcmp(vrps->v[j].addr.addr, vrps->v[i].addr.addr,
+			    sizeof(vrps->v[i].addr.addr)) != 0)
+				break;
+		}
+		rov_insert(&roots[vrps->v[i].afi], &vrps->v[i], j - i);
+	}
+}
+
+static enum rov_state
+rov_lookup(const struct rov_node *n, const unsigned char *addr,
+    unsigned int plen, uint32_t asid)
+{
+	enum rov_state	 state = ROV_NOTFOUND;
+	size_t		 i;
+
+	for (; n != NULL && n->plen <= plen; n = n->child[rov_bit(addr,
+	    n->plen)]) {
+		if (rov_common(n->addr, addr, n->plen) != n->plen)
+			break;
+		for (i = 0; i < n->nvrp; i++) {
+			state = ROV_INVALID;
+			if (n->vrp[i].asid != 0 && n->vrp[i].asid == asid &&
+			    plen <= n->vrp[i].maxlength)
+				return ROV_VALID;
+		}
+		if (n->plen == plen)
+			break;
+	}
+	return state;
+}
+
+/*
+ * Parse a line of the form "prefix origin-as", the AS may be prefixed
+ * with "AS". Returns 0 on success, -1 if the line is malformed.
+ */
+static int
+rov_parse(char *line, enum afi *afi, struct ip_addr *addr, uint32_t *asid)
+{
+	char		*pfx, *len, *as;
+	const char	*errs;
+	int		 af, i, max;
+
+	pfx = strtok(line, " \t");
+	as = strtok(NULL, " \t");
+	if (pfx == NULL || as == NULL || strtok(NULL, " \t") != NULL)
+		return -1;
+	if ((len = strchr(pfx, '/')) == NULL)
+		return -1;
+	*len++ = '\0';
+
+	memset(addr, 0, sizeof(*addr));
+	if (strchr(pfx, ':') != NULL) {
+		*afi = AFI_IPV6;
+		af = AF_INET6;
+		max = 128;
+	} else {
+		*afi = AFI_IPV4;
+		af = AF_INET;
+		max = 32;
+	}
+	if (inet_pton(af, pfx, addr->addr) != 1)
+		return -1;
+	addr->prefixlen = strtonum(len, 0, max, &errs);
+	if (errs != NULL)
+		return -1;
+	for (i = addr->prefixlen; i < max; i++)
+		addr->addr[i / 8] &= ~(0x80 >> (i % 8));
+
+	if (strncasecmp(as, "AS", 2) == 0)
+		as += 2;
+	*asid = strtonum(as, 0, UINT32_MAX, &errs);
+	if (errs != NULL)
+		return -1;
+	return 0;
+}
+
+int
+output_rov(FILE *out, struct vrp_array *vrps, struct brk_tree *brks,
+    struct vap_tree *vaps, struct vsp_tree *vsps, struct stats *st)
+{
+	struct rov_node	*roots[AFI_IPV6 + 1] = { NULL };
+	struct ip_addr	 addr;
+	enum afi	 afi;
+	enum rov_state	 state;
+	char		*line = NULL, buf[64];
+	size_t		 linesize = 0;
+	ssize_t		 n;
+	uint32_t	 asid;
+	unsigned long	 lineno = 0;
+	int		 rc = -1;
+
+	if (rov_input == NULL)
+		return 0;
+
+	rov_build(roots, vrps);
+
+	while ((n = getline(&line, &linesize, rov_input)) != -1) {
+		lineno++;
+		if (n > 0 && line[n - 1] == '\n')
+			line[--n] = '\0';
+		if (n == 0 || line[0] == '#')
+			continue;
+		if (rov_parse(line, &afi, &addr, &asid) == -1) {
+			warnx("routes line %lu: bad route", lineno);
+			continue;
+		}
+
+		state = rov_lookup(roots[afi], addr.addr, addr.prefixlen, asid);
+		ip_addr_print(&addr, afi, buf, sizeof(buf));
+		if (fprintf(out, "%s AS%u %s\n", buf, asid,
+		    rov_states[state]) < 0)
+			goto out;
+	}
+	if (ferror(rov_input))
+		goto out;
+	rc = 0;
+
+ out:
+	free(line);
+	rov_free(roots[AFI_IPV4]);
+	rov_free(roots[AFI_IPV6]);
+	return rc;
+}
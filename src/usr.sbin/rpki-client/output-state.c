@@ -0,0 +1,294 @@
+/*	$OpenBSD$ */
+/*
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+/*
+ * The VRPs and VAPs of the previous run, stored in the cache directory
+ * so that the outputs can be written right at startup (-O) instead of
+ * only at the end of a run. The state depends on the set of TALs, it
+ * is not used if the TALs changed.
+ */
+
+#include <err.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "extern.h"
+#include "version.h"
+
+struct state_vrp {
+	uint8_t		addr[16];
+	uint32_t	asid;
+	uint8_t		afi;
+	uint8_t		prefixlen;
+	uint8_t		maxlength;
+	uint8_t		pad;
+	int64_t		expires;
+	int32_t		talid;
+	uint32_t	pad2;
+};
+
+struct state_vap {
+	uint32_t	custasid;
+	int32_t		talid;
+	int64_t		expires;
+	uint64_t	providersz;	/* followed by the providers */
+};
+
+/*
+ * The header holds the TAL files with their descriptions, the state is
+ * only used with the same TALs in the same order.
+ */
+static int
+state_write_tals(FILE *f)
+{
+	int i;
+
+	if (fprintf(f, "%s%d\n", CACHE_MAGIC, talsz) < 0)
+		return -1;
+	for (i = 0; i < talsz; i++)
+		if (fprintf(f, "%s\n%s\n", tals[i],
+		    taldescs[i] != NULL ? taldescs[i] : "") < 0)
+			return -1;
+	return 0;
+}
+
+static int
+state_read_tals(FILE *f)
+{
+	char		*line = NULL;
+	const char	*errstr;
+	size_t		 linesize = 0;
+	int		 i, n, rc = -1;
+
+	if (getline(&line, &linesize, f) == -1 ||
+	    strcmp(line, CACHE_MAGIC) != 0)
+		goto out;
+	if (getline(&line, &linesize, f) == -1)
+		goto out;
+	line[strcspn(line, "\n")] = '\0';
+	n = strtonum(line, 0, INT_MAX, &errstr);
+	if (errstr != NULL || n != talsz)
+		goto out;
+	for (i = 0; i < talsz; i++) {
+		if (getline(&line, &linesize, f) == -1)
+			goto out;
+		line[strcspn(line, "\n")] = '\0';
+		if (strcmp(line, tals[i]) != 0)
+			goto out;
+		if (getline(&line, &linesize, f) == -1)
+			goto out;
+		line[strcspn(line, "\n")] = '\0';
+		if ((taldescs[i] = strdup(line)) == NULL)
+			err(1, NULL);
+	}
+	rc = 0;
+
+ out:
+	free(line);
+	return rc;
+}
+
+/*
+ * Store the VRPs and VAPs of this run for the early output of the next.
+ */
+void
+output_state_save(struct vrp_array *vrps, struct vap_tree *vaps)
+{
+	char			 tmpname[PATH_MAX];
+	struct state_vrp	 sv;
+	struct state_vap	 sp;
+	struct vrp		*v;
+	struct vap		*vap;
+	uint64_t		 nvrps = vrps->num, nvaps = 0;
+	FILE			*f;
+	int			 fd, n;
+
+	n = snprintf(tmpname, sizeof(tmpname), "%s.XXXXXXXXXX",
+	    OUTPUTSTATE_FILE);
+	if (n < 0 || (size_t)n >= sizeof(tmpname))
+		return;
+	if ((fd = mkostemp(tmpname, O_CLOEXEC)) == -1) {
+		warn("%s: save state", tmpname);
+		return;
+	}
+	(void)fchmod(fd, 0644);
+	if ((f = fdopen(fd, "w")) == NULL)
+		err(1, "fdopen");
+
+	RB_FOREACH(vap, vap_tree, vaps)
+		if (!vap->overflowed)
+			nvaps++;
+
+	if (state_write_tals(f) == -1 ||
+	    fwrite(&nvrps, sizeof(nvrps), 1, f) != 1 ||
+	    fwrite(&nvaps, sizeof(nvaps), 1, f) != 1)
+		goto fail;
+	VRP_FOREACH(v, vrps) {
+		memset(&sv, 0, sizeof(sv));
+		memcpy(sv.addr, v->addr.addr, sizeof(sv.addr));
+		sv.asid = v->asid;
+		sv.afi = v->afi;
+		sv.prefixlen = v->addr.prefixlen;
+		sv.maxlength = v->maxlength;
+		sv.expires = v->expires;
+		sv.talid = v->talid;
+		if (fwrite(&sv, sizeof(sv), 1, f) != 1)
+			goto fail;
+	}
+	RB_FOREACH(vap, vap_tree, vaps) {
+		if (vap->overflowed)
+			continue;
+		memset(&sp, 0, sizeof(sp));
+		sp.custasid = vap->custasid;
+		sp.talid = vap->talid;
+		sp.expires = vap->expires;
+		sp.providersz = vap->providersz;
+		if (fwrite(&sp, sizeof(sp), 1, f) != 1 ||
+		    (vap->providersz > 0 && fwrite(vap->providers,
+		    sizeof(vap->providers[0]), vap->providersz, f) !=
+		    vap->providersz))
+			goto fail;
+	}
+	if (fclose(f) != 0) {
+		warn("%s: save state", tmpname);
+		unlink(tmpname);
+		return;
+	}
+	if (rename(tmpname, OUTPUTSTATE_FILE) == -1) {
+		warn("rename %s to %s", tmpname, OUTPUTSTATE_FILE);
+		unlink(tmpname);
+	}
+	return;
+
+ fail:
+	warn("%s: save state", tmpname);
+	fclose(f);
+	unlink(tmpname);
+}
+
+/*
+ * Load the state of the previous run from the directory dirfd, leaving
+ * out the VRPs and VAPs which expired since. The TAL descriptions are
+ * set as well, so this is only done by the early output process.
+ * Returns -1 if there is no usable state.
+ */
+int
+output_state_load(int dirfd, struct vrp_array *vrps, struct vap_tree *vaps)
+{
+	struct state_vrp	 sv;
+	struct state_vap	 sp;
+	struct vrp		*v;
+	struct vap		*vap;
+	uint64_t		 nvrps, nvaps, i;
+	time_t			 now;
+	FILE			*f;
+	int			 fd;
+
+	if ((fd = openat(dirfd, OUTPUTSTATE_FILE, O_RDONLY | O_CLOEXEC)) == -1)
+		return -1;
+	if ((f = fdopen(fd, "r")) == NULL)
+		err(1, "fdopen");
+	if (state_read_tals(f) == -1 ||
+	    fread(&nvrps, sizeof(nvrps), 1, f) != 1 ||
+	    fread(&nvaps, sizeof(nvaps), 1, f) != 1 ||
+	    nvrps > SIZE_MAX / sizeof(*vrps->v))
+		goto fail;
+
+	now = get_current_time();
+	if (nvrps > 0 &&
+	    (vrps->v = calloc(nvrps, sizeof(*vrps->v))) == NULL)
+		err(1, NULL);
+	vrps->max = nvrps;
+	for (i = 0; i < nvrps; i++) {
+		if (fread(&sv, sizeof(sv), 1, f) != 1)
+			goto fail;
+		if (sv.afi != AFI_IPV4 && sv.afi != AFI_IPV6)
+			goto fail;
+		if (sv.talid < 0 ||
+		    (sv.talid >= talsz && sv.talid != slurm_talid))
+			goto fail;
+		if (sv.expires <= now)
+			continue;
+		v = &vrps->v[vrps->num++];
+		memcpy(v->addr.addr, sv.addr, sizeof(v->addr.addr));
+		v->addr.prefixlen = sv.prefixlen;
+		v->asid = sv.asid;
+		v->afi = sv.afi;
+		v->maxlength = sv.maxlength;
+		v->expires = sv.expires;
+		v->talid = sv.talid;
+	}
+
+	for (i = 0; i < nvaps; i++) {
+		if (fread(&sp, sizeof(sp), 1, f) != 1)
+			goto fail;
+		if (sp.talid < 0 ||
+		    (sp.talid >= talsz && sp.talid != slurm_talid) ||
+		    sp.providersz > MAX_ASPA_PROVIDERS)
+			goto fail;
+		if ((vap = calloc(1, sizeof(*vap))) == NULL)
+			err(1, NULL);
+		vap->custasid = sp.custasid;
+		vap->talid = sp.talid;
+		vap->expires = sp.expires;
+		vap->providersz = sp.providersz;
+		if ((vap->providers = calloc(sp.providersz + 1,
+		    sizeof(vap->providers[0]))) == NULL)
+			err(1, NULL);
+		if (sp.providersz > 0 && fread(vap->providers,
+		    sizeof(vap->providers[0]), sp.providersz, f) !=
+		    sp.providersz) {
+			free(vap->providers);
+			free(vap);
+			goto fail;
+		}
+		if (sp.expires <= now ||
+		    RB_INSERT(vap_tree, vaps, vap) != NULL) {
+			free(vap->providers);
+			free(vap);
+		}
+	}
+
+	fclose(f);
+	return 0;
+
+ fail:
+	warnx("%s: troubles reading state file", OUTPUTSTATE_FILE);
+	fclose(f);
+	output_state_free(vrps, vaps);
+	return -1;
+}
+
+void
+output_state_free(struct vrp_array *vrps, struct vap_tree *vaps)
+{
+	struct vap	*vap, *tvap;
+
+	free(vrps->v);
+	memset(vrps, 0, sizeof(*vrps));
+	RB_FOREACH_SAFE(vap, vap_tree, vaps, tvap) {
+		RB_REMOVE(vap_tree, vaps, vap);
+		free(vap->providers);
+		free(vap);
+	}
+}
@@ -42,28 +42,50 @@
  * SUCH DAMAGE.
  */
 
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
+
+#include <arpa/inet.h>
 
 #include <err.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <netdb.h>
 #include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <limits.h>
 #include <time.h>
+#include <zlib.h>
 
 #include "extern.h"
 
 int		 outformats;
+int		 outputgzip;
 
 static char	 output_tmpname[PATH_MAX];
 static char	 output_name[PATH_MAX];
+static char	 output_gztmpname[PATH_MAX];
+static char	 output_gzname[PATH_MAX];
+
+/*
+ * With -Z the large text outputs are written through a stdio stream
+ * which feeds the plain file and a gzip compressed copy at the same time.
+ */
+#define OUTPUT_GZIP	(FORMAT_CSV | FORMAT_JSON)
+
+struct output_gz {
+	FILE	*f;
+	gzFile	 gz;
+};
 
 static const struct outputs {
 	int	 format;
 	char	*name;
-	int	(*fn)(FILE *, struct vrp_tree *, struct brk_tree *,
+	int	(*fn)(FILE *, struct vrp_array *, struct brk_tree *,
 		    struct vap_tree *, struct vsp_tree *, struct stats *);
 } outputs[] = {
 	{ FORMAT_OPENBGPD, "openbgpd", output_bgpd },
@@ -71,59 +93,185 @@ static const struct outputs {
 	{ FORMAT_BIRD, "bird1v6", output_bird1v6 },
 	{ FORMAT_BIRD, "bird", output_bird2 },
 	{ FORMAT_CSV, "csv", output_csv },
+	{ FORMAT_DELTA, "vrp-delta", output_delta },
 	{ FORMAT_JSON, "json", output_json },
 	{ FORMAT_OMETRIC, "metrics", output_ometric },
+	{ FORMAT_BINARY, "binary", output_binary },
+	{ FORMAT_ROV, "rov", output_rov },
 	{ 0, NULL, NULL }
 };
 
-static FILE	*output_createtmp(char *);
+#define MAX_OUTPUTS	(sizeof(outputs) / sizeof(outputs[0]))
+
+#define OUTPUT_BUFSZ	(256 * 1024)
+
+static FILE	*output_createtmp(char *, int);
 static void	 output_cleantmp(void);
 static int	 output_finish(FILE *);
+static int	 output_gzwrite(void *, const char *, int);
+static int	 output_gzclose(void *);
 static void	 sig_handler(int);
 static void	 set_signal_handler(void);
 
+/*
+ * Write a single output format. Returns 0 on success, 1 on failure.
+ * With -v the size and the time it took are logged, with -Z also the
+ * size of the compressed copy.
+ */
+static int
+output_one(const struct outputs *o, struct vrp_array *v, struct brk_tree *b,
+    struct vap_tree *a, struct vsp_tree *p, struct stats *st)
+{
+	struct timespec start, end;
+	struct stat sb, gzsb;
+	FILE *fout;
+	char rate[64];
+	int gzip;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	gzip = outputgzip && (o->format & OUTPUT_GZIP);
+	fout = output_createtmp(o->name, gzip);
+	if (fout == NULL) {
+		warn("cannot create %s", o->name);
+		return 1;
+	}
+	if ((*o->fn)(fout, v, b, a, p, st) != 0) {
+		warn("output for %s format failed", o->name);
+		fclose(fout);
+		output_cleantmp();
+		return 1;
+	}
+	if (output_finish(fout) != 0) {
+		warn("finish for %s format failed", o->name);
+		output_cleantmp();
+		return 1;
+	}
+
+	if (verbose > 0 && stat(o->name, &sb) == 0) {
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		timespecsub(&end, &start, &end);
+		logx("output %s: %lld bytes in %s", o->name,
+		    (long long)sb.st_size,
+		    fmt_rate(rate, sizeof(rate), sb.st_size, &end));
+		if (gzip && stat(output_gzname, &gzsb) == 0)
+			logx("output %s: %lld bytes compressed", output_gzname,
+			    (long long)gzsb.st_size);
+	}
+	return 0;
+}
+
+/*
+ * The data is no longer modified at this point, so each format is
+ * written by its own child process and all of them run concurrently.
+ * If fork fails the format is written by the main process itself.
+ */
 int
-outputfiles(struct vrp_tree *v, struct brk_tree *b, struct vap_tree *a,
+outputfiles(struct vrp_array *v, struct brk_tree *b, struct vap_tree *a,
     struct vsp_tree *p, struct stats *st)
 {
-	int i, rc = 0;
+	pid_t pids[MAX_OUTPUTS];
+	int i, status, rc = 0;
 
 	atexit(output_cleantmp);
 	set_signal_handler();
 
-	for (i = 0; outputs[i].name; i++) {
-		FILE *fout;
+	/* don't let the children flush pending output a second time */
+	fflush(NULL);
 
+	for (i = 0; outputs[i].name; i++) {
+		pids[i] = -1;
 		if (!(outformats & outputs[i].format))
 			continue;
 
-		fout = output_createtmp(outputs[i].name);
-		if (fout == NULL) {
-			warn("cannot create %s", outputs[i].name);
-			rc = 1;
-			continue;
+		switch (pids[i] = fork()) {
+		case -1:
+			warn("fork");
+			rc |= output_one(&outputs[i], v, b, a, p, st);
+			break;
+		case 0:
+			if (pledge("stdio rpath wpath cpath fattr", NULL) == -1)
+				err(1, "pledge");
+			_exit(output_one(&outputs[i], v, b, a, p, st));
+		default:
+			break;
 		}
-		if ((*outputs[i].fn)(fout, v, b, a, p, st) != 0) {
-			warn("output for %s format failed", outputs[i].name);
-			fclose(fout);
-			output_cleantmp();
-			rc = 1;
+	}
+
+	for (i = 0; outputs[i].name; i++) {
+		if (pids[i] == -1)
 			continue;
+		while (waitpid(pids[i], &status, 0) == -1) {
+			if (errno != EINTR)
+				err(1, "wait");
 		}
-		if (output_finish(fout) != 0) {
-			warn("finish for %s format failed", outputs[i].name);
-			output_cleantmp();
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
 			rc = 1;
-			continue;
-		}
 	}
 
 	return rc;
 }
 
+/*
+ * Write the CSV output of a single TAL into a file named after it.
+ * Used as soon as all the entities of the TAL are processed.
+ */
+int
+outputfile_tal(int talid, struct vrp_array *v)
+{
+	struct outputs	o;
+	char		name[PATH_MAX];
+	int		n;
+
+	n = snprintf(name, sizeof(name), "%s.csv", taldescs[talid]);
+	if (n < 0 || (size_t)n >= sizeof(name))
+		return 1;
+	o.format = FORMAT_CSV;
+	o.name = name;
+	o.fn = output_csv;
+	return output_one(&o, v, NULL, NULL, NULL, NULL);
+}
+
+/*
+ * Write the progress of the running validation, the file is replaced
+ * each time.
+ */
+int
+outputfile_progress(const struct progress *pg)
+{
+	static int	 cleanup;
+	FILE		*fout;
+
+	if (!cleanup) {
+		atexit(output_cleantmp);
+		cleanup = 1;
+	}
+	/* a failed update is skipped, the run goes on */
+	if ((fout = output_createtmp(PROGRESS_FILE, 0)) == NULL) {
+		warn("cannot create %s", PROGRESS_FILE);
+		return 1;
+	}
+	if (output_ometric_progress(fout, pg) != 0) {
+		warn("output for %s failed", PROGRESS_FILE);
+		fclose(fout);
+		output_cleantmp();
+		return 1;
+	}
+	if (output_finish(fout) != 0) {
+		warn("finish for %s failed", PROGRESS_FILE);
+		output_cleantmp();
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * Create the temporary files of output name. Returns NULL with errno set
+ * if they can't be created in the output directory.
+ */
 static FILE *
-output_createtmp(char *name)
+output_createtmp(char *name, int gzip)
 {
+	struct output_gz *og;
 	FILE *f;
 	int fd, r;
 
@@ -135,15 +283,77 @@ output_createtmp(char *name)
 	if (r < 0 || r > (int)sizeof(output_tmpname))
 		err(1, "path too long");
 	fd = mkostemp(output_tmpname, O_CLOEXEC);
-	if (fd == -1)
-		err(1, "mkostemp: %s", output_tmpname);
+	if (fd == -1) {
+		output_tmpname[0] = '\0';
+		return NULL;
+	}
 	(void) fchmod(fd, 0644);
 	f = fdopen(fd, "w");
 	if (f == NULL)
 		err(1, "fdopen");
+	if (setvbuf(f, NULL, _IOFBF, OUTPUT_BUFSZ) != 0)
+		warnx("setvbuf failed");
+	if (!gzip)
+		return f;
+
+	r = snprintf(output_gzname, sizeof output_gzname, "%s.gz",
+	    output_name);
+	if (r < 0 || r >= (int)sizeof(output_gzname))
+		err(1, "path too long");
+	r = snprintf(output_gztmpname, sizeof output_gztmpname,
+	    "%s.XXXXXXXXXXX", output_gzname);
+	if (r < 0 || r >= (int)sizeof(output_gztmpname))
+		err(1, "path too long");
+	fd = mkostemp(output_gztmpname, O_CLOEXEC);
+	if (fd == -1) {
+		r = errno;
+		output_gztmpname[0] = '\0';
+		fclose(f);
+		output_cleantmp();
+		errno = r;
+		return NULL;
+	}
+	(void) fchmod(fd, 0644);
+
+	if ((og = malloc(sizeof(*og))) == NULL)
+		err(1, NULL);
+	og->f = f;
+	if ((og->gz = gzdopen(fd, "wb")) == NULL)
+		err(1, "gzdopen");
+	if ((f = funopen(og, NULL, output_gzwrite, NULL,
+	    output_gzclose)) == NULL)
+		err(1, "funopen");
+	if (setvbuf(f, NULL, _IOFBF, OUTPUT_BUFSZ) != 0)
+		warnx("setvbuf failed");
 	return f;
 }
 
+static int
+output_gzwrite(void *cookie, const char *buf, int len)
+{
+	struct output_gz *og = cookie;
+
+	if (fwrite(buf, 1, len, og->f) != (size_t)len)
+		return -1;
+	if (gzwrite(og->gz, buf, len) != len)
+		return -1;
+	return len;
+}
+
+static int
+output_gzclose(void *cookie)
+{
+	struct output_gz *og = cookie;
+	int rc = 0;
+
+	if (fclose(og->f) != 0)
+		rc = -1;
+	if (gzclose(og->gz) != Z_OK)
+		rc = -1;
+	free(og);
+	return rc;
+}
+
 static int
 output_finish(FILE *out)
 {
@@ -152,6 +362,11 @@ output_finish(FILE *out)
 	if (rename(output_tmpname, output_name) == -1)
 		return -1;
 	output_tmpname[0] = '\0';
+	if (*output_gztmpname) {
+		if (rename(output_gztmpname, output_gzname) == -1)
+			return -1;
+		output_gztmpname[0] = '\0';
+	}
 	return 0;
 }
 
@@ -161,6 +376,9 @@ output_cleantmp(void)
 	if (*output_tmpname)
 		unlink(output_tmpname);
 	output_tmpname[0] = '\0';
+	if (*output_gztmpname)
+		unlink(output_gztmpname);
+	output_gztmpname[0] = '\0';
 }
 
 /*
@@ -246,3 +464,211 @@ outputheader(FILE *out, struct stats *st)
 		return -1;
 	return 0;
 }
+
+/*
+ * Minimal formatters for the per VRP lines of the text outputs, they
+ * are called hundreds of thousands of times. Each one writes to p
+ * without NUL termination and returns the end of the output. The
+ * caller provides enough room.
+ */
+char *
+fmt_str(char *p, const char *s)
+{
+	while (*s != '\0')
+		*p++ = *s++;
+	return p;
+}
+
+char *
+fmt_uint(char *p, unsigned long long v)
+{
+	char	 tmp[20];
+	size_t	 n = 0;
+
+	do {
+		tmp[n++] = '0' + v % 10;
+		v /= 10;
+	} while (v != 0);
+	while (n > 0)
+		*p++ = tmp[--n];
+	return p;
+}
+
+static char *
+fmt_hex16(char *p, unsigned int v)
+{
+	static const char	 hex[] = "0123456789abcdef";
+	int			 shift;
+
+	for (shift = 12; shift > 0 && (v >> shift) == 0; shift -= 4)
+		;
+	for (; shift >= 0; shift -= 4)
+		*p++ = hex[(v >> shift) & 0xf];
+	return p;
+}
+
+/*
+ * Same output as ip_addr_print(). IPv6 addresses are formatted as
+ * RFC 5952 asks for, those starting with 80 zero bits are left to
+ * inet_ntop(3) since it may print them with an embedded IPv4 address.
+ */
+char *
+fmt_prefix(char *p, const struct ip_addr *addr, enum afi afi)
+{
+	static const unsigned char	 zero[10];
+	const unsigned char		*a = addr->addr;
+	char				 buf[INET6_ADDRSTRLEN];
+	unsigned int			 w[8];
+	int				 i, run, best = -1, bestlen = 1;
+
+	if (afi == AFI_IPV4) {
+		for (i = 0; i < 4; i++) {
+			if (i > 0)
+				*p++ = '.';
+			p = fmt_uint(p, a[i]);
+		}
+	} else if (memcmp(a, zero, sizeof(zero)) == 0) {
+		if (inet_ntop(AF_INET6, a, buf, sizeof(buf)) == NULL)
+			err(1, "inet_ntop");
+		p = fmt_str(p, buf);
+	} else {
+		for (i = 0; i < 8; i++)
+			w[i] = a[2 * i] << 8 | a[2 * i + 1];
+
+		/* the first longest run of two or more zero groups */
+		for (i = 0; i < 8; i += run) {
+			for (run = 0; i + run < 8 && w[i + run] == 0; run++)
+				;
+			if (run > bestlen) {
+				best = i;
+				bestlen = run;
+			}
+			if (run == 0)
+				run = 1;
+		}
+
+		for (i = 0; i < 8; i++) {
+			if (best != -1 && i >= best && i < best + bestlen) {
+				if (i == best)
+					*p++ = ':';
+				continue;
+			}
+			if (i > 0)
+				*p++ = ':';
+			p = fmt_hex16(p, w[i]);
+		}
+		if (best != -1 && best + bestlen == 8)
+			*p++ = ':';
+	}
+
+	*p++ = '/';
+	return fmt_uint(p, addr->prefixlen);
+}
+
+void
+brk_iter_init(struct brk_iter *it, struct brk_tree *tree)
+{
+	memset(it, 0, sizeof(*it));
+	it->tree = tree;
+	it->next = RB_MIN(brk_tree, tree);
+}
+
+void
+brk_iter_free(struct brk_iter *it)
+{
+	free(it->active);
+	it->active = NULL;
+	it->nactive = it->maxactive = 0;
+}
+
+/*
+ * Move the walk to the next ASID covered by any key. Returns 0 once all
+ * keys are done.
+ */
+static int
+brk_iter_step(struct brk_iter *it)
+{
+	struct brk	**a;
+	size_t		 i, n;
+
+	if (it->started) {
+		if (it->asid == UINT32_MAX)
+			return 0;
+		it->asid++;
+	}
+	it->started = 1;
+
+	/* drop the keys whose range ended */
+	for (i = n = 0; i < it->nactive; i++)
+		if (it->active[i]->asid_max >= it->asid)
+			it->active[n++] = it->active[i];
+	it->nactive = n;
+
+	/* jump over ASIDs without any key */
+	if (it->nactive == 0) {
+		if (it->next == NULL)
+			return 0;
+		it->asid = it->next->asid;
+	}
+
+	for (; it->next != NULL && it->next->asid <= it->asid;
+	    it->next = RB_NEXT(brk_tree, it->tree, it->next)) {
+		if (it->nactive == it->maxactive) {
+			n = it->maxactive == 0 ? 16 : it->maxactive * 2;
+			a = reallocarray(it->active, n, sizeof(*a));
+			if (a == NULL)
+				err(1, NULL);
+			it->active = a;
+			it->maxactive = n;
+		}
+		it->active[it->nactive++] = it->next;
+	}
+	it->idx = 0;
+	return 1;
+}
+
+/*
+ * Keys of overlapping ranges can cover the same ASID. Only the one which
+ * expires last, or the first of equals, is returned.
+ */
+static int
+brk_iter_dup(const struct brk_iter *it, size_t idx)
+{
+	const struct brk	*b = it->active[idx], *o;
+	size_t			 i;
+
+	for (i = 0; i < it->nactive; i++) {
+		o = it->active[i];
+		if (i == idx || strcmp(o->ski, b->ski) != 0 ||
+		    strcmp(o->pubkey, b->pubkey) != 0)
+			continue;
+		if (o->expires > b->expires ||
+		    (o->expires == b->expires && i < idx))
+			return 1;
+	}
+	return 0;
+}
+
+/*
+ * Return the next key and its ASID in asid, NULL once the walk is done.
+ * Ranges are expanded here so that the outputs which need one line per
+ * ASID do not need a tree node for each.
+ */
+const struct brk *
+brk_iter_next(struct brk_iter *it, uint32_t *asid)
+{
+	size_t	 idx;
+
+	while (!it->done) {
+		while (it->idx < it->nactive) {
+			idx = it->idx++;
+			if (brk_iter_dup(it, idx))
+				continue;
+			*asid = it->asid;
+			return it->active[idx];
+		}
+		if (!brk_iter_step(it))
+			it->done = 1;
+	}
+	return NULL;
+}
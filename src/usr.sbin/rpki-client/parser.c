@@ -17,6 +17,7 @@
  */
 
 #include <sys/queue.h>
+#include <sys/stat.h>
 #include <sys/tree.h>
 #include <sys/types.h>
 
@@ -31,6 +32,7 @@
 #include <imsg.h>
 
 #include <openssl/asn1.h>
+#include <openssl/bn.h>
 #include <openssl/err.h>
 #include <openssl/evp.h>
 #include <openssl/x509.h>
@@ -40,7 +42,9 @@
 
 extern int noop;
 extern int experimental;
+extern int skipinfo;
 extern int verbose;
+extern int repometrics;
 
 static X509_STORE_CTX	*ctx;
 static struct auth_tree	 auths = RB_INITIALIZER(&auths);
@@ -55,6 +59,22 @@ struct parse_repo {
 
 static RB_HEAD(repo_tree, parse_repo)	repos = RB_INITIALIZER(&repos);
 
+struct cache_entry {
+	RB_ENTRY(cache_entry)	 entry;
+	struct cache_rec	 rec;
+	unsigned char		*data;
+};
+
+static RB_HEAD(cache_tree, cache_entry)	objcache = RB_INITIALIZER(&objcache);
+
+/* parse times per object type since they were last sent to main */
+static struct time_hist	parse_times[RTYPE_SIG + 1];
+static int		parse_times_pending;
+
+/* with -u, CPU time per repository since it was last sent to main */
+static struct repo_ptime	*repo_ptimes;
+static size_t			 repo_ptimesz, repo_ptimemax;
+
 static inline int
 repocmp(struct parse_repo *a, struct parse_repo *b)
 {
@@ -63,6 +83,18 @@ repocmp(struct parse_repo *a, struct parse_repo *b)
 
 RB_GENERATE_STATIC(repo_tree, parse_repo, entry, repocmp);
 
+static inline int
+cachecmp(struct cache_entry *a, struct cache_entry *b)
+{
+	int rv;
+
+	if ((rv = memcmp(a->rec.hash, b->rec.hash, sizeof(a->rec.hash))) != 0)
+		return rv;
+	return memcmp(a->rec.chain, b->rec.chain, sizeof(a->rec.chain));
+}
+
+RB_GENERATE_STATIC(cache_tree, cache_entry, entry, cachecmp);
+
 static struct parse_repo *
 repo_get(unsigned int id)
 {
@@ -123,6 +155,29 @@ parse_filepath(unsigned int repoid, const char *path, const char *file,
 	return fn;
 }
 
+/*
+ * Remember the serial of the EE cert of a validated object in its cache
+ * record, objects with an oversized serial are not cached.
+ */
+static void
+parse_cache_serial(struct cache_rec *rec, X509 *x509)
+{
+	BIGNUM	*bn;
+	int	 sz;
+
+	if (rec->type == RTYPE_INVALID)
+		return;
+	if ((bn = ASN1_INTEGER_to_BN(X509_get0_serialNumber(x509),
+	    NULL)) == NULL)
+		errx(1, "ASN1_INTEGER_to_BN");
+	sz = BN_num_bytes(bn);
+	if (sz == 0 || (size_t)sz > sizeof(rec->serial))
+		rec->type = RTYPE_INVALID;
+	else
+		rec->serialsz = BN_bn2bin(bn, rec->serial);
+	BN_free(bn);
+}
+
 /*
  * Parse and validate a ROA.
  * This is standard stuff.
@@ -130,7 +185,7 @@ parse_filepath(unsigned int repoid, const char *path, const char *file,
  */
 static struct roa *
 proc_parser_roa(char *file, const unsigned char *der, size_t len,
-    const struct entity *entp)
+    const struct entity *entp, struct cache_rec *rec)
 {
 	struct roa		*roa;
 	struct auth		*a;
@@ -150,6 +205,7 @@ proc_parser_roa(char *file, const unsigned char *der, size_t len,
 		roa_free(roa);
 		return NULL;
 	}
+	parse_cache_serial(rec, x509);
 	X509_free(x509);
 
 	roa->talid = a->cert->talid;
@@ -165,7 +221,7 @@ proc_parser_roa(char *file, const unsigned char *der, size_t len,
  */
 static struct spl *
 proc_parser_spl(char *file, const unsigned char *der, size_t len,
-    const struct entity *entp)
+    const struct entity *entp, struct cache_rec *rec)
 {
 	struct spl		*spl;
 	struct auth		*a;
@@ -185,6 +241,7 @@ proc_parser_spl(char *file, const unsigned char *der, size_t len,
 		spl_free(spl);
 		return NULL;
 	}
+	parse_cache_serial(rec, x509);
 	X509_free(x509);
 
 	spl->talid = a->cert->talid;
@@ -214,8 +271,10 @@ proc_parser_mft_check(const char *fn, struct mft *p)
 		int try, fd = -1, noent = 0, valid = 0;
 		for (try = 0; try < 2 && !valid; try++) {
 			if ((path = parse_filepath(p->repoid, p->path, m->file,
-			    loc[try])) == NULL)
+			    loc[try])) == NULL) {
+				noent++;
 				continue;
+			}
 			fd = open(path, O_RDONLY);
 			if (fd == -1 && errno == ENOENT)
 				noent++;
@@ -412,6 +471,37 @@ proc_parser_mft_pre(struct entity *entp, char *file, struct crl **crl,
 	return NULL;
 }
 
+/*
+ * Check if the fetched manifest file1 holds the same bytes as the file2
+ * from the valid cache, which mft was parsed from. Parsing it again would
+ * give the same result, so there is no need to.
+ */
+static int
+proc_parser_mft_same(const char *file1, const char *file2,
+    const struct mft *mft)
+{
+	struct stat	 st1, st2;
+	unsigned char	*der, hash[SHA256_DIGEST_LENGTH];
+	size_t		 len;
+
+	if (mft == NULL)
+		return 0;
+	if (stat(file1, &st1) == -1 || stat(file2, &st2) == -1)
+		return 0;
+	if (st1.st_dev == st2.st_dev && st1.st_ino == st2.st_ino)
+		return 1;
+	if (st1.st_size != st2.st_size)
+		return 0;
+
+	if ((der = load_file(file1, &len)) == NULL)
+		return 0;
+	if (!EVP_Digest(der, len, hash, NULL, EVP_sha256(), NULL))
+		errx(1, "EVP_Digest failed");
+	free(der);
+
+	return memcmp(hash, mft->mfthash, sizeof(hash)) == 0;
+}
+
 /*
  * Load the most recent MFT by opening both options and comparing the two.
  */
@@ -434,6 +524,10 @@ proc_parser_mft(struct entity *entp, struct mft **mp, char **crlfile,
 	if (!noop) {
 		file1 = parse_filepath(entp->repoid, entp->path, entp->file,
 		    DIR_TEMP);
+		if (file1 != NULL && proc_parser_mft_same(file1, file2, mft2)) {
+			free(file1);
+			file1 = NULL;
+		}
 		mft1 = proc_parser_mft_pre(entp, file1, &crl1, &crl1file, mft2,
 		    &err1);
 	}
@@ -534,7 +628,7 @@ proc_parser_cert(char *file, const unsigned char *der, size_t len,
 	 * Add validated CA certs to the RPKI auth tree.
 	 */
 	if (cert->purpose == CERT_PURPOSE_CA)
-		auth_insert(&auths, cert, a);
+		auth_lru_add(auth_insert(&auths, cert, a), der, len);
 
 	return cert;
 }
@@ -572,7 +666,7 @@ proc_parser_root_cert(char *file, const unsigned char *der, size_t len,
 	/*
 	 * Add valid roots to the RPKI auth tree.
 	 */
-	auth_insert(&auths, cert, NULL);
+	auth_lru_add(auth_insert(&auths, cert, NULL), der, len);
 
 	return cert;
 }
@@ -615,7 +709,7 @@ proc_parser_gbr(char *file, const unsigned char *der, size_t len,
  */
 static struct aspa *
 proc_parser_aspa(char *file, const unsigned char *der, size_t len,
-    const struct entity *entp)
+    const struct entity *entp, struct cache_rec *rec)
 {
 	struct aspa	*aspa;
 	struct auth	*a;
@@ -635,6 +729,7 @@ proc_parser_aspa(char *file, const unsigned char *der, size_t len,
 		aspa_free(aspa);
 		return NULL;
 	}
+	parse_cache_serial(rec, x509);
 	X509_free(x509);
 
 	aspa->talid = a->cert->talid;
@@ -697,7 +792,7 @@ parse_load_file(struct entity *entp, unsigned char **f, size_t *flen)
 	if (file == NULL)
 		errx(1, "no path to file");
 
-	*f = load_file(file, flen);
+	*f = map_file(file, flen);
 	if (*f == NULL)
 		warn("parse file %s", file);
 
@@ -705,7 +800,316 @@ parse_load_file(struct entity *entp, unsigned char **f, size_t *flen)
 }
 
 /*
- * Process an entity and respond to parent process.
+ * Locate the file specified by the entity information without loading it.
+ */
+static char *
+parse_skip_file(struct entity *entp)
+{
+	char *file;
+
+	file = parse_filepath(entp->repoid, entp->path, entp->file,
+	    entp->location);
+	if (file == NULL)
+		errx(1, "no path to file");
+	return file;
+}
+
+static void
+objcache_insert(struct cache_rec *rec, unsigned char *data)
+{
+	struct cache_entry	*ce;
+
+	if ((ce = calloc(1, sizeof(*ce))) == NULL)
+		err(1, NULL);
+	ce->rec = *rec;
+	ce->data = data;
+	if (RB_INSERT(cache_tree, &objcache, ce) != NULL) {
+		free(ce->data);
+		free(ce);
+	}
+}
+
+static void
+objcache_free(void)
+{
+	struct cache_entry	*ce, *tce;
+
+	RB_FOREACH_SAFE(ce, cache_tree, &objcache, tce) {
+		RB_REMOVE(cache_tree, &objcache, ce);
+		free(ce->data);
+		free(ce);
+	}
+}
+
+/*
+ * Hash the chain of issuers starting at the cert with SKI aki together
+ * with the CRLs of that chain. Also return when the chain expires.
+ * For leaf objects the CRL of the issuer is left out, it changes with
+ * every manifest update, and the EE cert is checked against the current
+ * CRL when the result is reused instead.
+ * The TAL id is part of the hash since it is stored in the results and
+ * depends on the order of the TALs on the command line.
+ * Chains under constrained TALs are not cached since the hash does not
+ * cover the constraints.
+ * Returns 1 on success, 0 if the result can't be cached.
+ */
+static int
+parse_chain_hash(const char *aki, int talid, int leaf, unsigned char *chain,
+    time_t *expires)
+{
+	static const unsigned char	 zero[SHA256_DIGEST_LENGTH];
+	SHA256_CTX			 sctx;
+	struct auth			*a;
+	struct crl			*crl;
+
+	if (aki == NULL || constraints_active(talid))
+		return 0;
+	if ((a = auth_find(&auths, aki)) == NULL)
+		return 0;
+
+	*expires = x509_find_expires(a->cert->notafter, a, &crlt);
+
+	SHA256_Init(&sctx);
+	SHA256_Update(&sctx, a->chainhash, sizeof(a->chainhash));
+	SHA256_Update(&sctx, &talid, sizeof(talid));
+	if (leaf)
+		a = a->issuer;
+	for (; a != NULL; a = a->issuer) {
+		if ((crl = crl_get(&crlt, a)) != NULL)
+			SHA256_Update(&sctx, crl->hash, sizeof(crl->hash));
+		else
+			SHA256_Update(&sctx, zero, sizeof(zero));
+	}
+	SHA256_Update(&sctx, &experimental, sizeof(experimental));
+	SHA256_Final(chain, &sctx);
+	return 1;
+}
+
+/*
+ * Compute the cache key of an object from its content and the chain
+ * of issuers starting at the manifest's issuer.
+ */
+static void
+parse_cache_key(const struct entity *entp, const unsigned char *f,
+    size_t flen, struct cache_rec *rec)
+{
+	memset(rec, 0, sizeof(*rec));
+	rec->type = RTYPE_INVALID;
+
+	if (f == NULL)
+		return;
+	if (!parse_chain_hash(entp->mftaki, entp->talid, 1, rec->chain,
+	    &rec->expires))
+		return;
+	if (!EVP_Digest(f, flen, rec->hash, NULL, EVP_sha256(), NULL))
+		errx(1, "EVP_Digest failed");
+
+	rec->type = entp->type;
+}
+
+/*
+ * Check the serial of a cached EE cert against the CRL of its issuer.
+ * Returns 1 if the cert is not revoked, 0 otherwise.
+ */
+static int
+parse_cache_unrevoked(const struct entity *entp, const struct cache_rec *rec)
+{
+	struct auth	*a;
+	struct crl	*crl;
+	X509_REVOKED	*revoked;
+	ASN1_INTEGER	*serial;
+	BIGNUM		*bn;
+	int		 rc;
+
+	if (rec->serialsz == 0)
+		return 0;
+	if ((a = auth_find(&auths, entp->mftaki)) == NULL)
+		return 0;
+	if ((crl = crl_get(&crlt, a)) == NULL)
+		return 0;
+
+	if ((bn = BN_bin2bn(rec->serial, rec->serialsz, NULL)) == NULL)
+		errx(1, "BN_bin2bn");
+	if ((serial = BN_to_ASN1_INTEGER(bn, NULL)) == NULL)
+		errx(1, "BN_to_ASN1_INTEGER");
+	rc = X509_CRL_get0_by_serial(crl->x509_crl, &revoked, serial) == 0;
+	ASN1_INTEGER_free(serial);
+	BN_free(bn);
+	return rc;
+}
+
+/*
+ * Look up a still valid result for the object in the cache and, if found,
+ * add it to the response together with its cache record.
+ * Returns 1 if the cached result was used, 0 otherwise.
+ */
+static int
+parse_cache_lookup(const struct entity *entp, struct cache_rec *rec,
+    struct ibuf *b)
+{
+	struct cache_entry	*ce, needle;
+	time_t			 now;
+	int			 c = 1;
+
+	if (rec->type == RTYPE_INVALID)
+		return 0;
+
+	memcpy(&needle.rec, rec, sizeof(*rec));
+	if ((ce = RB_FIND(cache_tree, &objcache, &needle)) == NULL)
+		return 0;
+	if (ce->rec.type != rec->type)
+		return 0;
+
+	now = get_current_time();
+	if (now < ce->rec.vtime || now >= ce->rec.expires)
+		return 0;
+	if (!parse_cache_unrevoked(entp, &ce->rec))
+		return 0;
+	/* the key covers the digest of the whole file */
+	cms_sigcache_keep(ce->rec.hash);
+
+	io_simple_buffer(b, &ce->rec.mtime, sizeof(ce->rec.mtime));
+	io_simple_buffer(b, &c, sizeof(c));
+	io_simple_buffer(b, ce->data, ce->rec.len);
+	io_simple_buffer(b, &ce->rec, sizeof(ce->rec));
+	return 1;
+}
+
+/*
+ * Finish the cache record for an object serialized at offset off of b
+ * and append it to the response.
+ */
+static void
+parse_cache_add(struct ibuf *b, struct cache_rec *rec, size_t off,
+    time_t mtime, time_t expires)
+{
+	if (rec->type != RTYPE_INVALID) {
+		rec->vtime = get_current_time();
+		rec->expires = expires;
+		rec->mtime = mtime;
+		rec->len = ibuf_size(b) - off;
+	}
+	io_simple_buffer(b, rec, sizeof(*rec));
+}
+
+/*
+ * Return the path in the valid repo of a file in the temporary .rsync or
+ * .rrdp tree, or NULL if file is not a temporary path.
+ */
+static char *
+parse_validfile(const char *file)
+{
+	const char	*fn;
+	char		*vfn;
+
+	if (strncmp(file, ".rsync/", strlen(".rsync/")) == 0)
+		fn = file + strlen(".rsync/");
+	else if (strncmp(file, ".rrdp/", strlen(".rrdp/")) == 0) {
+		if ((fn = strchr(file + strlen(".rrdp/"), '/')) == NULL)
+			return NULL;
+		fn++;
+	} else
+		return NULL;
+	if ((vfn = strdup(fn)) == NULL)
+		err(1, NULL);
+	return vfn;
+}
+
+/*
+ * Insert a CA certificate or CRL that was already validated by another
+ * parser process. Only the object is parsed, the validation was done by
+ * the other process and the parent ensures that the issuer was sent first.
+ * The parent may already have moved the file into the valid repo, then it
+ * is loaded from there.
+ */
+static void
+parse_replica(struct entity *entp)
+{
+	struct cert	*cert;
+	struct crl	*crl;
+	struct auth	*a = NULL;
+	unsigned char	*f;
+	char		*vfn;
+	size_t		 flen;
+
+	if ((f = load_file(entp->file, &flen)) == NULL && errno == ENOENT &&
+	    (vfn = parse_validfile(entp->file)) != NULL) {
+		free(entp->file);
+		entp->file = vfn;
+		f = load_file(entp->file, &flen);
+	}
+	if (f == NULL) {
+		warn("parse file %s", entp->file);
+		return;
+	}
+
+	switch (entp->type) {
+	case RTYPE_AUTH:
+		cert = cert_parse_pre(entp->file, f, flen);
+		if (cert == NULL)
+			break;
+		if (auth_find(&auths, cert->ski) != NULL) {
+			cert_free(cert);
+			break;
+		}
+		if (cert->aki != NULL && strcmp(cert->aki, cert->ski) != 0) {
+			if ((a = auth_find(&auths, cert->aki)) == NULL) {
+				warnx("%s: replicated certificate without "
+				    "issuer", entp->file);
+				cert_free(cert);
+				break;
+			}
+		}
+		cert->talid = entp->talid;
+		cert->repoid = entp->repoid;
+		auth_lru_add(auth_insert(&auths, cert, a), f, flen);
+		cert_compact(cert);
+		break;
+	case RTYPE_CRL:
+		if ((crl = crl_parse(entp->file, f, flen)) == NULL)
+			break;
+		if (!crl_insert(&crlt, crl))
+			crl_free(crl);
+		break;
+	default:
+		errx(1, "%s: unexpected replica type %d", entp->file,
+		    entp->type);
+	}
+
+	free(f);
+}
+
+/*
+ * Add the CPU time spent on one object of repository repoid.
+ */
+static void
+repo_ptime_add(unsigned int repoid, const struct timespec *ts)
+{
+	struct repo_ptime	*pt;
+	size_t			 i;
+
+	for (i = 0; i < repo_ptimesz; i++)
+		if (repo_ptimes[i].repoid == repoid)
+			break;
+	if (i == repo_ptimesz) {
+		if (repo_ptimesz == repo_ptimemax) {
+			pt = recallocarray(repo_ptimes, repo_ptimemax,
+			    repo_ptimemax + 16, sizeof(*pt));
+			if (pt == NULL)
+				err(1, NULL);
+			repo_ptimes = pt;
+			repo_ptimemax += 16;
+		}
+		repo_ptimes[repo_ptimesz++].repoid = repoid;
+	}
+	pt = &repo_ptimes[i];
+	pt->objects++;
+	timespecadd(&pt->time, ts, &pt->time);
+}
+
+/*
+ * Process a batch of entities and respond to parent process.
+ * The responses are sent back in a single batch as well.
  */
 static void
 parse_entity(struct entityq *q, struct msgbuf *msgq)
@@ -719,14 +1123,21 @@ parse_entity(struct entityq *q, struct msgbuf *msgq)
 	struct gbr	*gbr;
 	struct tak	*tak;
 	struct spl	*spl;
-	struct ibuf	*b;
+	struct ibuf	*b, *batch;
+	struct cache_rec rec;
+	struct timespec	 start, end, cpustart, cpuend;
 	unsigned char	*f;
 	time_t		 mtime, crlmtime;
-	size_t		 flen;
+	size_t		 flen, off, n = 0;
 	char		*file, *crlfile;
+	enum rtype	 ptype, t;
+	unsigned int	 prepoid;
 	int		 c;
 
-	while ((entp = TAILQ_FIRST(q)) != NULL) {
+	batch = io_new_batch();
+
+	while ((entp = TAILQ_FIRST(q)) != NULL &&
+	    n++ < MAX_BATCH_ENTITIES && ibuf_size(batch) < MAX_BATCH_SIZE) {
 		TAILQ_REMOVE(q, entp, entries);
 
 		/* handle RTYPE_REPO first */
@@ -736,6 +1147,20 @@ parse_entity(struct entityq *q, struct msgbuf *msgq)
 			continue;
 		}
 
+		/* state replicated from other parsers, no response needed */
+		if (entp->type == RTYPE_AUTH || entp->type == RTYPE_CRL) {
+			parse_replica(entp);
+			entity_free(entp);
+			continue;
+		}
+
+		TRACE(TRACE_PARSE, 'B', entp->file);
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		if (repometrics)
+			clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpustart);
+		ptype = entp->type;
+		prepoid = entp->repoid;
+
 		/* pass back at least type, repoid and filename */
 		b = io_new_buffer();
 		io_simple_buffer(b, &entp->type, sizeof(entp->type));
@@ -744,6 +1169,7 @@ parse_entity(struct entityq *q, struct msgbuf *msgq)
 
 		file = NULL;
 		f = NULL;
+		flen = 0;
 		mtime = 0;
 		crlmtime = 0;
 
@@ -777,6 +1203,8 @@ parse_entity(struct entityq *q, struct msgbuf *msgq)
 			if (cert != NULL) {
 				cert->repoid = entp->repoid;
 				cert_buffer(b, cert);
+				if (cert->purpose == CERT_PURPOSE_CA)
+					cert_compact(cert);
 			}
 			/*
 			 * The parsed certificate data "cert" is now
@@ -792,9 +1220,22 @@ parse_entity(struct entityq *q, struct msgbuf *msgq)
 			io_simple_buffer(b, &mtime, sizeof(mtime));
 			c = (mft != NULL);
 			io_simple_buffer(b, &c, sizeof(int));
-			if (mft != NULL)
+			if (mft != NULL) {
 				mft_buffer(b, mft);
 
+				/* key for the results of the children */
+				memset(&rec, 0, sizeof(rec));
+				rec.type = RTYPE_INVALID;
+				if (parse_chain_hash(mft->aki, entp->talid, 0,
+				    rec.chain, &rec.expires)) {
+					memcpy(rec.hash, mft->mfthash,
+					    sizeof(rec.hash));
+					rec.vtime = get_current_time();
+					rec.type = RTYPE_MFT;
+				}
+				io_simple_buffer(b, &rec, sizeof(rec));
+			}
+
 			/* Push valid CRL together with the MFT. */
 			if (crlfile != NULL) {
 				enum rtype type;
@@ -812,24 +1253,41 @@ parse_entity(struct entityq *q, struct msgbuf *msgq)
 				    sizeof(crlmtime));
 				free(crlfile);
 
-				io_close_buffer(msgq, b2);
+				io_batch_add(batch, b2);
 			}
 			mft_free(mft);
 			break;
 		case RTYPE_ROA:
 			file = parse_load_file(entp, &f, &flen);
 			io_str_buffer(b, file);
-			roa = proc_parser_roa(file, f, flen, entp);
+			parse_cache_key(entp, f, flen, &rec);
+			if (parse_cache_lookup(entp, &rec, b))
+				break;
+			roa = proc_parser_roa(file, f, flen, entp, &rec);
 			if (roa != NULL)
 				mtime = roa->signtime;
 			io_simple_buffer(b, &mtime, sizeof(mtime));
 			c = (roa != NULL);
 			io_simple_buffer(b, &c, sizeof(int));
-			if (roa != NULL)
+			if (roa != NULL) {
+				off = ibuf_size(b);
 				roa_buffer(b, roa);
+				parse_cache_add(b, &rec, off, mtime,
+				    roa->expires);
+			}
 			roa_free(roa);
 			break;
 		case RTYPE_GBR:
+			/*
+			 * With -k only the manifest hash protects the file,
+			 * send it back unparsed with a zero mtime.
+			 */
+			if (skipinfo) {
+				file = parse_skip_file(entp);
+				io_str_buffer(b, file);
+				io_simple_buffer(b, &mtime, sizeof(mtime));
+				break;
+			}
 			file = parse_load_file(entp, &f, &flen);
 			io_str_buffer(b, file);
 			gbr = proc_parser_gbr(file, f, flen, entp);
@@ -841,17 +1299,30 @@ parse_entity(struct entityq *q, struct msgbuf *msgq)
 		case RTYPE_ASPA:
 			file = parse_load_file(entp, &f, &flen);
 			io_str_buffer(b, file);
-			aspa = proc_parser_aspa(file, f, flen, entp);
+			parse_cache_key(entp, f, flen, &rec);
+			if (parse_cache_lookup(entp, &rec, b))
+				break;
+			aspa = proc_parser_aspa(file, f, flen, entp, &rec);
 			if (aspa != NULL)
 				mtime = aspa->signtime;
 			io_simple_buffer(b, &mtime, sizeof(mtime));
 			c = (aspa != NULL);
 			io_simple_buffer(b, &c, sizeof(int));
-			if (aspa != NULL)
+			if (aspa != NULL) {
+				off = ibuf_size(b);
 				aspa_buffer(b, aspa);
+				parse_cache_add(b, &rec, off, mtime,
+				    aspa->expires);
+			}
 			aspa_free(aspa);
 			break;
 		case RTYPE_TAK:
+			if (skipinfo) {
+				file = parse_skip_file(entp);
+				io_str_buffer(b, file);
+				io_simple_buffer(b, &mtime, sizeof(mtime));
+				break;
+			}
 			file = parse_load_file(entp, &f, &flen);
 			io_str_buffer(b, file);
 			tak = proc_parser_tak(file, f, flen, entp);
@@ -864,7 +1335,10 @@ parse_entity(struct entityq *q, struct msgbuf *msgq)
 			file = parse_load_file(entp, &f, &flen);
 			io_str_buffer(b, file);
 			if (experimental) {
-				spl = proc_parser_spl(file, f, flen, entp);
+				parse_cache_key(entp, f, flen, &rec);
+				if (parse_cache_lookup(entp, &rec, b))
+					break;
+				spl = proc_parser_spl(file, f, flen, entp, &rec);
 				if (spl != NULL)
 					mtime = spl->signtime;
 			} else {
@@ -875,11 +1349,14 @@ parse_entity(struct entityq *q, struct msgbuf *msgq)
 			io_simple_buffer(b, &mtime, sizeof(mtime));
 			c = (spl != NULL);
 			io_simple_buffer(b, &c, sizeof(int));
-			if (spl != NULL)
+			if (spl != NULL) {
+				off = ibuf_size(b);
 				spl_buffer(b, spl);
+				parse_cache_add(b, &rec, off, mtime,
+				    spl->expires);
+			}
 			spl_free(spl);
 			break;
-		case RTYPE_CRL:
 		default:
 			file = parse_filepath(entp->repoid, entp->path,
 			    entp->file, entp->location);
@@ -889,11 +1366,80 @@ parse_entity(struct entityq *q, struct msgbuf *msgq)
 			break;
 		}
 
-		free(f);
+		unmap_file(f, flen);
 		free(file);
-		io_close_buffer(msgq, b);
+		io_batch_add(batch, b);
 		entity_free(entp);
+
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		timespecsub(&end, &start, &end);
+		if (ptype <= RTYPE_SIG) {
+			time_hist_add(&parse_times[ptype],
+			    end.tv_sec + end.tv_nsec / 1e9);
+			parse_times_pending = 1;
+		}
+		if (repometrics) {
+			clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpuend);
+			timespecsub(&cpuend, &cpustart, &cpuend);
+			repo_ptime_add(prepoid, &cpuend);
+		}
+		TRACE(TRACE_PARSE, 'E', NULL);
+	}
+
+	/* parse times of the object types seen in this batch */
+	if (parse_times_pending) {
+		ptype = RTYPE_PTIMES;
+		b = io_new_buffer();
+		io_simple_buffer(b, &ptype, sizeof(ptype));
+		for (t = 0; t <= RTYPE_SIG; t++) {
+			if (parse_times[t].count == 0)
+				continue;
+			io_simple_buffer(b, &t, sizeof(t));
+			io_simple_buffer(b, &parse_times[t],
+			    sizeof(parse_times[t]));
+		}
+		io_batch_add(batch, b);
+		memset(parse_times, 0, sizeof(parse_times));
+		parse_times_pending = 0;
+	}
+
+	/* CPU time per repository of this batch */
+	if (repo_ptimesz > 0) {
+		ptype = RTYPE_RTIMES;
+		b = io_new_buffer();
+		io_simple_buffer(b, &ptype, sizeof(ptype));
+		io_simple_buffer(b, repo_ptimes,
+		    repo_ptimesz * sizeof(*repo_ptimes));
+		io_batch_add(batch, b);
+		memset(repo_ptimes, 0, repo_ptimesz * sizeof(*repo_ptimes));
+		repo_ptimesz = 0;
 	}
+
+	/* digests of the signatures verified in this batch */
+	if (cms_sigcache_pending()) {
+		enum rtype type = RTYPE_SIG;
+
+		b = io_new_buffer();
+		io_simple_buffer(b, &type, sizeof(type));
+		cms_sigcache_buffer(b);
+		io_batch_add(batch, b);
+	}
+
+	/* stamps of the files whose hash matched in this batch */
+	if (valid_stamps_pending()) {
+		enum rtype type = RTYPE_STAMP;
+
+		b = io_new_buffer();
+		io_simple_buffer(b, &type, sizeof(type));
+		valid_stamps_buffer(b);
+		io_batch_add(batch, b);
+	}
+
+	/* control messages alone produce no response */
+	if (ibuf_size(batch) > sizeof(size_t))
+		io_close_buffer(msgq, batch);
+	else
+		ibuf_free(batch);
 }
 
 /*
@@ -911,6 +1457,7 @@ proc_parser(int fd)
 	struct pollfd	 pfd;
 	struct entity	*entp;
 	struct ibuf	*b, *inbuf = NULL;
+	struct ibuf	 msg;
 
 	/* Only allow access to the cache directory. */
 	if (unveil(".", "r") == -1)
@@ -922,11 +1469,16 @@ proc_parser(int fd)
 	OpenSSL_add_all_ciphers();
 	OpenSSL_add_all_digests();
 	x509_init_oid();
-	constraints_parse();
 
 	if ((ctx = X509_STORE_CTX_new()) == NULL)
 		err(1, "X509_STORE_CTX_new");
 
+	if (load_cache_file(OBJCACHE_FILE, objcache_insert) == -1 &&
+	    verbose > 1)
+		warnx("%s: ignoring missing or outdated cache", OBJCACHE_FILE);
+	cms_sigcache_load(SIGCACHE_FILE);
+	valid_stamps_load(STAMPCACHE_FILE);
+
 	TAILQ_INIT(&q);
 
 	msgbuf_init(&msgq);
@@ -939,7 +1491,8 @@ proc_parser(int fd)
 		if (msgq.queued)
 			pfd.events |= POLLOUT;
 
-		if (poll(&pfd, 1, INFTIM) == -1) {
+		/* don't block while there is work left */
+		if (poll(&pfd, 1, TAILQ_EMPTY(&q) ? INFTIM : 0) == -1) {
 			if (errno == EINTR)
 				continue;
 			err(1, "poll");
@@ -953,13 +1506,16 @@ proc_parser(int fd)
 			break;
 
 		if ((pfd.revents & POLLIN)) {
-			b = io_buf_read(fd, &inbuf);
-			if (b != NULL) {
-				entp = calloc(1, sizeof(struct entity));
-				if (entp == NULL)
-					err(1, NULL);
-				entity_read_req(b, entp);
-				TAILQ_INSERT_TAIL(&q, entp, entries);
+			io_buf_fill(fd, &inbuf);
+			while ((b = io_buf_next(inbuf)) != NULL) {
+				while (io_batch_get(b, &msg)) {
+					entp = calloc(1, sizeof(struct entity));
+					if (entp == NULL)
+						err(1, NULL);
+					entity_read_req(&msg, entp);
+					TRACE(TRACE_RECEIVE, 'i', entp->file);
+					TAILQ_INSERT_TAIL(&q, entp, entries);
+				}
 				ibuf_free(b);
 			}
 		}
@@ -983,11 +1539,13 @@ proc_parser(int fd)
 
 	auth_tree_free(&auths);
 	crl_tree_free(&crlt);
+	objcache_free();
 
 	X509_STORE_CTX_free(ctx);
 	msgbuf_clear(&msgq);
 
 	ibuf_free(inbuf);
 
+	trace_dump();
 	exit(0);
 }
@@ -831,10 +831,10 @@ geofeed_print(const X509 *x, const struct geofeed *p)
 	}
 
 	for (i = 0; i < p->geoipsz; i++) {
-		if (p->geoips[i].ip->type != CERT_IP_ADDR)
+		if (p->geoips[i].ip.type != CERT_IP_ADDR)
 			continue;
 
-		ip_addr_print(&p->geoips[i].ip->ip, p->geoips[i].ip->afi, buf,
+		ip_addr_print(&p->geoips[i].ip.ip, p->geoips[i].ip.afi, buf,
 		    sizeof(buf));
 		if (outformats & FORMAT_JSON) {
 			json_do_object("geoip", 1);
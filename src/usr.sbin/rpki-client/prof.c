@@ -0,0 +1,255 @@
+/*	$OpenBSD$ */
+/*
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Sampling CPU profiler. Every process takes a sample PROF_HZ times per
+ * second of CPU time by walking the frame pointer chain of the interrupted
+ * code and counts the distinct stacks in a fixed table. At exit the stacks
+ * are appended to the shared profile file as folded stacks, one line per
+ * stack with the process name as root frame. Addresses are written as
+ * offsets into their object, they are resolved later with addr2line(1).
+ */
+
+#include <sys/time.h>
+
+#include <dlfcn.h>
+#include <err.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "extern.h"
+
+#define PROF_HZ		100
+#define PROF_DEPTH	32
+#define PROF_STACKS	8192
+
+#if defined(__amd64__)
+#define PROF_PC(sc)	((sc)->sc_rip)
+#define PROF_SP(sc)	((sc)->sc_rsp)
+#define PROF_FP(sc)	((sc)->sc_rbp)
+#elif defined(__aarch64__)
+#define PROF_PC(sc)	((sc)->sc_elr)
+#define PROF_SP(sc)	((sc)->sc_sp)
+#define PROF_FP(sc)	((sc)->sc_x[29])
+#elif defined(__i386__)
+#define PROF_PC(sc)	((sc)->sc_eip)
+#define PROF_SP(sc)	((sc)->sc_esp)
+#define PROF_FP(sc)	((sc)->sc_ebp)
+#endif
+
+struct prof_stack {
+	uintptr_t	 pc[PROF_DEPTH];
+	unsigned int	 depth;
+	unsigned int	 count;
+};
+
+int			 proffd = -1;
+static struct prof_stack *prof_stacks;
+static uintptr_t	 prof_top;
+static const char	*prof_name;
+static pid_t		 prof_pid;
+static volatile sig_atomic_t prof_lost;
+
+/*
+ * Open the profile file, the descriptor is inherited by all processes.
+ * Frames at or above top, the frame of main(), are not walked.
+ */
+void
+prof_open(const char *file, void *top)
+{
+#ifndef PROF_PC
+	errx(1, "profiling not supported on this architecture");
+#endif
+	proffd = open(file, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND |
+	    O_CLOEXEC, 0644);
+	if (proffd == -1)
+		err(1, "profile file %s", file);
+	prof_top = (uintptr_t)top;
+}
+
+#ifdef PROF_PC
+static void
+prof_sample(int sig, siginfo_t *si, void *uc)
+{
+	struct sigcontext	*sc = uc;
+	struct prof_stack	*ps;
+	uintptr_t		 pc[PROF_DEPTH], sp, fp, next;
+	unsigned int		 depth = 0, h = 2166136261U, i, n;
+
+	pc[depth++] = PROF_PC(sc);
+	sp = PROF_SP(sc);
+	fp = PROF_FP(sc);
+	while (depth < PROF_DEPTH) {
+		/* only follow frames between the stack pointer and main() */
+		if (fp < sp || fp % sizeof(uintptr_t) != 0 ||
+		    fp + 2 * sizeof(uintptr_t) > prof_top)
+			break;
+		pc[depth++] = ((uintptr_t *)fp)[1];
+		next = ((uintptr_t *)fp)[0];
+		if (next <= fp)
+			break;
+		fp = next;
+	}
+
+	for (i = 0; i < depth; i++)
+		h = (h ^ (unsigned int)pc[i]) * 16777619U;
+
+	for (n = 0; n < PROF_STACKS; n++) {
+		ps = &prof_stacks[(h + n) % PROF_STACKS];
+		if (ps->depth == 0) {
+			memcpy(ps->pc, pc, depth * sizeof(pc[0]));
+			ps->depth = depth;
+		} else if (ps->depth != depth ||
+		    memcmp(ps->pc, pc, depth * sizeof(pc[0])) != 0)
+			continue;
+		ps->count++;
+		return;
+	}
+	prof_lost++;
+}
+#endif
+
+/*
+ * Start sampling in this process, called in freshly forked processes
+ * since the interval timer is not inherited.
+ */
+void
+prof_start(const char *name)
+{
+#ifdef PROF_PC
+	struct sigaction	sa;
+	struct itimerval	itv;
+
+	if (proffd == -1)
+		return;
+
+	if (prof_stacks == NULL) {
+		prof_stacks = calloc(PROF_STACKS, sizeof(*prof_stacks));
+		if (prof_stacks == NULL)
+			err(1, NULL);
+		atexit(prof_dump);
+	} else
+		memset(prof_stacks, 0, PROF_STACKS * sizeof(*prof_stacks));
+	prof_name = name;
+	prof_pid = getpid();
+	prof_lost = 0;
+
+	memset(&sa, 0, sizeof(sa));
+	sigemptyset(&sa.sa_mask);
+	sa.sa_flags = SA_RESTART | SA_SIGINFO;
+	sa.sa_sigaction = prof_sample;
+	if (sigaction(SIGPROF, &sa, NULL) == -1)
+		err(1, "sigaction SIGPROF");
+
+	memset(&itv, 0, sizeof(itv));
+	itv.it_interval.tv_usec = 1000000 / PROF_HZ;
+	itv.it_value = itv.it_interval;
+	if (setitimer(ITIMER_PROF, &itv, NULL) == -1)
+		err(1, "setitimer");
+#endif
+}
+
+/*
+ * Format the location of pc as object+offset.
+ */
+static int
+prof_format(char *buf, size_t bufsz, uintptr_t pc)
+{
+	Dl_info		 info;
+	const char	*obj;
+	int		 n;
+
+	if (dladdr((void *)pc, &info) == 0 || info.dli_fname == NULL)
+		n = snprintf(buf, bufsz, ";0x%lx", (unsigned long)pc);
+	else {
+		if ((obj = strrchr(info.dli_fname, '/')) != NULL)
+			obj++;
+		else
+			obj = info.dli_fname;
+		n = snprintf(buf, bufsz, ";%s+0x%lx", obj,
+		    (unsigned long)(pc - (uintptr_t)info.dli_fbase));
+	}
+	if (n < 0 || (size_t)n >= bufsz)
+		return -1;
+	return n;
+}
+
+/*
+ * Stop sampling and append the stacks of this process to the profile
+ * file. Writes only contain complete lines so the output of the
+ * processes does not interleave.
+ */
+void
+prof_dump(void)
+{
+	struct itimerval	 itv;
+	struct prof_stack	*ps;
+	char			 line[PROF_DEPTH * 64 + 64], buf[16 * 1024];
+	size_t			 i, len = 0, llen;
+	unsigned int		 d;
+	int			 n;
+
+	if (proffd == -1 || prof_stacks == NULL || getpid() != prof_pid)
+		return;
+
+	memset(&itv, 0, sizeof(itv));
+	setitimer(ITIMER_PROF, &itv, NULL);
+	signal(SIGPROF, SIG_IGN);
+
+	if (prof_lost > 0)
+		warnx("%s: %d profile samples lost", prof_name,
+		    (int)prof_lost);
+
+	for (i = 0; i < PROF_STACKS; i++) {
+		ps = &prof_stacks[i];
+		if (ps->count == 0)
+			continue;
+
+		/* root frame first, the sampled pc last */
+		llen = strlcpy(line, prof_name, sizeof(line));
+		for (d = ps->depth; d > 0; d--) {
+			n = prof_format(line + llen, sizeof(line) - llen,
+			    ps->pc[d - 1]);
+			if (n == -1)
+				break;
+			llen += n;
+		}
+		n = snprintf(line + llen, sizeof(line) - llen, " %u\n",
+		    ps->count);
+		if (d > 0 || n < 0 || (size_t)n >= sizeof(line) - llen)
+			continue;
+		llen += n;
+
+		if (sizeof(buf) - len < llen) {
+			if (write(proffd, buf, len) != (ssize_t)len)
+				warn("profile write");
+			len = 0;
+		}
+		memcpy(buf + len, line, llen);
+		len += llen;
+	}
+	if (len > 0 && write(proffd, buf, len) != (ssize_t)len)
+		warn("profile write");
+
+	close(proffd);
+	proffd = -1;
+}
@@ -0,0 +1,164 @@
+/*	$OpenBSD$ */
+/*
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+/*
+ * Read ahead in the valid cache while repositories are fetched. Main
+ * sends the valid directory of a repository when its fetch starts and
+ * the manifests, CRLs and certificates in there are read once, so they
+ * are in the buffer cache when the parser needs them. The other objects
+ * are mostly taken from the object cache and not read at all.
+ */
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fts.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "extern.h"
+
+int	readaheadfd = -1;
+
+/*
+ * Queue the directory dir for readahead. This is only a hint, if the
+ * readahead process can't keep up it is stopped.
+ */
+void
+readahead_add(const char *dir)
+{
+	struct iovec	 iov[2];
+	size_t		 len;
+
+	if (readaheadfd == -1)
+		return;
+
+	len = strlen(dir);
+	if (len >= PATH_MAX)
+		return;
+	iov[0].iov_base = (char *)dir;
+	iov[0].iov_len = len;
+	iov[1].iov_base = "\n";
+	iov[1].iov_len = 1;
+	if (writev(readaheadfd, iov, 2) != (ssize_t)len + 1) {
+		close(readaheadfd);
+		readaheadfd = -1;
+	}
+}
+
+/*
+ * Main closes its end once the fetches are done, stop then.
+ */
+static int
+readahead_stop(int fd)
+{
+	struct pollfd	 pfd;
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	if (poll(&pfd, 1, 0) == -1)
+		err(1, "poll");
+	return (pfd.revents & POLLHUP) != 0;
+}
+
+static void
+readahead_file(const char *file)
+{
+	char	 buf[64 * 1024];
+	int	 fd;
+
+	if ((fd = open(file, O_RDONLY)) == -1)
+		return;
+	while (read(fd, buf, sizeof(buf)) > 0)
+		;
+	close(fd);
+}
+
+static void
+readahead_dir(char *dir, int fd)
+{
+	char	*argv[2] = { dir, NULL };
+	FTS	*fts;
+	FTSENT	*e;
+
+	if ((fts = fts_open(argv, FTS_PHYSICAL | FTS_NOSTAT, NULL)) == NULL)
+		err(1, "fts_open");
+	while ((e = fts_read(fts)) != NULL) {
+		if (e->fts_info != FTS_NSOK && e->fts_info != FTS_F)
+			continue;
+		switch (rtype_from_file_extension(e->fts_name)) {
+		case RTYPE_CER:
+		case RTYPE_CRL:
+		case RTYPE_MFT:
+			readahead_file(e->fts_accpath);
+			if (readahead_stop(fd))
+				exit(0);
+			break;
+		default:
+			break;
+		}
+	}
+	fts_close(fts);
+}
+
+void
+proc_readahead(int fd)
+{
+	struct pollfd	 pfd;
+	char		 buf[2 * PATH_MAX], *nl;
+	size_t		 have = 0;
+	ssize_t		 n;
+
+	if (pledge("stdio rpath", NULL) == -1)
+		err(1, "pledge");
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	for (;;) {
+		if (poll(&pfd, 1, INFTIM) == -1) {
+			if (errno == EINTR)
+				continue;
+			err(1, "poll");
+		}
+		if ((n = read(fd, buf + have, sizeof(buf) - have)) == -1) {
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			err(1, "read");
+		}
+		if (n == 0)
+			break;
+		have += n;
+
+		while ((nl = memchr(buf, '\n', have)) != NULL) {
+			*nl++ = '\0';
+			readahead_dir(buf, fd);
+			have -= nl - buf;
+			memmove(buf, nl, have);
+		}
+		if (have == sizeof(buf))
+			errx(1, "readahead: path too long");
+	}
+
+	exit(0);
+}
@@ -20,6 +20,7 @@
 #include <sys/tree.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
 
 #include <assert.h>
 #include <err.h>
@@ -27,22 +28,49 @@
 #include <fcntl.h>
 #include <fts.h>
 #include <limits.h>
+#include <ohash.h>
 #include <poll.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <imsg.h>
 
 #include "extern.h"
+#include "version.h"
 
 extern struct stats	stats;
 extern int		noop;
 extern int		rrdpon;
+extern int		rrdphedge;
 extern int		repo_timeout;
+extern int		ta_delay;
+extern int		rsyncrest;
+extern int		rrdpwrite;
+extern int		repometrics;
 extern time_t		deadline;
 int			nofetch;
+FILE			*changelog;
+int			 changelog_failed;
+const char		*repo_mirror;
+
+/*
+ * Database of all file path accessed during a run.
+ * The paths are kept in a hash table since they are only looked up and
+ * never need to be visited in order.
+ */
+struct filepath {
+	time_t			 mtime;
+	char			 file[];	/* hash key */
+};
+
+struct filepath_tree {
+	struct ohash		 table;
+};
 
 enum repo_state {
 	REPO_LOADING = 0,
@@ -58,77 +86,358 @@ enum repo_state {
  */
 struct rrdprepo {
 	SLIST_ENTRY(rrdprepo)	 entry;
+	RB_ENTRY(rrdprepo)	 idtree;
+	RB_ENTRY(rrdprepo)	 uritree;
 	char			*notifyuri;
 	char			*basedir;
 	struct filepath_tree	 deleted;
+	struct filepath_tree	 unchanged;	/* same as in valid repo */
 	unsigned int		 id;
+	unsigned int		 prio;
+	unsigned int		 nfiles;	/* handled in this run */
 	enum repo_state		 state;
 };
 static SLIST_HEAD(, rrdprepo)	rrdprepos = SLIST_HEAD_INITIALIZER(rrdprepos);
+static RB_HEAD(rrdp_id_tree, rrdprepo)	rrdp_ids = RB_INITIALIZER(&rrdp_ids);
+static RB_HEAD(rrdp_uri_tree, rrdprepo)	rrdp_uris =
+    RB_INITIALIZER(&rrdp_uris);
 
 struct rsyncrepo {
 	SLIST_ENTRY(rsyncrepo)	 entry;
+	RB_ENTRY(rsyncrepo)	 idtree;
+	RB_ENTRY(rsyncrepo)	 uritree;
 	char			*repouri;
 	char			*basedir;
 	unsigned int		 id;
 	enum repo_state		 state;
+	int			 mirror;	/* fetching from repo_mirror */
 };
 static SLIST_HEAD(, rsyncrepo)	rsyncrepos = SLIST_HEAD_INITIALIZER(rsyncrepos);
+static RB_HEAD(rsync_id_tree, rsyncrepo) rsync_ids = RB_INITIALIZER(&rsync_ids);
+static RB_HEAD(rsync_uri_tree, rsyncrepo) rsync_uris =
+    RB_INITIALIZER(&rsync_uris);
+
+/*
+ * A TA is fetched from at most TA_FETCHES of its URIs at the same time,
+ * the next URI is started when the others did not finish within ta_delay.
+ * Every URI has its own fetch identifier so that late answers of stopped
+ * fetches can be ignored. Concurrent fetches never write to the same
+ * file: http downloads to a temporary file and rsync into a directory
+ * of its own, the winner is moved into basedir.
+ */
+#define TA_FETCHES	2
+
+struct tafetch {
+	char			*temp;		/* file or rsync directory */
+	unsigned int		 id;
+	int			 running;
+};
 
 struct tarepo {
 	SLIST_ENTRY(tarepo)	 entry;
 	char			*descr;
 	char			*basedir;
-	char			*temp;
 	char			**uri;
+	struct tafetch		*fetch;		/* one per URI */
 	size_t			 urisz;
-	size_t			 uriidx;
+	size_t			 uriidx;	/* URI the TA was loaded from */
+	size_t			 urinext;	/* next URI to try */
+	size_t			 nrunning;
+	time_t			 hedge;		/* start of the next fetch */
 	unsigned int		 id;
 	enum repo_state		 state;
 };
 static SLIST_HEAD(, tarepo)	tarepos = SLIST_HEAD_INITIALIZER(tarepos);
 
+/*
+ * The sync timeout and the hedge start of the repositories are kept in a
+ * binary min-heap, so the main loop finds the next one without looking
+ * at every repository.
+ */
+struct repotimer {
+	struct repo		*rp;
+	time_t			 when;
+	size_t			 idx;		/* heap slot + 1, 0 if unset */
+};
+static struct repotimer	**timers;
+static size_t		 ntimers, maxtimers;
+
 struct repo {
 	SLIST_ENTRY(repo)	 entry;
+	RB_ENTRY(repo)		 idtree;
+	RB_ENTRY(repo)		 uritree;	/* by repouri and notifyuri */
+	RB_ENTRY(repo)		 pathtree;	/* by basedir */
 	char			*repouri;
 	char			*notifyuri;
 	char			*basedir;
 	const struct rrdprepo	*rrdp;
 	const struct rsyncrepo	*rsync;
+	const struct rsyncrepo	*hedge;		/* rsync next to slow RRDP */
 	const struct tarepo	*ta;
 	struct entityq		 queue;		/* files waiting for repo */
 	struct repotalstats	 stats[TALSZ_MAX];
 	struct repostats	 repostats;
 	struct timespec		 start_time;
-	time_t			 alarm;		/* sync timeout */
+	struct repotimer	 alarm;		/* sync timeout */
+	struct repotimer	 hedgetime;	/* start of the hedge */
 	int			 talid;
 	int			 stats_used[TALSZ_MAX];
+	int			 prefetch;	/* not referenced yet */
+	int			 backoff;	/* not fetched, failing */
+	int			 rested;	/* not fetched, unchanged */
+	unsigned int		 fails;		/* failed syncs in a row */
+	unsigned int		 quiet;		/* unchanged syncs in a row */
+	time_t			 retry;		/* next probe or sync */
 	unsigned int		 id;		/* identifier */
 };
 static SLIST_HEAD(, repo)	repos = SLIST_HEAD_INITIALIZER(repos);
+static RB_HEAD(repo_id_tree, repo)	repo_ids = RB_INITIALIZER(&repo_ids);
+static RB_HEAD(repo_uri_tree, repo)	repo_uris = RB_INITIALIZER(&repo_uris);
+static RB_HEAD(repo_path_tree, repo)	repo_paths =
+    RB_INITIALIZER(&repo_paths);
 
 /* counter for unique repo id */
 unsigned int		repoid;
 
+/*
+ * Sync time of the repositories in the previous run. Fetches of the
+ * repositories that took longest are started first so that they do not
+ * end up as the tail of the run.
+ */
+struct repohist {
+	SLIST_ENTRY(repohist)	 entry;
+	char			*uri;
+	unsigned int		 msec;
+};
+static SLIST_HEAD(, repohist)	repohists = SLIST_HEAD_INITIALIZER(repohists);
+
+/*
+ * Repositories of the previous run. Their fetch is started right away
+ * instead of once the certificate naming them has been parsed.
+ */
+struct prefetch {
+	RB_ENTRY(prefetch)	 entry;
+	char			*tal;
+	char			*repouri;
+	char			*notifyuri;
+	unsigned int		 fails;
+	unsigned int		 quiet;
+	time_t			 retry;
+	int			 saved;		/* written by repohist_save() */
+};
+static RB_HEAD(prefetch_tree, prefetch)	prefetches =
+    RB_INITIALIZER(&prefetches);
+
+/*
+ * RRDP session state of all repositories, keyed by notification URI.
+ * Loaded from RRDPSTATE_FILE once and written back by cache_save().
+ */
+struct rrdpstate {
+	RB_ENTRY(rrdpstate)	 entry;
+	char			*notifyuri;
+	struct rrdp_session	*state;
+};
+static RB_HEAD(rrdpstate_tree, rrdpstate)	rrdpstates =
+    RB_INITIALIZER(&rrdpstates);
+
+/*
+ * Permanent HTTP redirects, keyed by the original URI. Requests go to
+ * the target directly until the entry expires and the redirect is
+ * learned again. An entry is dropped if a request to its target fails.
+ */
+struct redirect {
+	RB_ENTRY(redirect)	 entry;
+	RB_ENTRY(redirect)	 idtree;
+	char			*uri;
+	char			*target;
+	time_t			 expires;
+	unsigned int		 id;	/* last request sent to target */
+	int			 used;
+};
+static RB_HEAD(redirect_tree, redirect)	redirects =
+    RB_INITIALIZER(&redirects);
+/* entries in use by a request, keyed by the request id */
+static RB_HEAD(redirect_id_tree, redirect)	redirect_ids =
+    RB_INITIALIZER(&redirect_ids);
+
 static struct rsyncrepo	*rsync_get(const char *, const char *);
+static time_t		 repo_hedge_delay(const struct rrdprepo *);
+static void		 repo_hedge_stop(struct repo *);
 static void		 remove_contents(char *);
+static void		 repo_sync_stats_add(const void *,
+		    const struct repostats *);
+static void		 repo_timer_set(struct repotimer *, time_t);
+static void		 repo_timer_del(struct repotimer *);
+static unsigned int	 repohist_prio(const char *);
+static FILE		*fileindex_load(unsigned int *);
+static void		 fileindex_stale(FILE *, struct filepath_tree *,
+			    int);
+static void		 fileindex_save(struct filepath_tree *, unsigned int);
+static void		 cache_write(int);
 
 /*
- * Database of all file path accessed during a run.
+ * Lookup indexes for the repository lists above. The lists remain the
+ * owners of the entries and keep the iteration order.
  */
-struct filepath {
-	RB_ENTRY(filepath)	entry;
-	char			*file;
-	time_t			 mtime;
-};
+static inline int
+rrdp_id_cmp(struct rrdprepo *a, struct rrdprepo *b)
+{
+	return a->id < b->id ? -1 : a->id > b->id;
+}
+
+static inline int
+rrdp_uri_cmp(struct rrdprepo *a, struct rrdprepo *b)
+{
+	return strcmp(a->notifyuri, b->notifyuri);
+}
+
+RB_GENERATE_STATIC(rrdp_id_tree, rrdprepo, idtree, rrdp_id_cmp);
+RB_GENERATE_STATIC(rrdp_uri_tree, rrdprepo, uritree, rrdp_uri_cmp);
+
+static inline int
+rrdpstate_cmp(struct rrdpstate *a, struct rrdpstate *b)
+{
+	return strcmp(a->notifyuri, b->notifyuri);
+}
+
+RB_GENERATE_STATIC(rrdpstate_tree, rrdpstate, entry, rrdpstate_cmp);
+
+static inline int
+redirect_cmp(struct redirect *a, struct redirect *b)
+{
+	return strcmp(a->uri, b->uri);
+}
+
+RB_GENERATE_STATIC(redirect_tree, redirect, entry, redirect_cmp);
+
+static inline int
+redirect_id_cmp(struct redirect *a, struct redirect *b)
+{
+	return a->id < b->id ? -1 : a->id > b->id;
+}
 
+RB_GENERATE_STATIC(redirect_id_tree, redirect, idtree, redirect_id_cmp);
+
+static inline int
+rsync_id_cmp(struct rsyncrepo *a, struct rsyncrepo *b)
+{
+	return a->id < b->id ? -1 : a->id > b->id;
+}
+
+static inline int
+rsync_uri_cmp(struct rsyncrepo *a, struct rsyncrepo *b)
+{
+	return strcmp(a->repouri, b->repouri);
+}
+
+RB_GENERATE_STATIC(rsync_id_tree, rsyncrepo, idtree, rsync_id_cmp);
+RB_GENERATE_STATIC(rsync_uri_tree, rsyncrepo, uritree, rsync_uri_cmp);
+
+static inline int
+repo_id_cmp(struct repo *a, struct repo *b)
+{
+	return a->id < b->id ? -1 : a->id > b->id;
+}
+
+/*
+ * Repositories without notify URI sort before those with one.
+ */
 static inline int
-filepathcmp(struct filepath *a, struct filepath *b)
+repo_uri_cmp(struct repo *a, struct repo *b)
+{
+	int rv;
+
+	if ((rv = strcmp(a->repouri, b->repouri)) != 0)
+		return rv;
+	if (a->notifyuri == NULL || b->notifyuri == NULL)
+		return (a->notifyuri != NULL) - (b->notifyuri != NULL);
+	return strcmp(a->notifyuri, b->notifyuri);
+}
+
+/*
+ * Several repositories can share a base directory, the newest one
+ * sorts first so that a lookup finds it like the list walk did.
+ */
+static inline int
+repo_path_cmp(struct repo *a, struct repo *b)
+{
+	int rv;
+
+	if ((rv = strcmp(a->basedir, b->basedir)) != 0)
+		return rv;
+	return a->id > b->id ? -1 : a->id < b->id;
+}
+
+RB_GENERATE_STATIC(repo_id_tree, repo, idtree, repo_id_cmp);
+RB_GENERATE_STATIC(repo_uri_tree, repo, uritree, repo_uri_cmp);
+RB_GENERATE_STATIC(repo_path_tree, repo, pathtree, repo_path_cmp);
+
+static inline int
+prefetch_cmp(struct prefetch *a, struct prefetch *b)
+{
+	int rv;
+
+	if ((rv = strcmp(a->repouri, b->repouri)) != 0)
+		return rv;
+	if (a->notifyuri == NULL || b->notifyuri == NULL)
+		return (a->notifyuri != NULL) - (b->notifyuri != NULL);
+	return strcmp(a->notifyuri, b->notifyuri);
+}
+
+RB_GENERATE_STATIC(prefetch_tree, prefetch, entry, prefetch_cmp);
+
+static void *
+filepath_calloc(size_t n, size_t sz, void *arg)
+{
+	void *p;
+
+	if ((p = calloc(n, sz)) == NULL)
+		err(1, NULL);
+	return p;
+}
+
+static void *
+filepath_alloc(size_t sz, void *arg)
+{
+	void *p;
+
+	if ((p = malloc(sz)) == NULL)
+		err(1, NULL);
+	return p;
+}
+
+static void
+filepath_hfree(void *p, void *arg)
+{
+	free(p);
+}
+
+static struct ohash_info filepath_info = {
+	.key_offset = offsetof(struct filepath, file),
+	.calloc = filepath_calloc,
+	.free = filepath_hfree,
+	.alloc = filepath_alloc,
+};
+
+static void
+filepath_init(struct filepath_tree *tree)
 {
-	return strcmp(a->file, b->file);
+	ohash_init(&tree->table, 10, &filepath_info);
 }
 
-RB_PROTOTYPE(filepath_tree, filepath, entry, filepathcmp);
+/*
+ * Allocate a new and empty filepath tree.
+ */
+struct filepath_tree *
+filepath_new(void)
+{
+	struct filepath_tree *tree;
+
+	if ((tree = malloc(sizeof(*tree))) == NULL)
+		err(1, NULL);
+	filepath_init(tree);
+	return tree;
+}
 
 /*
  * Functions to lookup which files have been accessed during computation.
@@ -137,20 +446,19 @@ int
 filepath_add(struct filepath_tree *tree, char *file, time_t mtime)
 {
 	struct filepath *fp;
+	const char *end = NULL;
+	unsigned int slot;
 
-	if ((fp = malloc(sizeof(*fp))) == NULL)
-		err(1, NULL);
-	fp->mtime = mtime;
-	if ((fp->file = strdup(file)) == NULL)
-		err(1, NULL);
-
-	if (RB_INSERT(filepath_tree, tree, fp) != NULL) {
+	slot = ohash_qlookup(&tree->table, file);
+	if (ohash_find(&tree->table, slot) != NULL) {
 		/* already in the tree */
-		free(fp->file);
-		free(fp);
 		return 0;
 	}
 
+	fp = ohash_create_entry(&filepath_info, file, &end);
+	fp->mtime = mtime;
+	ohash_insert(&tree->table, slot, fp);
+
 	return 1;
 }
 
@@ -160,9 +468,7 @@ filepath_add(struct filepath_tree *tree, char *file, time_t mtime)
 static struct filepath *
 filepath_find(struct filepath_tree *tree, char *file)
 {
-	struct filepath needle = { .file = file };
-
-	return RB_FIND(filepath_tree, tree, &needle);
+	return ohash_find(&tree->table, ohash_qlookup(&tree->table, file));
 }
 
 /*
@@ -180,25 +486,48 @@ filepath_exists(struct filepath_tree *tree, char *file)
 static void
 filepath_put(struct filepath_tree *tree, struct filepath *fp)
 {
-	RB_REMOVE(filepath_tree, tree, fp);
-	free((void *)fp->file);
+	ohash_remove(&tree->table, ohash_qlookup(&tree->table, fp->file));
 	free(fp);
 }
 
 /*
- * Free all elements of a filepath tree.
+ * Return a snapshot of all elements of a filepath tree, the number of
+ * elements is stored in num. The table must not be modified while it is
+ * walked so callers that add or remove entries iterate over the snapshot.
+ */
+static struct filepath **
+filepath_list(struct filepath_tree *tree, size_t *num)
+{
+	struct filepath **list, *fp;
+	unsigned int slot;
+	size_t n = 0;
+
+	*num = ohash_entries(&tree->table);
+	if ((list = calloc(*num + 1, sizeof(*list))) == NULL)
+		err(1, NULL);
+	for (fp = ohash_first(&tree->table, &slot); fp != NULL;
+	    fp = ohash_next(&tree->table, &slot))
+		list[n++] = fp;
+	assert(n == *num);
+	return list;
+}
+
+/*
+ * Free all elements of a filepath tree, the tree is empty afterwards.
  */
 static void
 filepath_free(struct filepath_tree *tree)
 {
-	struct filepath *fp, *nfp;
+	struct filepath *fp;
+	unsigned int slot;
 
-	RB_FOREACH_SAFE(fp, filepath_tree, tree, nfp)
-		filepath_put(tree, fp);
+	for (fp = ohash_first(&tree->table, &slot); fp != NULL;
+	    fp = ohash_next(&tree->table, &slot))
+		free(fp);
+	ohash_delete(&tree->table);
+	filepath_init(tree);
 }
 
-RB_GENERATE(filepath_tree, filepath, entry, filepathcmp);
-
 /*
  * Function to hash a string into a unique directory name.
  * Returned hash needs to be freed.
@@ -244,6 +573,21 @@ repo_dir(const char *uri, const char *dir, int hash)
 	return out;
 }
 
+/*
+ * Directories created by repo_mkpath() relative to the cache directory.
+ * Most files land in a directory that already exists, so the mkdir of
+ * every path component is done once per directory. The cache is emptied
+ * whenever directories are removed.
+ */
+static struct filepath_tree	*mkdirs;
+
+static void
+repo_mkpath_flush(void)
+{
+	if (mkdirs != NULL && ohash_entries(&mkdirs->table) > 0)
+		filepath_free(mkdirs);
+}
+
 /*
  * Function to create all missing directories to a path.
  * This functions alters the path temporarily.
@@ -257,10 +601,19 @@ repo_mkpath(int fd, char *file)
 	slash = strrchr(file, '/');
 	assert(slash != NULL);
 	*slash = '\0';
+	if (fd == AT_FDCWD && mkdirs != NULL && filepath_exists(mkdirs, file)) {
+		*slash = '/';
+		return 0;
+	}
 	if (mkpathat(fd, file) == -1) {
 		warn("mkpath %s", file);
 		return -1;
 	}
+	if (fd == AT_FDCWD) {
+		if (mkdirs == NULL)
+			mkdirs = filepath_new();
+		filepath_add(mkdirs, file, 0);
+	}
 	*slash = '/';
 	return 0;
 }
@@ -292,9 +645,23 @@ repo_done(const void *vp, int ok)
 	struct timespec flush_time;
 
 	SLIST_FOREACH(rp, &repos, entry) {
-		if (vp != rp->ta && vp != rp->rsync && vp != rp->rrdp)
+		if (vp != rp->ta && vp != rp->rsync && vp != rp->rrdp &&
+		    vp != rp->hedge)
 			continue;
 
+		/* the first of RRDP and the hedged rsync to finish wins */
+		if (vp == rp->hedge) {
+			rp->hedge = NULL;
+			if (!ok || rp->rrdp == NULL)
+				continue;
+			logx("%s: rsync finished before RRDP", rp->repouri);
+			repo_hedge_stop(rp);
+			rp->rsync = vp;
+		} else if (vp == rp->rrdp) {
+			rp->hedge = NULL;
+			repo_timer_del(&rp->hedgetime);
+		}
+
 		/* for rrdp try to fall back to rsync */
 		if (vp == rp->rrdp && !ok && !nofetch) {
 			rp->rrdp = NULL;
@@ -332,55 +699,179 @@ ta_filename(const struct tarepo *tr, int temp)
 	return nfile;
 }
 
+static int
+ta_is_rsync(const struct tarepo *tr, size_t idx)
+{
+	return strncasecmp(tr->uri[idx], RSYNC_PROTO, RSYNC_PROTO_LEN) == 0;
+}
+
+/*
+ * Start fetching the TA from the next URI. Once all URIs are used up
+ * and no other fetch is running the TA falls back to cache.
+ */
 static void
 ta_fetch(struct tarepo *tr)
 {
+	struct tafetch *tf;
+	size_t idx;
+	int fd;
+
+	if (tr->state != REPO_LOADING)
+		return;
+
 	if (!rrdpon) {
-		for (; tr->uriidx < tr->urisz; tr->uriidx++) {
-			if (strncasecmp(tr->uri[tr->uriidx],
-			    RSYNC_PROTO, RSYNC_PROTO_LEN) == 0)
+		for (; tr->urinext < tr->urisz; tr->urinext++) {
+			if (ta_is_rsync(tr, tr->urinext))
 				break;
 		}
 	}
 
-	if (tr->uriidx >= tr->urisz) {
+	tr->hedge = 0;
+	if (tr->urinext >= tr->urisz) {
+		if (tr->nrunning > 0)
+			return;
 		tr->state = REPO_FAILED;
+		tr->uriidx = tr->urisz;
 		logx("ta/%s: fallback to cache", tr->descr);
 
 		repo_done(tr, 0);
 		return;
 	}
+	if (tr->nrunning >= TA_FETCHES)
+		return;
 
-	logx("ta/%s: pulling from %s", tr->descr, tr->uri[tr->uriidx]);
+	idx = tr->urinext++;
+	tf = &tr->fetch[idx];
+	tf->running = 1;
+	tr->nrunning++;
+	if (ta_delay > 0 && tr->urinext < tr->urisz &&
+	    tr->nrunning < TA_FETCHES)
+		tr->hedge = getmonotime() + ta_delay;
 
-	if (strncasecmp(tr->uri[tr->uriidx], RSYNC_PROTO,
-	    RSYNC_PROTO_LEN) == 0) {
+	logx("ta/%s: pulling from %s", tr->descr, tr->uri[idx]);
+
+	if (ta_is_rsync(tr, idx)) {
 		/*
 		 * Create destination location.
 		 * Build up the tree to this point.
 		 */
-		rsync_fetch(tr->id, tr->uri[tr->uriidx], tr->basedir, NULL);
+		if (asprintf(&tf->temp, "%s/.fetch.%u", tr->basedir,
+		    tf->id) == -1)
+			err(1, NULL);
+		if (mkpath(tf->temp) == -1) {
+			warn("mkpath %s", tf->temp);
+			rsync_finish(tf->id, 0);
+			return;
+		}
+		rsync_fetch(tf->id, tr->uri[idx], tf->temp, NULL, UINT_MAX);
 	} else {
-		int fd;
-
-		tr->temp = ta_filename(tr, 1);
-		fd = mkostemp(tr->temp, O_CLOEXEC);
+		tf->temp = ta_filename(tr, 1);
+		fd = mkostemp(tf->temp, O_CLOEXEC);
 		if (fd == -1) {
-			warn("mkostemp: %s", tr->temp);
-			http_finish(tr->id, HTTP_FAILED, NULL);
+			warn("mkostemp: %s", tf->temp);
+			http_finish(tf->id, HTTP_FAILED, NULL, NULL);
 			return;
 		}
 		if (fchmod(fd, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH) == -1)
-			warn("fchmod: %s", tr->temp);
+			warn("fchmod: %s", tf->temp);
+
+		http_fetch(tf->id, tr->uri[idx], NULL, NULL, 0, UINT_MAX, fd);
+		if (repometrics) {
+			struct repostats rs = { .http_reqs = 1 };
+
+			repo_sync_stats_add(tr, &rs);
+		}
+	}
+}
+
+/*
+ * Remove the temporary file or rsync directory of a fetch.
+ */
+static void
+ta_fetch_clean(struct tarepo *tr, struct tafetch *tf)
+{
+	struct stat st;
+
+	if (tf->temp == NULL)
+		return;
+	if (ta_is_rsync(tr, tf - tr->fetch)) {
+		if (lstat(tf->temp, &st) == 0)
+			remove_contents(tf->temp);
+		if (rmdir(tf->temp) == -1 && errno != ENOENT)
+			warn("rmdir %s", tf->temp);
+	} else if (unlink(tf->temp) == -1 && errno != ENOENT)
+		warn("unlink %s", tf->temp);
+	free(tf->temp);
+	tf->temp = NULL;
+}
+
+/*
+ * Stop a running fetch. The http process drops the request and its
+ * temporary file is removed. An aborted rsync may still be writing, its
+ * directory is removed once it reports back or at the end of the run.
+ */
+static void
+ta_fetch_stop(struct tarepo *tr, struct tafetch *tf)
+{
+	if (!tf->running)
+		return;
+	tf->running = 0;
+	tr->nrunning--;
+	if (ta_is_rsync(tr, tf - tr->fetch))
+		rsync_abort(tf->id);
+	else {
+		http_abort(tf->id);
+		ta_fetch_clean(tr, tf);
+	}
+}
+
+/*
+ * A fetch finished, the first successful one wins and stops the others.
+ * On failure the next URI is tried.
+ */
+static void
+ta_fetch_done(struct tarepo *tr, struct tafetch *tf, int ok)
+{
+	size_t i;
 
-		http_fetch(tr->id, tr->uri[tr->uriidx], NULL, fd);
+	tf->running = 0;
+	tr->nrunning--;
+	ta_fetch_clean(tr, tf);
+
+	if (!ok) {
+		warnx("ta/%s: load from network failed", tr->descr);
+		ta_fetch(tr);
+		return;
 	}
+
+	for (i = 0; i < tr->urisz; i++)
+		ta_fetch_stop(tr, &tr->fetch[i]);
+	logx("ta/%s: loaded from network", tr->descr);
+	tr->uriidx = tf - tr->fetch;
+	tr->hedge = 0;
+	tr->state = REPO_DONE;
+	repo_done(tr, 1);
+}
+
+/*
+ * Sync timeout of the TA, give up on all running fetches.
+ */
+static void
+ta_timeout(struct tarepo *tr)
+{
+	size_t i;
+
+	for (i = 0; i < tr->urisz; i++)
+		ta_fetch_stop(tr, &tr->fetch[i]);
+	warnx("ta/%s: load from network failed", tr->descr);
+	ta_fetch(tr);
 }
 
 static struct tarepo *
 ta_get(struct tal *tal)
 {
 	struct tarepo *tr;
+	size_t i;
 
 	/* no need to look for possible other repo */
 
@@ -399,32 +890,47 @@ ta_get(struct tal *tal)
 	tal->urisz = 0;
 	tal->uri = NULL;
 
+	if ((tr->fetch = calloc(tr->urisz, sizeof(*tr->fetch))) == NULL)
+		err(1, NULL);
+	for (i = 0; i < tr->urisz; i++)
+		tr->fetch[i].id = i == 0 ? tr->id : ++repoid;
+
 	ta_fetch(tr);
 
 	return tr;
 }
 
 static struct tarepo *
-ta_find(unsigned int id)
+ta_find(unsigned int id, struct tafetch **tfp)
 {
 	struct tarepo *tr;
+	size_t i;
 
-	SLIST_FOREACH(tr, &tarepos, entry)
-		if (id == tr->id)
-			break;
-	return tr;
+	SLIST_FOREACH(tr, &tarepos, entry) {
+		for (i = 0; i < tr->urisz; i++) {
+			if (id == tr->fetch[i].id) {
+				*tfp = &tr->fetch[i];
+				return tr;
+			}
+		}
+	}
+	return NULL;
 }
 
 static void
 ta_free(void)
 {
 	struct tarepo *tr;
+	size_t i;
 
 	while ((tr = SLIST_FIRST(&tarepos)) != NULL) {
 		SLIST_REMOVE_HEAD(&tarepos, entry);
 		free(tr->descr);
 		free(tr->basedir);
-		free(tr->temp);
+		/* all fetches are over, the processes exited */
+		for (i = 0; i < tr->urisz; i++)
+			ta_fetch_clean(tr, &tr->fetch[i]);
+		free(tr->fetch);
 		free(tr->uri);
 		free(tr);
 	}
@@ -433,25 +939,27 @@ ta_free(void)
 static struct rsyncrepo *
 rsync_get(const char *uri, const char *validdir)
 {
-	struct rsyncrepo *rr;
+	struct rsyncrepo *rr, key;
 	char *repo;
 
 	if ((repo = rsync_base_uri(uri)) == NULL)
 		errx(1, "bad caRepository URI: %s", uri);
 
-	SLIST_FOREACH(rr, &rsyncrepos, entry)
-		if (strcmp(rr->repouri, repo) == 0) {
-			free(repo);
-			return rr;
-		}
+	key.repouri = repo;
+	if ((rr = RB_FIND(rsync_uri_tree, &rsync_uris, &key)) != NULL) {
+		free(repo);
+		return rr;
+	}
 
 	if ((rr = calloc(1, sizeof(*rr))) == NULL)
 		err(1, NULL);
 
 	rr->id = ++repoid;
+	rr->repouri = repo;
 	SLIST_INSERT_HEAD(&rsyncrepos, rr, entry);
+	RB_INSERT(rsync_id_tree, &rsync_ids, rr);
+	RB_INSERT(rsync_uri_tree, &rsync_uris, rr);
 
-	rr->repouri = repo;
 	rr->basedir = repo_dir(repo, ".rsync", 0);
 
 	/* create base directory */
@@ -461,8 +969,23 @@ rsync_get(const char *uri, const char *validdir)
 		return rr;
 	}
 
+	/*
+	 * A peer exports its validated cache, which is laid out by
+	 * repo_dir(), so the repository is found under the same path.
+	 */
+	if (repo_mirror != NULL) {
+		rr->mirror = 1;
+		repo = repo_dir(rr->repouri, repo_mirror, 0);
+		logx("%s: pulling from %s", rr->basedir, repo);
+		rsync_fetch(rr->id, repo, rr->basedir, validdir,
+		    repohist_prio(rr->repouri));
+		free(repo);
+		return rr;
+	}
+
 	logx("%s: pulling from %s", rr->basedir, rr->repouri);
-	rsync_fetch(rr->id, rr->repouri, rr->basedir, validdir);
+	rsync_fetch(rr->id, rr->repouri, rr->basedir, validdir,
+	    repohist_prio(rr->repouri));
 
 	return rr;
 }
@@ -470,12 +993,10 @@ rsync_get(const char *uri, const char *validdir)
 static struct rsyncrepo *
 rsync_find(unsigned int id)
 {
-	struct rsyncrepo *rr;
+	struct rsyncrepo key;
 
-	SLIST_FOREACH(rr, &rsyncrepos, entry)
-		if (id == rr->id)
-			break;
-	return rr;
+	key.id = id;
+	return RB_FIND(rsync_id_tree, &rsync_ids, &key);
 }
 
 static void
@@ -485,6 +1006,8 @@ rsync_free(void)
 
 	while ((rr = SLIST_FIRST(&rsyncrepos)) != NULL) {
 		SLIST_REMOVE_HEAD(&rsyncrepos, entry);
+		RB_REMOVE(rsync_id_tree, &rsync_ids, rr);
+		RB_REMOVE(rsync_uri_tree, &rsync_uris, rr);
 		free(rr->repouri);
 		free(rr->basedir);
 		free(rr);
@@ -514,16 +1037,15 @@ rrdp_filename(const struct rrdprepo *rr, const char *uri, int valid)
 }
 
 /*
- * Build RRDP state file name based on the repo info.
- * If temp is set add Xs for mkostemp.
+ * Build the name of the RRDP state file of older versions, it is only
+ * read if the repository is not in RRDPSTATE_FILE yet.
  */
 static char *
-rrdp_state_filename(const struct rrdprepo *rr, int temp)
+rrdp_state_filename(const struct rrdprepo *rr)
 {
 	char *nfile;
 
-	if (asprintf(&nfile, "%s/.state%s", rr->basedir,
-	    temp ? ".XXXXXXXX" : "") == -1)
+	if (asprintf(&nfile, "%s/.state", rr->basedir) == -1)
 		err(1, NULL);
 
 	return nfile;
@@ -532,12 +1054,10 @@ rrdp_state_filename(const struct rrdprepo *rr, int temp)
 static struct rrdprepo *
 rrdp_find(unsigned int id)
 {
-	struct rrdprepo *rr;
+	struct rrdprepo key;
 
-	SLIST_FOREACH(rr, &rrdprepos, entry)
-		if (id == rr->id)
-			break;
-	return rr;
+	key.id = id;
+	return RB_FIND(rrdp_id_tree, &rrdp_ids, &key);
 }
 
 static void
@@ -547,11 +1067,16 @@ rrdp_free(void)
 
 	while ((rr = SLIST_FIRST(&rrdprepos)) != NULL) {
 		SLIST_REMOVE_HEAD(&rrdprepos, entry);
+		RB_REMOVE(rrdp_id_tree, &rrdp_ids, rr);
+		RB_REMOVE(rrdp_uri_tree, &rrdp_uris, rr);
 
 		free(rr->notifyuri);
 		free(rr->basedir);
 
 		filepath_free(&rr->deleted);
+		ohash_delete(&rr->deleted.table);
+		filepath_free(&rr->unchanged);
+		ohash_delete(&rr->unchanged.table);
 
 		free(rr);
 	}
@@ -607,37 +1132,104 @@ repo_alloc(int talid)
 
 	rp->id = ++repoid;
 	rp->talid = talid;
-	rp->alarm = getmonotime() + repo_timeout;
+	rp->alarm.rp = rp;
+	rp->hedgetime.rp = rp;
+	repo_timer_set(&rp->alarm, getmonotime() + repo_timeout);
 	TAILQ_INIT(&rp->queue);
 	SLIST_INSERT_HEAD(&repos, rp, entry);
+	RB_INSERT(repo_id_tree, &repo_ids, rp);
 	clock_gettime(CLOCK_MONOTONIC, &rp->start_time);
 
-	stats.repos++;
 	return rp;
 }
 
 /*
- * Parse the RRDP state file if it exists and set the session struct
- * based on that information.
+ * Parse the "snapshot delta" sizes line of the RRDP state file.
  */
-static struct rrdp_session *
-rrdp_session_parse(const struct rrdprepo *rr)
+static int
+rrdp_session_parse_size(struct rrdp_session *state, char *line)
 {
-	FILE *f;
-	struct rrdp_session *state;
-	int fd, ln = 0, deltacnt = 0;
 	const char *errstr;
-	char *line = NULL, *file;
-	size_t len = 0;
-	ssize_t n;
-
-	if ((state = calloc(1, sizeof(*state))) == NULL)
-		err(1, NULL);
+	char *delta;
 
-	file = rrdp_state_filename(rr, 0);
-	if ((fd = open(file, O_RDONLY)) == -1) {
-		if (errno != ENOENT)
-			warn("%s: open state file", rr->basedir);
+	if ((delta = strchr(line, ' ')) == NULL)
+		return -1;
+	*delta++ = '\0';
+	state->snapshot_size = strtonum(line, 0, LLONG_MAX, &errstr);
+	if (errstr != NULL)
+		return -1;
+	state->delta_size = strtonum(delta, 0, LLONG_MAX, &errstr);
+	if (errstr != NULL)
+		return -1;
+	return 0;
+}
+
+static char *
+xstrdup_null(const char *s)
+{
+	char *r;
+
+	if (s == NULL)
+		return NULL;
+	if ((r = strdup(s)) == NULL)
+		err(1, NULL);
+	return r;
+}
+
+static struct rrdp_session *
+rrdp_session_dup(const struct rrdp_session *s)
+{
+	struct rrdp_session *n;
+	size_t i;
+
+	if ((n = calloc(1, sizeof(*n))) == NULL)
+		err(1, NULL);
+	n->session_id = xstrdup_null(s->session_id);
+	n->last_mod = xstrdup_null(s->last_mod);
+	n->etag = xstrdup_null(s->etag);
+	n->serial = s->serial;
+	n->snapshot_size = s->snapshot_size;
+	n->delta_size = s->delta_size;
+	for (i = 0; i < MAX_RRDP_DELTAS && s->deltas[i] != NULL; i++)
+		n->deltas[i] = xstrdup_null(s->deltas[i]);
+	return n;
+}
+
+static struct rrdpstate *
+rrdpstate_find(const char *notifyuri)
+{
+	struct rrdpstate key;
+
+	key.notifyuri = (char *)notifyuri;
+	return RB_FIND(rrdpstate_tree, &rrdpstates, &key);
+}
+
+/*
+ * Return the session state of the RRDP repository, an empty session
+ * if nothing is known about it yet.
+ */
+static struct rrdp_session *
+rrdp_session_parse(const struct rrdprepo *rr)
+{
+	FILE *f;
+	struct rrdpstate *rs;
+	struct rrdp_session *state;
+	int fd, ln = 0, deltacnt = 0;
+	const char *errstr;
+	char *line = NULL, *file;
+	size_t len = 0;
+	ssize_t n;
+
+	if ((rs = rrdpstate_find(rr->notifyuri)) != NULL)
+		return rrdp_session_dup(rs->state);
+
+	if ((state = calloc(1, sizeof(*state))) == NULL)
+		err(1, NULL);
+
+	file = rrdp_state_filename(rr);
+	if ((fd = open(file, O_RDONLY)) == -1) {
+		if (errno != ENOENT)
+			warn("%s: open state file", rr->basedir);
 		free(file);
 		return state;
 	}
@@ -665,7 +1257,21 @@ rrdp_session_parse(const struct rrdprepo *rr)
 			if ((state->last_mod = strdup(line)) == NULL)
 				err(1, NULL);
 			break;
+		case 3:
+			/* optional entity tag, deltas start with a serial */
+			if (line[0] == '"' || strncmp(line, "W/", 2) == 0) {
+				if ((state->etag = strdup(line)) == NULL)
+					err(1, NULL);
+				break;
+			}
+			/* FALLTHROUGH */
 		default:
+			if (strncmp(line, "size ", 5) == 0) {
+				if (rrdp_session_parse_size(state, line + 5) ==
+				    -1)
+					goto fail;
+				break;
+			}
 			if (deltacnt >= MAX_RRDP_DELTAS)
 				goto fail;
 			if ((state->deltas[deltacnt++] = strdup(line)) == NULL)
@@ -687,72 +1293,41 @@ rrdp_session_parse(const struct rrdprepo *rr)
 	free(line);
 	free(state->session_id);
 	free(state->last_mod);
+	free(state->etag);
 	memset(state, 0, sizeof(*state));
 	return state;
 }
 
 /*
- * Carefully write the RRDP session state file back.
+ * Remember the new RRDP session state, it is written out together with
+ * that of all other repositories at the end of the run. A state file
+ * of an older version is removed since it is stale now.
  */
 void
 rrdp_session_save(unsigned int id, struct rrdp_session *state)
 {
 	struct rrdprepo *rr;
-	char *temp, *file;
-	FILE *f = NULL;
-	int fd, i;
+	struct rrdpstate *rs;
+	char *file;
 
 	rr = rrdp_find(id);
 	if (rr == NULL)
 		errx(1, "non-existent rrdp repo %u", id);
 
-	file = rrdp_state_filename(rr, 0);
-	temp = rrdp_state_filename(rr, 1);
-
-	if ((fd = mkostemp(temp, O_CLOEXEC)) == -1)
-		goto fail;
-	(void)fchmod(fd, 0644);
-	f = fdopen(fd, "w");
-	if (f == NULL)
-		err(1, "fdopen");
-
-	/* write session state file out */
-	if (fprintf(f, "%s\n%lld\n", state->session_id,
-	    state->serial) < 0)
-		goto fail;
-
-	if (state->last_mod != NULL) {
-		if (fprintf(f, "%s\n", state->last_mod) < 0)
-			goto fail;
-	} else {
-		if (fprintf(f, "-\n") < 0)
-			goto fail;
-	}
-	for (i = 0; i < MAX_RRDP_DELTAS && state->deltas[i] != NULL; i++) {
-		if (fprintf(f, "%s\n", state->deltas[i]) < 0)
-			goto fail;
-	}
-	if (fclose(f) != 0) {
-		f = NULL;
-		goto fail;
-	}
+	if ((rs = rrdpstate_find(rr->notifyuri)) == NULL) {
+		if ((rs = calloc(1, sizeof(*rs))) == NULL)
+			err(1, NULL);
+		if ((rs->notifyuri = strdup(rr->notifyuri)) == NULL)
+			err(1, NULL);
+		RB_INSERT(rrdpstate_tree, &rrdpstates, rs);
 
-	if (rename(temp, file) == -1) {
-		warn("%s: rename %s to %s", rr->basedir, temp, file);
-		unlink(temp);
+		file = rrdp_state_filename(rr);
+		if (unlink(file) == -1 && errno != ENOENT)
+			warn("%s: unlink", file);
+		free(file);
 	}
-
-	free(temp);
-	free(file);
-	return;
-
- fail:
-	warn("%s: save state to %s", rr->basedir, temp);
-	if (f != NULL)
-		fclose(f);
-	unlink(temp);
-	free(temp);
-	free(file);
+	rrdp_session_free(rs->state);
+	rs->state = rrdp_session_dup(state);
 }
 
 /*
@@ -767,6 +1342,7 @@ rrdp_session_free(struct rrdp_session *s)
 		return;
 	free(s->session_id);
 	free(s->last_mod);
+	free(s->etag);
 	for (i = 0; i < sizeof(s->deltas) / sizeof(s->deltas[0]); i++)
 		free(s->deltas[i]);
 	free(s);
@@ -779,7 +1355,10 @@ rrdp_session_buffer(struct ibuf *b, const struct rrdp_session *s)
 
 	io_str_buffer(b, s->session_id);
 	io_simple_buffer(b, &s->serial, sizeof(s->serial));
+	io_simple_buffer(b, &s->snapshot_size, sizeof(s->snapshot_size));
+	io_simple_buffer(b, &s->delta_size, sizeof(s->delta_size));
 	io_str_buffer(b, s->last_mod);
+	io_str_buffer(b, s->etag);
 	for (i = 0; i < sizeof(s->deltas) / sizeof(s->deltas[0]); i++)
 		io_str_buffer(b, s->deltas[i]);
 }
@@ -795,7 +1374,10 @@ rrdp_session_read(struct ibuf *b)
 
 	io_read_str(b, &s->session_id);
 	io_read_buf(b, &s->serial, sizeof(s->serial));
+	io_read_buf(b, &s->snapshot_size, sizeof(s->snapshot_size));
+	io_read_buf(b, &s->delta_size, sizeof(s->delta_size));
 	io_read_str(b, &s->last_mod);
+	io_read_str(b, &s->etag);
 	for (i = 0; i < sizeof(s->deltas) / sizeof(s->deltas[0]); i++)
 		io_read_str(b, &s->deltas[i]);
 
@@ -806,26 +1388,30 @@ static struct rrdprepo *
 rrdp_get(const char *uri)
 {
 	struct rrdp_session *state;
-	struct rrdprepo *rr;
+	struct rrdprepo *rr, key;
+	int fd;
 
-	SLIST_FOREACH(rr, &rrdprepos, entry)
-		if (strcmp(rr->notifyuri, uri) == 0) {
-			if (rr->state == REPO_FAILED)
-				return NULL;
-			return rr;
-		}
+	key.notifyuri = (char *)uri;
+	if ((rr = RB_FIND(rrdp_uri_tree, &rrdp_uris, &key)) != NULL) {
+		if (rr->state == REPO_FAILED)
+			return NULL;
+		return rr;
+	}
 
 	if ((rr = calloc(1, sizeof(*rr))) == NULL)
 		err(1, NULL);
 
 	rr->id = ++repoid;
-	SLIST_INSERT_HEAD(&rrdprepos, rr, entry);
-
 	if ((rr->notifyuri = strdup(uri)) == NULL)
 		err(1, NULL);
+	SLIST_INSERT_HEAD(&rrdprepos, rr, entry);
+	RB_INSERT(rrdp_id_tree, &rrdp_ids, rr);
+	RB_INSERT(rrdp_uri_tree, &rrdp_uris, rr);
 	rr->basedir = repo_dir(uri, ".rrdp", 1);
+	rr->prio = repohist_prio(uri);
 
-	RB_INIT(&rr->deleted);
+	filepath_init(&rr->deleted);
+	filepath_init(&rr->unchanged);
 
 	/* create base directory */
 	if (mkpath(rr->basedir) == -1) {
@@ -834,9 +1420,15 @@ rrdp_get(const char *uri)
 		return rr;
 	}
 
+	/* with -w the rrdp process writes into the temp repo directly */
+	fd = -1;
+	if (rrdpwrite &&
+	    (fd = open(rr->basedir, O_RDONLY | O_DIRECTORY)) == -1)
+		warn("open %s", rr->basedir);
+
 	/* parse state and start the sync */
 	state = rrdp_session_parse(rr);
-	rrdp_fetch(rr->id, rr->notifyuri, rr->notifyuri, state);
+	rrdp_fetch(rr->id, rr->notifyuri, rr->notifyuri, state, fd);
 	rrdp_session_free(state);
 
 	logx("%s: pulling from %s", rr->notifyuri, "network");
@@ -844,6 +1436,37 @@ rrdp_get(const char *uri)
 	return rr;
 }
 
+/*
+ * Add the transfer counters in in to every repository synced by vp.
+ */
+static void
+repo_sync_stats_add(const void *vp, const struct repostats *in)
+{
+	struct repo *rp;
+
+	SLIST_FOREACH(rp, &repos, entry) {
+		if (vp != rp->ta && vp != rp->rrdp)
+			continue;
+		rp->repostats.bytes += in->bytes;
+		rp->repostats.http_reqs += in->http_reqs;
+		rp->repostats.snapshots += in->snapshots;
+		rp->repostats.deltas += in->deltas;
+	}
+}
+
+/*
+ * Account the transfer counters of RRDP repo id.
+ */
+void
+rrdp_stats_add(unsigned int id, const struct repostats *in)
+{
+	struct rrdprepo *rr;
+
+	if ((rr = rrdp_find(id)) == NULL)
+		errx(1, "non-existent rrdp repo %u", id);
+	repo_sync_stats_add(rr, in);
+}
+
 /*
  * Remove RRDP repo and start over.
  */
@@ -858,51 +1481,129 @@ rrdp_clear(unsigned int id)
 
 	/* remove rrdp repository contents */
 	remove_contents(rr->basedir);
+	filepath_free(&rr->unchanged);
+	rr->nfiles = 0;
+}
+
+/*
+ * Check if the valid repo already holds the published object, passed as
+ * data or in the staging file sfn. Snapshots mostly republish unchanged
+ * files, those are neither written to the temp repo nor moved later.
+ * Returns 1 if the content is the same, 0 otherwise.
+ */
+static int
+rrdp_same_file(const struct rrdprepo *rr, const char *uri, const char *fn,
+    const char *sfn, const char *data, size_t dlen)
+{
+	struct stat st, sst;
+	unsigned char *vdata = NULL, *sdata = NULL;
+	char *vfn;
+	size_t vlen, slen;
+	int same = 0;
+
+	/* a file in the temp repo is a duplicate, leave that to the caller */
+	if (lstat(fn, &st) == 0 || errno != ENOENT)
+		return 0;
+
+	vfn = rrdp_filename(rr, uri, 1);
+	if (stat(vfn, &st) == -1 || !S_ISREG(st.st_mode))
+		goto out;
+	if (sfn != NULL) {
+		if (stat(sfn, &sst) == -1)
+			goto out;
+		dlen = sst.st_size;
+	}
+	if ((size_t)st.st_size != dlen)
+		goto out;
+	if (sfn != NULL) {
+		if ((sdata = load_file(sfn, &slen)) == NULL || slen != dlen)
+			goto out;
+		data = sdata;
+	}
+	if ((vdata = load_file(vfn, &vlen)) == NULL)
+		goto out;
+	same = vlen == dlen && memcmp(vdata, data, dlen) == 0;
+
+ out:
+	free(vdata);
+	free(sdata);
+	free(vfn);
+	return same;
 }
 
 /*
  * Write a file into the temporary RRDP dir but only after checking
  * its hash (if required). The function also makes sure that the file
  * tracking is properly adjusted.
+ * If staged is not NULL the content was already written by the rrdp
+ * process to that file in the temporary RRDP dir and is moved in place.
  * Returns 1 on success, 0 if the repo is corrupt, -1 on IO error
  */
 int
 rrdp_handle_file(unsigned int id, enum publish_type pt, char *uri,
-    char *hash, size_t hlen, char *data, size_t dlen)
+    char *hash, size_t hlen, const char *staged, char *data, size_t dlen)
 {
 	struct rrdprepo *rr;
 	struct filepath *fp;
 	ssize_t s;
-	char *fn = NULL;
+	char *fn = NULL, *sfn = NULL;
 	int fd = -1, try = 0, deleted = 0;
-	int flags;
+	int flags, ok, rc = 1;
 
 	rr = rrdp_find(id);
 	if (rr == NULL)
 		errx(1, "non-existent rrdp repo %u", id);
-	if (rr->state == REPO_FAILED)
-		return -1;
+
+	if (staged != NULL) {
+		if (pt == PUB_DEL || strchr(staged, '/') != NULL ||
+		    strncmp(staged, RRDP_STAGE_PREFIX,
+		    strlen(RRDP_STAGE_PREFIX)) != 0)
+			errx(1, "%s: bad staging file %s", rr->notifyuri,
+			    staged);
+		if (asprintf(&sfn, "%s/%s", rr->basedir, staged) == -1)
+			err(1, NULL);
+	}
+
+	if (rr->state == REPO_FAILED) {
+		rc = -1;
+		goto out;
+	}
+
+	if (++rr->nfiles > MAX_REPO_FILES) {
+		if (rr->nfiles == MAX_REPO_FILES + 1)
+			warnx("%s: more than %d files", rr->notifyuri,
+			    MAX_REPO_FILES);
+		rc = 0;
+		goto out;
+	}
 
 	/* check hash of original file for updates and deletes */
 	if (pt == PUB_UPD || pt == PUB_DEL) {
 		if (filepath_exists(&rr->deleted, uri)) {
 			warnx("%s: already deleted", uri);
-			return 0;
+			rc = 0;
+			goto out;
 		}
 		/* try to open file first in rrdp then in valid repo */
 		do {
 			free(fn);
-			if ((fn = rrdp_filename(rr, uri, try++)) == NULL)
-				return 0;
+			if ((fn = rrdp_filename(rr, uri, try++)) == NULL) {
+				rc = 0;
+				goto out;
+			}
 			fd = open(fn, O_RDONLY);
 		} while (fd == -1 && try < 2);
 
-		if (!valid_filehash(fd, hash, hlen)) {
+		/* valid_filehash() closes the fd */
+		ok = valid_filehash(fd, hash, hlen);
+		fd = -1;
+		if (!ok) {
 			warnx("%s: bad file digest for %s", rr->notifyuri, fn);
-			free(fn);
-			return 0;
+			rc = 0;
+			goto out;
 		}
 		free(fn);
+		fn = NULL;
 	}
 
 	/* write new content or mark uri as deleted. */
@@ -916,12 +1617,51 @@ rrdp_handle_file(unsigned int id, enum publish_type pt, char *uri,
 		}
 
 		/* add new file to rrdp dir */
-		if ((fn = rrdp_filename(rr, uri, 0)) == NULL)
-			return 0;
+		if ((fn = rrdp_filename(rr, uri, 0)) == NULL) {
+			rc = 0;
+			goto out;
+		}
+
+		/* the first copy may have been skipped as unchanged */
+		if (pt == PUB_ADD && !deleted &&
+		    filepath_exists(&rr->unchanged, uri)) {
+			warnx("%s: duplicate publish element for %s",
+			    rr->notifyuri, fn);
+			rc = 0;
+			goto out;
+		}
+
+		/* an identical copy in the valid repo is used as is */
+		if (pt == PUB_ADD && rrdp_same_file(rr, uri, fn, sfn,
+		    data, dlen)) {
+			filepath_add(&rr->unchanged, uri, 0);
+			goto out;
+		}
 
 		if (repo_mkpath(AT_FDCWD, fn) == -1)
 			goto fail;
 
+		if (sfn != NULL) {
+			/* link(2) refuses to replace, like O_EXCL below */
+			if (pt == PUB_ADD && !deleted) {
+				if (link(sfn, fn) == -1) {
+					if (errno == EEXIST) {
+						warnx("%s: duplicate publish "
+						    "element for %s",
+						    rr->notifyuri, fn);
+						rc = 0;
+						goto out;
+					}
+					warn("link %s", fn);
+					goto fail;
+				}
+			} else if (rename(sfn, fn) == -1) {
+				warn("rename %s", fn);
+				goto fail;
+			}
+			goto out;
+		}
+
 		flags = O_WRONLY|O_CREAT|O_TRUNC;
 		if (pt == PUB_ADD && !deleted)
 			flags |= O_EXCL;
@@ -930,8 +1670,8 @@ rrdp_handle_file(unsigned int id, enum publish_type pt, char *uri,
 			if (errno == EEXIST) {
 				warnx("%s: duplicate publish element for %s",
 				    rr->notifyuri, fn);
-				free(fn);
-				return 0;
+				rc = 0;
+				goto out;
 			}
 			warn("open %s", fn);
 			goto fail;
@@ -941,20 +1681,23 @@ rrdp_handle_file(unsigned int id, enum publish_type pt, char *uri,
 			warn("write %s", fn);
 			goto fail;
 		}
-		close(fd);
 		if ((size_t)s != dlen)	/* impossible */
 			errx(1, "short write %s", fn);
-		free(fn);
 	}
-
-	return 1;
+	goto out;
 
 fail:
 	rr->state = REPO_FAILED;
+	rc = -1;
+out:
 	if (fd != -1)
 		close(fd);
+	/* the staging file is consumed in any case */
+	if (sfn != NULL && unlink(sfn) == -1 && errno != ENOENT)
+		warn("unlink %s", sfn);
+	free(sfn);
 	free(fn);
-	return -1;
+	return rc;
 }
 
 /*
@@ -965,23 +1708,35 @@ rsync_finish(unsigned int id, int ok)
 {
 	struct rsyncrepo *rr;
 	struct tarepo *tr;
+	struct tafetch *tf;
 
-	tr = ta_find(id);
+	tr = ta_find(id, &tf);
 	if (tr != NULL) {
-		/* repository changed state already, ignore request */
-		if (tr->state != REPO_LOADING)
+		/* repository or fetch changed state already, ignore request */
+		if (tr->state != REPO_LOADING || !tf->running) {
+			ta_fetch_clean(tr, tf);
 			return;
+		}
+		/* Move the fetched TA file into place. */
 		if (ok) {
-			logx("ta/%s: loaded from network", tr->descr);
+			char *file, *tfile;
+
+			file = ta_filename(tr, 0);
+			if (asprintf(&tfile, "%s%s", tf->temp,
+			    strrchr(file, '/')) == -1)
+				err(1, NULL);
+			if (rename(tfile, file) == -1) {
+				warn("rename to %s", file);
+				ok = 0;
+			}
+			free(tfile);
+			free(file);
+		}
+		if (ok)
 			stats.rsync_repos++;
-			tr->state = REPO_DONE;
-			repo_done(tr, 1);
-		} else {
-			warnx("ta/%s: load from network failed", tr->descr);
+		else
 			stats.rsync_fails++;
-			tr->uriidx++;
-			ta_fetch(tr);
-		}
+		ta_fetch_done(tr, tf, ok);
 		return;
 	}
 
@@ -992,6 +1747,21 @@ rsync_finish(unsigned int id, int ok)
 	if (rr->state != REPO_LOADING)
 		return;
 
+	/* the mirror lacks the repository, go to the publication point */
+	if (!ok && rr->mirror && !nofetch) {
+		char *validdir;
+
+		warnx("%s: load from mirror failed, pulling from %s",
+		    rr->basedir, rr->repouri);
+		rr->mirror = 0;
+		remove_contents(rr->basedir);
+		validdir = repo_dir(rr->repouri, NULL, 0);
+		rsync_fetch(rr->id, rr->repouri, rr->basedir, validdir,
+		    repohist_prio(rr->repouri));
+		free(validdir);
+		return;
+	}
+
 	if (ok) {
 		logx("%s: loaded from network", rr->basedir);
 		stats.rsync_repos++;
@@ -1037,6 +1807,7 @@ rrdp_finish(unsigned int id, int ok)
 		/* also clear the list of deleted files */
 		filepath_free(&rr->deleted);
 	}
+	filepath_free(&rr->unchanged);
 
 	repo_done(rr, ok);
 }
@@ -1047,42 +1818,35 @@ rrdp_finish(unsigned int id, int ok)
  * over to the rrdp process.
  */
 void
-http_finish(unsigned int id, enum http_result res, const char *last_mod)
+http_finish(unsigned int id, enum http_result res, const char *last_mod,
+    const char *etag)
 {
 	struct tarepo *tr;
+	struct tafetch *tf;
 
-	tr = ta_find(id);
+	tr = ta_find(id, &tf);
 	if (tr == NULL) {
 		/* not a TA fetch therefore RRDP */
-		rrdp_http_done(id, res, last_mod);
+		rrdp_http_done(id, res, last_mod, etag);
 		return;
 	}
 
-	/* repository changed state already, ignore request */
-	if (tr->state != REPO_LOADING)
+	/* repository or fetch changed state already, ignore request */
+	if (tr->state != REPO_LOADING || !tf->running)
 		return;
 
-	/* Move downloaded TA file into place, or unlink on failure. */
+	/* Move downloaded TA file into place, a failed one is removed. */
 	if (res == HTTP_OK) {
 		char *file;
 
 		file = ta_filename(tr, 0);
-		if (rename(tr->temp, file) == -1)
+		if (rename(tf->temp, file) == -1)
 			warn("rename to %s", file);
 		free(file);
 
-		logx("ta/%s: loaded from network", tr->descr);
-		tr->state = REPO_DONE;
 		stats.http_repos++;
-		repo_done(tr, 1);
-	} else {
-		if (unlink(tr->temp) == -1 && errno != ENOENT)
-			warn("unlink %s", tr->temp);
-
-		tr->uriidx++;
-		warnx("ta/%s: load from network failed", tr->descr);
-		ta_fetch(tr);
 	}
+	ta_fetch_done(tr, tf, res == HTTP_OK);
 }
 
 /*
@@ -1091,21 +1855,24 @@ http_finish(unsigned int id, enum http_result res, const char *last_mod)
 struct repo *
 ta_lookup(int id, struct tal *tal)
 {
-	struct repo	*rp;
+	struct repo	*rp, key;
 
 	if (tal->urisz == 0)
 		errx(1, "TAL %s has no URI", tal->descr);
 
 	/* Look up in repository table. (Lookup should actually fail here) */
-	SLIST_FOREACH(rp, &repos, entry) {
-		if (strcmp(rp->repouri, tal->uri[0]) == 0)
-			return rp;
-	}
+	key.repouri = tal->uri[0];
+	key.notifyuri = NULL;
+	if ((rp = RB_FIND(repo_uri_tree, &repo_uris, &key)) != NULL)
+		return rp;
 
 	rp = repo_alloc(id);
+	stats.repos++;
 	rp->basedir = repo_dir(tal->descr, "ta", 0);
 	if ((rp->repouri = strdup(tal->uri[0])) == NULL)
 		err(1, NULL);
+	RB_INSERT(repo_uri_tree, &repo_uris, rp);
+	RB_INSERT(repo_path_tree, &repo_paths, rp);
 
 	/* check if sync disabled ... */
 	if (noop) {
@@ -1130,37 +1897,52 @@ ta_lookup(int id, struct tal *tal)
 /*
  * Look up a repository, queueing it for discovery if not found.
  */
-struct repo *
-repo_lookup(int talid, const char *uri, const char *notify)
+static struct repo *
+repo_get(int talid, const char *uri, const char *notify, int prefetch)
 {
-	struct repo	*rp;
+	struct repo	*rp, key;
+	struct prefetch	*pf, pfkey;
 	char		*repouri;
 
 	if ((repouri = rsync_base_uri(uri)) == NULL)
 		errx(1, "bad caRepository URI: %s", uri);
 
 	/* Look up in repository table. */
-	SLIST_FOREACH(rp, &repos, entry) {
-		if (strcmp(rp->repouri, repouri) != 0)
-			continue;
-		if (rp->notifyuri != NULL) {
-			if (notify == NULL)
-				continue;
-			if (strcmp(rp->notifyuri, notify) != 0)
-				continue;
-		} else if (notify != NULL)
-			continue;
-		/* found matching repo */
+	key.repouri = repouri;
+	key.notifyuri = (char *)notify;
+	if ((rp = RB_FIND(repo_uri_tree, &repo_uris, &key)) != NULL) {
 		free(repouri);
+		if (rp->prefetch && !prefetch) {
+			rp->prefetch = 0;
+			stats.repos++;
+		}
 		return rp;
 	}
 
 	rp = repo_alloc(talid);
+	rp->prefetch = prefetch;
+	if (!prefetch)
+		stats.repos++;
 	rp->basedir = repo_dir(repouri, NULL, 0);
 	rp->repouri = repouri;
 	if (notify != NULL)
 		if ((rp->notifyuri = strdup(notify)) == NULL)
 			err(1, NULL);
+	RB_INSERT(repo_uri_tree, &repo_uris, rp);
+	RB_INSERT(repo_path_tree, &repo_paths, rp);
+
+	pfkey.repouri = rp->repouri;
+	pfkey.notifyuri = rp->notifyuri;
+	if ((pf = RB_FIND(prefetch_tree, &prefetches, &pfkey)) != NULL) {
+		rp->fails = pf->fails;
+		rp->retry = pf->retry;
+		rp->quiet = pf->quiet;
+		if (rp->fails >= REPO_FAIL_MAX && time(NULL) < rp->retry)
+			rp->backoff = 1;
+		if (rsyncrest && notify == NULL && rp->fails == 0 &&
+		    rp->quiet >= REPO_QUIET_MIN && time(NULL) < rp->retry)
+			rp->rested = 1;
+	}
 
 	if (++talrepocnt[talid] >= MAX_REPO_PER_TAL) {
 		if (talrepocnt[talid] == MAX_REPO_PER_TAL)
@@ -1175,6 +1957,22 @@ repo_lookup(int talid, const char *uri, const char *notify)
 		return rp;
 	}
 
+	/* ... or if the publication point keeps failing */
+	if (rp->backoff) {
+		logx("%s: failed %u times in a row, using cache", rp->basedir,
+		    rp->fails);
+		entityq_flush(&rp->queue, rp);
+		return rp;
+	}
+
+	/* ... or if it did not change for a while */
+	if (rp->rested) {
+		logx("%s: unchanged in %u syncs, using cache", rp->basedir,
+		    rp->quiet);
+		entityq_flush(&rp->queue, rp);
+		return rp;
+	}
+
 	/* try to create base directory */
 	if (mkpath(rp->basedir) == -1)
 		warn("mkpath %s", rp->basedir);
@@ -1184,27 +1982,150 @@ repo_lookup(int talid, const char *uri, const char *notify)
 		rp->rrdp = rrdp_get(notify);
 	if (rp->rrdp == NULL)
 		rp->rsync = rsync_get(uri, rp->basedir);
+	else if (rrdphedge && rp->rrdp->state == REPO_LOADING)
+		repo_timer_set(&rp->hedgetime,
+		    getmonotime() + repo_hedge_delay(rp->rrdp));
+
+	/* a probe of a failing repository should not hold up the run */
+	if (rp->fails >= REPO_FAIL_MAX) {
+		logx("%s: probing after %u failures", rp->basedir, rp->fails);
+		repo_timer_set(&rp->alarm, getmonotime() + repo_timeout / 4);
+	}
 
 	/* need to check if it was already loaded */
 	if (repo_state(rp) != REPO_LOADING)
 		entityq_flush(&rp->queue, rp);
+	else
+		readahead_add(rp->basedir);
 
 	return rp;
 }
 
 /*
- * Find repository by identifier.
+ * Look up a repository, queueing it for download if not found.
  */
 struct repo *
-repo_byid(unsigned int id)
+repo_lookup(int talid, const char *uri, const char *notify)
+{
+	return repo_get(talid, uri, notify, 0);
+}
+
+/*
+ * Start the fetch of a repository of the previous run. Unless the
+ * repository is looked up again it is left out of the stats and its
+ * files are removed by the cleanup like those of any unused repository.
+ */
+void
+repo_prefetch(int talid, const char *uri, const char *notify)
+{
+	if (noop || nofetch)
+		return;
+	repo_get(talid, uri, notify, 1);
+}
+
+/*
+ * Call cb for each repository of the previous run which belonged to a
+ * TAL that is loaded again.
+ */
+void
+repo_prefetch_collect(void (*cb)(int, const char *, const char *))
+{
+	struct prefetch	*pf;
+	int		 talid;
+
+	RB_FOREACH(pf, prefetch_tree, &prefetches) {
+		for (talid = 0; talid < talsz; talid++)
+			if (strcmp(taldescs[talid], pf->tal) == 0)
+				break;
+		if (talid < talsz)
+			cb(talid, pf->repouri, pf->notifyuri);
+	}
+}
+
+struct warmhost {
+	const char	*uri;
+	size_t		 len;		/* of the host part of uri */
+	unsigned long long msec;
+};
+
+static int
+warmhost_cmp(const void *a, const void *b)
+{
+	const struct warmhost *wa = a, *wb = b;
+
+	if (wa->msec > wb->msec)
+		return -1;
+	if (wa->msec < wb->msec)
+		return 1;
+	return 0;
+}
+
+/*
+ * Connect to the HTTP_WARM_HOSTS hosts of the prefetched RRDP repositories
+ * which took longest to sync in the previous run, so the DNS lookup and
+ * TLS handshake are done once their requests get through the RRDP queue.
+ */
+void
+repo_warm(void)
 {
 	struct repo	*rp;
+	struct redirect	*rd, key;
+	struct warmhost	*wh = NULL;
+	const char	*uri, *host;
+	size_t		 i, len, nwh = 0, maxwh = 0;
+	time_t		 now = time(NULL);
 
 	SLIST_FOREACH(rp, &repos, entry) {
-		if (rp->id == id)
-			return rp;
+		if (!rp->prefetch || rp->rrdp == NULL ||
+		    rp->notifyuri == NULL)
+			continue;
+
+		uri = rp->notifyuri;
+		key.uri = rp->notifyuri;
+		rd = RB_FIND(redirect_tree, &redirects, &key);
+		if (rd != NULL && rd->expires > now)
+			uri = rd->target;
+		if (strncasecmp(uri, HTTPS_PROTO, HTTPS_PROTO_LEN) != 0)
+			continue;
+		host = uri + HTTPS_PROTO_LEN;
+		len = strcspn(host, "/");
+
+		for (i = 0; i < nwh; i++)
+			if (wh[i].len == len &&
+			    strncasecmp(wh[i].uri + HTTPS_PROTO_LEN, host,
+			    len) == 0)
+				break;
+		if (i == nwh) {
+			if (nwh == maxwh) {
+				maxwh += 16;
+				wh = reallocarray(wh, maxwh, sizeof(*wh));
+				if (wh == NULL)
+					err(1, NULL);
+			}
+			wh[nwh].uri = uri;
+			wh[nwh].len = len;
+			wh[nwh].msec = 0;
+			nwh++;
+		}
+		wh[i].msec += repohist_prio(rp->notifyuri);
 	}
-	return NULL;
+
+	qsort(wh, nwh, sizeof(*wh), warmhost_cmp);
+	for (i = 0; i < nwh && i < HTTP_WARM_HOSTS; i++)
+		http_prewarm(wh[i].uri);
+	free(wh);
+}
+
+/*
+ * Find repository by identifier.
+ */
+struct repo *
+repo_byid(unsigned int id)
+{
+	struct repo	key;
+
+	key.id = id;
+	return RB_FIND(repo_id_tree, &repo_ids, &key);
 }
 
 /*
@@ -1213,12 +2134,13 @@ repo_byid(unsigned int id)
 static struct repo *
 repo_bypath(const char *path)
 {
-	struct repo	*rp;
+	struct repo	*rp, key;
 
-	SLIST_FOREACH(rp, &repos, entry) {
-		if (strcmp(rp->basedir, path) == 0)
-			return rp;
-	}
+	key.basedir = (char *)path;
+	key.id = UINT_MAX;
+	rp = RB_NFIND(repo_path_tree, &repo_paths, &key);
+	if (rp != NULL && strcmp(rp->basedir, path) == 0)
+		return rp;
 	return NULL;
 }
 
@@ -1250,6 +2172,19 @@ repo_basedir(const struct repo *rp, int wantvalid)
 	return path;
 }
 
+/*
+ * Return 0 if no file of the repository can be in the temporary
+ * directory. The RRDP files of this run are the only ones there,
+ * earlier ones were moved to the valid directory already.
+ */
+int
+repo_temp_used(const struct repo *rp)
+{
+	if (rp->ta == NULL && rp->rsync == NULL && rp->rrdp != NULL)
+		return rp->rrdp->nfiles > 0;
+	return 1;
+}
+
 /*
  * Return the repository identifier.
  */
@@ -1292,11 +2227,40 @@ repo_synced(const struct repo *rp)
 }
 
 /*
- * Return the protocol string "rrdp", "rsync", "https" which was used to sync.
- * Result is only correct if repository was properly synced.
+ * Return 1 if repository is still syncing else 0.
  */
-const char *
-repo_proto(const struct repo *rp)
+int
+repo_loading(const struct repo *rp)
+{
+	return repo_state(rp) == REPO_LOADING;
+}
+
+/*
+ * Count the syncs which are still going on for the progress report.
+ */
+void
+repo_progress(struct progress *pg)
+{
+	struct rrdprepo *rr;
+	struct rsyncrepo *sr;
+	struct tarepo *tr;
+
+	SLIST_FOREACH(rr, &rrdprepos, entry)
+		if (rr->state == REPO_LOADING)
+			pg->rrdp_syncs++;
+	SLIST_FOREACH(sr, &rsyncrepos, entry)
+		if (sr->state == REPO_LOADING)
+			pg->rsync_syncs++;
+	SLIST_FOREACH(tr, &tarepos, entry)
+		pg->http_syncs += tr->nrunning;
+}
+
+/*
+ * Return the protocol string "rrdp", "rsync", "https" which was used to sync.
+ * Result is only correct if repository was properly synced.
+ */
+const char *
+repo_proto(const struct repo *rp)
 {
 
 	if (rp->ta != NULL) {
@@ -1332,15 +2296,82 @@ repo_queued(struct repo *rp, struct entity *p)
 	return 0;
 }
 
+/*
+ * Seconds after which a still running RRDP sync gets an rsync fetch next
+ * to it: twice the sync time of the previous run, or half the repository
+ * timeout if there is no history.
+ */
+static time_t
+repo_hedge_delay(const struct rrdprepo *rr)
+{
+	time_t delay;
+
+	if (rr->prio == 0)
+		delay = repo_timeout / 2;
+	else
+		delay = 2 * (rr->prio / 1000);
+	if (delay < RRDP_HEDGE_MIN)
+		delay = RRDP_HEDGE_MIN;
+	return delay;
+}
+
+/*
+ * Start the hedged rsync fetch of a repository with a slow RRDP sync.
+ */
+static void
+repo_hedge(struct repo *rp)
+{
+	const struct rsyncrepo *rr;
+
+	repo_timer_del(&rp->hedgetime);
+	if (nofetch)
+		return;
+	logx("%s: RRDP sync is slow, also pulling via rsync", rp->repouri);
+	rr = rsync_get(rp->repouri, rp->basedir);
+	if (rr->state == REPO_LOADING)
+		rp->hedge = rr;
+	else if (rr->state == REPO_DONE) {
+		struct timespec flush_time;
+
+		/* already synced for another repository */
+		repo_hedge_stop(rp);
+		rp->rsync = rr;
+		entityq_flush(&rp->queue, rp);
+		clock_gettime(CLOCK_MONOTONIC, &flush_time);
+		timespecsub(&flush_time, &rp->start_time,
+		    &rp->repostats.sync_time);
+	}
+}
+
+/*
+ * Rsync won over RRDP, detach the RRDP repository and abort its sync
+ * unless other repositories still wait for it. The rsync repository is
+ * never aborted when RRDP wins since others may fall back to it.
+ */
+static void
+repo_hedge_stop(struct repo *rp)
+{
+	const struct rrdprepo *rr = rp->rrdp;
+	struct repo *orp;
+
+	rp->rrdp = NULL;
+	SLIST_FOREACH(orp, &repos, entry)
+		if (orp->rrdp == rr)
+			return;
+	rrdp_abort(rr->id);
+}
+
 static void
 repo_fail(struct repo *rp)
 {
 	/* reset the alarm since code may fallback to rsync */
-	rp->alarm = getmonotime() + repo_timeout;
+	repo_timer_set(&rp->alarm, getmonotime() + repo_timeout);
 
-	if (rp->ta)
-		http_finish(rp->ta->id, HTTP_FAILED, NULL);
-	else if (rp->rsync)
+	if (rp->ta) {
+		struct tafetch *tf;
+
+		ta_timeout(ta_find(rp->ta->id, &tf));
+	} else if (rp->rsync)
 		rsync_finish(rp->rsync->id, 0);
 	else if (rp->rrdp)
 		rrdp_finish(rp->rrdp->id, 0);
@@ -1352,7 +2383,7 @@ static void
 repo_abort(struct repo *rp)
 {
 	/* reset the alarm */
-	rp->alarm = getmonotime() + repo_timeout;
+	repo_timer_set(&rp->alarm, getmonotime() + repo_timeout);
 
 	if (rp->rsync)
 		rsync_abort(rp->rsync->id);
@@ -1362,10 +2393,95 @@ repo_abort(struct repo *rp)
 		repo_fail(rp);
 }
 
+static void
+repo_timer_swap(size_t a, size_t b)
+{
+	struct repotimer *t;
+
+	t = timers[a];
+	timers[a] = timers[b];
+	timers[b] = t;
+	timers[a]->idx = a + 1;
+	timers[b]->idx = b + 1;
+}
+
+static void
+repo_timer_up(size_t i)
+{
+	while (i > 0 && timers[(i - 1) / 2]->when > timers[i]->when) {
+		repo_timer_swap(i, (i - 1) / 2);
+		i = (i - 1) / 2;
+	}
+}
+
+static void
+repo_timer_down(size_t i)
+{
+	size_t c;
+
+	while ((c = 2 * i + 1) < ntimers) {
+		if (c + 1 < ntimers && timers[c + 1]->when < timers[c]->when)
+			c++;
+		if (timers[i]->when <= timers[c]->when)
+			break;
+		repo_timer_swap(i, c);
+		i = c;
+	}
+}
+
+/*
+ * Arm timer t to expire at when, moving it if it is armed already.
+ */
+static void
+repo_timer_set(struct repotimer *t, time_t when)
+{
+	struct repotimer **nt;
+	size_t max;
+
+	t->when = when;
+	if (t->idx == 0) {
+		if (ntimers == maxtimers) {
+			max = maxtimers == 0 ? 64 : maxtimers * 2;
+			if ((nt = recallocarray(timers, maxtimers, max,
+			    sizeof(*timers))) == NULL)
+				err(1, NULL);
+			timers = nt;
+			maxtimers = max;
+		}
+		timers[ntimers++] = t;
+		t->idx = ntimers;
+	}
+	repo_timer_up(t->idx - 1);
+	repo_timer_down(t->idx - 1);
+}
+
+static void
+repo_timer_del(struct repotimer *t)
+{
+	size_t i;
+
+	if (t->idx == 0)
+		return;
+	i = t->idx - 1;
+	t->idx = 0;
+	t->when = 0;
+	if (i == --ntimers)
+		return;
+	timers[i] = timers[ntimers];
+	timers[i]->idx = i + 1;
+	repo_timer_up(i);
+	repo_timer_down(i);
+}
+
 int
 repo_check_timeout(int timeout)
 {
+	static struct repotimer	**expired;
+	static size_t		 maxexpired;
 	struct repo	*rp;
+	struct tarepo	*tr;
+	void		*t;
+	size_t		 i, nexpired;
 	time_t		 now;
 	int		 diff;
 
@@ -1387,21 +2503,61 @@ repo_check_timeout(int timeout)
 				timeout = diff;
 		}
 	}
-	/* Look up in repository table. (Lookup should actually fail here) */
-	SLIST_FOREACH(rp, &repos, entry) {
-		if (repo_state(rp) == REPO_LOADING) {
-			if (rp->alarm <= now) {
-				warnx("%s: synchronisation timeout",
-				    rp->repouri);
-				repo_abort(rp);
-			} else {
-				diff = rp->alarm - now;
-				diff *= 1000;
-				if (timeout == INFTIM || diff < timeout)
-					timeout = diff;
-			}
+	/* start another fetch for slow TAs */
+	SLIST_FOREACH(tr, &tarepos, entry) {
+		if (tr->state != REPO_LOADING || tr->hedge == 0)
+			continue;
+		if (tr->hedge <= now) {
+			logx("ta/%s: slow, also trying the next URI",
+			    tr->descr);
+			ta_fetch(tr);
+		}
+		if (tr->hedge != 0) {
+			diff = tr->hedge - now;
+			diff *= 1000;
+			if (timeout == INFTIM || diff < timeout)
+				timeout = diff;
+		}
+	}
+
+	/*
+	 * Take all expired timers off the heap first, repo_abort() sets
+	 * a new alarm which may already be due after the deadline.
+	 */
+	nexpired = 0;
+	while (ntimers > 0 && timers[0]->when <= now) {
+		if (nexpired == maxexpired) {
+			maxexpired = maxexpired == 0 ? 16 : maxexpired * 2;
+			if ((t = recallocarray(expired, nexpired, maxexpired,
+			    sizeof(*expired))) == NULL)
+				err(1, NULL);
+			expired = t;
+		}
+		expired[nexpired] = timers[0];
+		repo_timer_del(expired[nexpired++]);
+	}
+
+	for (i = 0; i < nexpired; i++) {
+		rp = expired[i]->rp;
+		if (repo_state(rp) != REPO_LOADING)
+			continue;
+		if (expired[i] == &rp->hedgetime)
+			repo_hedge(rp);
+		else {
+			warnx("%s: synchronisation timeout", rp->repouri);
+			repo_abort(rp);
 		}
 	}
+
+	/* timers of repositories which are done are dropped lazily */
+	while (ntimers > 0 && repo_state(timers[0]->rp) != REPO_LOADING)
+		repo_timer_del(timers[0]);
+	if (ntimers > 0) {
+		diff = timers[0]->when - now;
+		diff *= 1000;
+		if (timeout == INFTIM || diff < timeout)
+			timeout = diff;
+	}
 	return timeout;
 }
 
@@ -1417,6 +2573,17 @@ repostats_new_files_inc(struct repo *rp, const char *file)
 		rp->repostats.new_files++;
 }
 
+/*
+ * Add the parser CPU time reported for the objects of repository rp.
+ */
+void
+repostats_parse_add(struct repo *rp, const struct repo_ptime *pt)
+{
+	rp->repostats.objects += pt->objects;
+	timespecadd(&rp->repostats.parse_time, &pt->time,
+	    &rp->repostats.parse_time);
+}
+
 /*
  * Update stats object of repository depending on rtype and subtype.
  */
@@ -1525,10 +2692,16 @@ repo_stat_inc(struct repo *rp, int talid, enum rtype type, enum stype subtype)
 		rp->stats[talid].crls++;
 		break;
 	case RTYPE_GBR:
-		rp->stats[talid].gbrs++;
+		if (subtype == STYPE_SKIP)
+			rp->stats[talid].skipped++;
+		else
+			rp->stats[talid].gbrs++;
 		break;
 	case RTYPE_TAK:
-		rp->stats[talid].taks++;
+		if (subtype == STYPE_SKIP)
+			rp->stats[talid].skipped++;
+		else
+			rp->stats[talid].taks++;
 		break;
 	default:
 		break;
@@ -1547,14 +2720,28 @@ repo_tal_stats_collect(void (*cb)(const struct repo *,
 	}
 }
 
+/*
+ * Return the stats of repository rp for TAL talid or NULL if the
+ * repository was not used by that TAL.
+ */
+const struct repotalstats *
+repo_tal_stats(const struct repo *rp, int talid)
+{
+	if (!rp->stats_used[talid])
+		return NULL;
+	return &rp->stats[talid];
+}
+
 void
 repo_stats_collect(void (*cb)(const struct repo *, const struct repostats *,
     void *), void *arg)
 {
 	struct repo	*rp;
 
-	SLIST_FOREACH(rp, &repos, entry)
-		cb(rp, &rp->repostats, arg);
+	SLIST_FOREACH(rp, &repos, entry) {
+		if (!rp->prefetch)
+			cb(rp, &rp->repostats, arg);
+	}
 }
 
 /*
@@ -1567,14 +2754,17 @@ repo_cleanup_rrdp(struct filepath_tree *tree)
 {
 	struct repo *rp;
 	struct rrdprepo *rr;
-	struct filepath *fp, *nfp;
+	struct filepath **list, *fp;
+	size_t i, n;
 	char *fn;
 
 	SLIST_FOREACH(rp, &repos, entry) {
 		if (rp->rrdp == NULL)
 			continue;
 		rr = (struct rrdprepo *)rp->rrdp;
-		RB_FOREACH_SAFE(fp, filepath_tree, &rr->deleted, nfp) {
+		list = filepath_list(&rr->deleted, &n);
+		for (i = 0; i < n; i++) {
+			fp = list[i];
 			if (!rrdp_uri_valid(rr, fp->file)) {
 				warnx("%s: external URI %s", rr->notifyuri,
 				    fp->file);
@@ -1612,75 +2802,105 @@ repo_cleanup_rrdp(struct filepath_tree *tree)
 			free(fn);
 			filepath_put(&rr->deleted, fp);
 		}
+		free(list);
 	}
 }
 
 /*
- * All files in tree are valid and should be moved to the valid repository
- * if not already there. Rename the files to the new path and readd the
+ * Move a file from a temporary directory to the valid repository if it
+ * is not already there. Rename the file to the new path and readd the
  * filepath entry with the new path if successful.
  */
 static void
-repo_move_valid(struct filepath_tree *tree)
+repo_move_one(struct filepath_tree *tree, struct filepath *fp)
 {
-	struct filepath *fp, *nfp;
 	size_t rsyncsz = strlen(".rsync/");
 	size_t rrdpsz = strlen(".rrdp/");
 	char *fn, *base;
 
-	RB_FOREACH_SAFE(fp, filepath_tree, tree, nfp) {
-		if (strncmp(fp->file, ".rsync/", rsyncsz) != 0 &&
-		    strncmp(fp->file, ".rrdp/", rrdpsz) != 0)
-			continue; /* not a temporary file path */
+	if (strncmp(fp->file, ".rsync/", rsyncsz) != 0 &&
+	    strncmp(fp->file, ".rrdp/", rrdpsz) != 0)
+		return; /* not a temporary file path */
 
-		if (strncmp(fp->file, ".rsync/", rsyncsz) == 0) {
-			fn = fp->file + rsyncsz;
-		} else {
-			base = strchr(fp->file + rrdpsz, '/');
-			assert(base != NULL);
-			fn = base + 1;
+	if (strncmp(fp->file, ".rsync/", rsyncsz) == 0) {
+		fn = fp->file + rsyncsz;
+	} else {
+		base = strchr(fp->file + rrdpsz, '/');
+		assert(base != NULL);
+		fn = base + 1;
 
-			/*
-			 * Adjust file last modification time in order to
-			 * minimize RSYNC synchronization load after transport
-			 * failover.
-			 * While serializing RRDP datastructures to disk, set
-			 * the last modified timestamp to the CMS signing-time,
-			 * the X.509 notBefore, or CRL lastUpdate timestamp.
-			 */
-			if (fp->mtime != 0) {
-				int ret;
-				struct timespec ts[2];
-
-				ts[0].tv_nsec = UTIME_OMIT;
-				ts[1].tv_sec = fp->mtime;
-				ts[1].tv_nsec = 0;
-				ret = utimensat(AT_FDCWD, fp->file, ts, 0);
-				if (ret == -1) {
-					warn("utimensat %s", fp->file);
-					continue;
-				}
+		/*
+		 * Adjust file last modification time in order to
+		 * minimize RSYNC synchronization load after transport
+		 * failover.
+		 * While serializing RRDP datastructures to disk, set
+		 * the last modified timestamp to the CMS signing-time,
+		 * the X.509 notBefore, or CRL lastUpdate timestamp.
+		 */
+		if (fp->mtime != 0) {
+			int ret;
+			struct timespec ts[2];
+
+			ts[0].tv_nsec = UTIME_OMIT;
+			ts[1].tv_sec = fp->mtime;
+			ts[1].tv_nsec = 0;
+			ret = utimensat(AT_FDCWD, fp->file, ts, 0);
+			if (ret == -1) {
+				warn("utimensat %s", fp->file);
+				return;
 			}
 		}
+	}
 
-		if (repo_mkpath(AT_FDCWD, fn) == -1)
-			continue;
-
-		if (rename(fp->file, fn) == -1) {
-			warn("rename %s", fp->file);
-			continue;
-		}
+	if (repo_mkpath(AT_FDCWD, fn) == -1)
+		return;
 
-		/* switch filepath node to new path */
-		RB_REMOVE(filepath_tree, tree, fp);
-		base = fp->file;
-		if ((fp->file = strdup(fn)) == NULL)
-			err(1, NULL);
-		free(base);
-		if (RB_INSERT(filepath_tree, tree, fp) != NULL)
-			errx(1, "%s: both possibilities of file present",
-			    fp->file);
+	if (rename(fp->file, fn) == -1) {
+		warn("rename %s", fp->file);
+		return;
 	}
+	if (changelog != NULL && !changelog_failed &&
+	    fprintf(changelog, "%s\n", fn) < 0) {
+		warn("change log");
+		changelog_failed = 1;
+	}
+
+	/* switch filepath node to new path */
+	if (filepath_add(tree, fn, fp->mtime) == 0)
+		errx(1, "%s: both possibilities of file present", fn);
+	filepath_put(tree, fp);
+}
+
+/*
+ * Move a file as soon as it has been processed. Its repository is done
+ * syncing, so this only takes work off the end of the run. Replicas of
+ * CA certs and CRLs sent to the other parsers still name the temporary
+ * location, parse_replica() then loads them from the valid repo.
+ */
+void
+repo_move_file(struct filepath_tree *tree, char *file)
+{
+	struct filepath *fp;
+
+	if ((fp = filepath_find(tree, file)) != NULL)
+		repo_move_one(tree, fp);
+}
+
+/*
+ * All files in tree are valid and should be moved to the valid repository
+ * if not already there. Most of them were moved by repo_move_file(),
+ * this handles the ones that failed to move earlier.
+ */
+static void
+repo_move_valid(struct filepath_tree *tree)
+{
+	struct filepath **list;
+	size_t i, n;
+
+	list = filepath_list(tree, &n);
+	for (i = 0; i < n; i++)
+		repo_move_one(tree, list[i]);
+	free(list);
 }
 
 struct fts_state {
@@ -1714,6 +2934,19 @@ repo_cleanup_entry(FTSENT *e, struct filepath_tree *tree, int cachefd)
 	path = skip_dotslash(e->fts_path);
 	switch (e->fts_info) {
 	case FTS_NSOK:
+		/* keep the cache files in the base dir */
+		if (e->fts_level == 1 &&
+		    (strcmp(e->fts_name, OBJCACHE_FILE) == 0 ||
+		    strcmp(e->fts_name, MFTCACHE_FILE) == 0 ||
+		    strcmp(e->fts_name, OUTPUTSTATE_FILE) == 0 ||
+		    strcmp(e->fts_name, SIGCACHE_FILE) == 0 ||
+		    strcmp(e->fts_name, STAMPCACHE_FILE) == 0 ||
+		    strcmp(e->fts_name, FILEINDEX_FILE) == 0 ||
+		    strcmp(e->fts_name, REPOHIST_FILE) == 0 ||
+		    strcmp(e->fts_name, LOCK_FILE) == 0 ||
+		    strcmp(e->fts_name, RRDPSTATE_FILE) == 0 ||
+		    strcmp(e->fts_name, REDIRECT_FILE) == 0))
+			break;
 		if (filepath_exists(tree, path)) {
 			e->fts_parent->fts_number++;
 			break;
@@ -1722,7 +2955,8 @@ repo_cleanup_entry(FTSENT *e, struct filepath_tree *tree, int cachefd)
 			e->fts_parent->fts_number++;
 			/* handle rrdp .state files explicitly */
 			if (e->fts_level == 3 &&
-			    strcmp(e->fts_name, ".state") == 0)
+			    (strcmp(e->fts_name, ".state") == 0 ||
+			    strcmp(e->fts_name, RRDP_PARTIAL) == 0))
 				break;
 			/* can't delete these extra files */
 			fts_state.rp->repostats.extra_files++;
@@ -1825,6 +3059,7 @@ repo_cleanup_entry(FTSENT *e, struct filepath_tree *tree, int cachefd)
 		e->fts_parent->fts_number += e->fts_number;
 
 		if (e->fts_number == 0) {
+			repo_mkpath_flush();
 			if (rmdir(e->fts_accpath) == -1)
 				warn("rmdir %s", path);
 			if (fts_state.rp != NULL)
@@ -1852,22 +3087,90 @@ repo_cleanup_entry(FTSENT *e, struct filepath_tree *tree, int cachefd)
 	}
 }
 
-void
-repo_cleanup(struct filepath_tree *tree, int cachefd)
+/*
+ * The cleanup walk is split over CLEANUP_PROCS processes. Each one
+ * handles the repository directories whose name hashes to its slot,
+ * at the base level and below .rsync and .rrdp. The files in the base
+ * directory itself are left to the first one.
+ */
+static int cleanup_slot, cleanup_nslots = 1;
+
+/*
+ * With an index of the valid cache from the previous run only .rsync and
+ * .rrdp are walked, the stale files of the valid cache are taken from the
+ * index by fileindex_stale().
+ */
+static int cleanup_indexed;
+
+struct cleanup_rec {
+	unsigned int	id;
+	int		global;
+	struct repostats st;
+};
+
+static int
+cleanup_mine(const char *name)
+{
+	unsigned int h = 5381;
+
+	while (*name != '\0')
+		h = h * 33 + (unsigned char)*name++;
+	return h % cleanup_nslots == (unsigned int)cleanup_slot;
+}
+
+static int
+cleanup_skip(FTSENT *e)
+{
+	const char *parent;
+
+	if (cleanup_indexed && e->fts_level == 1 && e->fts_info == FTS_D &&
+	    strcmp(e->fts_name, ".rsync") != 0 &&
+	    strcmp(e->fts_name, ".rrdp") != 0)
+		return 1;
+	if (cleanup_nslots == 1 || e->fts_level == FTS_ROOTLEVEL)
+		return 0;
+	if (e->fts_level == 1) {
+		if (e->fts_info != FTS_D && e->fts_info != FTS_DP)
+			return cleanup_slot != 0;
+		if (e->fts_info == FTS_DP ||
+		    strcmp(e->fts_name, ".rsync") == 0 ||
+		    strcmp(e->fts_name, ".rrdp") == 0)
+			return 0;
+		return !cleanup_mine(e->fts_name);
+	}
+	if (e->fts_level == 2 && e->fts_info == FTS_D) {
+		parent = e->fts_parent->fts_name;
+		if (strcmp(parent, ".rsync") == 0 ||
+		    strcmp(parent, ".rrdp") == 0)
+			return !cleanup_mine(e->fts_name);
+	}
+	return 0;
+}
+
+static void
+repo_cleanup_walk(struct filepath_tree *tree, int cachefd)
 {
 	char *argv[2] = { ".", NULL };
 	FTS *fts;
 	FTSENT *e;
 
-	/* first move temp files which have been used to valid dir */
-	repo_move_valid(tree);
-	/* then delete files requested by rrdp */
-	repo_cleanup_rrdp(tree);
-
 	if ((fts = fts_open(argv, FTS_PHYSICAL | FTS_NOSTAT, NULL)) == NULL)
 		err(1, "fts_open");
 	errno = 0;
 	while ((e = fts_read(fts)) != NULL) {
+		/* the TLS sessions of the http process are kept as is */
+		if (e->fts_info == FTS_D && e->fts_level == 1 &&
+		    strcmp(e->fts_name, TLS_SESSION_DIR) == 0) {
+			fts_set(fts, e, FTS_SKIP);
+			errno = 0;
+			continue;
+		}
+		if (cleanup_skip(e)) {
+			if (e->fts_info == FTS_D)
+				fts_set(fts, e, FTS_SKIP);
+			errno = 0;
+			continue;
+		}
 		repo_cleanup_entry(e, tree, cachefd);
 		errno = 0;
 	}
@@ -1877,17 +3180,1155 @@ repo_cleanup(struct filepath_tree *tree, int cachefd)
 		err(1, "fts_close");
 }
 
+static void
+cleanup_write(int fd, const struct cleanup_rec *rec)
+{
+	if (write(fd, rec, sizeof(*rec)) != sizeof(*rec))
+		err(1, "cleanup write");
+}
+
+static void
+cleanup_zero(struct repostats *rs)
+{
+	rs->del_files = 0;
+	rs->extra_files = 0;
+	rs->del_extra_files = 0;
+	rs->del_dirs = 0;
+}
+
+/*
+ * The counters are cleared before the walk, pass back what was done.
+ */
+static void
+cleanup_report(int fd)
+{
+	struct cleanup_rec rec;
+	struct repo *rp;
+
+	memset(&rec, 0, sizeof(rec));
+	rec.global = 1;
+	rec.st = stats.repo_stats;
+	cleanup_write(fd, &rec);
+
+	SLIST_FOREACH(rp, &repos, entry) {
+		if (rp->repostats.del_files == 0 &&
+		    rp->repostats.extra_files == 0 &&
+		    rp->repostats.del_extra_files == 0 &&
+		    rp->repostats.del_dirs == 0)
+			continue;
+		memset(&rec, 0, sizeof(rec));
+		rec.id = rp->id;
+		rec.st = rp->repostats;
+		cleanup_write(fd, &rec);
+	}
+}
+
+static void
+cleanup_merge(struct repostats *to, const struct repostats *from)
+{
+	to->del_files += from->del_files;
+	to->extra_files += from->extra_files;
+	to->del_extra_files += from->del_extra_files;
+	to->del_dirs += from->del_dirs;
+}
+
+static pid_t cleanup_pids[CLEANUP_PROCS];
+static int cleanup_fds[CLEANUP_PROCS], cleanup_nprocs;
+static FILE *cleanup_index;
+static unsigned int cleanup_runs;
+
+/*
+ * Start the cleanup of the cache. The walk runs in child processes so
+ * the caller can work on the validated data in the meantime, the
+ * cleanup is completed by repo_cleanup_finish().
+ */
 void
-repo_free(void)
+repo_cleanup_start(struct filepath_tree *tree, int cachefd)
 {
 	struct repo *rp;
+	int i, nprocs, pair[2];
 
-	while ((rp = SLIST_FIRST(&repos)) != NULL) {
-		SLIST_REMOVE_HEAD(&repos, entry);
-		free(rp->repouri);
-		free(rp->notifyuri);
-		free(rp->basedir);
-		free(rp);
+	/* first move temp files which have been used to valid dir */
+	repo_move_valid(tree);
+	/* then delete files requested by rrdp */
+	repo_cleanup_rrdp(tree);
+
+	cleanup_index = fileindex_load(&cleanup_runs);
+	if (cleanup_index != NULL && cleanup_runs % CLEANUP_FULL_RUNS != 0)
+		cleanup_indexed = 1;
+	else
+		cleanup_runs = 0;
+
+	fflush(NULL);
+	cleanup_nslots = CLEANUP_PROCS;
+	for (nprocs = 0; nprocs < CLEANUP_PROCS; nprocs++) {
+		if (pipe2(pair, O_CLOEXEC) == -1) {
+			warn("pipe");
+			break;
+		}
+		if ((cleanup_pids[nprocs] = fork()) == -1) {
+			warn("fork");
+			close(pair[0]);
+			close(pair[1]);
+			break;
+		}
+		if (cleanup_pids[nprocs] == 0) {
+			close(pair[0]);
+			for (i = 0; i < nprocs; i++)
+				close(cleanup_fds[i]);
+			cleanup_slot = nprocs;
+			cleanup_zero(&stats.repo_stats);
+			SLIST_FOREACH(rp, &repos, entry)
+				cleanup_zero(&rp->repostats);
+			repo_cleanup_walk(tree, cachefd);
+			cleanup_report(pair[1]);
+			_exit(0);
+		}
+		close(pair[1]);
+		cleanup_fds[nprocs] = pair[0];
+	}
+	cleanup_nprocs = nprocs;
+
+	/* walk the slots no process could be started for */
+	for (cleanup_slot = nprocs; cleanup_slot < CLEANUP_PROCS;
+	    cleanup_slot++)
+		repo_cleanup_walk(tree, cachefd);
+}
+
+/*
+ * Wait for the cleanup processes, merge their statistics and finish
+ * with the stale files of the index.
+ */
+void
+repo_cleanup_finish(struct filepath_tree *tree, int cachefd)
+{
+	struct cleanup_rec rec;
+	struct repo *rp;
+	int i, st;
+	ssize_t n;
+
+	for (i = 0; i < cleanup_nprocs; i++) {
+		while ((n = read(cleanup_fds[i], &rec, sizeof(rec))) ==
+		    sizeof(rec)) {
+			if (rec.global) {
+				cleanup_merge(&stats.repo_stats, &rec.st);
+				continue;
+			}
+			if ((rp = repo_byid(rec.id)) == NULL)
+				errx(1, "cleanup: bad repository id");
+			cleanup_merge(&rp->repostats, &rec.st);
+		}
+		if (n != 0)
+			errx(1, "cleanup: bad message");
+		close(cleanup_fds[i]);
+		while (waitpid(cleanup_pids[i], &st, 0) == -1) {
+			if (errno != EINTR)
+				err(1, "waitpid");
+		}
+		if (!WIFEXITED(st) || WEXITSTATUS(st) != 0)
+			errx(1, "cleanup process exited abnormally");
+	}
+	cleanup_nprocs = 0;
+
+	if (cleanup_indexed)
+		fileindex_stale(cleanup_index, tree, cachefd);
+	if (cleanup_index != NULL)
+		fclose(cleanup_index);
+	cleanup_index = NULL;
+	fileindex_save(tree, cleanup_runs + 1);
+}
+
+/*
+ * Save the work of a run which is aborted by the global timeout. Files
+ * which were validated are moved and the caches are written so that the
+ * next run can pick up from here. Repositories still syncing keep the
+ * RRDP session state they started with, the full cleanup is skipped.
+ * The caches keep the entries of the previous run for the part of the
+ * tree this run did not reach.
+ */
+void
+repo_checkpoint(struct filepath_tree *tree)
+{
+	repo_move_valid(tree);
+	repo_cleanup_rrdp(tree);
+	cache_write(1);
+}
+
+/*
+ * The objects themselves stay one file each below cachedir: rsync(1)
+ * writes them that way, the valid tree is its --compare-dest base and
+ * other tools read the cache directly. The per-file costs are cut by
+ * these caches instead, the files of a replayed manifest subtree are
+ * only read for the hash check.
+ */
+struct cachefile {
+	const char	*name;
+	char		*temp;
+	FILE		*f;
+};
+
+static struct cachefile	objcache = { .name = OBJCACHE_FILE };
+static struct cachefile	mftcache = { .name = MFTCACHE_FILE };
+static struct cachefile	sigcache = { .name = SIGCACHE_FILE };
+static struct cachefile	stampcache = { .name = STAMPCACHE_FILE };
+
+static void
+cachefile_fail(struct cachefile *cf)
+{
+	warn("%s: save cache", cf->temp);
+	if (cf->f != NULL)
+		fclose(cf->f);
+	cf->f = NULL;
+	unlink(cf->temp);
+	free(cf->temp);
+	cf->temp = NULL;
+}
+
+/*
+ * Open a temporary file to collect the cache of this run.
+ * The file is moved in place by cachefile_save() once the run finished.
+ */
+static void
+cachefile_open(struct cachefile *cf)
+{
+	int fd;
+
+	if (asprintf(&cf->temp, "%s.XXXXXXXXXX", cf->name) == -1)
+		err(1, NULL);
+	if ((fd = mkostemp(cf->temp, O_CLOEXEC)) == -1) {
+		cachefile_fail(cf);
+		return;
+	}
+	(void)fchmod(fd, 0644);
+	if ((cf->f = fdopen(fd, "w")) == NULL)
+		err(1, "fdopen");
+
+	if (fprintf(cf->f, "%s", CACHE_MAGIC) < 0)
+		cachefile_fail(cf);
+}
+
+/*
+ * Append a cache record and its data to the cache file.
+ */
+static void
+cachefile_add(struct cachefile *cf, const struct cache_rec *rec,
+    const void *data)
+{
+	if (cf->f == NULL || rec->type == RTYPE_INVALID)
+		return;
+
+	if (fwrite(rec, sizeof(*rec), 1, cf->f) != 1 ||
+	    fwrite(data, rec->len, 1, cf->f) != 1)
+		cachefile_fail(cf);
+}
+
+/*
+ * Append the records of the cache file of the previous run to the current
+ * one. On load the first record of a key wins, so the results of this run
+ * take precedence.
+ */
+static void
+cachefile_merge(struct cachefile *cf)
+{
+	FILE *f;
+	char buf[8192], *line = NULL;
+	size_t linesize = 0, n;
+
+	if (cf->f == NULL || (f = fopen(cf->name, "r")) == NULL)
+		return;
+	if (getline(&line, &linesize, f) != -1 &&
+	    strcmp(line, CACHE_MAGIC) == 0) {
+		while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+			if (fwrite(buf, 1, n, cf->f) != n) {
+				cachefile_fail(cf);
+				break;
+			}
+		}
+	}
+	free(line);
+	fclose(f);
+}
+
+/*
+ * Replace the cache file of the previous run with the current one.
+ */
+static void
+cachefile_save(struct cachefile *cf)
+{
+	if (cf->f == NULL)
+		return;
+
+	if (fclose(cf->f) != 0) {
+		cf->f = NULL;
+		cachefile_fail(cf);
+		return;
+	}
+	cf->f = NULL;
+
+	if (rename(cf->temp, cf->name) == -1) {
+		warn("rename %s to %s", cf->temp, cf->name);
+		unlink(cf->temp);
+	}
+	free(cf->temp);
+	cf->temp = NULL;
+}
+
+/*
+ * Open the index of the valid cache written by the previous run and read
+ * the number of runs since the last full cleanup walk.
+ * Returns NULL if there is no usable index.
+ */
+static FILE *
+fileindex_load(unsigned int *runs)
+{
+	FILE *f;
+	char *line = NULL;
+	const char *errstr;
+	size_t linesize = 0;
+	ssize_t n;
+
+	if ((f = fopen(FILEINDEX_FILE, "r")) == NULL)
+		return NULL;
+	if (getline(&line, &linesize, f) == -1 ||
+	    strcmp(line, CACHE_MAGIC) != 0 ||
+	    (n = getline(&line, &linesize, f)) == -1 || line[n - 1] != '\n')
+		goto fail;
+	line[n - 1] = '\0';
+	*runs = strtonum(line, 0, UINT_MAX - 1, &errstr);
+	if (errstr != NULL)
+		goto fail;
+	free(line);
+	return f;
+
+ fail:
+	free(line);
+	fclose(f);
+	return NULL;
+}
+
+/*
+ * Remove a file of the valid cache which is no longer used, like
+ * repo_cleanup_entry() does, and the directories this leaves empty.
+ */
+static void
+fileindex_remove(char *path, int cachefd)
+{
+	const struct rrdprepo *rr = NULL;
+	struct repo *rp = NULL;
+	struct stat st;
+	char *fn, *p;
+
+	/* rpki.example.org/repository is the base of the repository */
+	if ((p = strchr(path, '/')) != NULL &&
+	    (p = strchr(p + 1, '/')) != NULL) {
+		*p = '\0';
+		rp = repo_bypath(path);
+		*p = '/';
+	}
+	if (rp != NULL)
+		rr = repo_is_rrdp(rp);
+
+	if (rr != NULL) {
+		if (asprintf(&fn, "%s/%s", rr->basedir, path) == -1)
+			err(1, NULL);
+		/* a file in the rrdp dir is newer, keep that one */
+		if (fstatat(cachefd, fn, &st, 0) == 0 && S_ISREG(st.st_mode))
+			rr = NULL;
+		else if (repo_mkpath(cachefd, fn) == 0) {
+			if (renameat(AT_FDCWD, path, cachefd, fn) == -1) {
+				if (errno != ENOENT)
+					warn("rename %s to %s", path, fn);
+			} else {
+				if (verbose > 1)
+					logx("moved %s", path);
+				rp->repostats.extra_files++;
+			}
+		}
+		free(fn);
+	}
+	if (rr == NULL) {
+		if (unlink(path) == -1) {
+			if (errno != ENOENT)
+				warn("unlink %s", path);
+			return;
+		}
+		if (verbose > 1)
+			logx("deleted %s", path);
+		if (rp != NULL)
+			rp->repostats.del_files++;
+		else
+			stats.repo_stats.del_files++;
+	}
+
+	repo_mkpath_flush();
+	while ((p = strrchr(path, '/')) != NULL) {
+		*p = '\0';
+		if (rmdir(path) == -1)
+			return;
+		if (rp != NULL && strchr(path, '/') != NULL)
+			rp->repostats.del_dirs++;
+		else
+			stats.repo_stats.del_dirs++;
+	}
+}
+
+/*
+ * Remove the files in the index of the previous run which are not used
+ * by this one.
+ */
+static void
+fileindex_stale(FILE *f, struct filepath_tree *tree, int cachefd)
+{
+	char *line = NULL;
+	size_t linesize = 0;
+	ssize_t n;
+
+	while ((n = getline(&line, &linesize, f)) != -1) {
+		if (line[n - 1] == '\n')
+			line[--n] = '\0';
+		/* only relative paths below the cache directory */
+		if (n == 0 || line[0] == '.' || line[0] == '/' ||
+		    strstr(line, "/.") != NULL)
+			continue;
+		if (!filepath_exists(tree, line))
+			fileindex_remove(line, cachefd);
+	}
+	free(line);
+}
+
+/*
+ * Write the files in the valid cache at the end of this run, all of
+ * them are in tree once the cleanup is done.
+ */
+static void
+fileindex_save(struct filepath_tree *tree, unsigned int runs)
+{
+	struct cachefile cf = { .name = FILEINDEX_FILE };
+	struct filepath **list;
+	size_t i, n;
+
+	cachefile_open(&cf);
+	if (cf.f != NULL && fprintf(cf.f, "%u\n", runs) < 0)
+		cachefile_fail(&cf);
+
+	list = filepath_list(tree, &n);
+	for (i = 0; i < n && cf.f != NULL; i++) {
+		/* files left in the temporary directories were removed */
+		if (list[i]->file[0] == '.')
+			continue;
+		if (fprintf(cf.f, "%s\n", list[i]->file) < 0)
+			cachefile_fail(&cf);
+	}
+	free(list);
+	cachefile_save(&cf);
+}
+
+/*
+ * Record the sync time of uri, keeping the longest one.
+ */
+static void
+repohist_set(const char *uri, unsigned int msec)
+{
+	struct repohist *rh;
+
+	SLIST_FOREACH(rh, &repohists, entry)
+		if (strcmp(rh->uri, uri) == 0) {
+			if (rh->msec < msec)
+				rh->msec = msec;
+			return;
+		}
+
+	if ((rh = calloc(1, sizeof(*rh))) == NULL)
+		err(1, NULL);
+	if ((rh->uri = strdup(uri)) == NULL)
+		err(1, NULL);
+	rh->msec = msec;
+	SLIST_INSERT_HEAD(&repohists, rh, entry);
+}
+
+/*
+ * Return the fetch priority of uri, the sync time of the previous run.
+ * Unknown repositories get the lowest priority.
+ */
+static unsigned int
+repohist_prio(const char *uri)
+{
+	struct repohist *rh;
+
+	SLIST_FOREACH(rh, &repohists, entry)
+		if (strcmp(rh->uri, uri) == 0)
+			return rh->msec;
+	return 0;
+}
+
+/*
+ * Remember a repository of the previous run for repo_prefetch_collect().
+ * The line holds the TAL, the repository URI, the number of failed syncs
+ * in a row, the number of unchanged syncs in a row, the time of the next
+ * probe or sync and the optional notification URI, separated by spaces.
+ */
+static void
+prefetch_add(char *line)
+{
+	struct prefetch *pf;
+	char *tal, *repouri, *fails, *quiet, *retry, *notify;
+	const char *errstr;
+
+	tal = strsep(&line, " ");
+	repouri = strsep(&line, " ");
+	fails = strsep(&line, " ");
+	quiet = strsep(&line, " ");
+	retry = strsep(&line, " ");
+	notify = line;
+	if (tal == NULL || *tal == '\0' || repouri == NULL ||
+	    strncmp(repouri, RSYNC_PROTO, RSYNC_PROTO_LEN) != 0 ||
+	    fails == NULL || quiet == NULL || retry == NULL)
+		return;
+
+	if ((pf = calloc(1, sizeof(*pf))) == NULL)
+		err(1, NULL);
+	pf->fails = strtonum(fails, 0, UINT_MAX, &errstr);
+	if (errstr == NULL)
+		pf->quiet = strtonum(quiet, 0, UINT_MAX, &errstr);
+	if (errstr == NULL)
+		pf->retry = strtonum(retry, 0, LLONG_MAX, &errstr);
+	if (errstr != NULL) {
+		free(pf);
+		return;
+	}
+	if ((pf->tal = strdup(tal)) == NULL ||
+	    (pf->repouri = strdup(repouri)) == NULL)
+		err(1, NULL);
+	if (notify != NULL && *notify != '\0')
+		if ((pf->notifyuri = strdup(notify)) == NULL)
+			err(1, NULL);
+	if (RB_INSERT(prefetch_tree, &prefetches, pf) != NULL) {
+		free(pf->tal);
+		free(pf->repouri);
+		free(pf->notifyuri);
+		free(pf);
+	}
+}
+
+/*
+ * Load the sync times of the previous run. Each line holds the sync time
+ * in milliseconds and the rsync or RRDP notification URI, followed by
+ * the repository for prefetch_add().
+ */
+static void
+repohist_load(void)
+{
+	FILE *f;
+	char *line = NULL, *uri, *rest;
+	const char *errstr;
+	size_t linesize = 0;
+	ssize_t n;
+	unsigned int msec;
+
+	if ((f = fopen(REPOHIST_FILE, "r")) == NULL)
+		return;
+
+	if (getline(&line, &linesize, f) == -1 ||
+	    strcmp(line, CACHE_MAGIC) != 0)
+		goto out;
+
+	while ((n = getline(&line, &linesize, f)) != -1) {
+		if (line[n - 1] == '\n')
+			line[n - 1] = '\0';
+		if ((uri = strchr(line, ' ')) == NULL)
+			break;
+		*uri++ = '\0';
+		if ((rest = strchr(uri, ' ')) != NULL)
+			*rest++ = '\0';
+		msec = strtonum(line, 0, UINT_MAX, &errstr);
+		if (errstr != NULL || *uri == '\0')
+			break;
+		repohist_set(uri, msec);
+		if (rest != NULL)
+			prefetch_add(rest);
+	}
+
+ out:
+	free(line);
+	fclose(f);
+}
+
+/*
+ * Write the sync time of all repositories of this run for the next one,
+ * together with their failure and quiet counters. Repositories skipped
+ * because of a backoff or because they rested keep the sync time of the
+ * previous run, trust anchors are not written.
+ * If partial is set the run was aborted and the repositories of the
+ * previous run it did not reach are carried over as they were loaded.
+ */
+static void
+repohist_save(int partial)
+{
+	struct cachefile cf = { .name = REPOHIST_FILE };
+	struct repo *rp;
+	struct prefetch *pf, key;
+	const char *uri;
+	long long msec;
+	unsigned int fails, quiet, i;
+	time_t retry, delay;
+
+	if (noop)
+		return;
+
+	cachefile_open(&cf);
+	SLIST_FOREACH(rp, &repos, entry) {
+		if (cf.f == NULL)
+			return;
+		if (rp->prefetch)
+			continue;
+		key.repouri = rp->repouri;
+		key.notifyuri = rp->notifyuri;
+		if ((pf = RB_FIND(prefetch_tree, &prefetches, &key)) != NULL)
+			pf->saved = 1;
+
+		fails = rp->fails;
+		quiet = rp->quiet;
+		retry = rp->retry;
+		if (rp->backoff || rp->rested) {
+			/* keep the history of the previous run */
+			uri = rp->notifyuri != NULL ? rp->notifyuri :
+			    rp->repouri;
+			msec = repohist_prio(uri);
+		} else {
+			if (rp->rrdp != NULL)
+				uri = rp->rrdp->notifyuri;
+			else if (rp->rsync != NULL)
+				uri = rp->rsync->repouri;
+			else
+				continue;
+
+			msec = (long long)rp->repostats.sync_time.tv_sec *
+			    1000 + rp->repostats.sync_time.tv_nsec / 1000000;
+			if (msec > UINT_MAX)
+				msec = UINT_MAX;
+
+			retry = 0;
+			if (repo_state(rp) != REPO_FAILED)
+				fails = 0;
+			else if (++fails >= REPO_FAIL_MAX) {
+				delay = REPO_BACKOFF;
+				for (i = REPO_FAIL_MAX; i < fails &&
+				    delay < REPO_BACKOFF_MAX; i++)
+					delay *= 2;
+				if (delay > REPO_BACKOFF_MAX)
+					delay = REPO_BACKOFF_MAX;
+				retry = time(NULL) + delay;
+			}
+
+			/* rsync has no cheap check for changes, learn them */
+			quiet = 0;
+			if (rp->notifyuri == NULL && fails == 0 &&
+			    rp->repostats.new_files == 0 &&
+			    (quiet = rp->quiet + 1) >= REPO_QUIET_MIN) {
+				delay = REPO_QUIET_DELAY;
+				for (i = REPO_QUIET_MIN; i < quiet &&
+				    delay < REPO_QUIET_DELAY_MAX; i++)
+					delay *= 2;
+				if (delay > REPO_QUIET_DELAY_MAX)
+					delay = REPO_QUIET_DELAY_MAX;
+				retry = time(NULL) + delay;
+			}
+		}
+
+		if (fprintf(cf.f, "%lld %s %s %s %u %u %lld%s%s\n", msec,
+		    uri, taldescs[rp->talid], rp->repouri, fails, quiet,
+		    (long long)retry,
+		    rp->notifyuri != NULL ? " " : "",
+		    rp->notifyuri != NULL ? rp->notifyuri : "") < 0)
+			cachefile_fail(&cf);
+	}
+	RB_FOREACH(pf, prefetch_tree, &prefetches) {
+		if (cf.f == NULL)
+			return;
+		if (!partial || pf->saved)
+			continue;
+		uri = pf->notifyuri != NULL ? pf->notifyuri : pf->repouri;
+		if (fprintf(cf.f, "%u %s %s %s %u %u %lld%s%s\n",
+		    repohist_prio(uri), uri, pf->tal, pf->repouri, pf->fails,
+		    pf->quiet, (long long)pf->retry,
+		    pf->notifyuri != NULL ? " " : "",
+		    pf->notifyuri != NULL ? pf->notifyuri : "") < 0)
+			cachefile_fail(&cf);
+	}
+	cachefile_save(&cf);
+}
+
+static int
+rrdpstate_read_str(FILE *f, char **s)
+{
+	size_t sz;
+
+	*s = NULL;
+	if (fread(&sz, sizeof(sz), 1, f) != 1)
+		return -1;
+	if (sz == 0)
+		return 0;
+	if (sz > MAX_URI_LENGTH)
+		return -1;
+	if ((*s = calloc(sz + 1, 1)) == NULL)
+		err(1, NULL);
+	if (fread(*s, sz, 1, f) != 1 || strlen(*s) != sz)
+		return -1;
+	return 0;
+}
+
+static int
+rrdpstate_write_str(FILE *f, const char *s)
+{
+	size_t sz = 0;
+
+	if (s != NULL)
+		sz = strlen(s);
+	if (fwrite(&sz, sizeof(sz), 1, f) != 1)
+		return -1;
+	if (sz > 0 && fwrite(s, sz, 1, f) != 1)
+		return -1;
+	return 0;
+}
+
+/*
+ * Load the RRDP session state of all repositories. Each record holds
+ * the notification URI, session id, last modified, entity tag, serial,
+ * the sizes and the delta hashes. Strings are stored as their length
+ * followed by the characters, a length of 0 stands for NULL.
+ */
+static void
+rrdpstate_load(void)
+{
+	FILE *f;
+	struct rrdpstate *rs;
+	struct rrdp_session *state;
+	char *line = NULL;
+	size_t linesize = 0, i, ndeltas;
+	int c;
+
+	if ((f = fopen(RRDPSTATE_FILE, "r")) == NULL)
+		return;
+
+	if (getline(&line, &linesize, f) == -1 ||
+	    strcmp(line, CACHE_MAGIC) != 0)
+		goto out;
+
+	while ((c = getc(f)) != EOF) {
+		ungetc(c, f);
+		if ((rs = calloc(1, sizeof(*rs))) == NULL)
+			err(1, NULL);
+		if ((state = calloc(1, sizeof(*state))) == NULL)
+			err(1, NULL);
+		rs->state = state;
+
+		if (rrdpstate_read_str(f, &rs->notifyuri) == -1 ||
+		    rrdpstate_read_str(f, &state->session_id) == -1 ||
+		    rrdpstate_read_str(f, &state->last_mod) == -1 ||
+		    rrdpstate_read_str(f, &state->etag) == -1 ||
+		    fread(&state->serial, sizeof(state->serial), 1, f) != 1 ||
+		    fread(&state->snapshot_size, sizeof(state->snapshot_size),
+		    1, f) != 1 ||
+		    fread(&state->delta_size, sizeof(state->delta_size),
+		    1, f) != 1 ||
+		    fread(&ndeltas, sizeof(ndeltas), 1, f) != 1)
+			goto fail;
+		if (rs->notifyuri == NULL || state->session_id == NULL ||
+		    ndeltas > MAX_RRDP_DELTAS)
+			goto fail;
+		for (i = 0; i < ndeltas; i++) {
+			if (rrdpstate_read_str(f, &state->deltas[i]) == -1 ||
+			    state->deltas[i] == NULL)
+				goto fail;
+		}
+		if (RB_INSERT(rrdpstate_tree, &rrdpstates, rs) != NULL)
+			goto fail;
+	}
+	goto out;
+
+ fail:
+	warnx("%s: troubles reading state file", RRDPSTATE_FILE);
+	free(rs->notifyuri);
+	rrdp_session_free(rs->state);
+	free(rs);
+ out:
+	free(line);
+	fclose(f);
+}
+
+/*
+ * Write the RRDP session state of all repositories used in this run,
+ * the state of repositories which are gone is dropped with them. If
+ * partial is set the run was aborted and the state of all repositories
+ * is kept.
+ */
+static void
+rrdpstate_save(int partial)
+{
+	struct cachefile cf = { .name = RRDPSTATE_FILE };
+	struct rrdpstate *rs;
+	struct rrdprepo key;
+	struct rrdp_session *s;
+	size_t i, ndeltas;
+
+	if (noop)
+		return;
+
+	cachefile_open(&cf);
+	RB_FOREACH(rs, rrdpstate_tree, &rrdpstates) {
+		if (cf.f == NULL)
+			return;
+		key.notifyuri = rs->notifyuri;
+		if (!partial &&
+		    RB_FIND(rrdp_uri_tree, &rrdp_uris, &key) == NULL)
+			continue;
+
+		s = rs->state;
+		for (ndeltas = 0; ndeltas < MAX_RRDP_DELTAS &&
+		    s->deltas[ndeltas] != NULL; ndeltas++)
+			;
+		if (rrdpstate_write_str(cf.f, rs->notifyuri) == -1 ||
+		    rrdpstate_write_str(cf.f, s->session_id) == -1 ||
+		    rrdpstate_write_str(cf.f, s->last_mod) == -1 ||
+		    rrdpstate_write_str(cf.f, s->etag) == -1 ||
+		    fwrite(&s->serial, sizeof(s->serial), 1, cf.f) != 1 ||
+		    fwrite(&s->snapshot_size, sizeof(s->snapshot_size), 1,
+		    cf.f) != 1 ||
+		    fwrite(&s->delta_size, sizeof(s->delta_size), 1,
+		    cf.f) != 1 ||
+		    fwrite(&ndeltas, sizeof(ndeltas), 1, cf.f) != 1) {
+			cachefile_fail(&cf);
+			continue;
+		}
+		for (i = 0; i < ndeltas; i++) {
+			if (rrdpstate_write_str(cf.f, s->deltas[i]) == -1) {
+				cachefile_fail(&cf);
+				break;
+			}
+		}
+	}
+	cachefile_save(&cf);
+}
+
+/*
+ * Only redirects to the same origin are followed, see http_parse_header().
+ * Check this again for entries read from the cache file.
+ */
+static int
+redirect_valid(const char *uri, const char *target)
+{
+	if (!valid_uri(uri, strlen(uri), HTTPS_PROTO) ||
+	    !valid_uri(target, strlen(target), HTTPS_PROTO))
+		return 0;
+	return valid_origin(target, uri);
+}
+
+static void
+redirect_set(const char *uri, const char *target, time_t expires)
+{
+	struct redirect *rd, key;
+
+	key.uri = (char *)uri;
+	if ((rd = RB_FIND(redirect_tree, &redirects, &key)) == NULL) {
+		if ((rd = calloc(1, sizeof(*rd))) == NULL)
+			err(1, NULL);
+		if ((rd->uri = strdup(uri)) == NULL)
+			err(1, NULL);
+		RB_INSERT(redirect_tree, &redirects, rd);
+	}
+	free(rd->target);
+	if ((rd->target = strdup(target)) == NULL)
+		err(1, NULL);
+	rd->expires = expires;
+}
+
+static void
+redirect_remove(struct redirect *rd)
+{
+	if (rd->used)
+		RB_REMOVE(redirect_id_tree, &redirect_ids, rd);
+	RB_REMOVE(redirect_tree, &redirects, rd);
+	free(rd->uri);
+	free(rd->target);
+	free(rd);
+}
+
+/*
+ * Load the permanent redirects of previous runs. Each line holds the
+ * expiry time, the URI and the target URI.
+ */
+static void
+redirect_load(void)
+{
+	FILE *f;
+	char *line = NULL, *uri, *target;
+	const char *errstr;
+	size_t linesize = 0;
+	ssize_t n;
+	time_t expires, now;
+
+	if ((f = fopen(REDIRECT_FILE, "r")) == NULL)
+		return;
+
+	if (getline(&line, &linesize, f) == -1 ||
+	    strcmp(line, CACHE_MAGIC) != 0)
+		goto out;
+
+	now = time(NULL);
+	while ((n = getline(&line, &linesize, f)) != -1) {
+		if (line[n - 1] == '\n')
+			line[n - 1] = '\0';
+		if ((uri = strchr(line, ' ')) == NULL)
+			break;
+		*uri++ = '\0';
+		if ((target = strchr(uri, ' ')) == NULL)
+			break;
+		*target++ = '\0';
+		expires = strtonum(line, 0, LLONG_MAX, &errstr);
+		if (errstr != NULL)
+			break;
+		if (expires <= now || expires > now + REDIRECT_TTL ||
+		    !redirect_valid(uri, target))
+			continue;
+		redirect_set(uri, target, expires);
+	}
+
+ out:
+	free(line);
+	fclose(f);
+}
+
+static void
+redirect_save(void)
+{
+	struct cachefile cf = { .name = REDIRECT_FILE };
+	struct redirect *rd;
+
+	if (noop)
+		return;
+
+	cachefile_open(&cf);
+	RB_FOREACH(rd, redirect_tree, &redirects) {
+		if (cf.f == NULL)
+			return;
+		if (fprintf(cf.f, "%lld %s %s\n", (long long)rd->expires,
+		    rd->uri, rd->target) < 0)
+			cachefile_fail(&cf);
+	}
+	cachefile_save(&cf);
+}
+
+/*
+ * Return the URI to request for uri, the target of an unexpired
+ * permanent redirect or uri itself.
+ */
+const char *
+repo_redirect(unsigned int id, const char *uri)
+{
+	struct redirect *rd, key;
+
+	key.uri = (char *)uri;
+	if ((rd = RB_FIND(redirect_tree, &redirects, &key)) == NULL)
+		return uri;
+	if (rd->expires <= time(NULL))
+		return uri;
+	if (rd->used)
+		RB_REMOVE(redirect_id_tree, &redirect_ids, rd);
+	rd->id = id;
+	rd->used = 1;
+	RB_INSERT(redirect_id_tree, &redirect_ids, rd);
+	return rd->target;
+}
+
+/*
+ * Learn the permanent redirect from -> to of request id. If the request
+ * used a cached redirect, a failure drops it and a further permanent
+ * redirect of its target updates it.
+ */
+void
+repo_redirect_done(unsigned int id, enum http_result res, const char *from,
+    const char *to)
+{
+	struct redirect *rd, key;
+
+	key.id = id;
+	if ((rd = RB_FIND(redirect_id_tree, &redirect_ids, &key)) != NULL) {
+		RB_REMOVE(redirect_id_tree, &redirect_ids, rd);
+		rd->used = 0;
+		if (res == HTTP_FAILED) {
+			redirect_remove(rd);
+			return;
+		}
+	}
+
+	if (res == HTTP_FAILED || from == NULL || to == NULL ||
+	    !redirect_valid(from, to))
+		return;
+	if (rd != NULL && strcmp(rd->target, from) == 0)
+		from = rd->uri;
+	redirect_set(from, to, time(NULL) + REDIRECT_TTL);
+}
+
+/*
+ * Return a fresh identifier, unique among all repositories and requests.
+ */
+unsigned int
+repo_newid(void)
+{
+	return ++repoid;
+}
+
+/*
+ * Return the fetch priority of the RRDP repository with identifier id.
+ */
+unsigned int
+repo_fetch_prio(unsigned int id)
+{
+	struct rrdprepo *rr;
+
+	if ((rr = rrdp_find(id)) == NULL)
+		return 0;
+	return rr->prio;
+}
+
+void
+cache_open(void)
+{
+	cachefile_open(&objcache);
+	cachefile_open(&mftcache);
+	cachefile_open(&sigcache);
+	cachefile_open(&stampcache);
+	/* the hashes of RRDP updates and withdraws are checked with these */
+	valid_stamps_load(STAMPCACHE_FILE);
+	repohist_load();
+	rrdpstate_load();
+	redirect_load();
+}
+
+void
+objcache_add(const struct cache_rec *rec, const void *data)
+{
+	cachefile_add(&objcache, rec, data);
+}
+
+void
+mftcache_add(const struct cache_rec *rec, const void *data)
+{
+	cachefile_add(&mftcache, rec, data);
+}
+
+/*
+ * Append the digests of CMS objects with a verified signature.
+ */
+void
+sigcache_add(const void *data, size_t len)
+{
+	if (sigcache.f == NULL || len == 0)
+		return;
+
+	if (fwrite(data, len, 1, sigcache.f) != 1)
+		cachefile_fail(&sigcache);
+}
+
+/*
+ * Append the stamps of files whose hash matched their manifest entry.
+ */
+void
+stampcache_add(const void *data, size_t len)
+{
+	if (stampcache.f == NULL || len == 0)
+		return;
+
+	if (fwrite(data, len, 1, stampcache.f) != 1)
+		cachefile_fail(&stampcache);
+}
+
+/*
+ * Write all caches. If partial is set the run was aborted and the
+ * entries of the previous run are carried over for what it missed.
+ */
+static void
+cache_write(int partial)
+{
+	const struct file_stamp *fs;
+	size_t n;
+
+	fs = valid_stamps_take(&n);
+	stampcache_add(fs, n * sizeof(*fs));
+
+	if (partial) {
+		cachefile_merge(&objcache);
+		cachefile_merge(&mftcache);
+		cachefile_merge(&sigcache);
+		cachefile_merge(&stampcache);
+	}
+	cachefile_save(&objcache);
+	cachefile_save(&mftcache);
+	cachefile_save(&sigcache);
+	cachefile_save(&stampcache);
+	repohist_save(partial);
+	rrdpstate_save(partial);
+	redirect_save();
+}
+
+void
+cache_save(void)
+{
+	cache_write(0);
+}
+
+void
+repo_free(void)
+{
+	struct repo *rp;
+	struct repohist *rh;
+	struct prefetch *pf;
+	struct rrdpstate *rs, *trs;
+	struct redirect *rd, *trd;
+
+	while ((rp = SLIST_FIRST(&repos)) != NULL) {
+		SLIST_REMOVE_HEAD(&repos, entry);
+		free(rp->repouri);
+		free(rp->notifyuri);
+		free(rp->basedir);
+		free(rp);
+	}
+	RB_INIT(&repo_ids);
+	RB_INIT(&repo_uris);
+	RB_INIT(&repo_paths);
+	free(timers);
+	timers = NULL;
+	ntimers = maxtimers = 0;
+
+	while ((rh = SLIST_FIRST(&repohists)) != NULL) {
+		SLIST_REMOVE_HEAD(&repohists, entry);
+		free(rh->uri);
+		free(rh);
+	}
+
+	while ((pf = RB_MIN(prefetch_tree, &prefetches)) != NULL) {
+		RB_REMOVE(prefetch_tree, &prefetches, pf);
+		free(pf->tal);
+		free(pf->repouri);
+		free(pf->notifyuri);
+		free(pf);
+	}
+
+	RB_FOREACH_SAFE(rs, rrdpstate_tree, &rrdpstates, trs) {
+		RB_REMOVE(rrdpstate_tree, &rrdpstates, rs);
+		free(rs->notifyuri);
+		rrdp_session_free(rs->state);
+		free(rs);
+	}
+
+	RB_FOREACH_SAFE(rd, redirect_tree, &redirects, trd)
+		redirect_remove(rd);
+
+	if (mkdirs != NULL) {
+		filepath_free(mkdirs);
+		ohash_delete(&mkdirs->table);
+		free(mkdirs);
+		mkdirs = NULL;
 	}
 
 	ta_free();
@@ -1897,7 +4338,8 @@ repo_free(void)
 
 /*
  * Remove all files and directories under base.
- * Do not remove base directory itself and the .state file.
+ * Do not remove base directory itself, the .state file and a partially
+ * downloaded snapshot.
  */
 static void
 remove_contents(char *base)
@@ -1915,7 +4357,8 @@ remove_contents(char *base)
 		case FTS_SL:
 		case FTS_SLNONE:
 			if (e->fts_level == 1 &&
-			    strcmp(e->fts_name, ".state") == 0)
+			    (strcmp(e->fts_name, ".state") == 0 ||
+			    strcmp(e->fts_name, RRDP_PARTIAL) == 0))
 				break;
 			if (unlink(e->fts_accpath) == -1)
 				warn("unlink %s", e->fts_path);
@@ -1926,6 +4369,7 @@ remove_contents(char *base)
 			/* keep root directory */
 			if (e->fts_level == FTS_ROOTLEVEL)
 				break;
+			repo_mkpath_flush();
 			if (rmdir(e->fts_accpath) == -1)
 				warn("rmdir %s", e->fts_path);
 			break;
@@ -90,6 +90,98 @@ ASN1_SEQUENCE(RouteOriginAttestation) = {
 DECLARE_ASN1_FUNCTIONS(RouteOriginAttestation);
 IMPLEMENT_ASN1_FUNCTIONS(RouteOriginAttestation);
 
+/*
+ * Decode the eContent straight into roa without the templates.
+ * Only handles well-formed strict DER, returns zero for anything else
+ * and leaves the diagnostics to the template decoder.
+ */
+static int
+roa_parse_econtent_der(struct roa *roa, const unsigned char *d, size_t dsz)
+{
+	struct der	 der, econ, blocks, fam, afi_der, addrs, addr, bits;
+	struct roa_ip	*res;
+	enum afi	 afi;
+	size_t		 ipmax = 0, n;
+	uint32_t	 maxlen;
+	unsigned int	 unused, seen = 0, nblocks = 0;
+
+	der.p = d;
+	der.len = dsz;
+	if (!der_get(&der, DER_SEQUENCE, &econ) || der.len != 0)
+		return 0;
+	if (der_peek(&econ, DER_EXPLICIT0))
+		return 0;
+	if (!der_get_uint32(&econ, &roa->asid))
+		return 0;
+	if (!der_get(&econ, DER_SEQUENCE, &blocks) || econ.len != 0)
+		return 0;
+
+	while (blocks.len > 0) {
+		if (++nblocks > 2)
+			return 0;
+		if (!der_get(&blocks, DER_SEQUENCE, &fam))
+			return 0;
+		if (!der_get(&fam, DER_OCTET_STRING, &afi_der) ||
+		    afi_der.len != 2 || afi_der.p[0] != 0)
+			return 0;
+		afi = afi_der.p[1];
+		if (afi != AFI_IPV4 && afi != AFI_IPV6)
+			return 0;
+		if (seen & (1 << afi))
+			return 0;
+		seen |= 1 << afi;
+		if (!der_get(&fam, DER_SEQUENCE, &addrs) || fam.len != 0 ||
+		    addrs.len == 0)
+			return 0;
+
+		while (addrs.len > 0) {
+			if (roa->ipsz + 1 >= MAX_IP_SIZE)
+				return 0;
+			if (!der_get(&addrs, DER_SEQUENCE, &addr))
+				return 0;
+			if (!der_get(&addr, DER_BIT_STRING, &bits) ||
+			    bits.len == 0)
+				return 0;
+			unused = bits.p[0];
+			n = bits.len - 1;
+			if (unused > 7 || (n == 0 && unused != 0))
+				return 0;
+			if (n > (afi == AFI_IPV4 ? 4 : 16))
+				return 0;
+			if (n > 0 && (bits.p[n] & ((1 << unused) - 1)))
+				return 0;
+
+			if (roa->ipsz == ipmax) {
+				n = ipmax == 0 ? 16 : ipmax * 2;
+				roa->ips = recallocarray(roa->ips, ipmax, n,
+				    sizeof(struct roa_ip));
+				if (roa->ips == NULL)
+					err(1, NULL);
+				ipmax = n;
+			}
+			res = &roa->ips[roa->ipsz];
+			memcpy(res->addr.addr, bits.p + 1, bits.len - 1);
+			res->addr.prefixlen = (bits.len - 1) * 8 - unused;
+
+			maxlen = res->addr.prefixlen;
+			if (addr.len > 0) {
+				if (!der_get_uint32(&addr, &maxlen) ||
+				    addr.len != 0)
+					return 0;
+				if (maxlen < res->addr.prefixlen ||
+				    maxlen > (afi == AFI_IPV4 ? 32 : 128))
+					return 0;
+			}
+			res->afi = afi;
+			res->maxlength = maxlen;
+			ip_roa_compose_ranges(res);
+			roa->ipsz++;
+		}
+	}
+
+	return nblocks > 0;
+}
+
 /*
  * Parses the eContent section of an ROA file, RFC 6482, section 3.
  * Returns zero on failure, non-zero on success.
@@ -111,6 +203,14 @@ roa_parse_econtent(const char *fn, struct roa *roa, const unsigned char *d,
 	int				 ipaddrblocksz;
 	int				 i, j, rc = 0;
 
+	if (roa_parse_econtent_der(roa, d, dsz))
+		return 1;
+
+	/* Redo it with the templates for proper diagnostics. */
+	free(roa->ips);
+	roa->ips = NULL;
+	roa->ipsz = 0;
+
 	oder = d;
 	if ((roa_asn1 = d2i_RouteOriginAttestation(NULL, &d, dsz)) == NULL) {
 		warnx("%s: RFC 6482 section 3: failed to parse "
@@ -276,13 +376,13 @@ roa_parse(X509 **x509, const char *fn, int talid, const unsigned char *der,
 	if (!roa_parse_econtent(fn, roa, cms, cmsz))
 		goto out;
 
-	if (x509_any_inherits(*x509)) {
-		warnx("%s: inherit elements not allowed in EE cert", fn);
+	if ((cert = cert_parse_ee_cert(fn, talid, *x509)) == NULL)
 		goto out;
-	}
 
-	if ((cert = cert_parse_ee_cert(fn, talid, *x509)) == NULL)
+	if (cert_any_inherits(cert)) {
+		warnx("%s: inherit elements not allowed in EE cert", fn);
 		goto out;
+	}
 
 	if (cert->asz > 0) {
 		warnx("%s: superfluous AS Resources extension present", fn);
@@ -378,58 +478,43 @@ roa_read(struct ibuf *b)
 }
 
 /*
- * Add each IP address in the ROA into the VRP tree.
- * Updates "vrps" to be the number of VRPs and "uniqs" to be the unique
- * number of addresses.
+ * Append each IP address in the ROA to the VRP array.
+ * Duplicates are only removed, and counted as unique, by vrp_sort().
  */
 void
-roa_insert_vrps(struct vrp_tree *tree, struct roa *roa, struct repo *rp)
+roa_insert_vrps(struct vrp_array *va, struct roa *roa, struct repo *rp)
 {
-	struct vrp	*v, *found;
-	size_t		 i;
+	struct vrp	*v;
+	size_t		 i, max;
+
+	if (roa->ipsz > SIZE_MAX - va->num)
+		errx(1, "too many VRPs");
+	if (va->num + roa->ipsz > va->max) {
+		max = va->max == 0 ? 1024 : va->max;
+		while (max < va->num + roa->ipsz)
+			max *= 2;
+		if ((v = reallocarray(va->v, max, sizeof(*v))) == NULL)
+			err(1, NULL);
+		va->v = v;
+		va->max = max;
+	}
 
 	for (i = 0; i < roa->ipsz; i++) {
-		if ((v = malloc(sizeof(*v))) == NULL)
-			err(1, NULL);
+		v = &va->v[va->num++];
 		v->afi = roa->ips[i].afi;
 		v->addr = roa->ips[i].addr;
 		v->maxlength = roa->ips[i].maxlength;
 		v->asid = roa->asid;
 		v->talid = roa->talid;
-		if (rp != NULL)
-			v->repoid = repo_id(rp);
-		else
-			v->repoid = 0;
+		v->repo = rp;
 		v->expires = roa->expires;
 
-		/*
-		 * Check if a similar VRP already exists in the tree.
-		 * If the found VRP expires sooner, update it to this
-		 * ROAs later expiry moment.
-		 */
-		if ((found = RB_INSERT(vrp_tree, tree, v)) != NULL) {
-			/* already exists */
-			if (found->expires < v->expires) {
-				/* update found with preferred data */
-				/* adjust unique count */
-				repo_stat_inc(repo_byid(found->repoid),
-				    found->talid, RTYPE_ROA, STYPE_DEC_UNIQUE);
-				found->expires = v->expires;
-				found->talid = v->talid;
-				found->repoid = v->repoid;
-				repo_stat_inc(rp, v->talid, RTYPE_ROA,
-				    STYPE_UNIQUE);
-			}
-			free(v);
-		} else
-			repo_stat_inc(rp, v->talid, RTYPE_ROA, STYPE_UNIQUE);
-
 		repo_stat_inc(rp, roa->talid, RTYPE_ROA, STYPE_TOTAL);
 	}
 }
 
 static inline int
-vrpcmp(struct vrp *a, struct vrp *b)
+vrpcmp(const struct vrp *a, const struct vrp *b)
 {
 	int rv;
 
@@ -469,4 +554,98 @@ vrpcmp(struct vrp *a, struct vrp *b)
 	return 0;
 }
 
-RB_GENERATE(vrp_tree, vrp, entry, vrpcmp);
+/*
+ * Order equal VRPs so that the preferred one, the one expiring last,
+ * comes first. The TAL and repository ids break the remaining ties so
+ * that the output does not depend on the order the ROAs were parsed in.
+ */
+static int
+vrp_sortcmp(const void *va, const void *vb)
+{
+	const struct vrp *a = va, *b = vb;
+	unsigned int aid, bid;
+	int rv;
+
+	if ((rv = vrpcmp(a, b)) != 0)
+		return rv;
+
+	if (a->expires > b->expires)
+		return -1;
+	if (a->expires < b->expires)
+		return 1;
+	if (a->talid < b->talid)
+		return -1;
+	if (a->talid > b->talid)
+		return 1;
+
+	aid = a->repo != NULL ? repo_id(a->repo) : 0;
+	bid = b->repo != NULL ? repo_id(b->repo) : 0;
+	if (aid < bid)
+		return -1;
+	if (aid > bid)
+		return 1;
+	return 0;
+}
+
+/*
+ * Sort the VRP array and remove the duplicates in one pass, keeping
+ * the VRP with the latest expiry moment.
+ */
+static void
+vrp_sort_unique(struct vrp_array *va)
+{
+	size_t i, n;
+
+	if (va->num == 0)
+		return;
+
+	qsort(va->v, va->num, sizeof(va->v[0]), vrp_sortcmp);
+
+	for (i = 1, n = 1; i < va->num; i++) {
+		if (vrpcmp(&va->v[n - 1], &va->v[i]) == 0)
+			continue;
+		va->v[n++] = va->v[i];
+	}
+	va->num = n;
+}
+
+/*
+ * Sort and deduplicate the VRP array, see vrp_sort_unique().
+ * Updates the unique VRP count of the repository the survivor is from.
+ */
+void
+vrp_sort(struct vrp_array *va)
+{
+	size_t i;
+
+	vrp_sort_unique(va);
+
+	for (i = 0; i < va->num; i++)
+		repo_stat_inc(va->v[i].repo, va->v[i].talid, RTYPE_ROA,
+		    STYPE_UNIQUE);
+}
+
+/*
+ * Fill dst with the sorted and unique VRPs of src covered by talid.
+ * The stats are not touched. Result must be passed to free(dst->v).
+ */
+void
+vrp_tal_subset(struct vrp_array *dst, const struct vrp_array *src,
+    int talid)
+{
+	size_t i;
+
+	memset(dst, 0, sizeof(*dst));
+	for (i = 0; i < src->num; i++)
+		if (src->v[i].talid == talid)
+			dst->max++;
+	if (dst->max == 0)
+		return;
+	if ((dst->v = calloc(dst->max, sizeof(dst->v[0]))) == NULL)
+		err(1, NULL);
+	for (i = 0; i < src->num; i++)
+		if (src->v[i].talid == talid)
+			dst->v[dst->num++] = src->v[i];
+
+	vrp_sort_unique(dst);
+}
@@ -17,13 +17,16 @@
  */
 #include <sys/queue.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 
 #include <err.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
 #include <poll.h>
+#include <stdio.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <imsg.h>
 
@@ -35,9 +38,17 @@
 
 #define MAX_SESSIONS	12
 #define	READ_BUF_SIZE	(32 * 1024)
+#define PARSE_BUF_SIZE	(64 * 1024)	/* read directly into expat */
+#define RRDP_PREFETCH	4		/* deltas fetched ahead */
+#define PREFETCH_SIZE	(2 * 1024 * 1024)	/* buffered per delta */
+#define FILE_WINDOW	512		/* files not yet stored by main */
+#define NPFDS		(MAX_SESSIONS * (1 + RRDP_PREFETCH) + 1)
 
 static struct msgbuf	msgq;
 
+extern int rrdpscan;
+extern int rrdpwrite;
+
 #define RRDP_STATE_REQ		0x01
 #define RRDP_STATE_WAIT		0x02
 #define RRDP_STATE_PARSE	0x04
@@ -46,19 +57,52 @@ static struct msgbuf	msgq;
 #define RRDP_STATE_HTTP_DONE	0x20
 #define RRDP_STATE_DONE		(RRDP_STATE_PARSE_DONE | RRDP_STATE_HTTP_DONE)
 
+/*
+ * A delta fetched ahead of time while the deltas before it are processed.
+ * Its data is buffered until the delta is due and then fed to the parser.
+ * Every http request is identified by its slot.
+ */
+struct rrdp_prefetch {
+	TAILQ_ENTRY(rrdp_prefetch)	 entry;
+	struct ibuf			*buf;
+	struct pollfd			*pfd;
+	unsigned int			 id;
+	unsigned int			 slot;
+	int				 infd;
+	int				 state;
+	enum http_result		 res;
+};
+
+TAILQ_HEAD(rrdp_prefetchq, rrdp_prefetch);
+
 struct rrdp {
 	TAILQ_ENTRY(rrdp)	 entry;
 	unsigned int		 id;
 	char			*notifyuri;
 	char			*local;
 	char			*last_mod;
+	char			*etag;
 
 	struct pollfd		*pfd;
 	int			 infd;
+	int			 dirfd;		/* temp repo, -1 if unavailable */
+	int			 partfd;	/* RRDP_PARTIAL, -1 if none */
+	int			 replay;	/* infd reads RRDP_PARTIAL */
+	int			 partbad;	/* RRDP_PARTIAL did not parse */
+	int			 resumed;	/* snapshot was retried */
+	long long		 partstart;	/* from RRDP_PARTIAL */
+	unsigned int		 file_seq;
+	unsigned int		 slot;		/* of the current request */
 	int			 state;
 	int			 aborted;
+	int			 finish;	/* call rrdp_finished() */
 	unsigned int		 file_pending;
 	unsigned int		 file_failed;
+	long long		 bytes;		/* of the current request */
+	long long		 totalbytes;	/* of all requests */
+	unsigned int		 published;	/* elements sent to main */
+	unsigned int		 deltas;	/* applied in this sync */
+	struct timespec		 parsetime;	/* spent parsing the XML */
 	enum http_result	 res;
 	enum rrdp_task		 task;
 
@@ -68,13 +112,19 @@ struct rrdp {
 	struct rrdp_session	*repository;
 	struct rrdp_session	*current;
 	XML_Parser		 parser;
+	struct rrdp_scan	*scan;		/* used instead of parser */
 	struct notification_xml	*nxml;
 	struct snapshot_xml	*sxml;
 	struct delta_xml	*dxml;
+	struct rrdp_prefetchq	 prefetch;
 };
 
 static TAILQ_HEAD(, rrdp)	states = TAILQ_HEAD_INITIALIZER(states);
 
+/* prefetches of finished sessions waiting for their HTTP_INI or HTTP_FIN */
+static struct rrdp_prefetchq	zombies = TAILQ_HEAD_INITIALIZER(zombies);
+static unsigned int		rrdp_slot;
+
 char *
 xstrdup(const char *s)
 {
@@ -103,14 +153,17 @@ rrdp_done(unsigned int id, int ok)
 
 /*
  * Request an URI to be fetched via HTTPS.
- * The main process will respond with a RRDP_HTTP_INI which includes
- * the file descriptor to read from. RRDP_HTTP_FIN is sent at the
- * end of the request with the HTTP status code and last modified timestamp.
+ * The main process will respond with a RRDP_HTTP_INI for the same slot
+ * which includes the file descriptor to read from. RRDP_HTTP_FIN is sent at the
+ * end of the request with the HTTP status code, last modified timestamp
+ * and entity tag.
  * If the request should not set the If-Modified-Since: header then last_mod
  * should be set to NULL, else it should point to a proper date string.
+ * Likewise etag is sent as If-None-Match: header unless it is NULL.
  */
 static void
-rrdp_http_req(unsigned int id, const char *uri, const char *last_mod)
+rrdp_http_req(unsigned int id, unsigned int slot, const char *uri,
+    const char *last_mod, const char *etag, long long offset)
 {
 	enum rrdp_msg type = RRDP_HTTP_REQ;
 	struct ibuf *b;
@@ -118,8 +171,11 @@ rrdp_http_req(unsigned int id, const char *uri, const char *last_mod)
 	b = io_new_buffer();
 	io_simple_buffer(b, &type, sizeof(type));
 	io_simple_buffer(b, &id, sizeof(id));
+	io_simple_buffer(b, &slot, sizeof(slot));
 	io_str_buffer(b, uri);
 	io_str_buffer(b, last_mod);
+	io_str_buffer(b, etag);
+	io_simple_buffer(b, &offset, sizeof(offset));
 	io_close_buffer(&msgq, b);
 }
 
@@ -155,7 +211,44 @@ rrdp_clear_repo(struct rrdp *s)
 }
 
 /*
- * Send a blob of data to the main process to store it in the repository.
+ * Write a blob of data into a staging file in the temp repo of the session.
+ * The file name relative to the temp repo is stored in name.
+ * Returns 0 on success or -1 on error.
+ */
+static int
+rrdp_stage_file(struct rrdp *s, const unsigned char *data, size_t datasz,
+    char *name, size_t namesz)
+{
+	ssize_t n;
+	int fd;
+
+	snprintf(name, namesz, "%s%u", RRDP_STAGE_PREFIX, s->file_seq++);
+	fd = openat(s->dirfd, name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+	    0644);
+	if (fd == -1) {
+		warn("%s: open %s", s->local, name);
+		return -1;
+	}
+	while (datasz > 0) {
+		if ((n = write(fd, data, datasz)) == -1) {
+			if (errno == EINTR)
+				continue;
+			warn("%s: write %s", s->local, name);
+			close(fd);
+			unlinkat(s->dirfd, name, 0);
+			return -1;
+		}
+		data += n;
+		datasz -= n;
+	}
+	close(fd);
+	return 0;
+}
+
+/*
+ * Send a file to the main process to store it in the repository.
+ * If possible the data is written to a staging file and only its name is
+ * sent, else the full blob is passed along.
  */
 void
 rrdp_publish_file(struct rrdp *s, struct publish_xml *pxml,
@@ -163,9 +256,15 @@ rrdp_publish_file(struct rrdp *s, struct publish_xml *pxml,
 {
 	enum rrdp_msg type = RRDP_FILE;
 	struct ibuf *b;
+	char name[32];
+	int staged = 0;
 
 	/* only send files if the fetch did not fail already */
 	if (s->file_failed == 0) {
+		if (data != NULL && s->dirfd != -1)
+			staged = rrdp_stage_file(s, data, datasz, name,
+			    sizeof(name)) == 0;
+
 		b = io_new_buffer();
 		io_simple_buffer(b, &type, sizeof(type));
 		io_simple_buffer(b, &s->id, sizeof(s->id));
@@ -173,14 +272,92 @@ rrdp_publish_file(struct rrdp *s, struct publish_xml *pxml,
 		if (pxml->type != PUB_ADD)
 			io_simple_buffer(b, &pxml->hash, sizeof(pxml->hash));
 		io_str_buffer(b, pxml->uri);
-		io_buf_buffer(b, data, datasz);
+		if (staged) {
+			io_str_buffer(b, name);
+			io_buf_buffer(b, NULL, 0);
+		} else {
+			io_str_buffer(b, NULL);
+			io_buf_buffer(b, data, datasz);
+		}
 		io_close_buffer(&msgq, b);
 		s->file_pending++;
 	}
+	s->published++;
+}
+
+static void
+rrdp_prefetch_free(struct rrdp_prefetch *pf)
+{
+	if (pf->infd != -1)
+		close(pf->infd);
+	ibuf_free(pf->buf);
+	free(pf);
 }
 
+/*
+ * Request the deltas following the current one until RRDP_PREFETCH
+ * of them are in flight.
+ */
 static void
-rrdp_new(unsigned int id, char *local, char *notify, struct rrdp_session *state)
+rrdp_prefetch_fill(struct rrdp *s)
+{
+	struct rrdp_prefetch *pf;
+	const char *uri;
+	size_t n = 0;
+
+	if (s->task != DELTA || s->aborted)
+		return;
+
+	TAILQ_FOREACH(pf, &s->prefetch, entry)
+		n++;
+	for (; n < RRDP_PREFETCH; n++) {
+		/* the current delta is still the first one in the queue */
+		if ((uri = notification_peek_delta(s->nxml, n + 1)) == NULL)
+			break;
+		if ((pf = calloc(1, sizeof(*pf))) == NULL)
+			err(1, NULL);
+		if ((pf->buf = ibuf_dynamic(READ_BUF_SIZE, PREFETCH_SIZE)) ==
+		    NULL)
+			err(1, NULL);
+		pf->id = s->id;
+		pf->slot = ++rrdp_slot;
+		pf->infd = -1;
+		pf->state = RRDP_STATE_WAIT;
+		TAILQ_INSERT_TAIL(&s->prefetch, pf, entry);
+		rrdp_http_req(s->id, pf->slot, uri, NULL, NULL, 0);
+	}
+}
+
+/*
+ * Drop all prefetched deltas of a session. Closing the pipe cuts the
+ * transfer short but the requests are kept as zombies until the main
+ * process is done with them.
+ */
+static void
+rrdp_prefetch_clear(struct rrdp *s)
+{
+	struct rrdp_prefetch *pf;
+
+	while ((pf = TAILQ_FIRST(&s->prefetch)) != NULL) {
+		TAILQ_REMOVE(&s->prefetch, pf, entry);
+		if (pf->state & RRDP_STATE_HTTP_DONE) {
+			rrdp_prefetch_free(pf);
+			continue;
+		}
+		if (pf->infd != -1) {
+			close(pf->infd);
+			pf->infd = -1;
+		}
+		ibuf_free(pf->buf);
+		pf->buf = NULL;
+		pf->pfd = NULL;
+		TAILQ_INSERT_TAIL(&zombies, pf, entry);
+	}
+}
+
+static void
+rrdp_new(unsigned int id, char *local, char *notify, struct rrdp_session *state,
+    int dirfd)
 {
 	struct rrdp *s;
 
@@ -188,6 +365,8 @@ rrdp_new(unsigned int id, char *local, char *notify, struct rrdp_session *state)
 		err(1, NULL);
 
 	s->infd = -1;
+	s->dirfd = dirfd;
+	s->partfd = -1;
 	s->id = id;
 	s->local = local;
 	s->notifyuri = notify;
@@ -196,8 +375,11 @@ rrdp_new(unsigned int id, char *local, char *notify, struct rrdp_session *state)
 		err(1, NULL);
 
 	s->state = RRDP_STATE_REQ;
+	TAILQ_INIT(&s->prefetch);
 	if ((s->parser = XML_ParserCreate("US-ASCII")) == NULL)
 		err(1, "XML_ParserCreate");
+	if (rrdpscan)
+		s->scan = rrdp_scan_new();
 
 	s->nxml = new_notification_xml(s->parser, s->repository, s->current,
 	    notify);
@@ -212,6 +394,7 @@ rrdp_free(struct rrdp *s)
 		return;
 
 	TAILQ_REMOVE(&states, s, entry);
+	rrdp_prefetch_clear(s);
 
 	free_notification_xml(s->nxml);
 	free_snapshot_xml(s->sxml);
@@ -219,11 +402,17 @@ rrdp_free(struct rrdp *s)
 
 	if (s->parser)
 		XML_ParserFree(s->parser);
+	rrdp_scan_free(s->scan);
 	if (s->infd != -1)
 		close(s->infd);
+	if (s->dirfd != -1)
+		close(s->dirfd);
+	if (s->partfd != -1)
+		close(s->partfd);
 	free(s->notifyuri);
 	free(s->local);
 	free(s->last_mod);
+	free(s->etag);
 	rrdp_session_free(s->repository);
 	rrdp_session_free(s->current);
 
@@ -241,16 +430,274 @@ rrdp_get(unsigned int id)
 	return s;
 }
 
+static struct rrdp_prefetch *
+rrdp_prefetch_get(struct rrdp_prefetchq *q, unsigned int id,
+    unsigned int slot)
+{
+	struct rrdp_prefetch *pf;
+
+	TAILQ_FOREACH(pf, q, entry)
+		if (pf->id == id && pf->slot == slot)
+			break;
+	return pf;
+}
+
+/*
+ * Handle the RRDP_HTTP_INI of a prefetched delta.
+ * Returns 0 if the slot belongs to the current request of the session.
+ */
+static int
+rrdp_prefetch_ini(unsigned int id, unsigned int slot, int fd)
+{
+	struct rrdp_prefetch *pf;
+	struct rrdp *s;
+
+	if ((pf = rrdp_prefetch_get(&zombies, id, slot)) == NULL) {
+		if ((s = rrdp_get(id)) == NULL)
+			return 0;
+		if ((pf = rrdp_prefetch_get(&s->prefetch, id, slot)) == NULL)
+			return 0;
+		pf->infd = fd;
+		fd = -1;
+	}
+	if (pf->state != RRDP_STATE_WAIT)
+		errx(1, "prefetch %u: bad internal state", slot);
+	if (fd != -1)
+		close(fd);
+	pf->state = RRDP_STATE_PARSE;
+	return 1;
+}
+
+/*
+ * Handle the RRDP_HTTP_FIN of a prefetched delta.
+ * Returns 0 if the slot belongs to the current request of the session.
+ */
+static int
+rrdp_prefetch_fin(unsigned int id, unsigned int slot, enum http_result res)
+{
+	struct rrdp_prefetch *pf;
+	struct rrdp *s;
+
+	if ((pf = rrdp_prefetch_get(&zombies, id, slot)) != NULL) {
+		if (!(pf->state & RRDP_STATE_PARSE))
+			errx(1, "prefetch %u: bad internal state", slot);
+		TAILQ_REMOVE(&zombies, pf, entry);
+		rrdp_prefetch_free(pf);
+		return 1;
+	}
+	if ((s = rrdp_get(id)) == NULL)
+		return 0;
+	if ((pf = rrdp_prefetch_get(&s->prefetch, id, slot)) == NULL)
+		return 0;
+	if (!(pf->state & RRDP_STATE_PARSE))
+		errx(1, "%s: bad internal state", s->local);
+	pf->state |= RRDP_STATE_HTTP_DONE;
+	pf->res = res;
+	return 1;
+}
+
+/*
+ * Buffer the data of a prefetched delta until it is due.
+ */
+static void
+rrdp_prefetch_read(struct rrdp *s, struct rrdp_prefetch *pf)
+{
+	char buf[READ_BUF_SIZE];
+	ssize_t len;
+
+	len = read(pf->infd, buf, sizeof(buf));
+	if (len == -1) {
+		warn("%s: read failure", s->local);
+		pf->state |= RRDP_STATE_PARSE_ERROR;
+	}
+	if (len <= 0) {
+		close(pf->infd);
+		pf->infd = -1;
+		pf->state |= RRDP_STATE_PARSE_DONE;
+		return;
+	}
+	if (ibuf_add(pf->buf, buf, len) == -1)
+		err(1, NULL);
+}
+
+/*
+ * Start the snapshot download. If RRDP_PARTIAL holds the beginning of
+ * the same snapshot it is parsed first and only the rest is requested,
+ * else RRDP_PARTIAL is started anew. The file begins with the hash of
+ * the snapshot from the notification file, followed by the data.
+ */
+static void
+rrdp_snapshot_start(struct rrdp *s, const char *uri)
+{
+	char hash[SHA256_DIGEST_LENGTH];
+	struct stat st;
+	int fd;
+
+	s->partstart = 0;
+	if (s->dirfd == -1) {
+		s->partfd = -1;
+		goto fetch;
+	}
+
+	fd = openat(s->dirfd, RRDP_PARTIAL, O_RDWR | O_CLOEXEC);
+	if (fd != -1) {
+		if (read(fd, hash, sizeof(hash)) == sizeof(hash) &&
+		    memcmp(hash, s->hash, sizeof(hash)) == 0 &&
+		    fstat(fd, &st) == 0 &&
+		    st.st_size - (off_t)sizeof(hash) >= RRDP_PARTIAL_MIN &&
+		    (s->infd = fcntl(fd, F_DUPFD_CLOEXEC, 0)) != -1) {
+			s->partfd = fd;
+			s->partstart = st.st_size - sizeof(hash);
+			s->replay = 1;
+			s->state = RRDP_STATE_PARSE;
+			logx("%s: resuming snapshot download after %lld bytes",
+			    s->local, s->partstart);
+			return;
+		}
+		close(fd);
+	}
+
+	s->partfd = openat(s->dirfd, RRDP_PARTIAL,
+	    O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (s->partfd == -1)
+		warn("%s: open %s", s->local, RRDP_PARTIAL);
+	else if (write(s->partfd, s->hash, sizeof(s->hash)) !=
+	    sizeof(s->hash)) {
+		warn("%s: write %s", s->local, RRDP_PARTIAL);
+		close(s->partfd);
+		s->partfd = -1;
+	}
+
+ fetch:
+	s->slot = ++rrdp_slot;
+	rrdp_http_req(s->id, s->slot, uri, NULL, NULL, 0);
+	s->state = RRDP_STATE_WAIT;
+}
+
+/*
+ * All of RRDP_PARTIAL was parsed, request the rest of the snapshot.
+ */
+static void
+rrdp_replay_done(struct rrdp *s)
+{
+	const char *uri;
+
+	s->replay = 0;
+	if (s->state & RRDP_STATE_PARSE_ERROR) {
+		warnx("%s: bad partial snapshot", s->local);
+		s->partbad = 1;
+		s->res = HTTP_FAILED;
+		s->state |= RRDP_STATE_PARSE_DONE | RRDP_STATE_HTTP_DONE;
+		s->finish = 1;
+		return;
+	}
+
+	uri = notification_get_next(s->nxml, s->hash, sizeof(s->hash),
+	    SNAPSHOT);
+	s->slot = ++rrdp_slot;
+	rrdp_http_req(s->id, s->slot, uri, NULL, NULL, s->bytes);
+	s->state = RRDP_STATE_WAIT;
+}
+
+/*
+ * Append the snapshot data just received to RRDP_PARTIAL.
+ */
+static void
+rrdp_partial_write(struct rrdp *s, const char *buf, size_t len)
+{
+	if (write(s->partfd, buf, len) != (ssize_t)len) {
+		warn("%s: write %s", s->local, RRDP_PARTIAL);
+		close(s->partfd);
+		s->partfd = -1;
+		unlinkat(s->dirfd, RRDP_PARTIAL, 0);
+	}
+}
+
+/*
+ * The snapshot download ended. RRDP_PARTIAL is kept if keep is set and
+ * it is large enough to be worth resuming. Returns 1 if it was kept.
+ */
+static int
+rrdp_partial_close(struct rrdp *s, int keep)
+{
+	if (s->partfd == -1)
+		return 0;
+	close(s->partfd);
+	s->partfd = -1;
+	if (keep && (s->bytes > s->partstart ? s->bytes : s->partstart) >=
+	    RRDP_PARTIAL_MIN)
+		return 1;
+	if (unlinkat(s->dirfd, RRDP_PARTIAL, 0) == -1 && errno != ENOENT)
+		warn("%s: unlink %s", s->local, RRDP_PARTIAL);
+	return 0;
+}
+
+/*
+ * Return 1 if the notification file announced the serial of the repository,
+ * in that case parsing stopped after the notification element.
+ */
+static int
+rrdp_unchanged(struct rrdp *s)
+{
+	return s->task == NOTIFICATION && notification_unchanged(s->nxml);
+}
+
+/*
+ * Return 1 if the restricted scanner parses the current request. The
+ * notification file is always parsed by expat.
+ */
+static int
+rrdp_scanning(struct rrdp *s)
+{
+	return s->scan != NULL && s->task != NOTIFICATION;
+}
+
+/*
+ * Let the restricted scanner, if used, call the element and content
+ * handlers of a new snapshot or delta parser.
+ */
+void
+rrdp_scan_setup(struct rrdp *s, XML_StartElementHandler start,
+    XML_EndElementHandler end, XML_CharacterDataHandler data, void *arg)
+{
+	if (s != NULL && s->scan != NULL)
+		rrdp_scan_reset(s->scan, start, end, data, arg);
+}
+
 static void
 rrdp_failed(struct rrdp *s)
 {
 	unsigned int id = s->id;
+	int keep;
 
 	/* reset file state before retrying */
 	s->file_failed = 0;
 
+	/*
+	 * Keep the partial snapshot after a timeout or a download that
+	 * broke off after making progress and retry once right away.
+	 * Drop it if the data itself is bad.
+	 */
+	if (s->task == SNAPSHOT) {
+		keep = !s->partbad && (s->aborted ||
+		    (s->res != HTTP_OK && s->bytes > s->partstart));
+		if ((rrdp_partial_close(s, keep) || s->partbad) &&
+		    !s->aborted && !s->resumed) {
+			s->resumed = 1;
+			s->partbad = 0;
+			free_snapshot_xml(s->sxml);
+			rrdp_clear_repo(s);
+			s->sxml = new_snapshot_xml(s->parser, s->current, s);
+			s->state = RRDP_STATE_REQ;
+			logx("%s: snapshot download failed, retrying",
+			    s->local);
+			return;
+		}
+	}
+
 	if (s->task == DELTA && !s->aborted) {
 		/* fallback to a snapshot as per RFC8182 */
+		rrdp_prefetch_clear(s);
 		free_delta_xml(s->dxml);
 		s->dxml = NULL;
 		rrdp_clear_repo(s);
@@ -269,6 +716,48 @@ rrdp_failed(struct rrdp *s)
 	}
 }
 
+/*
+ * Update the running average of the delta size used to choose between
+ * deltas and a snapshot on the next run.
+ */
+static void
+rrdp_delta_size(struct rrdp_session *rs, long long bytes)
+{
+	if (rs->delta_size == 0)
+		rs->delta_size = bytes;
+	else
+		rs->delta_size = (3 * rs->delta_size + bytes) / 4;
+}
+
+/*
+ * Report how fast the XML of a completed sync was parsed.
+ */
+static void
+rrdp_parse_stats(struct rrdp *s)
+{
+	enum rrdp_msg	 type = RRDP_PARSED;
+	struct ibuf	*b;
+	double		 secs;
+	char		 rate[64];
+	int		 snapshot;
+
+	/* main keeps the distribution for the metrics */
+	secs = s->parsetime.tv_sec + s->parsetime.tv_nsec / 1e9;
+	snapshot = s->task == SNAPSHOT;
+	b = io_new_buffer();
+	io_simple_buffer(b, &type, sizeof(type));
+	io_simple_buffer(b, &s->id, sizeof(s->id));
+	io_simple_buffer(b, &secs, sizeof(secs));
+	io_simple_buffer(b, &s->totalbytes, sizeof(s->totalbytes));
+	io_simple_buffer(b, &snapshot, sizeof(snapshot));
+	io_simple_buffer(b, &s->deltas, sizeof(s->deltas));
+	io_close_buffer(&msgq, b);
+
+	logx("%s: parsed %lld bytes and %u elements in %s", s->local,
+	    s->totalbytes, s->published,
+	    fmt_rate(rate, sizeof(rate), s->totalbytes, &s->parsetime));
+}
+
 static void
 rrdp_finished(struct rrdp *s)
 {
@@ -296,7 +785,16 @@ rrdp_finished(struct rrdp *s)
 		 * since the call would most probably fail for non
 		 * successful data fetches.
 		 */
-		if (XML_Parse(p, NULL, 0, 1) != XML_STATUS_OK) {
+		if (rrdp_scanning(s)) {
+			if (rrdp_scan_parse(s->scan, NULL, 0, 1) == -1) {
+				warnx("%s: XML error at line %llu: %s",
+				    s->local, rrdp_scan_line(s->scan),
+				    rrdp_scan_error(s->scan));
+				rrdp_failed(s);
+				return;
+			}
+		} else if (!rrdp_unchanged(s) &&
+		    XML_Parse(p, NULL, 0, 1) != XML_STATUS_OK) {
 			warnx("%s: XML error at line %llu: %s", s->local,
 			    (unsigned long long)XML_GetCurrentLineNumber(p),
 			    XML_ErrorString(XML_GetErrorCode(p)));
@@ -312,8 +810,10 @@ rrdp_finished(struct rrdp *s)
 
 		switch (s->task) {
 		case NOTIFICATION:
-			s->task = notification_done(s->nxml, s->last_mod);
+			s->task = notification_done(s->nxml, s->last_mod,
+			    s->etag);
 			s->last_mod = NULL;
+			s->etag = NULL;
 			switch (s->task) {
 			case NOTIFICATION:
 				logx("%s: repository not modified (%s#%lld)",
@@ -342,13 +842,19 @@ rrdp_finished(struct rrdp *s)
 			}
 			break;
 		case SNAPSHOT:
+			s->current->snapshot_size = s->bytes;
+			rrdp_partial_close(s, 0);
+			rrdp_parse_stats(s);
 			rrdp_state_send(s);
 			rrdp_free(s);
 			rrdp_done(id, 1);
 			break;
 		case DELTA:
+			rrdp_delta_size(s->current, s->bytes);
+			s->deltas++;
 			if (notification_delta_done(s->nxml)) {
 				/* finished */
+				rrdp_parse_stats(s);
 				rrdp_state_send(s);
 				rrdp_free(s);
 				rrdp_done(id, 1);
@@ -377,6 +883,7 @@ rrdp_abort_req(struct rrdp *s)
 	unsigned int id = s->id;
 
 	s->aborted = 1;
+	rrdp_prefetch_clear(s);
 	if (s->state == RRDP_STATE_REQ) {
 		/* nothing is pending, just abort */
 		rrdp_free(s);
@@ -390,7 +897,13 @@ rrdp_abort_req(struct rrdp *s)
 	/*
 	 * RRDP_STATE_PARSE or later, close infd, abort parser but
 	 * wait for HTTP_FIN and file_pending to drop to 0.
+	 * There is no HTTP_FIN while the partial snapshot is read.
 	 */
+	if (s->replay) {
+		s->replay = 0;
+		s->state |= RRDP_STATE_HTTP_DONE;
+		s->res = HTTP_FAILED;
+	}
 	if (s->infd != -1) {
 		close(s->infd);
 		s->infd = -1;
@@ -404,13 +917,13 @@ rrdp_input_handler(int fd)
 {
 	static struct ibuf *inbuf;
 	struct rrdp_session *state;
-	char *local, *notify, *last_mod;
+	char *local, *notify, *last_mod, *etag;
 	struct ibuf *b;
 	struct rrdp *s;
 	enum rrdp_msg type;
 	enum http_result res;
-	unsigned int id;
-	int ok;
+	unsigned int id, slot;
+	int infd, ok;
 
 	b = io_buf_recvfd(fd, &inbuf);
 	if (b == NULL)
@@ -421,22 +934,25 @@ rrdp_input_handler(int fd)
 
 	switch (type) {
 	case RRDP_START:
-		if (ibuf_fd_avail(b))
-			errx(1, "received unexpected fd");
 		io_read_str(b, &local);
 		io_read_str(b, &notify);
 		state = rrdp_session_read(b);
-		rrdp_new(id, local, notify, state);
+		/* the temp repo is optional */
+		rrdp_new(id, local, notify, state, ibuf_fd_get(b));
 		break;
 	case RRDP_HTTP_INI:
+		io_read_buf(b, &slot, sizeof(slot));
+		infd = ibuf_fd_get(b);
+		if (infd == -1)
+			errx(1, "expected fd not received");
+		if (rrdp_prefetch_ini(id, slot, infd))
+			break;
 		s = rrdp_get(id);
 		if (s == NULL)
 			errx(1, "http ini, rrdp session %u does not exist", id);
-		if (s->state != RRDP_STATE_WAIT)
+		if (s->state != RRDP_STATE_WAIT || s->slot != slot)
 			errx(1, "%s: bad internal state", s->local);
-		s->infd = ibuf_fd_get(b);
-		if (s->infd == -1)
-			errx(1, "expected fd not received");
+		s->infd = infd;
 		s->state = RRDP_STATE_PARSE;
 		if (s->aborted) {
 			rrdp_abort_req(s);
@@ -444,20 +960,29 @@ rrdp_input_handler(int fd)
 		}
 		break;
 	case RRDP_HTTP_FIN:
+		io_read_buf(b, &slot, sizeof(slot));
 		io_read_buf(b, &res, sizeof(res));
 		io_read_str(b, &last_mod);
+		io_read_str(b, &etag);
 		if (ibuf_fd_avail(b))
 			errx(1, "received unexpected fd");
 
+		if (rrdp_prefetch_fin(id, slot, res)) {
+			free(last_mod);
+			free(etag);
+			break;
+		}
 		s = rrdp_get(id);
 		if (s == NULL)
 			errx(1, "http fin, rrdp session %u does not exist", id);
-		if (!(s->state & RRDP_STATE_PARSE))
+		if (!(s->state & RRDP_STATE_PARSE) || s->slot != slot)
 			errx(1, "%s: bad internal state", s->local);
 		s->state |= RRDP_STATE_HTTP_DONE;
 		s->res = res;
 		free(s->last_mod);
+		free(s->etag);
 		s->last_mod = last_mod;
+		s->etag = etag;
 		rrdp_finished(s);
 		break;
 	case RRDP_FILE:
@@ -486,14 +1011,121 @@ rrdp_input_handler(int fd)
 	ibuf_free(b);
 }
 
+/*
+ * Hash and parse a chunk of the current request.
+ * If inplace is set buf is the one returned by XML_GetBuffer().
+ */
 static void
-rrdp_data_handler(struct rrdp *s)
+rrdp_parse_data(struct rrdp *s, const char *buf, size_t len, int inplace)
 {
-	char buf[READ_BUF_SIZE];
 	XML_Parser p = s->parser;
+	struct timespec start, end;
+	enum XML_Status rv;
+
+	/* the rest of an unchanged notification file is just drained */
+	if (rrdp_unchanged(s))
+		return;
+	s->bytes += len;
+	s->totalbytes += len;
+	if (s->totalbytes > MAX_REPO_SIZE &&
+	    !(s->state & RRDP_STATE_PARSE_ERROR)) {
+		warnx("%s: more than %lld bytes of RRDP data", s->local,
+		    MAX_REPO_SIZE);
+		s->state |= RRDP_STATE_PARSE_ERROR;
+	}
+
+	/* parse and maybe hash the bytes just read */
+	if (s->task != NOTIFICATION)
+		SHA256_Update(&s->ctx, buf, len);
+	if (s->state & RRDP_STATE_PARSE_ERROR)
+		return;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (rrdp_scanning(s)) {
+		if (rrdp_scan_parse(s->scan, buf, len, 0) == -1) {
+			warnx("%s: parse error at line %llu: %s", s->local,
+			    rrdp_scan_line(s->scan), rrdp_scan_error(s->scan));
+			s->state |= RRDP_STATE_PARSE_ERROR;
+		}
+		rv = XML_STATUS_OK;
+	} else if (inplace)
+		rv = XML_ParseBuffer(p, len, 0);
+	else
+		rv = XML_Parse(p, buf, len, 0);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	timespecsub(&end, &start, &end);
+	timespecadd(&s->parsetime, &end, &s->parsetime);
+
+	if (rv != XML_STATUS_OK && !rrdp_unchanged(s)) {
+		warnx("%s: parse error at line %llu: %s", s->local,
+		    (unsigned long long)XML_GetCurrentLineNumber(p),
+		    XML_ErrorString(XML_GetErrorCode(p)));
+		s->state |= RRDP_STATE_PARSE_ERROR;
+	}
+}
+
+/*
+ * All data of the current request was parsed, verify its digest.
+ */
+static void
+rrdp_parse_end(struct rrdp *s)
+{
+	char h[SHA256_DIGEST_LENGTH];
+
+	if (s->task != NOTIFICATION) {
+		SHA256_Final(h, &s->ctx);
+		if (memcmp(s->hash, h, sizeof(s->hash)) != 0) {
+			s->state |= RRDP_STATE_PARSE_ERROR;
+			warnx("%s: bad message digest", s->local);
+		}
+	}
+	s->state |= RRDP_STATE_PARSE_DONE;
+}
+
+/*
+ * The prefetched delta is due, make it the current request of the session
+ * and parse what was buffered so far. Deltas are still applied in order.
+ */
+static void
+rrdp_prefetch_adopt(struct rrdp *s, struct rrdp_prefetch *pf)
+{
+	TAILQ_REMOVE(&s->prefetch, pf, entry);
+	s->slot = pf->slot;
+	s->state = pf->state;
+	s->res = pf->res;
+	s->infd = pf->infd;
+	pf->infd = -1;
+
+	if (s->state != RRDP_STATE_WAIT) {
+		rrdp_parse_data(s, ibuf_data(pf->buf), ibuf_size(pf->buf), 0);
+		if (s->state & RRDP_STATE_PARSE_DONE) {
+			s->state &= ~RRDP_STATE_PARSE_DONE;
+			rrdp_parse_end(s);
+			s->finish = 1;
+		}
+	}
+	rrdp_prefetch_free(pf);
+}
+
+static void
+rrdp_data_handler(struct rrdp *s)
+{
+	char sbuf[READ_BUF_SIZE], *buf = NULL;
+	size_t bufsz = PARSE_BUF_SIZE;
 	ssize_t len;
 
-	len = read(s->infd, buf, sizeof(buf));
+	/*
+	 * Read straight into the parser buffer to save a copy. Once the
+	 * parser stopped the data is still read for the digest.
+	 */
+	if ((s->state & RRDP_STATE_PARSE_ERROR) == 0 && !rrdp_unchanged(s) &&
+	    !rrdp_scanning(s))
+		buf = XML_GetBuffer(s->parser, bufsz);
+	if (buf == NULL) {
+		buf = sbuf;
+		bufsz = sizeof(sbuf);
+	}
+
+	len = read(s->infd, buf, bufsz);
 	if (len == -1) {
 		warn("%s: read failure", s->local);
 		rrdp_abort_req(s);
@@ -505,52 +1137,50 @@ rrdp_data_handler(struct rrdp *s)
 		/* parser stage finished */
 		close(s->infd);
 		s->infd = -1;
-
-		if (s->task != NOTIFICATION) {
-			char h[SHA256_DIGEST_LENGTH];
-
-			SHA256_Final(h, &s->ctx);
-			if (memcmp(s->hash, h, sizeof(s->hash)) != 0) {
-				s->state |= RRDP_STATE_PARSE_ERROR;
-				warnx("%s: bad message digest", s->local);
-			}
+		if (s->replay) {
+			rrdp_replay_done(s);
+			return;
 		}
-
-		s->state |= RRDP_STATE_PARSE_DONE;
+		rrdp_parse_end(s);
 		rrdp_finished(s);
 		return;
 	}
 
-	/* parse and maybe hash the bytes just read */
-	if (s->task != NOTIFICATION)
-		SHA256_Update(&s->ctx, buf, len);
-	if ((s->state & RRDP_STATE_PARSE_ERROR) == 0 &&
-	    XML_Parse(p, buf, len, 0) != XML_STATUS_OK) {
-		warnx("%s: parse error at line %llu: %s", s->local,
-		    (unsigned long long)XML_GetCurrentLineNumber(p),
-		    XML_ErrorString(XML_GetErrorCode(p)));
-		s->state |= RRDP_STATE_PARSE_ERROR;
-	}
+	if (s->partfd != -1 && !s->replay)
+		rrdp_partial_write(s, buf, len);
+	rrdp_parse_data(s, buf, len, buf != sbuf);
 }
 
 void
 proc_rrdp(int fd)
 {
-	struct pollfd pfds[MAX_SESSIONS + 1];
+	struct pollfd pfds[NPFDS];
+	struct rrdp_prefetch *pf;
 	struct rrdp *s, *ns;
-	size_t i;
-
-	if (pledge("stdio recvfd", NULL) == -1)
-		err(1, "pledge");
+	size_t i, n;
+	int timeout;
+
+	if (rrdpwrite) {
+		/* only the temp repos passed by the parent are written */
+		if (unveil(".rrdp", "rwc") == -1)
+			err(1, "unveil .rrdp");
+		if (pledge("stdio recvfd rpath wpath cpath", NULL) == -1)
+			err(1, "pledge");
+	} else {
+		if (pledge("stdio recvfd", NULL) == -1)
+			err(1, "pledge");
+	}
 
 	msgbuf_init(&msgq);
 	msgq.fd = fd;
 
 	for (;;) {
 		i = 1;
+		n = 0;
+		timeout = INFTIM;
 		memset(&pfds, 0, sizeof(pfds));
 		TAILQ_FOREACH(s, &states, entry) {
-			if (i >= MAX_SESSIONS + 1) {
+			if (n++ >= MAX_SESSIONS) {
 				/* not enough sessions, wait for better times */
 				s->pfd = NULL;
 				continue;
@@ -560,8 +1190,12 @@ proc_rrdp(int fd)
 				const char *uri;
 				switch (s->task) {
 				case NOTIFICATION:
-					rrdp_http_req(s->id, s->notifyuri,
-					    s->repository->last_mod);
+					s->slot = ++rrdp_slot;
+					rrdp_http_req(s->id, s->slot,
+					    s->notifyuri,
+					    s->repository->last_mod,
+					    s->repository->etag, 0);
+					s->state = RRDP_STATE_WAIT;
 					break;
 				case SNAPSHOT:
 				case DELTA:
@@ -569,14 +1203,42 @@ proc_rrdp(int fd)
 					    s->hash, sizeof(s->hash),
 					    s->task);
 					SHA256_Init(&s->ctx);
-					rrdp_http_req(s->id, uri, NULL);
+					s->bytes = 0;
+					pf = TAILQ_FIRST(&s->prefetch);
+					if (pf != NULL) {
+						rrdp_prefetch_adopt(s, pf);
+					} else if (s->task == SNAPSHOT) {
+						rrdp_snapshot_start(s, uri);
+					} else {
+						s->slot = ++rrdp_slot;
+						rrdp_http_req(s->id, s->slot,
+						    uri, NULL, NULL, 0);
+						s->state = RRDP_STATE_WAIT;
+					}
+					rrdp_prefetch_fill(s);
 					break;
 				}
-				s->state = RRDP_STATE_WAIT;
 			}
+			if (s->finish)
+				timeout = 0;
 			s->pfd = pfds + i++;
 			s->pfd->fd = s->infd;
 			s->pfd->events = POLLIN;
+
+			/* pause parsing until main caught up with the files */
+			if (s->file_pending >= FILE_WINDOW)
+				s->pfd->fd = -1;
+
+			/* stop reading ahead once enough is buffered */
+			TAILQ_FOREACH(pf, &s->prefetch, entry) {
+				pf->pfd = NULL;
+				if (pf->infd == -1 || ibuf_size(pf->buf) +
+				    READ_BUF_SIZE > PREFETCH_SIZE)
+					continue;
+				pf->pfd = pfds + i++;
+				pf->pfd->fd = pf->infd;
+				pf->pfd->events = POLLIN;
+			}
 		}
 
 		/*
@@ -588,7 +1250,7 @@ proc_rrdp(int fd)
 		if (msgq.queued)
 			pfds[0].events |= POLLOUT;
 
-		if (poll(pfds, i, INFTIM) == -1) {
+		if (poll(pfds, i, timeout) == -1) {
 			if (errno == EINTR)
 				continue;
 			err(1, "poll");
@@ -610,7 +1272,13 @@ proc_rrdp(int fd)
 		TAILQ_FOREACH_SAFE(s, &states, entry, ns) {
 			if (s->pfd == NULL)
 				continue;
-			if (s->pfd->revents != 0)
+			TAILQ_FOREACH(pf, &s->prefetch, entry)
+				if (pf->pfd != NULL && pf->pfd->revents != 0)
+					rrdp_prefetch_read(s, pf);
+			if (s->finish) {
+				s->finish = 0;
+				rrdp_finished(s);
+			} else if (s->pfd->revents != 0)
 				rrdp_data_handler(s);
 		}
 	}
@@ -24,6 +24,7 @@
 /* save everyone doing this code over and over */
 #define PARSE_FAIL(p, ...) do {		\
 	XML_StopParser(p, XML_FALSE);	\
+	rrdp_scan_stop();		\
 	warnx(__VA_ARGS__);		\
 	return;				\
 } while (0)
@@ -38,25 +39,47 @@ struct rrdp;
 
 struct publish_xml {
 	char			*uri;
-	char			*data;
+	unsigned char		*data;		/* decoded content */
+	EVP_ENCODE_CTX		*ctx;
 	char			 hash[SHA256_DIGEST_LENGTH];
+	size_t			 uri_size;
 	size_t			 data_length;
+	size_t			 data_size;
 	enum publish_type	 type;
+	int			 decoding;	/* ctx holds content */
+	int			 failed;
 };
 
 /* rrdp generic */
 char			*xstrdup(const char *);
 void			 rrdp_publish_file(struct rrdp *, struct publish_xml *,
 			    unsigned char *, size_t);
+void			 rrdp_scan_setup(struct rrdp *, XML_StartElementHandler,
+			    XML_EndElementHandler, XML_CharacterDataHandler,
+			    void *);
 
 /* rrdp util */
-struct publish_xml	*new_publish_xml(enum publish_type, char *,
+struct publish_xml	*new_publish_xml(enum publish_type, const char *,
 			    char *, size_t);
 void			 free_publish_xml(struct publish_xml *);
 int			 publish_add_content(struct publish_xml *,
 			    const char *, int);
 int			 publish_done(struct rrdp *, struct publish_xml *);
 
+/* restricted scanner for snapshots and deltas */
+struct rrdp_scan;
+
+struct rrdp_scan	*rrdp_scan_new(void);
+void			 rrdp_scan_free(struct rrdp_scan *);
+void			 rrdp_scan_reset(struct rrdp_scan *,
+			    XML_StartElementHandler, XML_EndElementHandler,
+			    XML_CharacterDataHandler, void *);
+int			 rrdp_scan_parse(struct rrdp_scan *, const char *,
+			    size_t, int);
+void			 rrdp_scan_stop(void);
+unsigned long long	 rrdp_scan_line(const struct rrdp_scan *);
+const char		*rrdp_scan_error(const struct rrdp_scan *);
+
 /* notification */
 struct notification_xml;
 
@@ -65,10 +88,13 @@ struct notification_xml	*new_notification_xml(XML_Parser,
 			    const char *);
 void			 free_notification_xml(struct notification_xml *);
 enum rrdp_task		 notification_done(struct notification_xml *,
-			    char *);
+			    char *, char *);
+int			 notification_unchanged(struct notification_xml *);
 const char		*notification_get_next(struct notification_xml *,
 			    char *, size_t, enum rrdp_task);
 int			 notification_delta_done(struct notification_xml *);
+const char		*notification_peek_delta(struct notification_xml *,
+			    size_t);
 void			 log_notification_xml(struct notification_xml *);
 
 /* snapshot */
@@ -113,7 +113,8 @@ start_publish_withdraw_elem(struct delta_xml *dxml, const char **attr,
     int withdraw)
 {
 	XML_Parser p = dxml->parser;
-	char *uri = NULL, hash[SHA256_DIGEST_LENGTH];
+	const char *uri = NULL;
+	char hash[SHA256_DIGEST_LENGTH];
 	int i, hasUri = 0, hasHash = 0;
 	enum publish_type pub = PUB_UPD;
 
@@ -125,7 +126,7 @@ start_publish_withdraw_elem(struct delta_xml *dxml, const char **attr,
 		if (strcmp("uri", attr[i]) == 0 && hasUri++ == 0) {
 			if (valid_uri(attr[i + 1], strlen(attr[i + 1]),
 			    RSYNC_PROTO)) {
-				uri = xstrdup(attr[i + 1]);
+				uri = attr[i + 1];
 				continue;
 			}
 		}
@@ -252,6 +253,8 @@ new_delta_xml(XML_Parser p, struct rrdp_session *rs, struct rrdp *r)
 	XML_SetCharacterDataHandler(dxml->parser, delta_content_handler);
 	XML_SetUserData(dxml->parser, dxml);
 	XML_SetDoctypeDeclHandler(dxml->parser, delta_doctype_handler, NULL);
+	rrdp_scan_setup(r, delta_xml_elem_start, delta_xml_elem_end,
+	    delta_content_handler, dxml);
 
 	return dxml;
 }
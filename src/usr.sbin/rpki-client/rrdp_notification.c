@@ -62,6 +62,7 @@ struct notification_xml {
 	long long		 serial;
 	long long		 min_serial;
 	int			 version;
+	int			 unchanged;
 	enum notification_scope	 scope;
 };
 
@@ -200,6 +201,14 @@ start_notification_elem(struct notification_xml *nxml, const char **attr)
 		nxml->min_serial = nxml->serial - MAX_RRDP_DELTAS;
 
 	nxml->scope = NOTIFICATION_SCOPE_NOTIFICATION;
+
+	/* Same session and serial, the rest of the file does not matter. */
+	if (nxml->repository->session_id != NULL &&
+	    strcmp(nxml->session_id, nxml->repository->session_id) == 0 &&
+	    nxml->serial == nxml->repository->serial) {
+		nxml->unchanged = 1;
+		XML_StopParser(p, XML_FALSE);
+	}
 }
 
 static void
@@ -506,10 +515,27 @@ notification_check_deltas(struct notification_xml *nxml)
  * Return NOTIFICATION if repository is up to date.
  */
 enum rrdp_task
-notification_done(struct notification_xml *nxml, char *last_mod)
+notification_done(struct notification_xml *nxml, char *last_mod, char *etag)
 {
+	size_t i;
+
 	nxml->current->last_mod = last_mod;
+	nxml->current->etag = etag;
 	nxml->current->session_id = xstrdup(nxml->session_id);
+	nxml->current->snapshot_size = nxml->repository->snapshot_size;
+	nxml->current->delta_size = nxml->repository->delta_size;
+
+	/* parsing stopped early, the known deltas are still valid */
+	if (nxml->unchanged) {
+		for (i = 0; i < sizeof(nxml->current->deltas) /
+		    sizeof(nxml->current->deltas[0]); i++)
+			if (nxml->repository->deltas[i] != NULL)
+				nxml->current->deltas[i] =
+				    xstrdup(nxml->repository->deltas[i]);
+		nxml->current->serial = nxml->repository->serial;
+		return NOTIFICATION;
+	}
+
 	notification_collect_deltas(nxml);
 
 	/* check the that the session_id was valid and still the same */
@@ -548,6 +574,13 @@ notification_done(struct notification_xml *nxml, char *last_mod)
 	if (nxml->repository->serial + 1 != TAILQ_FIRST(&nxml->delta_q)->serial)
 		goto snapshot;
 
+	/* the snapshot is expected to be smaller than the deltas */
+	if (nxml->repository->snapshot_size > 0 &&
+	    nxml->repository->delta_size > 0 &&
+	    (nxml->serial - nxml->repository->serial) *
+	    nxml->repository->delta_size > nxml->repository->snapshot_size)
+		goto snapshot;
+
 	/* update via delta possible */
 	nxml->current->serial = nxml->repository->serial;
 	nxml->repository->serial = nxml->serial;
@@ -560,6 +593,16 @@ snapshot:
 	return SNAPSHOT;
 }
 
+/*
+ * Return 1 if the notification file announced the serial the repository
+ * is already at. Parsing stops after the notification element then.
+ */
+int
+notification_unchanged(struct notification_xml *nxml)
+{
+	return nxml->unchanged;
+}
+
 const char *
 notification_get_next(struct notification_xml *nxml, char *hash, size_t hlen,
     enum rrdp_task task)
@@ -608,6 +651,21 @@ notification_delta_done(struct notification_xml *nxml)
 	return TAILQ_EMPTY(&nxml->delta_q);
 }
 
+/*
+ * Return the URI of the delta idx positions after the first one in the
+ * delta queue or NULL if there is no such delta. Used to fetch ahead.
+ */
+const char *
+notification_peek_delta(struct notification_xml *nxml, size_t idx)
+{
+	struct delta_item *d;
+
+	TAILQ_FOREACH(d, &nxml->delta_q, q)
+		if (idx-- == 0)
+			return d->uri;
+	return NULL;
+}
+
 /* Used in regress. */
 void
 log_notification_xml(struct notification_xml *nxml)
@@ -0,0 +1,564 @@
+/*	$OpenBSD$ */
+/*
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * A restricted XML scanner for RRDP snapshots and deltas. It only knows
+ * what these documents use: elements with attributes, comments, an XML
+ * declaration and character data. DOCTYPE, CDATA sections and references
+ * in character data are rejected. Character data is handed to the content
+ * handler straight from the input buffer, the tags are collected in a
+ * buffer of their own. The element and content handlers are the ones of
+ * the expat based snapshot and delta parsers, which do all the checks of
+ * the RRDP grammar.
+ */
+
+#include <err.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <expat.h>
+#include <openssl/evp.h>
+#include <openssl/sha.h>
+
+#include "extern.h"
+#include "rrdp.h"
+
+#define SCAN_TAG_MAX	(16 * 1024)	/* URIs are much shorter */
+#define SCAN_NAME_MAX	32
+#define SCAN_DEPTH_MAX	4
+#define SCAN_ATTR_MAX	16
+
+enum scan_state {
+	SCAN_CONTENT,
+	SCAN_TAG,
+	SCAN_COMMENT,
+};
+
+struct rrdp_scan {
+	XML_StartElementHandler	 start;
+	XML_EndElementHandler	 end;
+	XML_CharacterDataHandler data;
+	void			*arg;
+	char			*tag;		/* from '<' to '>' */
+	size_t			 taglen;
+	char			 stack[SCAN_DEPTH_MAX][SCAN_NAME_MAX];
+	size_t			 depth;
+	unsigned long long	 line;
+	const char		*error;
+	enum scan_state		 state;
+	char			 quote;		/* open attribute value */
+	int			 dashes;	/* in a row inside a comment */
+	int			 root;		/* 0 before, 1 in, 2 after */
+	int			 seen;		/* past the XML declaration */
+	int			 failed;
+};
+
+/* the scanner calling the handlers, see rrdp_scan_stop() */
+static struct rrdp_scan	*scan_running;
+
+struct rrdp_scan *
+rrdp_scan_new(void)
+{
+	struct rrdp_scan *sc;
+
+	if ((sc = calloc(1, sizeof(*sc))) == NULL)
+		err(1, NULL);
+	if ((sc->tag = malloc(SCAN_TAG_MAX + 1)) == NULL)
+		err(1, NULL);
+	return sc;
+}
+
+void
+rrdp_scan_free(struct rrdp_scan *sc)
+{
+	if (sc == NULL)
+		return;
+	free(sc->tag);
+	free(sc);
+}
+
+/*
+ * Start a new document, the handlers are called with arg.
+ */
+void
+rrdp_scan_reset(struct rrdp_scan *sc, XML_StartElementHandler start,
+    XML_EndElementHandler end, XML_CharacterDataHandler data, void *arg)
+{
+	sc->start = start;
+	sc->end = end;
+	sc->data = data;
+	sc->arg = arg;
+	sc->taglen = 0;
+	sc->depth = 0;
+	sc->line = 1;
+	sc->error = NULL;
+	sc->state = SCAN_CONTENT;
+	sc->quote = 0;
+	sc->dashes = 0;
+	sc->root = 0;
+	sc->seen = 0;
+	sc->failed = 0;
+}
+
+/*
+ * Called through PARSE_FAIL() by a handler which rejected the document.
+ */
+void
+rrdp_scan_stop(void)
+{
+	if (scan_running == NULL)
+		return;
+	scan_running->failed = 1;
+	if (scan_running->error == NULL)
+		scan_running->error = "parsing aborted";
+}
+
+unsigned long long
+rrdp_scan_line(const struct rrdp_scan *sc)
+{
+	return sc->line;
+}
+
+const char *
+rrdp_scan_error(const struct rrdp_scan *sc)
+{
+	return sc->error != NULL ? sc->error : "no error";
+}
+
+static void
+scan_fail(struct rrdp_scan *sc, const char *error)
+{
+	sc->failed = 1;
+	sc->error = error;
+}
+
+static int
+scan_char(unsigned char c)
+{
+	return c == '\t' || c == '\n' || c == '\r' || (c >= 0x20 && c < 0x80);
+}
+
+static int
+scan_space(unsigned char c)
+{
+	return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+static int
+scan_namechar(unsigned char c, int first)
+{
+	if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+	    c == '_' || c == ':')
+		return 1;
+	if (first)
+		return 0;
+	return (c >= '0' && c <= '9') || c == '-' || c == '.';
+}
+
+static char *
+scan_name(char *p)
+{
+	if (!scan_namechar(*p, 1))
+		return p;
+	while (scan_namechar(*++p, 0))
+		;
+	return p;
+}
+
+/*
+ * Replace the predefined entities of an attribute value and normalize
+ * its white space like expat does. Returns -1 on bad references.
+ */
+static int
+scan_unescape(char *v)
+{
+	static const struct {
+		const char	*name;
+		char		 c;
+	} ents[] = {
+		{ "amp;", '&' },
+		{ "lt;", '<' },
+		{ "gt;", '>' },
+		{ "quot;", '"' },
+		{ "apos;", '\'' },
+	};
+	char *r, *w;
+	size_t i, n;
+
+	for (r = w = v; *r != '\0'; ) {
+		if (*r == '<')
+			return -1;
+		if (*r == '&') {
+			for (i = 0; i < sizeof(ents) / sizeof(ents[0]); i++) {
+				n = strlen(ents[i].name);
+				if (strncmp(r + 1, ents[i].name, n) == 0)
+					break;
+			}
+			if (i == sizeof(ents) / sizeof(ents[0]))
+				return -1;
+			*w++ = ents[i].c;
+			r += n + 1;
+		} else if (scan_space(*r)) {
+			if (r[0] == '\r' && r[1] == '\n')
+				r++;
+			*w++ = ' ';
+			r++;
+		} else
+			*w++ = *r++;
+	}
+	*w = '\0';
+	return 0;
+}
+
+static void
+scan_end_elem(struct rrdp_scan *sc, const char *name)
+{
+	if (sc->depth == 0 || strcmp(sc->stack[sc->depth - 1], name) != 0) {
+		scan_fail(sc, "mismatched tag");
+		return;
+	}
+	if (--sc->depth == 0)
+		sc->root = 2;
+	sc->end(sc->arg, name);
+}
+
+/*
+ * Split the start tag in t, which lacks the '<' and '>', into the name
+ * and the attributes and call the start handler. Self closing elements
+ * are ended right away.
+ */
+static void
+scan_start_elem(struct rrdp_scan *sc, char *t, size_t len)
+{
+	const char *attrs[2 * SCAN_ATTR_MAX + 1];
+	char *p, *name, *aname, *aend, *v;
+	size_t i, n = 0;
+	int empty = 0;
+
+	if (len > 0 && t[len - 1] == '/') {
+		empty = 1;
+		t[--len] = '\0';
+	}
+
+	name = t;
+	if ((p = scan_name(t)) == t) {
+		scan_fail(sc, "not well-formed (invalid token)");
+		return;
+	}
+	if (p - t >= SCAN_NAME_MAX) {
+		scan_fail(sc, "element name too long");
+		return;
+	}
+
+	while (*p != '\0') {
+		if (!scan_space(*p)) {
+			scan_fail(sc, "not well-formed (invalid token)");
+			return;
+		}
+		*p++ = '\0';
+		while (scan_space(*p))
+			p++;
+		if (*p == '\0')
+			break;
+
+		aname = p;
+		if ((p = scan_name(p)) == aname) {
+			scan_fail(sc, "not well-formed (invalid token)");
+			return;
+		}
+		aend = p;
+		while (scan_space(*p))
+			p++;
+		if (*p++ != '=') {
+			scan_fail(sc, "not well-formed (invalid token)");
+			return;
+		}
+		while (scan_space(*p))
+			p++;
+		if (*p != '"' && *p != '\'') {
+			scan_fail(sc, "not well-formed (invalid token)");
+			return;
+		}
+		v = p + 1;
+		if ((p = strchr(v, *p)) == NULL) {
+			scan_fail(sc, "unclosed token");
+			return;
+		}
+		*aend = '\0';
+		*p++ = '\0';
+		if (scan_unescape(v) == -1) {
+			scan_fail(sc, "bad reference in attribute value");
+			return;
+		}
+
+		for (i = 0; i < n; i += 2)
+			if (strcmp(attrs[i], aname) == 0) {
+				scan_fail(sc, "duplicate attribute");
+				return;
+			}
+		if (n == 2 * SCAN_ATTR_MAX) {
+			scan_fail(sc, "too many attributes");
+			return;
+		}
+		attrs[n++] = aname;
+		attrs[n++] = v;
+
+		/* the next attribute needs white space in front */
+		if (*p != '\0' && !scan_space(*p)) {
+			scan_fail(sc, "not well-formed (invalid token)");
+			return;
+		}
+	}
+	attrs[n] = NULL;
+
+	if (sc->root == 2) {
+		scan_fail(sc, "junk after document element");
+		return;
+	}
+	if (sc->depth == SCAN_DEPTH_MAX) {
+		scan_fail(sc, "elements nested too deep");
+		return;
+	}
+	sc->root = 1;
+	strlcpy(sc->stack[sc->depth++], name, SCAN_NAME_MAX);
+
+	sc->start(sc->arg, name, attrs);
+	if (empty && !sc->failed)
+		scan_end_elem(sc, name);
+}
+
+/*
+ * A complete tag is in sc->tag, act on it.
+ */
+static void
+scan_markup(struct rrdp_scan *sc)
+{
+	char *t = sc->tag + 1, *p;
+	size_t len = sc->taglen - 2;
+
+	t[len] = '\0';
+	switch (*t) {
+	case '?':
+		if (len < 2 || t[len - 1] != '?') {
+			scan_fail(sc, "not well-formed (invalid token)");
+			return;
+		}
+		p = scan_name(t + 1);
+		if (p - (t + 1) == 3 && strncasecmp(t + 1, "xml", 3) == 0 &&
+		    sc->seen) {
+			scan_fail(sc, "XML or text declaration not at start "
+			    "of entity");
+			return;
+		}
+		break;
+	case '!':
+		if (strncmp(t, "!DOCTYPE", 8) == 0)
+			scan_fail(sc, "DOCTYPE not allowed");
+		else if (strncmp(t, "![CDATA[", 8) == 0)
+			scan_fail(sc, "CDATA section not supported");
+		else
+			scan_fail(sc, "not well-formed (invalid token)");
+		return;
+	case '/':
+		p = scan_name(t + 1);
+		if (p == t + 1) {
+			scan_fail(sc, "not well-formed (invalid token)");
+			return;
+		}
+		while (scan_space(*p))
+			*p++ = '\0';
+		if (*p != '\0') {
+			scan_fail(sc, "not well-formed (invalid token)");
+			return;
+		}
+		scan_end_elem(sc, t + 1);
+		break;
+	default:
+		scan_start_elem(sc, t, len);
+		break;
+	}
+	sc->seen = 1;
+}
+
+/*
+ * Pass the character data up to the next '<' to the content handler.
+ */
+static const char *
+scan_content(struct rrdp_scan *sc, const char *p, const char *end)
+{
+	const char *lt, *q;
+	size_t n;
+
+	if ((lt = memchr(p, '<', end - p)) == NULL)
+		lt = end;
+
+	for (q = p; q < lt; q++) {
+		if (*q == '\n')
+			sc->line++;
+		if (!scan_char(*q)) {
+			scan_fail(sc, "not well-formed (invalid token)");
+			return end;
+		}
+		if (*q == '&') {
+			scan_fail(sc, "reference in character data not "
+			    "supported");
+			return end;
+		}
+		if (sc->root != 1 && !scan_space(*q)) {
+			scan_fail(sc, sc->root == 0 ? "syntax error" :
+			    "junk after document element");
+			return end;
+		}
+	}
+
+	if (lt > p) {
+		sc->seen = 1;
+		if (sc->root == 1) {
+			for (; p < lt && !sc->failed; p += n) {
+				n = lt - p;
+				if (n > INT_MAX)
+					n = INT_MAX;
+				sc->data(sc->arg, p, n);
+			}
+		}
+	}
+
+	if (lt < end) {
+		sc->state = SCAN_TAG;
+		sc->tag[0] = '<';
+		sc->taglen = 1;
+		sc->quote = 0;
+		lt++;
+	}
+	return lt;
+}
+
+/*
+ * Collect a tag up to the '>' which is not part of an attribute value.
+ */
+static const char *
+scan_tag(struct rrdp_scan *sc, const char *p, const char *end)
+{
+	unsigned char c;
+
+	for (; p < end; p++) {
+		c = *p;
+		if (!scan_char(c)) {
+			scan_fail(sc, "not well-formed (invalid token)");
+			return end;
+		}
+		if (c == '\n')
+			sc->line++;
+		if (sc->taglen == SCAN_TAG_MAX) {
+			scan_fail(sc, "tag too long");
+			return end;
+		}
+		sc->tag[sc->taglen++] = c;
+
+		if (sc->taglen == 4 && memcmp(sc->tag, "<!--", 4) == 0) {
+			sc->state = SCAN_COMMENT;
+			sc->dashes = 0;
+			return p + 1;
+		}
+		if (sc->quote != 0) {
+			if (c == sc->quote)
+				sc->quote = 0;
+		} else if (c == '"' || c == '\'') {
+			sc->quote = c;
+		} else if (c == '<') {
+			scan_fail(sc, "not well-formed (invalid token)");
+			return end;
+		} else if (c == '>') {
+			sc->state = SCAN_CONTENT;
+			scan_markup(sc);
+			return p + 1;
+		}
+	}
+	return p;
+}
+
+/*
+ * Skip a comment up to the closing "-->", "--" may not show up before.
+ */
+static const char *
+scan_comment(struct rrdp_scan *sc, const char *p, const char *end)
+{
+	unsigned char c;
+
+	for (; p < end; p++) {
+		c = *p;
+		if (!scan_char(c)) {
+			scan_fail(sc, "not well-formed (invalid token)");
+			return end;
+		}
+		if (c == '\n')
+			sc->line++;
+		if (sc->dashes == 2 && c == '>') {
+			sc->state = SCAN_CONTENT;
+			sc->seen = 1;
+			return p + 1;
+		}
+		if (sc->dashes == 2) {
+			scan_fail(sc, "not well-formed (invalid token)");
+			return end;
+		}
+		if (c == '-')
+			sc->dashes++;
+		else
+			sc->dashes = 0;
+	}
+	return p;
+}
+
+/*
+ * Scan the next len bytes of the document in buf. If final is set the
+ * document has to be complete. Returns 0 on success and -1 on failure,
+ * rrdp_scan_line() and rrdp_scan_error() tell where and why.
+ */
+int
+rrdp_scan_parse(struct rrdp_scan *sc, const char *buf, size_t len, int final)
+{
+	const char *end = buf + len;
+
+	if (sc->failed)
+		return -1;
+
+	scan_running = sc;
+	while (buf < end && !sc->failed) {
+		switch (sc->state) {
+		case SCAN_CONTENT:
+			buf = scan_content(sc, buf, end);
+			break;
+		case SCAN_TAG:
+			buf = scan_tag(sc, buf, end);
+			break;
+		case SCAN_COMMENT:
+			buf = scan_comment(sc, buf, end);
+			break;
+		}
+	}
+	scan_running = NULL;
+
+	if (!sc->failed && final) {
+		if (sc->state != SCAN_CONTENT || sc->root == 1)
+			scan_fail(sc, "unclosed token");
+		else if (sc->root == 0)
+			scan_fail(sc, "no element found");
+	}
+	return sc->failed ? -1 : 0;
+}
@@ -110,7 +110,7 @@ static void
 start_publish_elem(struct snapshot_xml *sxml, const char **attr)
 {
 	XML_Parser p = sxml->parser;
-	char *uri = NULL;
+	const char *uri = NULL;
 	int i, hasUri = 0;
 
 	if (sxml->scope != SNAPSHOT_SCOPE_SNAPSHOT)
@@ -120,7 +120,7 @@ start_publish_elem(struct snapshot_xml *sxml, const char **attr)
 		if (strcmp("uri", attr[i]) == 0 && hasUri++ == 0) {
 			if (valid_uri(attr[i + 1], strlen(attr[i + 1]),
 			    RSYNC_PROTO)) {
-				uri = xstrdup(attr[i + 1]);
+				uri = attr[i + 1];
 				continue;
 			}
 		}
@@ -233,6 +233,8 @@ new_snapshot_xml(XML_Parser p, struct rrdp_session *rs, struct rrdp *r)
 	XML_SetUserData(sxml->parser, sxml);
 	XML_SetDoctypeDeclHandler(sxml->parser, snapshot_doctype_handler,
 	    NULL);
+	rrdp_scan_setup(r, snapshot_xml_elem_start, snapshot_xml_elem_end,
+	    snapshot_content_handler, sxml);
 
 	return sxml;
 }
@@ -21,26 +21,52 @@
 #include <string.h>
 
 #include <expat.h>
+#include <openssl/evp.h>
 #include <openssl/sha.h>
 
 #include "extern.h"
 #include "rrdp.h"
 
+/*
+ * A snapshot has one publish element per file, so finished publish_xml
+ * are kept together with their buffers and decode context for the next
+ * element. Buffers grown bigger than PUBLISH_KEEP_SIZE are not kept.
+ */
+#define PUBLISH_CACHE_MAX	16
+#define PUBLISH_KEEP_SIZE	(256 * 1024)
+
+static struct publish_xml	*publish_cache[PUBLISH_CACHE_MAX];
+static size_t			 publish_ncache;
+
 /*
  * Both snapshots and deltas use publish_xml to store the publish and
  * withdraw records. Once all the content is added the request is sent
  * to the main process where it is processed.
+ * The uri is copied.
  */
 struct publish_xml *
-new_publish_xml(enum publish_type type, char *uri, char *hash, size_t hlen)
+new_publish_xml(enum publish_type type, const char *uri, char *hash,
+    size_t hlen)
 {
 	struct publish_xml *pxml;
+	size_t len;
+	char *u;
 
-	if ((pxml = calloc(1, sizeof(*pxml))) == NULL)
+	if (publish_ncache > 0)
+		pxml = publish_cache[--publish_ncache];
+	else if ((pxml = calloc(1, sizeof(*pxml))) == NULL)
 		err(1, "%s", __func__);
 
+	len = strlen(uri) + 1;
+	if (len > pxml->uri_size) {
+		if ((u = realloc(pxml->uri, len)) == NULL)
+			err(1, "%s", __func__);
+		pxml->uri = u;
+		pxml->uri_size = len;
+	}
+	memcpy(pxml->uri, uri, len);
+
 	pxml->type = type;
-	pxml->uri = uri;
 	if (hlen > 0) {
 		assert(hlen == sizeof(pxml->hash));
 		memcpy(pxml->hash, hash, hlen);
@@ -55,19 +81,38 @@ free_publish_xml(struct publish_xml *pxml)
 	if (pxml == NULL)
 		return;
 
+	if (publish_ncache < PUBLISH_CACHE_MAX) {
+		if (pxml->data_size > PUBLISH_KEEP_SIZE) {
+			free(pxml->data);
+			pxml->data = NULL;
+			pxml->data_size = 0;
+		}
+		pxml->data_length = 0;
+		pxml->decoding = 0;
+		pxml->failed = 0;
+		memset(pxml->hash, 0, sizeof(pxml->hash));
+		publish_cache[publish_ncache++] = pxml;
+		return;
+	}
+
 	free(pxml->uri);
 	free(pxml->data);
+	EVP_ENCODE_CTX_free(pxml->ctx);
 	free(pxml);
 }
 
 /*
- * Add buf to the base64 data string, ensure that this remains a proper
- * string by NUL-terminating the string.
+ * Decode the base64 data in buf and append it to the content. Decoding
+ * happens as the character data arrives so the base64 text is never kept.
+ * Returns -1 if the content grows too big. Bad encodings are reported
+ * by publish_done().
  */
 int
 publish_add_content(struct publish_xml *pxml, const char *buf, int length)
 {
-	size_t newlen, outlen;
+	unsigned char *data;
+	size_t outlen, newsize;
+	int evplen;
 
 	/*
 	 * optmisiation, this often gets called with '\n' as the
@@ -76,26 +121,49 @@ publish_add_content(struct publish_xml *pxml, const char *buf, int length)
 	if (length == 1 && buf[0] == '\n')
 		return 0;
 
-	/* append content to data */
-	if (SIZE_MAX - length - 1 <= pxml->data_length)
-		return -1;
-	newlen = pxml->data_length + length;
-	if (base64_decode_len(newlen, &outlen) == -1 ||
-	    outlen > MAX_FILE_SIZE)
-		return -1;
+	if (pxml->failed)
+		return 0;
+	if (pxml->type == PUB_DEL) {
+		/* withdraw elements have no content */
+		pxml->failed = 1;
+		return 0;
+	}
 
-	pxml->data = realloc(pxml->data, newlen + 1);
-	if (pxml->data == NULL)
-		err(1, "%s", __func__);
+	if (!pxml->decoding) {
+		if (pxml->ctx == NULL &&
+		    (pxml->ctx = EVP_ENCODE_CTX_new()) == NULL)
+			err(1, "EVP_ENCODE_CTX_new");
+		EVP_DecodeInit(pxml->ctx);
+		pxml->decoding = 1;
+	}
+
+	/* leave room for the partial block kept in the decode context */
+	if (base64_decode_len((size_t)length + 80, &outlen) == -1)
+		return -1;
+	if (pxml->data_length + outlen > pxml->data_size) {
+		newsize = pxml->data_size * 2;
+		if (newsize < pxml->data_length + outlen)
+			newsize = pxml->data_length + outlen;
+		if ((data = realloc(pxml->data, newsize)) == NULL)
+			err(1, "%s", __func__);
+		pxml->data = data;
+		pxml->data_size = newsize;
+	}
 
-	memcpy(pxml->data + pxml->data_length, buf, length);
-	pxml->data[newlen] = '\0';
-	pxml->data_length = newlen;
+	evplen = outlen;
+	if (EVP_DecodeUpdate(pxml->ctx, pxml->data + pxml->data_length,
+	    &evplen, buf, length) == -1) {
+		pxml->failed = 1;
+		return 0;
+	}
+	pxml->data_length += evplen;
+	if (pxml->data_length > MAX_FILE_SIZE)
+		return -1;
 	return 0;
 }
 
 /*
- * Base64 decode the data blob and send the file to the main process
+ * Finish decoding of the data blob and send the file to the main process
  * where the hash is validated and the file stored in the repository.
  * Increase the file_pending counter to ensure the RRDP process waits
  * until all files have been processed before moving to the next stage.
@@ -104,29 +172,30 @@ publish_add_content(struct publish_xml *pxml, const char *buf, int length)
 int
 publish_done(struct rrdp *s, struct publish_xml *pxml)
 {
-	unsigned char *data = NULL;
-	size_t datasz = 0;
+	int evplen;
+
+	if (pxml->failed)
+		return -1;
 
 	switch (pxml->type) {
 	case PUB_ADD:
 	case PUB_UPD:
-		if (base64_decode_len(pxml->data_length, &datasz) == -1)
+		if (!pxml->decoding)
 			return -1;
-		if (datasz < MIN_FILE_SIZE)
+		evplen = pxml->data_size - pxml->data_length;
+		if (EVP_DecodeFinal(pxml->ctx,
+		    pxml->data + pxml->data_length, &evplen) == -1)
 			return -1;
-		if ((base64_decode(pxml->data, pxml->data_length,
-		    &data, &datasz)) == -1)
+		pxml->data_length += evplen;
+		if (pxml->data_length < MIN_FILE_SIZE)
 			return -1;
 		break;
 	case PUB_DEL:
-		if (pxml->data_length != 0)
-			return -1;
 		break;
 	}
 
-	rrdp_publish_file(s, pxml, data, datasz);
+	rrdp_publish_file(s, pxml, pxml->data, pxml->data_length);
 
-	free(data);
 	free_publish_xml(pxml);
 	return 0;
 }
@@ -171,7 +171,7 @@ rsc_parse_aslist(const char *fn, struct rsc *rsc,
 		}
 	}
 
-	return 1;
+	return as_check_overlap(fn, rsc->as, rsc->asz);
 }
 
 static int
@@ -235,7 +235,7 @@ rsc_parse_iplist(const char *fn, struct rsc *rsc,
 		}
 	}
 
-	return 1;
+	return ip_addr_check_overlap(fn, rsc->ips, rsc->ipsz);
 }
 
 static int
@@ -420,17 +420,17 @@ rsc_parse(X509 **x509, const char *fn, int talid, const unsigned char *der,
 		goto out;
 	}
 
-	if (x509_any_inherits(*x509)) {
-		warnx("%s: inherit elements not allowed in EE cert", fn);
-		goto out;
-	}
-
 	if (!rsc_parse_econtent(fn, rsc, cms, cmsz))
 		goto out;
 
 	if ((cert = cert_parse_ee_cert(fn, talid, *x509)) == NULL)
 		goto out;
 
+	if (cert_any_inherits(cert)) {
+		warnx("%s: inherit elements not allowed in EE cert", fn);
+		goto out;
+	}
+
 	rsc->valid = valid_rsc(fn, cert, rsc);
 
 	rc = 1;
@@ -43,9 +43,11 @@
 struct rsync {
 	TAILQ_ENTRY(rsync)	 entry;
 	char			*uri; /* uri of this rsync proc */
+	char			*host; /* host part of uri */
 	char			*dst; /* destination directory */
 	char			*compdst; /* compare against directory */
 	unsigned int		 id; /* identity of request */
+	unsigned int		 prio; /* higher prio requests start first */
 	pid_t			 pid; /* pid of process or 0 if unassociated */
 };
 
@@ -165,6 +167,14 @@ exec_rsync(const char *prog, const char *bind_addr, char *uri, char *dst,
 			args[i++] = "--address";
 			args[i++] = (char *)bind_addr;
 		}
+		/*
+		 * Files equal to those in compdst are not copied, so dst
+		 * ends up holding the change list of this transfer. main
+		 * moves only these into the valid tree and reports them.
+		 * --link-dest would make dst complete, but rename(2) of a
+		 * hardlink onto itself is a no-op and the valid tree is
+		 * shared with RRDP, so it can not simply be swapped in.
+		 */
 		if (compdst != NULL &&
 		    (reldst = rsync_fixup_dest(dst, compdst)) != NULL) {
 			args[i++] = "--compare-dest";
@@ -182,19 +192,34 @@ exec_rsync(const char *prog, const char *bind_addr, char *uri, char *dst,
 }
 
 static void
-rsync_new(unsigned int id, char *uri, char *dst, char *compdst)
+rsync_new(unsigned int id, unsigned int prio, char *uri, char *dst,
+    char *compdst)
 {
-	struct rsync *s;
+	struct rsync *s, *t;
+	const char *host;
 
 	if ((s = calloc(1, sizeof(*s))) == NULL)
 		err(1, NULL);
 
+	/* main only sends URIs that passed rsync_base_uri() */
+	host = uri + RSYNC_PROTO_LEN;
+	if ((s->host = strndup(host, strcspn(host, "/"))) == NULL)
+		err(1, NULL);
+
 	s->id = id;
+	s->prio = prio;
 	s->uri = uri;
 	s->dst = dst;
 	s->compdst = compdst;
 
-	TAILQ_INSERT_TAIL(&states, s, entry);
+	/* keep the list sorted by prio, equal prios in request order */
+	TAILQ_FOREACH(t, &states, entry)
+		if (t->prio < prio)
+			break;
+	if (t != NULL)
+		TAILQ_INSERT_BEFORE(t, s, entry);
+	else
+		TAILQ_INSERT_TAIL(&states, s, entry);
 }
 
 static void
@@ -202,11 +227,28 @@ rsync_free(struct rsync *s)
 {
 	TAILQ_REMOVE(&states, s, entry);
 	free(s->uri);
+	free(s->host);
 	free(s->dst);
 	free(s->compdst);
 	free(s);
 }
 
+/*
+ * Modules on the same host are served by the same rsync daemon, don't
+ * run more than RSYNC_HOST_REQUESTS requests against it at once.
+ */
+static int
+rsync_host_busy(const struct rsync *s)
+{
+	const struct rsync *t;
+	int n = 0;
+
+	TAILQ_FOREACH(t, &states, entry)
+		if (t->pid != 0 && strcasecmp(t->host, s->host) == 0)
+			n++;
+	return n >= RSYNC_HOST_REQUESTS;
+}
+
 static void
 proc_child(int signal)
 {
@@ -222,9 +264,10 @@ proc_child(int signal)
  * It only exits cleanly when fd is closed.
  */
 void
-proc_rsync(char *prog, char *bind_addr, int fd)
+proc_rsync(char *prog, char **bind_addrs, int maxprocs, int fd)
 {
 	int			 nprocs = 0, npending = 0, rc = 0;
+	size_t			 nbind = 0, nextbind = 0;
 	struct pollfd		 pfd;
 	struct msgbuf		 msgq;
 	struct ibuf		*b, *inbuf = NULL;
@@ -234,6 +277,9 @@ proc_rsync(char *prog, char *bind_addr, int fd)
 	if (pledge("stdio rpath proc exec unveil", NULL) == -1)
 		err(1, "pledge");
 
+	while (bind_addrs[nbind] != NULL)
+		nbind++;
+
 	pfd.fd = fd;
 	msgbuf_init(&msgq);
 	msgq.fd = fd;
@@ -288,7 +334,7 @@ proc_rsync(char *prog, char *bind_addr, int fd)
 
 	for (;;) {
 		char *uri, *dst, *compdst;
-		unsigned int id;
+		unsigned int id, prio;
 		pid_t pid;
 		int st;
 
@@ -297,16 +343,17 @@ proc_rsync(char *prog, char *bind_addr, int fd)
 		if (msgq.queued)
 			pfd.events |= POLLOUT;
 
-		if (npending > 0 && nprocs < MAX_RSYNC_REQUESTS) {
+		if (npending > 0 && nprocs < maxprocs) {
 			TAILQ_FOREACH(s, &states, entry) {
-				if (s->pid == 0) {
-					s->pid = exec_rsync(prog, bind_addr,
-					    s->uri, s->dst, s->compdst);
-					if (++nprocs >= MAX_RSYNC_REQUESTS)
-						break;
-					if (--npending == 0)
-						break;
-				}
+				if (s->pid != 0 || rsync_host_busy(s))
+					continue;
+				/* use the source addresses in turn */
+				s->pid = exec_rsync(prog, nbind == 0 ? NULL :
+				    bind_addrs[nextbind++ % nbind],
+				    s->uri, s->dst, s->compdst);
+				nprocs++;
+				if (--npending == 0 || nprocs >= maxprocs)
+					break;
 			}
 		}
 
@@ -376,6 +423,7 @@ proc_rsync(char *prog, char *bind_addr, int fd)
 
 		/* Read host and module. */
 		io_read_buf(b, &id, sizeof(id));
+		io_read_buf(b, &prio, sizeof(prio));
 		io_read_str(b, &dst);
 		io_read_str(b, &compdst);
 		io_read_str(b, &uri);
@@ -383,7 +431,7 @@ proc_rsync(char *prog, char *bind_addr, int fd)
 		ibuf_free(b);
 
 		if (dst != NULL) {
-			rsync_new(id, uri, dst, compdst);
+			rsync_new(id, prio, uri, dst, compdst);
 			npending++;
 		} else {
 			TAILQ_FOREACH(s, &states, entry)
@@ -392,8 +440,10 @@ proc_rsync(char *prog, char *bind_addr, int fd)
 			if (s != NULL) {
 				if (s->pid != 0)
 					kill(s->pid, SIGTERM);
-				else
+				else {
 					rsync_free(s);
+					npending--;
+				}
 			}
 		}
 	}
@@ -0,0 +1,1112 @@
+/*	$OpenBSD$ */
+/*
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Local exceptions, RFC 8416 (SLURM), plus the ASPA members of
+ * draft-ietf-sidrops-aspa-slurm in slurmVersion 2 files.
+ * The file is parsed once at startup, any error is fatal. The prefix
+ * filters are kept in a path compressed binary trie per address family,
+ * so filtering walks down the covering prefixes of each VRP only once.
+ * Local assertions are attributed to an extra pseudo TAL named "slurm".
+ */
+
+#include <sys/socket.h>
+
+#include <arpa/inet.h>
+
+#include <err.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "extern.h"
+
+#define SLURM_DEPTH	16		/* maximum JSON nesting */
+#define SLURM_EXPIRES	(24 * 60 * 60)	/* lifetime of the assertions */
+
+int			 slurm_talid = -1;
+
+enum json_type {
+	JSON_NULL,
+	JSON_BOOL,
+	JSON_NUMBER,
+	JSON_STRING,
+	JSON_ARRAY,
+	JSON_OBJECT,
+};
+
+struct json {
+	enum json_type	 type;
+	char		*key;		/* member name within an object */
+	char		*str;
+	long long	 num;
+	struct json	*child;		/* first element or member */
+	struct json	*next;
+};
+
+struct json_parser {
+	const char	*fn;
+	const char	*buf;
+	const char	*p;
+	const char	*end;
+};
+
+struct slurm_node {
+	struct slurm_node *child[2];
+	uint32_t	*asids;		/* sorted, of the filters with an ASN */
+	size_t		 asidsz;
+	int		 any;		/* a filter without ASN */
+	unsigned char	 addr[16];
+	unsigned char	 plen;
+};
+
+struct slurm_bgpsec {
+	uint32_t	 asid;
+	int		 has_asid;
+	char		*ski;		/* hex encoded or NULL */
+};
+
+static const char		*slurm_fn;
+static struct slurm_node	*slurm_pfx[AFI_IPV6 + 1];
+static uint32_t			*slurm_asids;	/* ASN only prefix filters */
+static size_t			 slurm_asidsz;
+static struct slurm_bgpsec	*slurm_bgpsec;
+static size_t			 slurm_bgpsecsz;
+static uint32_t			*slurm_aspa;	/* sorted customer ASIDs */
+static size_t			 slurm_aspasz;
+static struct vrp		*slurm_vrps;
+static size_t			 slurm_vrpsz;
+static struct brk		*slurm_brks;
+static size_t			 slurm_brksz;
+static struct vap		*slurm_vaps;
+static size_t			 slurm_vapsz;
+
+static struct json	*json_value(struct json_parser *, int);
+
+static void
+json_fail(struct json_parser *jp, const char *what)
+{
+	errx(1, "%s: JSON %s at offset %td", jp->fn, what, jp->p - jp->buf);
+}
+
+static void
+json_ws(struct json_parser *jp)
+{
+	while (jp->p < jp->end && (*jp->p == ' ' || *jp->p == '\t' ||
+	    *jp->p == '\n' || *jp->p == '\r'))
+		jp->p++;
+}
+
+static int
+json_hex(struct json_parser *jp)
+{
+	int	 c, i, v = 0;
+
+	if (jp->end - jp->p < 4)
+		json_fail(jp, "bad escape");
+	for (i = 0; i < 4; i++) {
+		c = (unsigned char)*jp->p++;
+		if (c >= '0' && c <= '9')
+			c -= '0';
+		else if (c >= 'a' && c <= 'f')
+			c -= 'a' - 10;
+		else if (c >= 'A' && c <= 'F')
+			c -= 'A' - 10;
+		else
+			json_fail(jp, "bad escape");
+		v = v << 4 | c;
+	}
+	return v;
+}
+
+/*
+ * Parse a string, the escapes are resolved and \u escapes are encoded
+ * as UTF-8, surrogate pairs are combined. NUL characters and unpaired
+ * surrogates are not allowed.
+ */
+static char *
+json_string(struct json_parser *jp)
+{
+	char	*s;
+	size_t	 n = 0;
+	int	 c, lo;
+
+	if (jp->p == jp->end || *jp->p != '"')
+		json_fail(jp, "string expected");
+	jp->p++;
+
+	/* the result is never longer than the input */
+	if ((s = malloc(jp->end - jp->p + 1)) == NULL)
+		err(1, NULL);
+
+	for (;;) {
+		if (jp->p == jp->end)
+			json_fail(jp, "unterminated string");
+		c = (unsigned char)*jp->p++;
+		if (c == '"')
+			break;
+		if (c < 0x20)
+			json_fail(jp, "control character in string");
+		if (c != '\\') {
+			s[n++] = c;
+			continue;
+		}
+		if (jp->p == jp->end)
+			json_fail(jp, "unterminated string");
+		switch ((c = *jp->p++)) {
+		case '"':
+		case '\\':
+		case '/':
+			s[n++] = c;
+			break;
+		case 'b':
+			s[n++] = '\b';
+			break;
+		case 'f':
+			s[n++] = '\f';
+			break;
+		case 'n':
+			s[n++] = '\n';
+			break;
+		case 'r':
+			s[n++] = '\r';
+			break;
+		case 't':
+			s[n++] = '\t';
+			break;
+		case 'u':
+			/* six input bytes, at most three output bytes */
+			if ((c = json_hex(jp)) == 0)
+				json_fail(jp, "NUL in string");
+			if (c >= 0xdc00 && c <= 0xdfff)
+				json_fail(jp, "unpaired surrogate");
+			if (c >= 0xd800 && c <= 0xdbff) {
+				/* twelve input bytes, four output bytes */
+				if (jp->end - jp->p < 2 || jp->p[0] != '\\' ||
+				    jp->p[1] != 'u')
+					json_fail(jp, "unpaired surrogate");
+				jp->p += 2;
+				lo = json_hex(jp);
+				if (lo < 0xdc00 || lo > 0xdfff)
+					json_fail(jp, "unpaired surrogate");
+				c = 0x10000 + ((c - 0xd800) << 10) +
+				    (lo - 0xdc00);
+				s[n++] = 0xf0 | c >> 18;
+				s[n++] = 0x80 | (c >> 12 & 0x3f);
+				s[n++] = 0x80 | (c >> 6 & 0x3f);
+				s[n++] = 0x80 | (c & 0x3f);
+			} else if (c < 0x80)
+				s[n++] = c;
+			else if (c < 0x800) {
+				s[n++] = 0xc0 | c >> 6;
+				s[n++] = 0x80 | (c & 0x3f);
+			} else {
+				s[n++] = 0xe0 | c >> 12;
+				s[n++] = 0x80 | (c >> 6 & 0x3f);
+				s[n++] = 0x80 | (c & 0x3f);
+			}
+			break;
+		default:
+			json_fail(jp, "bad escape");
+		}
+	}
+	s[n] = '\0';
+	return s;
+}
+
+/*
+ * Only integers are needed, fractions and exponents are rejected.
+ */
+static long long
+json_number(struct json_parser *jp)
+{
+	long long	 v = 0;
+	int		 neg = 0, digits = 0;
+
+	if (jp->p < jp->end && *jp->p == '-') {
+		neg = 1;
+		jp->p++;
+	}
+	while (jp->p < jp->end && *jp->p >= '0' && *jp->p <= '9') {
+		if (digits++ > 0 && v == 0)
+			json_fail(jp, "leading zero in number");
+		if (v > (LLONG_MAX - (*jp->p - '0')) / 10)
+			json_fail(jp, "number too large");
+		v = v * 10 + *jp->p++ - '0';
+	}
+	if (digits == 0)
+		json_fail(jp, "bad number");
+	if (jp->p < jp->end &&
+	    (*jp->p == '.' || *jp->p == 'e' || *jp->p == 'E'))
+		json_fail(jp, "integer expected");
+	return neg ? -v : v;
+}
+
+static int
+json_literal(struct json_parser *jp, const char *lit)
+{
+	size_t	 len = strlen(lit);
+
+	if ((size_t)(jp->end - jp->p) < len || memcmp(jp->p, lit, len) != 0)
+		return 0;
+	jp->p += len;
+	return 1;
+}
+
+/*
+ * Parse the elements of an array or the members of an object.
+ */
+static void
+json_children(struct json_parser *jp, struct json *j, int depth)
+{
+	struct json	**link = &j->child, *c;
+	char		 close = j->type == JSON_ARRAY ? ']' : '}';
+	char		*key = NULL;
+
+	jp->p++;
+	json_ws(jp);
+	if (jp->p < jp->end && *jp->p == close) {
+		jp->p++;
+		return;
+	}
+	for (;;) {
+		if (j->type == JSON_OBJECT) {
+			key = json_string(jp);
+			json_ws(jp);
+			if (jp->p == jp->end || *jp->p++ != ':')
+				json_fail(jp, "':' expected");
+		}
+		c = json_value(jp, depth + 1);
+		c->key = key;
+		*link = c;
+		link = &c->next;
+
+		json_ws(jp);
+		if (jp->p == jp->end)
+			json_fail(jp, "unexpected end");
+		if (*jp->p == close) {
+			jp->p++;
+			return;
+		}
+		if (*jp->p++ != ',')
+			json_fail(jp, "',' expected");
+		json_ws(jp);
+	}
+}
+
+static struct json *
+json_value(struct json_parser *jp, int depth)
+{
+	struct json	*j;
+
+	if (depth > SLURM_DEPTH)
+		json_fail(jp, "nested too deep");
+	if ((j = calloc(1, sizeof(*j))) == NULL)
+		err(1, NULL);
+
+	json_ws(jp);
+	if (jp->p == jp->end)
+		json_fail(jp, "unexpected end");
+	switch (*jp->p) {
+	case '{':
+		j->type = JSON_OBJECT;
+		json_children(jp, j, depth);
+		break;
+	case '[':
+		j->type = JSON_ARRAY;
+		json_children(jp, j, depth);
+		break;
+	case '"':
+		j->type = JSON_STRING;
+		j->str = json_string(jp);
+		break;
+	case 't':
+	case 'f':
+		j->type = JSON_BOOL;
+		if (json_literal(jp, "true"))
+			j->num = 1;
+		else if (!json_literal(jp, "false"))
+			json_fail(jp, "bad literal");
+		break;
+	case 'n':
+		j->type = JSON_NULL;
+		if (!json_literal(jp, "null"))
+			json_fail(jp, "bad literal");
+		break;
+	default:
+		j->type = JSON_NUMBER;
+		j->num = json_number(jp);
+		break;
+	}
+	return j;
+}
+
+static void
+json_free(struct json *j)
+{
+	struct json	*next;
+
+	for (; j != NULL; j = next) {
+		next = j->next;
+		json_free(j->child);
+		free(j->key);
+		free(j->str);
+		free(j);
+	}
+}
+
+/*
+ * Return the member of obj named key or NULL. Any member not listed in
+ * the NULL terminated allowed array is fatal, as are duplicates.
+ */
+static const struct json *
+slurm_member(const struct json *obj, const char *key,
+    const char * const *allowed)
+{
+	const struct json	*c, *d, *found = NULL;
+	size_t			 i;
+
+	for (c = obj->child; c != NULL; c = c->next) {
+		for (i = 0; allowed[i] != NULL; i++)
+			if (strcmp(c->key, allowed[i]) == 0)
+				break;
+		if (allowed[i] == NULL)
+			errx(1, "%s: unknown member \"%s\"", slurm_fn, c->key);
+		for (d = c->next; d != NULL; d = d->next)
+			if (strcmp(c->key, d->key) == 0)
+				errx(1, "%s: duplicate member \"%s\"",
+				    slurm_fn, c->key);
+		if (strcmp(c->key, key) == 0)
+			found = c;
+	}
+	return found;
+}
+
+static const struct json *
+slurm_type(const struct json *j, enum json_type type, const char *what)
+{
+	static const char *names[] = {
+		[JSON_NULL] = "null",
+		[JSON_BOOL] = "boolean",
+		[JSON_NUMBER] = "number",
+		[JSON_STRING] = "string",
+		[JSON_ARRAY] = "array",
+		[JSON_OBJECT] = "object",
+	};
+
+	if (j != NULL && j->type != type)
+		errx(1, "%s: %s: %s expected", slurm_fn, what, names[type]);
+	return j;
+}
+
+static uint32_t
+slurm_asn(const struct json *j)
+{
+	slurm_type(j, JSON_NUMBER, "asn");
+	if (j->num < 0 || j->num > UINT32_MAX)
+		errx(1, "%s: bad AS number %lld", slurm_fn, j->num);
+	return j->num;
+}
+
+/*
+ * Parse a prefix, RFC 8416 section 3.3 does not allow bits set beyond
+ * the prefix length.
+ */
+static void
+slurm_prefix(const struct json *j, enum afi *afi, struct ip_addr *addr)
+{
+	const char	*errstr;
+	char		 buf[64], *len;
+	int		 af, i, max;
+
+	slurm_type(j, JSON_STRING, "prefix");
+	if (strlcpy(buf, j->str, sizeof(buf)) >= sizeof(buf) ||
+	    (len = strchr(buf, '/')) == NULL)
+		errx(1, "%s: bad prefix %s", slurm_fn, j->str);
+	*len++ = '\0';
+
+	memset(addr, 0, sizeof(*addr));
+	if (strchr(buf, ':') != NULL) {
+		*afi = AFI_IPV6;
+		af = AF_INET6;
+		max = 128;
+	} else {
+		*afi = AFI_IPV4;
+		af = AF_INET;
+		max = 32;
+	}
+	if (inet_pton(af, buf, addr->addr) != 1)
+		errx(1, "%s: bad prefix %s", slurm_fn, j->str);
+	addr->prefixlen = strtonum(len, 0, max, &errstr);
+	if (errstr != NULL)
+		errx(1, "%s: bad prefix length %s", slurm_fn, j->str);
+	for (i = addr->prefixlen; i < max; i++)
+		if (addr->addr[i / 8] & (0x80 >> (i % 8)))
+			errx(1, "%s: host bits set in %s", slurm_fn, j->str);
+}
+
+/*
+ * Decode the unpadded base64url encoding of RFC 8416 section 3.3.2
+ * into a regular base64 string with padding.
+ */
+static char *
+slurm_base64url(const struct json *j, const char *what)
+{
+	char	*s;
+	size_t	 i, len;
+
+	slurm_type(j, JSON_STRING, what);
+	len = strlen(j->str);
+	if (len % 4 == 1)
+		errx(1, "%s: bad %s", slurm_fn, what);
+	if ((s = calloc(1, len + 3 + 1)) == NULL)
+		err(1, NULL);
+	for (i = 0; i < len; i++) {
+		switch (j->str[i]) {
+		case '-':
+			s[i] = '+';
+			break;
+		case '_':
+			s[i] = '/';
+			break;
+		case '+':
+		case '/':
+		case '=':
+			errx(1, "%s: bad %s", slurm_fn, what);
+		default:
+			s[i] = j->str[i];
+			break;
+		}
+	}
+	while (i % 4 != 0)
+		s[i++] = '=';
+	return s;
+}
+
+/*
+ * The SKI is the base64url encoded key identifier, return it hex
+ * encoded like the SKIs in the BRKs.
+ */
+static char *
+slurm_ski(const struct json *j)
+{
+	unsigned char	*der;
+	char		*b64, *ski;
+	size_t		 dersz;
+
+	b64 = slurm_base64url(j, "SKI");
+	if (base64_decode(b64, strlen(b64), &der, &dersz) == -1 ||
+	    dersz != SHA_DIGEST_LENGTH)
+		errx(1, "%s: bad SKI %s", slurm_fn, j->str);
+	ski = hex_encode(der, dersz);
+	free(b64);
+	free(der);
+	return ski;
+}
+
+static int
+slurm_bit(const unsigned char *addr, unsigned int bit)
+{
+	return (addr[bit / 8] >> (7 - bit % 8)) & 1;
+}
+
+/*
+ * Return the number of leading bits of a and b which are equal,
+ * looking at most at max bits.
+ */
+static unsigned int
+slurm_common(const unsigned char *a, const unsigned char *b, unsigned int max)
+{
+	unsigned int	 i;
+	unsigned char	 diff;
+
+	for (i = 0; i < max; i += 8) {
+		if ((diff = a[i / 8] ^ b[i / 8]) == 0)
+			continue;
+		while ((diff & 0x80) == 0) {
+			diff <<= 1;
+			i++;
+		}
+		break;
+	}
+	return i < max ? i : max;
+}
+
+static struct slurm_node *
+slurm_node_new(const unsigned char *addr, unsigned int plen)
+{
+	struct slurm_node	*n;
+
+	if ((n = calloc(1, sizeof(*n))) == NULL)
+		err(1, NULL);
+	memcpy(n->addr, addr, (plen + 7) / 8);
+	if (plen % 8)
+		n->addr[plen / 8] &= 0xff << (8 - plen % 8);
+	n->plen = plen;
+	return n;
+}
+
+/*
+ * Return the node for addr/plen, creating it and any glue node needed.
+ */
+static struct slurm_node *
+slurm_node_get(struct slurm_node **link, const unsigned char *addr,
+    unsigned int plen)
+{
+	struct slurm_node	*n, *new;
+	unsigned int		 common;
+
+	while ((n = *link) != NULL) {
+		common = slurm_common(n->addr, addr,
+		    n->plen < plen ? n->plen : plen);
+		if (common == n->plen && common == plen)
+			return n;
+		if (common == n->plen) {
+			link = &n->child[slurm_bit(addr, n->plen)];
+			continue;
+		}
+
+		/* the new prefix covers n or the two diverge */
+		new = slurm_node_new(addr, common);
+		new->child[slurm_bit(n->addr, common)] = n;
+		*link = new;
+		if (common == plen)
+			return new;
+		link = &new->child[slurm_bit(addr, common)];
+	}
+	return *link = slurm_node_new(addr, plen);
+}
+
+static int
+slurm_asidcmp(const void *a, const void *b)
+{
+	uint32_t	 x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void
+slurm_node_sort(struct slurm_node *n)
+{
+	if (n == NULL)
+		return;
+	qsort(n->asids, n->asidsz, sizeof(n->asids[0]), slurm_asidcmp);
+	slurm_node_sort(n->child[0]);
+	slurm_node_sort(n->child[1]);
+}
+
+static void
+slurm_node_free(struct slurm_node *n)
+{
+	if (n == NULL)
+		return;
+	slurm_node_free(n->child[0]);
+	slurm_node_free(n->child[1]);
+	free(n->asids);
+	free(n);
+}
+
+static int
+slurm_has_asid(const uint32_t *asids, size_t asidsz, uint32_t asid)
+{
+	return bsearch(&asid, asids, asidsz, sizeof(asids[0]),
+	    slurm_asidcmp) != NULL;
+}
+
+static void
+slurm_push_asid(uint32_t **asids, size_t *asidsz, uint32_t asid)
+{
+	*asids = reallocarray(*asids, *asidsz + 1, sizeof(**asids));
+	if (*asids == NULL)
+		err(1, NULL);
+	(*asids)[(*asidsz)++] = asid;
+}
+
+static void
+slurm_prefix_filters(const struct json *arr)
+{
+	static const char *allowed[] = { "prefix", "asn", "comment", NULL };
+	const struct json	*e, *pfx, *asn;
+	struct slurm_node	*n;
+	struct ip_addr		 addr;
+	enum afi		 afi;
+
+	for (e = arr->child; e != NULL; e = e->next) {
+		slurm_type(e, JSON_OBJECT, "prefixFilters");
+		pfx = slurm_member(e, "prefix", allowed);
+		asn = slurm_member(e, "asn", allowed);
+		slurm_type(slurm_member(e, "comment", allowed), JSON_STRING,
+		    "comment");
+		if (pfx == NULL && asn == NULL)
+			errx(1, "%s: prefix filter without prefix and asn",
+			    slurm_fn);
+
+		if (pfx == NULL) {
+			slurm_push_asid(&slurm_asids, &slurm_asidsz,
+			    slurm_asn(asn));
+			continue;
+		}
+		slurm_prefix(pfx, &afi, &addr);
+		n = slurm_node_get(&slurm_pfx[afi], addr.addr, addr.prefixlen);
+		if (asn == NULL)
+			n->any = 1;
+		else
+			slurm_push_asid(&n->asids, &n->asidsz, slurm_asn(asn));
+	}
+}
+
+static void
+slurm_bgpsec_filters(const struct json *arr)
+{
+	static const char *allowed[] = { "asn", "SKI", "comment", NULL };
+	const struct json	*e, *asn, *ski;
+	struct slurm_bgpsec	*f;
+
+	for (e = arr->child; e != NULL; e = e->next) {
+		slurm_type(e, JSON_OBJECT, "bgpsecFilters");
+		asn = slurm_member(e, "asn", allowed);
+		ski = slurm_member(e, "SKI", allowed);
+		slurm_type(slurm_member(e, "comment", allowed), JSON_STRING,
+		    "comment");
+		if (asn == NULL && ski == NULL)
+			errx(1, "%s: BGPsec filter without asn and SKI",
+			    slurm_fn);
+
+		slurm_bgpsec = recallocarray(slurm_bgpsec, slurm_bgpsecsz,
+		    slurm_bgpsecsz + 1, sizeof(*slurm_bgpsec));
+		if (slurm_bgpsec == NULL)
+			err(1, NULL);
+		f = &slurm_bgpsec[slurm_bgpsecsz++];
+		if (asn != NULL) {
+			f->asid = slurm_asn(asn);
+			f->has_asid = 1;
+		}
+		if (ski != NULL)
+			f->ski = slurm_ski(ski);
+	}
+}
+
+static void
+slurm_aspa_filters(const struct json *arr)
+{
+	static const char *allowed[] = { "customerAsid", "comment", NULL };
+	const struct json	*e, *asn;
+
+	for (e = arr->child; e != NULL; e = e->next) {
+		slurm_type(e, JSON_OBJECT, "aspaFilters");
+		asn = slurm_member(e, "customerAsid", allowed);
+		slurm_type(slurm_member(e, "comment", allowed), JSON_STRING,
+		    "comment");
+		if (asn == NULL)
+			errx(1, "%s: ASPA filter without customerAsid",
+			    slurm_fn);
+		slurm_push_asid(&slurm_aspa, &slurm_aspasz, slurm_asn(asn));
+	}
+	qsort(slurm_aspa, slurm_aspasz, sizeof(slurm_aspa[0]), slurm_asidcmp);
+}
+
+static void
+slurm_prefix_assertions(const struct json *arr)
+{
+	static const char *allowed[] = {
+		"prefix", "asn", "maxPrefixLength", "comment", NULL
+	};
+	const struct json	*e, *pfx, *asn, *max;
+	struct vrp		*v;
+
+	for (e = arr->child; e != NULL; e = e->next) {
+		slurm_type(e, JSON_OBJECT, "prefixAssertions");
+		pfx = slurm_member(e, "prefix", allowed);
+		asn = slurm_member(e, "asn", allowed);
+		max = slurm_member(e, "maxPrefixLength", allowed);
+		slurm_type(slurm_member(e, "comment", allowed), JSON_STRING,
+		    "comment");
+		if (pfx == NULL || asn == NULL)
+			errx(1, "%s: prefix assertion without prefix or asn",
+			    slurm_fn);
+
+		slurm_vrps = recallocarray(slurm_vrps, slurm_vrpsz,
+		    slurm_vrpsz + 1, sizeof(*slurm_vrps));
+		if (slurm_vrps == NULL)
+			err(1, NULL);
+		v = &slurm_vrps[slurm_vrpsz++];
+		slurm_prefix(pfx, &v->afi, &v->addr);
+		v->asid = slurm_asn(asn);
+		v->maxlength = v->addr.prefixlen;
+		if (max != NULL) {
+			slurm_type(max, JSON_NUMBER, "maxPrefixLength");
+			if (max->num < v->addr.prefixlen ||
+			    max->num > (v->afi == AFI_IPV4 ? 32 : 128))
+				errx(1, "%s: bad maxPrefixLength %lld for %s",
+				    slurm_fn, max->num, pfx->str);
+			v->maxlength = max->num;
+		}
+	}
+}
+
+static void
+slurm_bgpsec_assertions(const struct json *arr)
+{
+	static const char *allowed[] = {
+		"asn", "SKI", "routerPublicKey", "comment", NULL
+	};
+	const struct json	*e, *asn, *ski, *key;
+	struct brk		*b;
+
+	for (e = arr->child; e != NULL; e = e->next) {
+		slurm_type(e, JSON_OBJECT, "bgpsecAssertions");
+		asn = slurm_member(e, "asn", allowed);
+		ski = slurm_member(e, "SKI", allowed);
+		key = slurm_member(e, "routerPublicKey", allowed);
+		slurm_type(slurm_member(e, "comment", allowed), JSON_STRING,
+		    "comment");
+		if (asn == NULL || ski == NULL || key == NULL)
+			errx(1, "%s: BGPsec assertion needs asn, SKI and "
+			    "routerPublicKey", slurm_fn);
+
+		slurm_brks = recallocarray(slurm_brks, slurm_brksz,
+		    slurm_brksz + 1, sizeof(*slurm_brks));
+		if (slurm_brks == NULL)
+			err(1, NULL);
+		b = &slurm_brks[slurm_brksz++];
+		b->asid = slurm_asn(asn);
+		b->ski = slurm_ski(ski);
+		b->pubkey = slurm_base64url(key, "routerPublicKey");
+	}
+}
+
+static void
+slurm_aspa_assertions(const struct json *arr)
+{
+	static const char *allowed[] = {
+		"customerAsid", "providers", "comment", NULL
+	};
+	const struct json	*e, *asn, *providers, *p;
+	struct vap		*v;
+	size_t			 n;
+
+	for (e = arr->child; e != NULL; e = e->next) {
+		slurm_type(e, JSON_OBJECT, "aspaAssertions");
+		asn = slurm_member(e, "customerAsid", allowed);
+		providers = slurm_member(e, "providers", allowed);
+		slurm_type(slurm_member(e, "comment", allowed), JSON_STRING,
+		    "comment");
+		if (asn == NULL || providers == NULL)
+			errx(1, "%s: ASPA assertion needs customerAsid and "
+			    "providers", slurm_fn);
+		slurm_type(providers, JSON_ARRAY, "providers");
+
+		slurm_vaps = recallocarray(slurm_vaps, slurm_vapsz,
+		    slurm_vapsz + 1, sizeof(*slurm_vaps));
+		if (slurm_vaps == NULL)
+			err(1, NULL);
+		v = &slurm_vaps[slurm_vapsz++];
+		v->custasid = slurm_asn(asn);
+
+		for (p = providers->child; p != NULL; p = p->next)
+			slurm_push_asid(&v->providers, &v->providersz,
+			    slurm_asn(p));
+		if (v->providersz == 0 || v->providersz >= MAX_ASPA_PROVIDERS)
+			errx(1, "%s: bad number of providers for AS%u",
+			    slurm_fn, v->custasid);
+		qsort(v->providers, v->providersz, sizeof(v->providers[0]),
+		    slurm_asidcmp);
+		for (n = 0; n < v->providersz; n++) {
+			if (v->providers[n] == v->custasid ||
+			    (n > 0 && v->providers[n - 1] == v->providers[n]))
+				errx(1, "%s: bad provider AS%u for AS%u",
+				    slurm_fn, v->providers[n], v->custasid);
+		}
+	}
+}
+
+/*
+ * Load and check the SLURM file. This needs talsz to be final, the
+ * assertions get the talid after the last TAL.
+ */
+void
+slurm_load(const char *fn)
+{
+	static const char *top[] = {
+		"slurmVersion", "validationOutputFilters",
+		"locallyAddedAssertions", NULL
+	};
+	static const char *filters[] = {
+		"prefixFilters", "bgpsecFilters", "aspaFilters", NULL
+	};
+	static const char *assertions[] = {
+		"prefixAssertions", "bgpsecAssertions", "aspaAssertions", NULL
+	};
+	struct json_parser	 jp;
+	struct json		*root;
+	const struct json	*version, *f, *a, *j;
+	char			*buf;
+	size_t			 len;
+
+	slurm_fn = fn;
+	if (talsz >= TALSZ_MAX)
+		errx(1, "%s: no room for the SLURM assertions, too many TALs",
+		    fn);
+	if ((buf = load_file(fn, &len)) == NULL)
+		err(1, "%s", fn);
+
+	jp.fn = fn;
+	jp.buf = jp.p = buf;
+	jp.end = buf + len;
+	root = json_value(&jp, 0);
+	json_ws(&jp);
+	if (jp.p != jp.end)
+		json_fail(&jp, "trailing data");
+	free(buf);
+
+	slurm_type(root, JSON_OBJECT, "top level");
+	version = slurm_member(root, "slurmVersion", top);
+	f = slurm_member(root, "validationOutputFilters", top);
+	a = slurm_member(root, "locallyAddedAssertions", top);
+	if (version == NULL || f == NULL || a == NULL)
+		errx(1, "%s: slurmVersion, validationOutputFilters and "
+		    "locallyAddedAssertions are required", fn);
+	slurm_type(version, JSON_NUMBER, "slurmVersion");
+	if (version->num != 1 && version->num != 2)
+		errx(1, "%s: unsupported slurmVersion %lld", fn, version->num);
+	slurm_type(f, JSON_OBJECT, "validationOutputFilters");
+	slurm_type(a, JSON_OBJECT, "locallyAddedAssertions");
+
+	/* the ASPA members are only known in version 2 */
+	if (version->num == 1) {
+		filters[2] = NULL;
+		assertions[2] = NULL;
+	}
+
+	if ((j = slurm_member(f, "prefixFilters", filters)) == NULL)
+		errx(1, "%s: prefixFilters missing", fn);
+	slurm_prefix_filters(slurm_type(j, JSON_ARRAY, "prefixFilters"));
+	if ((j = slurm_member(f, "bgpsecFilters", filters)) == NULL)
+		errx(1, "%s: bgpsecFilters missing", fn);
+	slurm_bgpsec_filters(slurm_type(j, JSON_ARRAY, "bgpsecFilters"));
+	if ((j = slurm_member(f, "aspaFilters", filters)) != NULL)
+		slurm_aspa_filters(slurm_type(j, JSON_ARRAY, "aspaFilters"));
+
+	if ((j = slurm_member(a, "prefixAssertions", assertions)) == NULL)
+		errx(1, "%s: prefixAssertions missing", fn);
+	slurm_prefix_assertions(slurm_type(j, JSON_ARRAY,
+	    "prefixAssertions"));
+	if ((j = slurm_member(a, "bgpsecAssertions", assertions)) == NULL)
+		errx(1, "%s: bgpsecAssertions missing", fn);
+	slurm_bgpsec_assertions(slurm_type(j, JSON_ARRAY,
+	    "bgpsecAssertions"));
+	if ((j = slurm_member(a, "aspaAssertions", assertions)) != NULL)
+		slurm_aspa_assertions(slurm_type(j, JSON_ARRAY,
+		    "aspaAssertions"));
+
+	json_free(root);
+
+	slurm_node_sort(slurm_pfx[AFI_IPV4]);
+	slurm_node_sort(slurm_pfx[AFI_IPV6]);
+	qsort(slurm_asids, slurm_asidsz, sizeof(slurm_asids[0]),
+	    slurm_asidcmp);
+
+	slurm_talid = talsz;
+	taldescs[slurm_talid] = "slurm";
+}
+
+static int
+slurm_match_vrp(const struct vrp *v)
+{
+	const struct slurm_node	*n;
+	const unsigned char	*addr = v->addr.addr;
+	unsigned int		 plen = v->addr.prefixlen;
+
+	if (slurm_has_asid(slurm_asids, slurm_asidsz, v->asid))
+		return 1;
+
+	for (n = slurm_pfx[v->afi]; n != NULL && n->plen <= plen;
+	    n = n->child[slurm_bit(addr, n->plen)]) {
+		if (slurm_common(n->addr, addr, n->plen) != n->plen)
+			break;
+		if (n->any || slurm_has_asid(n->asids, n->asidsz, v->asid))
+			return 1;
+		if (n->plen == plen)
+			break;
+	}
+	return 0;
+}
+
+/*
+ * Remove the VRPs matching a prefix filter, keeping the order.
+ */
+void
+slurm_filter_vrps(struct vrp_array *va)
+{
+	size_t	 i, n;
+
+	if (slurm_fn == NULL)
+		return;
+	for (i = 0, n = 0; i < va->num; i++) {
+		if (slurm_match_vrp(&va->v[i]))
+			continue;
+		va->v[n++] = va->v[i];
+	}
+	va->num = n;
+}
+
+static void
+slurm_free_brk(struct brk *b)
+{
+	free(b->ski);
+	free(b->pubkey);
+	free(b);
+}
+
+/*
+ * Insert the part of b which no filter matches into the tree. A filter
+ * for a single ASID cuts it out of the range of b, the rest of the range
+ * is checked against the remaining filters.
+ */
+static void
+slurm_filter_brk(struct brk_tree *brks, struct brk *b, size_t i)
+{
+	struct brk	*rest, *found;
+	uint32_t	 asid;
+
+	for (; i < slurm_bgpsecsz; i++) {
+		if (slurm_bgpsec[i].ski != NULL &&
+		    strcmp(slurm_bgpsec[i].ski, b->ski) != 0)
+			continue;
+		if (!slurm_bgpsec[i].has_asid) {
+			slurm_free_brk(b);
+			return;
+		}
+		asid = slurm_bgpsec[i].asid;
+		if (asid < b->asid || asid > b->asid_max)
+			continue;
+
+		if (asid < b->asid_max) {
+			if ((rest = calloc(1, sizeof(*rest))) == NULL)
+				err(1, NULL);
+			*rest = *b;
+			rest->asid = asid + 1;
+			if ((rest->ski = strdup(b->ski)) == NULL ||
+			    (rest->pubkey = strdup(b->pubkey)) == NULL)
+				err(1, NULL);
+			slurm_filter_brk(brks, rest, i + 1);
+		}
+		if (asid == b->asid) {
+			slurm_free_brk(b);
+			return;
+		}
+		b->asid_max = asid - 1;
+	}
+
+	/* as in insert_brk() a duplicate keeps the later expiry */
+	if ((found = RB_INSERT(brk_tree, brks, b)) != NULL) {
+		if (found->expires < b->expires) {
+			found->expires = b->expires;
+			found->talid = b->talid;
+		}
+		slurm_free_brk(b);
+	}
+}
+
+/*
+ * Apply the filters of the SLURM file and then add its assertions.
+ * VRPs are appended unsorted, vrp_sort() takes care of duplicates.
+ */
+void
+slurm_apply(struct vrp_array *va, struct brk_tree *brks,
+    struct vap_tree *vaps)
+{
+	struct vrp	*v;
+	struct brk	*b, *btmp;
+	struct brk_tree	 in;
+	struct vap	*vap, *vtmp;
+	time_t		 expires;
+	size_t		 i, max;
+
+	if (slurm_fn == NULL)
+		return;
+
+	slurm_filter_vrps(va);
+	in = *brks;
+	RB_INIT(brks);
+	RB_FOREACH_SAFE(b, brk_tree, &in, btmp) {
+		RB_REMOVE(brk_tree, &in, b);
+		slurm_filter_brk(brks, b, 0);
+	}
+	RB_FOREACH_SAFE(vap, vap_tree, vaps, vtmp) {
+		if (!slurm_has_asid(slurm_aspa, slurm_aspasz, vap->custasid))
+			continue;
+		RB_REMOVE(vap_tree, vaps, vap);
+		free(vap->providers);
+		free(vap);
+	}
+
+	expires = get_current_time() + SLURM_EXPIRES;
+
+	if (va->num + slurm_vrpsz > va->max) {
+		max = va->num + slurm_vrpsz;
+		if ((v = reallocarray(va->v, max, sizeof(*v))) == NULL)
+			err(1, NULL);
+		va->v = v;
+		va->max = max;
+	}
+	for (i = 0; i < slurm_vrpsz; i++) {
+		v = &va->v[va->num++];
+		*v = slurm_vrps[i];
+		v->talid = slurm_talid;
+		v->expires = expires;
+	}
+
+	for (i = 0; i < slurm_brksz; i++) {
+		if ((b = calloc(1, sizeof(*b))) == NULL)
+			err(1, NULL);
+		b->asid = slurm_brks[i].asid;
+		b->asid_max = slurm_brks[i].asid;
+		b->talid = slurm_talid;
+		b->expires = expires;
+		if ((b->ski = strdup(slurm_brks[i].ski)) == NULL ||
+		    (b->pubkey = strdup(slurm_brks[i].pubkey)) == NULL)
+			err(1, NULL);
+		if (RB_INSERT(brk_tree, brks, b) != NULL)
+			slurm_free_brk(b);
+	}
+
+	/* an assertion replaces the validated providers of the customer */
+	for (i = 0; i < slurm_vapsz; i++) {
+		if ((vap = RB_FIND(vap_tree, vaps, &slurm_vaps[i])) == NULL) {
+			if ((vap = calloc(1, sizeof(*vap))) == NULL)
+				err(1, NULL);
+			vap->custasid = slurm_vaps[i].custasid;
+			RB_INSERT(vap_tree, vaps, vap);
+		}
+		free(vap->providers);
+		vap->providersz = slurm_vaps[i].providersz;
+		vap->providers = calloc(vap->providersz,
+		    sizeof(vap->providers[0]));
+		if (vap->providers == NULL)
+			err(1, NULL);
+		memcpy(vap->providers, slurm_vaps[i].providers,
+		    vap->providersz * sizeof(vap->providers[0]));
+		vap->talid = slurm_talid;
+		vap->repoid = 0;
+		vap->expires = expires;
+		vap->overflowed = 0;
+	}
+
+	logx("%s: %zu local assertions", slurm_fn,
+	    slurm_vrpsz + slurm_brksz + slurm_vapsz);
+}
@@ -283,13 +283,13 @@ spl_parse(X509 **x509, const char *fn, int talid, const unsigned char *der,
 	if (!spl_parse_econtent(fn, spl, cms, cmsz))
 		goto out;
 
-	if (x509_any_inherits(*x509)) {
-		warnx("%s: inherit elements not allowed in EE cert", fn);
+	if ((cert = cert_parse_ee_cert(fn, talid, *x509)) == NULL)
 		goto out;
-	}
 
-	if ((cert = cert_parse_ee_cert(fn, talid, *x509)) == NULL)
+	if (cert_any_inherits(cert)) {
+		warnx("%s: inherit elements not allowed in EE cert", fn);
 		goto out;
+	}
 
 	if (cert->asz == 0) {
 		warnx("%s: AS Resources extension missing", fn);
@@ -396,16 +396,6 @@ spl_pfx_cmp(const struct spl_pfx *a, const struct spl_pfx *b)
 	return prefix_cmp(a->afi, &a->prefix, &b->prefix);
 }
 
-static void
-insert_vsp(struct vsp *vsp, size_t idx, struct spl_pfx *pfx)
-{
-	if (idx < vsp->prefixesz)
-		memmove(vsp->prefixes + idx + 1, vsp->prefixes + idx,
-		    (vsp->prefixesz - idx) * sizeof(*vsp->prefixes));
-	vsp->prefixes[idx] = *pfx;
-	vsp->prefixesz++;
-}
-
 /*
  * Add each prefix in the SPL into the VSP tree.
  * Updates "vsps" to be the number of VSPs and "uniqs" to be the unique
@@ -415,7 +405,7 @@ void
 spl_insert_vsps(struct vsp_tree *tree, struct spl *spl, struct repo *rp)
 {
 	struct vsp	*vsp, *found;
-	size_t		 i, j;
+	size_t		 i, j, k, n;
 	int		 cmp;
 
 	if ((vsp = calloc(1, sizeof(*vsp))) == NULL)
@@ -445,29 +435,43 @@ spl_insert_vsps(struct vsp_tree *tree, struct spl *spl, struct repo *rp)
 		repo_stat_inc(rp, vsp->talid, RTYPE_SPL, STYPE_UNIQUE);
 	repo_stat_inc(rp, spl->talid, RTYPE_SPL, STYPE_TOTAL);
 
-	/* merge content of multiple SPLs */
-	vsp->prefixes = reallocarray(vsp->prefixes,
-	    vsp->prefixesz + spl->pfxsz, sizeof(struct spl_pfx));
-	if (vsp->prefixes == NULL)
-		err(1, NULL);
-
 	/*
-	 * Merge all data from the new SPL at hand into 'vsp': loop over
-	 * all SPL->pfxs, and insert them in the right place in
-	 * vsp->prefixes while keeping the order of the array.
+	 * Both prefix arrays are sorted. Count the prefixes of spl
+	 * missing in vsp, then merge from the back so every element is
+	 * moved at most once.
 	 */
-	for (i = 0, j = 0; i < spl->pfxsz; ) {
-		cmp = -1;
+	for (i = 0, j = 0, n = 0; i < spl->pfxsz; ) {
 		if (j == vsp->prefixesz ||
 		    (cmp = spl_pfx_cmp(&spl->pfxs[i], &vsp->prefixes[j])) < 0) {
-			insert_vsp(vsp, j, &spl->pfxs[i]);
+			n++;
 			i++;
-		} else if (cmp == 0)
+		} else if (cmp == 0) {
 			i++;
-
-		if (j < vsp->prefixesz)
 			j++;
+		} else
+			j++;
+	}
+	if (n == 0)
+		return;
+
+	vsp->prefixes = reallocarray(vsp->prefixes, vsp->prefixesz + n,
+	    sizeof(*vsp->prefixes));
+	if (vsp->prefixes == NULL)
+		err(1, NULL);
+
+	i = spl->pfxsz;
+	j = vsp->prefixesz;
+	k = j + n;
+	while (i > 0) {
+		if (j > 0 && (cmp = spl_pfx_cmp(&vsp->prefixes[j - 1],
+		    &spl->pfxs[i - 1])) >= 0) {
+			if (cmp == 0)
+				i--;
+			vsp->prefixes[--k] = vsp->prefixes[--j];
+		} else
+			vsp->prefixes[--k] = spl->pfxs[--i];
 	}
+	vsp->prefixesz += n;
 }
 
 /*
@@ -0,0 +1,185 @@
+/*	$OpenBSD$ */
+/*
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Entity lifecycle tracing. Every process records its events in a ring
+ * buffer, keeping the most recent TRACE_EVENTS, and appends them to the
+ * shared trace file when it exits. The file is a JSON array in the
+ * Chrome trace event format, the closing bracket is optional there so
+ * the processes never need to coordinate.
+ */
+
+#include <err.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "extern.h"
+
+#define TRACE_EVENTS	(64 * 1024)
+#define TRACE_FILELEN	64
+
+struct trace_event {
+	struct timespec	ts;
+	enum trace_type	type;
+	char		ph;
+	char		file[TRACE_FILELEN];
+};
+
+static const char *trace_names[] = {
+	[TRACE_QUEUE] = "queue",
+	[TRACE_DISPATCH] = "dispatch",
+	[TRACE_RECEIVE] = "receive",
+	[TRACE_PARSE] = "parse",
+	[TRACE_PROCESS] = "process",
+};
+
+int			 tracefd = -1;
+static struct trace_event *trace_ring;
+static size_t		 trace_next;
+static int		 trace_wrapped;
+
+/*
+ * Open the trace file, the descriptor is inherited by all processes.
+ */
+void
+trace_open(const char *file)
+{
+	tracefd = open(file, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND |
+	    O_CLOEXEC, 0644);
+	if (tracefd == -1)
+		err(1, "trace file %s", file);
+	if (write(tracefd, "[\n", 2) != 2)
+		err(1, "trace file %s", file);
+	trace_reset();
+}
+
+/*
+ * Start with an empty ring, called in freshly forked processes.
+ */
+void
+trace_reset(void)
+{
+	if (tracefd == -1)
+		return;
+	if (trace_ring == NULL) {
+		trace_ring = calloc(TRACE_EVENTS, sizeof(*trace_ring));
+		if (trace_ring == NULL)
+			err(1, NULL);
+	}
+	trace_next = 0;
+	trace_wrapped = 0;
+}
+
+/*
+ * Record an event, ph is 'B' or 'E' for begin and end of a duration
+ * or 'i' for an instant. Long file names keep their tail.
+ */
+void
+trace_event(enum trace_type type, char ph, const char *file)
+{
+	struct trace_event	*ev;
+	size_t			 len;
+
+	ev = &trace_ring[trace_next];
+	clock_gettime(CLOCK_MONOTONIC, &ev->ts);
+	ev->type = type;
+	ev->ph = ph;
+	ev->file[0] = '\0';
+	if (file != NULL) {
+		len = strlen(file);
+		if (len >= sizeof(ev->file))
+			file += len - sizeof(ev->file) + 1;
+		strlcpy(ev->file, file, sizeof(ev->file));
+	}
+
+	if (++trace_next == TRACE_EVENTS) {
+		trace_next = 0;
+		trace_wrapped = 1;
+	}
+}
+
+/*
+ * Format a single event, quotes and control characters in the file
+ * name are replaced since they never show up in valid names anyway.
+ */
+static int
+trace_format(char *buf, size_t bufsz, const struct trace_event *ev,
+    pid_t pid)
+{
+	char	 file[TRACE_FILELEN];
+	size_t	 i;
+	int	 n;
+
+	for (i = 0; ev->file[i] != '\0'; i++) {
+		file[i] = ev->file[i];
+		if (file[i] == '"' || file[i] == '\\' ||
+		    (unsigned char)file[i] < 0x20)
+			file[i] = '_';
+	}
+	file[i] = '\0';
+
+	n = snprintf(buf, bufsz, "{\"name\":\"%s\",\"cat\":\"entity\","
+	    "\"ph\":\"%c\",%s\"ts\":%lld,\"pid\":%d,\"tid\":%d,"
+	    "\"args\":{\"file\":\"%s\"}},\n", trace_names[ev->type], ev->ph,
+	    ev->ph == 'i' ? "\"s\":\"t\"," : "",
+	    (long long)ev->ts.tv_sec * 1000000 + ev->ts.tv_nsec / 1000,
+	    (int)pid, (int)pid, file);
+	if (n < 0 || (size_t)n >= bufsz)
+		return -1;
+	return n;
+}
+
+/*
+ * Append the recorded events to the trace file. Writes only contain
+ * complete events so the output of the processes does not interleave.
+ */
+void
+trace_dump(void)
+{
+	char	 buf[16 * 1024];
+	size_t	 i, n, len = 0;
+	pid_t	 pid;
+	int	 rv;
+
+	if (tracefd == -1)
+		return;
+
+	pid = getpid();
+	i = trace_wrapped ? trace_next : 0;
+	n = trace_wrapped ? TRACE_EVENTS : trace_next;
+	for (; n > 0; n--, i = (i + 1) % TRACE_EVENTS) {
+		if (sizeof(buf) - len < 256) {
+			if (write(tracefd, buf, len) != (ssize_t)len)
+				warn("trace write");
+			len = 0;
+		}
+		rv = trace_format(buf + len, sizeof(buf) - len,
+		    &trace_ring[i], pid);
+		if (rv == -1)
+			continue;
+		len += rv;
+	}
+	if (len > 0 && write(tracefd, buf, len) != (ssize_t)len)
+		warn("trace write");
+
+	close(tracefd);
+	tracefd = -1;
+}
@@ -15,68 +15,54 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <sys/stat.h>
+
 #include <arpa/inet.h>
 #include <assert.h>
 #include <ctype.h>
 #include <err.h>
 #include <fcntl.h>
 #include <inttypes.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
 #include "extern.h"
+#include "version.h"
 
 extern ASN1_OBJECT	*certpol_oid;
 
 /*
- * Walk up the chain of certificates trying to match our AS number to
- * one of the allocations in that chain.
+ * Match our AS number to one of the allocations of the first certificate
+ * up the chain that does not inherit them.
  * Returns 1 if covered or 0 if not.
  */
 static int
 valid_as(struct auth *a, uint32_t min, uint32_t max)
 {
-	int	 c;
-
-	if (a == NULL)
+	if (a == NULL || (a = a->asfrom) == NULL)
 		return 0;
 
 	/* Does this certificate cover our AS number? */
-	c = as_check_covered(min, max, a->cert->as, a->cert->asz);
-	if (c > 0)
-		return 1;
-	else if (c < 0)
-		return 0;
-
-	/* If it inherits, walk up the chain. */
-	return valid_as(a->issuer, min, max);
+	return as_index_covered(&a->res, min, max) > 0;
 }
 
 /*
- * Walk up the chain of certificates (really just the last one, but in
- * the case of inheritance, the ones before) making sure that our IP
- * prefix is covered in the first non-inheriting specification.
+ * Make sure that our IP prefix is covered in the first non-inheriting
+ * specification up the chain of certificates (really just the last one,
+ * but in the case of inheritance, the ones before).
  * Returns 1 if covered or 0 if not.
  */
 static int
 valid_ip(struct auth *a, enum afi afi,
     const unsigned char *min, const unsigned char *max)
 {
-	int	 c;
-
-	if (a == NULL)
+	if (a == NULL || (a = a->ipfrom[afi - 1]) == NULL)
 		return 0;
 
 	/* Does this certificate cover our IP prefix? */
-	c = ip_addr_check_covered(afi, min, max, a->cert->ips, a->cert->ipsz);
-	if (c > 0)
-		return 1;
-	else if (c < 0)
-		return 0;
-
-	/* If it inherits, walk up the chain. */
-	return valid_ip(a->issuer, afi, min, max);
+	return ip_index_covered(&a->res, afi, min, max) > 0;
 }
 
 /*
@@ -210,18 +196,161 @@ valid_spl(const char *fn, struct cert *cert, struct spl *spl)
 	return 0;
 }
 
+/*
+ * Stamps of the files whose hash matched in the previous run, sorted by
+ * device and inode. A file with the same stamp is not read and hashed
+ * again. The stamps of this run are collected in stamps and passed on
+ * to the main process which stores them for the next run.
+ */
+static struct file_stamp	*stampcache;
+static size_t			 stampcachesz;
+static int			 stamps_on;
+static struct file_stamp	*stamps;
+static size_t			 stampsz, stampmax;
+
+static int
+stamp_cmp(const void *a, const void *b)
+{
+	const struct file_stamp *sa = a, *sb = b;
+
+	if (sa->dev != sb->dev)
+		return sa->dev < sb->dev ? -1 : 1;
+	if (sa->ino != sb->ino)
+		return sa->ino < sb->ino ? -1 : 1;
+	return 0;
+}
+
+static void
+stamp_set(struct file_stamp *fs, const struct stat *st,
+    const unsigned char *hash)
+{
+	memset(fs, 0, sizeof(*fs));
+	memcpy(fs->hash, hash, sizeof(fs->hash));
+	fs->dev = st->st_dev;
+	fs->ino = st->st_ino;
+	fs->size = st->st_size;
+	fs->mtime = st->st_mtim;
+	fs->ctime = st->st_ctim;
+}
+
+static int
+stamp_find(const struct stat *st, const unsigned char *hash)
+{
+	struct file_stamp key, *fs;
+
+	stamp_set(&key, st, hash);
+	fs = bsearch(&key, stampcache, stampcachesz, sizeof(key), stamp_cmp);
+	if (fs == NULL)
+		return 0;
+	return fs->size == key.size &&
+	    timespeccmp(&fs->mtime, &key.mtime, ==) &&
+	    timespeccmp(&fs->ctime, &key.ctime, ==) &&
+	    memcmp(fs->hash, key.hash, sizeof(key.hash)) == 0;
+}
+
+static void
+stamp_collect(const struct stat *st, const unsigned char *hash)
+{
+	struct file_stamp *fs;
+	size_t max;
+
+	if (stampsz == stampmax) {
+		max = stampmax == 0 ? 64 : stampmax * 2;
+		if ((fs = reallocarray(stamps, max, sizeof(*fs))) == NULL)
+			err(1, NULL);
+		stamps = fs;
+		stampmax = max;
+	}
+	stamp_set(&stamps[stampsz++], st, hash);
+}
+
+/*
+ * Load the file stamps written by the main process and start to
+ * collect the stamps of verified files.
+ */
+void
+valid_stamps_load(const char *name)
+{
+	FILE *f;
+	struct file_stamp *fs;
+	char *line = NULL;
+	size_t linesize = 0, max = 0;
+
+	stamps_on = 1;
+
+	if ((f = fopen(name, "r")) == NULL)
+		return;
+	if (getline(&line, &linesize, f) == -1 ||
+	    strcmp(line, CACHE_MAGIC) != 0)
+		goto out;
+
+	for (;;) {
+		if (stampcachesz == max) {
+			max = max == 0 ? 4096 : max * 2;
+			fs = reallocarray(stampcache, max, sizeof(*fs));
+			if (fs == NULL)
+				err(1, NULL);
+			stampcache = fs;
+		}
+		if (fread(&stampcache[stampcachesz], sizeof(*fs), 1, f) != 1)
+			break;
+		stampcachesz++;
+	}
+	qsort(stampcache, stampcachesz, sizeof(*fs), stamp_cmp);
+
+ out:
+	free(line);
+	fclose(f);
+}
+
+/*
+ * Return 1 if stamps were collected since the last valid_stamps_buffer().
+ */
+int
+valid_stamps_pending(void)
+{
+	return stampsz > 0;
+}
+
+/*
+ * Move the collected stamps into b.
+ */
+void
+valid_stamps_buffer(struct ibuf *b)
+{
+	io_buf_buffer(b, stamps, stampsz * sizeof(*stamps));
+	stampsz = 0;
+}
+
+/*
+ * Return the collected stamps and forget about them, for the main process
+ * which stores its own stamps.
+ */
+const struct file_stamp *
+valid_stamps_take(size_t *num)
+{
+	*num = stampsz;
+	stampsz = 0;
+	return stamps;
+}
+
 /*
  * Validate a file by verifying the SHA256 hash of that file.
  * The file to check is passed as a file descriptor.
  * Returns 1 if hash matched, 0 otherwise. Closes fd when done.
+ * Most files of a manifest are a few KB, they are hashed in one go
+ * after a single read which ends at the size reported by fstat(2).
  */
 int
 valid_filehash(int fd, const char *hash, size_t hlen)
 {
 	SHA256_CTX	ctx;
+	struct stat	st;
 	char		filehash[SHA256_DIGEST_LENGTH];
 	char		buffer[8192];
 	ssize_t		nr;
+	off_t		left = -1;
+	int		stamped = 0;
 
 	if (hlen != sizeof(filehash))
 		errx(1, "bad hash size");
@@ -229,6 +358,40 @@ valid_filehash(int fd, const char *hash, size_t hlen)
 	if (fd == -1)
 		return 0;
 
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+		left = st.st_size;
+		if (stamps_on) {
+			stamped = 1;
+			if (stamp_find(&st, (const unsigned char *)hash)) {
+				close(fd);
+				stamp_collect(&st,
+				    (const unsigned char *)hash);
+				return 1;
+			}
+		}
+	}
+
+	if (left >= 0 && left < (off_t)sizeof(buffer)) {
+		/* the whole file at once, no read for the end of file */
+		if ((nr = read(fd, buffer, sizeof(buffer))) == left) {
+			close(fd);
+			if (!EVP_Digest(buffer, nr, filehash, NULL,
+			    EVP_sha256(), NULL))
+				errx(1, "EVP_Digest failed");
+			if (memcmp(hash, filehash, sizeof(filehash)) != 0)
+				return 0;
+			if (stamped)
+				stamp_collect(&st, (const unsigned char *)hash);
+			return 1;
+		}
+		/* the file changed, hash what is there now */
+		if (lseek(fd, 0, SEEK_SET) == -1) {
+			close(fd);
+			return 0;
+		}
+		stamped = 0;
+	}
+
 	SHA256_Init(&ctx);
 	while ((nr = read(fd, buffer, sizeof(buffer))) > 0)
 		SHA256_Update(&ctx, buffer, nr);
@@ -237,6 +400,8 @@ valid_filehash(int fd, const char *hash, size_t hlen)
 
 	if (memcmp(hash, filehash, sizeof(filehash)) != 0)
 		return 0;
+	if (stamped && nr == 0)
+		stamp_collect(&st, (const unsigned char *)hash);
 	return 1;
 }
 
@@ -342,49 +507,71 @@ valid_origin(const char *uri, const char *proto)
  * certificate as a trusted root by virtue of X509_V_FLAG_PARTIAL_CHAIN. The
  * RFC 3779 path validation needs a non-inheriting trust root to ensure that
  * all delegated resources are covered.
+ * The chain is the same for all objects below a, so it is built once and
+ * kept in a until the auth tree is freed or the cert of a is evicted.
  */
 static void
-build_chain(const struct auth *a, STACK_OF(X509) **intermediates,
+build_chain(struct auth *ca, STACK_OF(X509) **intermediates,
     STACK_OF(X509) **root)
 {
+	struct auth	*a;
+	X509		*x509;
+
 	*intermediates = NULL;
 	*root = NULL;
 
-	if (a == NULL)
+	if (ca == NULL)
 		return;
 
+	/* mark ca as recently used, evicting it also drops the chain */
+	auth_x509(ca);
+	if (ca->trusted != NULL) {
+		*intermediates = ca->untrusted;
+		*root = ca->trusted;
+		return;
+	}
+
 	if ((*intermediates = sk_X509_new_null()) == NULL)
 		err(1, "sk_X509_new_null");
 	if ((*root = sk_X509_new_null()) == NULL)
 		err(1, "sk_X509_new_null");
-	for (; a != NULL; a = a->issuer) {
-		assert(a->cert->x509 != NULL);
+	for (a = ca; a != NULL; a = a->issuer) {
+		x509 = auth_x509(a);
+		if (!X509_up_ref(x509))
+			errx(1, "X509_up_ref failed");
 		if (!a->any_inherits) {
-			if (!sk_X509_push(*root, a->cert->x509))
+			if (!sk_X509_push(*root, x509))
 				errx(1, "sk_X509_push");
 			break;
 		}
-		if (!sk_X509_push(*intermediates, a->cert->x509))
+		if (!sk_X509_push(*intermediates, x509))
 			errx(1, "sk_X509_push");
 	}
 	assert(sk_X509_num(*root) == 1);
+
+	ca->untrusted = *intermediates;
+	ca->trusted = *root;
 }
 
 /*
  * Add the CRL based on the certs SKI value.
  * No need to insert any other CRL since those were already checked.
+ * The stack is kept with the CRL and goes away together with it.
  */
 static void
-build_crls(const struct crl *crl, STACK_OF(X509_CRL) **crls)
+build_crls(struct crl *crl, STACK_OF(X509_CRL) **crls)
 {
 	*crls = NULL;
 
 	if (crl == NULL)
 		return;
-	if ((*crls = sk_X509_CRL_new_null()) == NULL)
-		errx(1, "sk_X509_CRL_new_null");
-	if (!sk_X509_CRL_push(*crls, crl->x509_crl))
-		err(1, "sk_X509_CRL_push");
+	if (crl->crls == NULL) {
+		if ((crl->crls = sk_X509_CRL_new_null()) == NULL)
+			errx(1, "sk_X509_CRL_new_null");
+		if (!sk_X509_CRL_push(crl->crls, crl->x509_crl))
+			err(1, "sk_X509_CRL_push");
+	}
+	*crls = crl->crls;
 }
 
 /*
@@ -464,16 +651,10 @@ valid_x509(char *file, X509_STORE_CTX *store_ctx, X509 *x509, struct auth *a,
 		if (filemode && error == X509_V_ERR_CERT_REVOKED)
 			pretty_revocation_time(x509, crl->x509_crl, errstr);
 		X509_STORE_CTX_cleanup(store_ctx);
-		sk_X509_free(intermediates);
-		sk_X509_free(root);
-		sk_X509_CRL_free(crls);
 		return 0;
 	}
 
 	X509_STORE_CTX_cleanup(store_ctx);
-	sk_X509_free(intermediates);
-	sk_X509_free(root);
-	sk_X509_CRL_free(crls);
 	return 1;
 }
 
@@ -571,22 +752,29 @@ valid_aspa(const char *fn, struct cert *cert, struct aspa *aspa)
 int
 valid_geofeed(const char *fn, struct cert *cert, struct geofeed *g)
 {
-	size_t	 i;
-	char	 buf[64];
+	struct res_index	 ri;
+	size_t			 i;
+	char			 buf[64];
+	int			 rc = 1;
+
+	memset(&ri, 0, sizeof(ri));
+	ip_index_build(&ri, cert->ips, cert->ipsz);
 
 	for (i = 0; i < g->geoipsz; i++) {
-		if (ip_addr_check_covered(g->geoips[i].ip->afi,
-		    g->geoips[i].ip->min, g->geoips[i].ip->max, cert->ips,
-		    cert->ipsz) > 0)
+		if (ip_index_covered(&ri, g->geoips[i].ip.afi,
+		    g->geoips[i].ip.min, g->geoips[i].ip.max) > 0)
 			continue;
 
-		ip_addr_print(&g->geoips[i].ip->ip, g->geoips[i].ip->afi, buf,
+		ip_addr_print(&g->geoips[i].ip.ip, g->geoips[i].ip.afi, buf,
 		    sizeof(buf));
 		warnx("%s: Geofeed: uncovered IP: %s", fn, buf);
-		return 0;
+		rc = 0;
+		break;
 	}
 
-	return 1;
+	free(ri.ips[0]);
+	free(ri.ips[1]);
+	return rc;
 }
 
 /*
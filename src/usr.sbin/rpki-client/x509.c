@@ -136,63 +136,87 @@ x509_init_oid(void)
 	}
 }
 
+/*
+ * Look up the extension nid of x. The x509_ext_get_*() functions below
+ * decode an extension already found, for example while walking all
+ * extensions of a certificate once. Returns 0 if the extension is
+ * present more than once, otherwise 1 with ext set to the extension or
+ * NULL if it is absent.
+ */
+static int
+x509_find_ext(X509 *x, const char *fn, int nid, X509_EXTENSION **ext)
+{
+	int	 idx;
+
+	*ext = NULL;
+	if ((idx = X509_get_ext_by_NID(x, nid, -1)) < 0)
+		return 1;
+	if (X509_get_ext_by_NID(x, nid, idx) >= 0) {
+		warnx("%s: RFC 5280 section 4.2: duplicate extension: %s", fn,
+		    nid2str(nid));
+		return 0;
+	}
+	*ext = X509_get_ext(x, idx);
+	return 1;
+}
+
 /*
  * Parse X509v3 authority key identifier (AKI), RFC 6487 sec. 4.8.3.
  * Returns the AKI or NULL if it could not be parsed.
  * The AKI is formatted as a hex string.
  */
 int
-x509_get_aki(X509 *x, const char *fn, char **aki)
+x509_ext_get_aki(X509 *x, X509_EXTENSION *ext, const char *fn, char **aki)
 {
-	const unsigned char	*d;
-	AUTHORITY_KEYID		*akid;
-	ASN1_OCTET_STRING	*os;
-	int			 dsz, crit, rc = 0;
+	const ASN1_OCTET_STRING	*os;
 
 	*aki = NULL;
-	akid = X509_get_ext_d2i(x, NID_authority_key_identifier, &crit, NULL);
-	if (akid == NULL) {
-		if (crit != -1) {
-			warnx("%s: RFC 6487 section 4.8.3: error parsing AKI",
-			    fn);
-			return 0;
-		}
+	if (ext == NULL)
 		return 1;
+
+	/* the extension cache of libcrypto already decoded it */
+	os = X509_get0_authority_key_id(x);
+	if (os == NULL && (X509_get_extension_flags(x) & EXFLAG_INVALID)) {
+		warnx("%s: RFC 6487 section 4.8.3: error parsing AKI", fn);
+		return 0;
 	}
-	if (crit != 0) {
+	if (X509_EXTENSION_get_critical(ext) != 0) {
 		warnx("%s: RFC 6487 section 4.8.3: "
 		    "AKI: extension not non-critical", fn);
-		goto out;
+		return 0;
 	}
-	if (akid->issuer != NULL || akid->serial != NULL) {
+	if (X509_get0_authority_issuer(x) != NULL ||
+	    X509_get0_authority_serial(x) != NULL) {
 		warnx("%s: RFC 6487 section 4.8.3: AKI: "
 		    "authorityCertIssuer or authorityCertSerialNumber present",
 		    fn);
-		goto out;
+		return 0;
 	}
-
-	os = akid->keyid;
 	if (os == NULL) {
 		warnx("%s: RFC 6487 section 4.8.3: AKI: "
 		    "Key Identifier missing", fn);
-		goto out;
+		return 0;
 	}
-
-	d = os->data;
-	dsz = os->length;
-
-	if (dsz != SHA_DIGEST_LENGTH) {
+	if (os->length != SHA_DIGEST_LENGTH) {
 		warnx("%s: RFC 6487 section 4.8.2: AKI: "
 		    "want %d bytes SHA1 hash, have %d bytes",
-		    fn, SHA_DIGEST_LENGTH, dsz);
-		goto out;
+		    fn, SHA_DIGEST_LENGTH, os->length);
+		return 0;
 	}
 
-	*aki = hex_encode(d, dsz);
-	rc = 1;
-out:
-	AUTHORITY_KEYID_free(akid);
-	return rc;
+	*aki = hex_encode(os->data, os->length);
+	return 1;
+}
+
+int
+x509_get_aki(X509 *x, const char *fn, char **aki)
+{
+	X509_EXTENSION	*ext;
+
+	*aki = NULL;
+	if (!x509_find_ext(x, fn, NID_authority_key_identifier, &ext))
+		return 0;
+	return x509_ext_get_aki(x, ext, fn, aki);
 }
 
 /*
@@ -202,51 +226,57 @@ out:
  * Returns the SKI formatted as hex string, or NULL if it couldn't be parsed.
  */
 int
-x509_get_ski(X509 *x, const char *fn, char **ski)
+x509_ext_get_ski(X509 *x, X509_EXTENSION *ext, const char *fn, char **ski)
 {
-	ASN1_OCTET_STRING	*os;
+	const ASN1_OCTET_STRING	*os;
 	unsigned char		 md[EVP_MAX_MD_SIZE];
 	unsigned int		 md_len = EVP_MAX_MD_SIZE;
-	int			 crit, rc = 0;
 
 	*ski = NULL;
-	os = X509_get_ext_d2i(x, NID_subject_key_identifier, &crit, NULL);
-	if (os == NULL) {
-		if (crit != -1) {
-			warnx("%s: RFC 6487 section 4.8.2: error parsing SKI",
-			    fn);
-			return 0;
-		}
+	if (ext == NULL)
 		return 1;
+
+	/* the extension cache of libcrypto already decoded it */
+	if ((os = X509_get0_subject_key_id(x)) == NULL) {
+		warnx("%s: RFC 6487 section 4.8.2: error parsing SKI", fn);
+		return 0;
 	}
-	if (crit != 0) {
+	if (X509_EXTENSION_get_critical(ext) != 0) {
 		warnx("%s: RFC 6487 section 4.8.2: "
 		    "SKI: extension not non-critical", fn);
-		goto out;
+		return 0;
 	}
 
 	if (!X509_pubkey_digest(x, EVP_sha1(), md, &md_len)) {
 		warnx("%s: X509_pubkey_digest", fn);
-		goto out;
+		return 0;
 	}
 
 	if (os->length < 0 || md_len != (size_t)os->length) {
 		warnx("%s: RFC 6487 section 4.8.2: SKI: "
 		    "want %u bytes SHA1 hash, have %d bytes",
 		    fn, md_len, os->length);
-		goto out;
+		return 0;
 	}
 
 	if (memcmp(os->data, md, md_len) != 0) {
 		warnx("%s: SKI does not match SHA1 hash of SPK", fn);
-		goto out;
+		return 0;
 	}
 
 	*ski = hex_encode(md, md_len);
-	rc = 1;
- out:
-	ASN1_OCTET_STRING_free(os);
-	return rc;
+	return 1;
+}
+
+int
+x509_get_ski(X509 *x, const char *fn, char **ski)
+{
+	X509_EXTENSION	*ext;
+
+	*ski = NULL;
+	if (!x509_find_ext(x, fn, NID_subject_key_identifier, &ext))
+		return 0;
+	return x509_ext_get_ski(x, ext, fn, ski);
 }
 
 /*
@@ -418,21 +448,19 @@ x509_pubkey_get_ski(X509_PUBKEY *pubkey, const char *fn)
  * (which has to be freed after use).
  */
 int
-x509_get_aia(X509 *x, const char *fn, char **aia)
+x509_ext_get_aia(X509 *x, X509_EXTENSION *ext, const char *fn, char **aia)
 {
 	ACCESS_DESCRIPTION		*ad;
 	AUTHORITY_INFO_ACCESS		*info;
 	int				 crit, rc = 0;
 
 	*aia = NULL;
-	info = X509_get_ext_d2i(x, NID_info_access, &crit, NULL);
-	if (info == NULL) {
-		if (crit != -1) {
-			warnx("%s: RFC 6487 section 4.8.7: error parsing AIA",
-			    fn);
-			return 0;
-		}
+	if (ext == NULL)
 		return 1;
+	crit = X509_EXTENSION_get_critical(ext);
+	if ((info = X509V3_EXT_d2i(ext)) == NULL) {
+		warnx("%s: RFC 6487 section 4.8.7: error parsing AIA", fn);
+		return 0;
 	}
 
 	if (crit != 0) {
@@ -471,6 +499,17 @@ out:
 	return rc;
 }
 
+int
+x509_get_aia(X509 *x, const char *fn, char **aia)
+{
+	X509_EXTENSION	*ext;
+
+	*aia = NULL;
+	if (!x509_find_ext(x, fn, NID_info_access, &ext))
+		return 0;
+	return x509_ext_get_aia(x, ext, fn, aia);
+}
+
 /*
  * Parse the Subject Information Access (SIA) extension
  * See RFC 6487, section 4.8.8 for details.
@@ -666,36 +705,6 @@ x509_inherits(X509 *x)
 	return rc;
 }
 
-/*
- * Check whether at least one RFC 3779 extension is set to inherit.
- * Return 1 if an inherit element is encountered in AS or IP.
- * Return 0 otherwise.
- */
-int
-x509_any_inherits(X509 *x)
-{
-	STACK_OF(IPAddressFamily)	*addrblk = NULL;
-	ASIdentifiers			*asidentifiers = NULL;
-	int				 crit, rc = 0;
-
-	addrblk = X509_get_ext_d2i(x, NID_sbgp_ipAddrBlock, &crit, NULL);
-	if (addrblk == NULL && crit != -1)
-		warnx("error parsing ipAddrBlock");
-	if (X509v3_addr_inherits(addrblk))
-		rc = 1;
-
-	asidentifiers = X509_get_ext_d2i(x, NID_sbgp_autonomousSysNum, &crit,
-	    NULL);
-	if (asidentifiers == NULL && crit != -1)
-		warnx("error parsing asIdentifiers");
-	if (X509v3_asid_inherits(asidentifiers))
-		rc = 1;
-
-	ASIdentifiers_free(asidentifiers);
-	sk_IPAddressFamily_pop_free(addrblk, IPAddressFamily_free);
-	return rc;
-}
-
 /*
  * Parse the very specific subset of information in the CRL distribution
  * point extension.
@@ -704,7 +713,7 @@ x509_any_inherits(X509 *x)
  * after use.
  */
 int
-x509_get_crl(X509 *x, const char *fn, char **crl)
+x509_ext_get_crl(X509 *x, X509_EXTENSION *ext, const char *fn, char **crl)
 {
 	CRL_DIST_POINTS		*crldp;
 	DIST_POINT		*dp;
@@ -713,14 +722,13 @@ x509_get_crl(X509 *x, const char *fn, char **crl)
 	int			 i, crit, rsync_found = 0;
 
 	*crl = NULL;
-	crldp = X509_get_ext_d2i(x, NID_crl_distribution_points, &crit, NULL);
-	if (crldp == NULL) {
-		if (crit != -1) {
-			warnx("%s: RFC 6487 section 4.8.6: failed to parse "
-			    "CRL distribution points", fn);
-			return 0;
-		}
+	if (ext == NULL)
 		return 1;
+	crit = X509_EXTENSION_get_critical(ext);
+	if ((crldp = X509V3_EXT_d2i(ext)) == NULL) {
+		warnx("%s: RFC 6487 section 4.8.6: failed to parse "
+		    "CRL distribution points", fn);
+		return 0;
 	}
 
 	if (crit != 0) {
@@ -790,6 +798,17 @@ x509_get_crl(X509 *x, const char *fn, char **crl)
 	return rsync_found;
 }
 
+int
+x509_get_crl(X509 *x, const char *fn, char **crl)
+{
+	X509_EXTENSION	*ext;
+
+	*crl = NULL;
+	if (!x509_find_ext(x, fn, NID_crl_distribution_points, &ext))
+		return 0;
+	return x509_ext_get_crl(x, ext, fn, crl);
+}
+
 /*
  * Parse X509v3 authority key identifier (AKI) from the CRL.
  * This is matched against the string from x509_get_ski() above.
@@ -876,6 +895,75 @@ x509_crl_get_number(X509_CRL *crl, const char *fn)
 	return res;
 }
 
+static int
+x509_time_digits(const unsigned char *p, int n, int min, int max, int *out)
+{
+	int	 i, v = 0;
+
+	for (i = 0; i < n; i++) {
+		if (p[i] < '0' || p[i] > '9')
+			return 0;
+		v = v * 10 + p[i] - '0';
+	}
+	if (v < min || v > max)
+		return 0;
+	*out = v;
+	return 1;
+}
+
+/*
+ * Convert the YYMMDDHHMMSSZ and YYYYMMDDHHMMSSZ forms RFC 5280 requires
+ * without going through struct tm, the days since the epoch come from
+ * the usual civil calendar arithmetic.
+ * Returns 0 for anything else so the library has the final say.
+ */
+static int
+x509_get_time_fast(const ASN1_TIME *at, time_t *t)
+{
+	static const int mdays[] = {
+		31, 29, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31
+	};
+	const unsigned char	*p = ASN1_STRING_get0_data(at);
+	int			 len = ASN1_STRING_length(at);
+	int			 year, mon, mday, hour, min, sec, y, doy;
+	int64_t			 era, yoe, days;
+
+	switch (ASN1_STRING_type(at)) {
+	case V_ASN1_UTCTIME:
+		if (len != 13 || !x509_time_digits(p, 2, 0, 99, &year))
+			return 0;
+		year += year < 50 ? 2000 : 1900;
+		p += 2;
+		break;
+	case V_ASN1_GENERALIZEDTIME:
+		if (len != 15 || !x509_time_digits(p, 4, 0, 9999, &year))
+			return 0;
+		p += 4;
+		break;
+	default:
+		return 0;
+	}
+	if (!x509_time_digits(p, 2, 1, 12, &mon) ||
+	    !x509_time_digits(p + 2, 2, 1, mdays[mon - 1], &mday) ||
+	    !x509_time_digits(p + 4, 2, 0, 23, &hour) ||
+	    !x509_time_digits(p + 6, 2, 0, 59, &min) ||
+	    !x509_time_digits(p + 8, 2, 0, 59, &sec) || p[10] != 'Z')
+		return 0;
+	if (mon == 2 && mday == 29 &&
+	    (year % 4 != 0 || (year % 100 == 0 && year % 400 != 0)))
+		return 0;
+
+	/* days from civil, with the year starting in March */
+	y = mon <= 2 ? year - 1 : year;
+	era = (y >= 0 ? y : y - 399) / 400;
+	yoe = y - era * 400;
+	doy = (153 * (mon > 2 ? mon - 3 : mon + 9) + 2) / 5 + mday - 1;
+	days = era * 146097 + yoe * 365 + yoe / 4 - yoe / 100 + doy - 719468;
+
+	*t = days * 86400 + hour * 3600 + min * 60 + sec;
+	return 1;
+}
+
 /*
  * Convert passed ASN1_TIME to time_t *t.
  * Returns 1 on success and 0 on failure.
@@ -890,6 +978,8 @@ x509_get_time(const ASN1_TIME *at, time_t *t)
 	/* Fail instead of silently falling back to the current time. */
 	if (at == NULL)
 		return 0;
+	if (x509_get_time_fast(at, t))
+		return 1;
 	if (!ASN1_TIME_to_tm(at, &tm))
 		return 0;
 	if ((*t = timegm(&tm)) == -1)
@@ -1051,24 +1141,55 @@ x509_convert_seqnum(const char *fn, const ASN1_INTEGER *i)
 	return s;
 }
 
+/*
+ * Find the closest expiry moment of the chain of authorities starting at a.
+ * CRLs are never replaced once inserted, so the result is kept in the
+ * auth as soon as the CRLs of the whole chain are known.
+ */
+static time_t
+x509_auth_expires(struct auth *a, struct crl_tree *crlt)
+{
+	struct crl	*crl;
+	time_t		 expires, iexpires;
+	int		 done = 1;
+
+	if (a->expires_done)
+		return a->expires;
+
+	expires = a->cert->notafter;
+	if ((crl = crl_get(crlt, a)) == NULL)
+		done = 0;
+	else if (expires > crl->nextupdate)
+		expires = crl->nextupdate;
+
+	if (a->issuer != NULL) {
+		iexpires = x509_auth_expires(a->issuer, crlt);
+		if (expires > iexpires)
+			expires = iexpires;
+		if (!a->issuer->expires_done)
+			done = 0;
+	}
+
+	if (done) {
+		a->expires = expires;
+		a->expires_done = 1;
+	}
+	return expires;
+}
+
 /*
  * Find the closest expiry moment by walking the chain of authorities.
  */
 time_t
 x509_find_expires(time_t notafter, struct auth *a, struct crl_tree *crlt)
 {
-	struct crl	*crl;
 	time_t		 expires;
 
-	expires = notafter;
-
-	for (; a != NULL; a = a->issuer) {
-		if (expires > a->cert->notafter)
-			expires = a->cert->notafter;
-		crl = crl_get(crlt, a);
-		if (crl != NULL && expires > crl->nextupdate)
-			expires = crl->nextupdate;
-	}
+	if (a == NULL)
+		return notafter;
 
+	expires = x509_auth_expires(a, crlt);
+	if (expires > notafter)
+		expires = notafter;
 	return expires;
 }